@@ -20,6 +20,7 @@ AC_MSG_RESULT([
  SOCKETS:                   $SOCKETLIB
  MATH:                      $MATHLIB
  MHASH:                     $MHASHLIB
+ ZLIB:                      $ZLIB
  LIBEVENT:                  $EVENTLIB
  OPENSSL:                   $SSLLIB
  SYSTEMD:                   $SYSTEMD_LIBS
@@ -323,6 +324,15 @@ AC_DEFUN([DM_CHECK_MHASH], [dnl
 	fi
 ])
 
+AC_DEFUN([DM_CHECK_ZLIB], [dnl
+	AC_CHECK_HEADERS([zlib.h],[ZLIB="-lz"], [ZLIB="failed"])
+	if test [ "x$ZLIB" = "xfailed" ]; then
+		AC_MSG_ERROR([Could not find ZLIB library.])
+	else
+		LDFLAGS="$LDFLAGS $ZLIB"
+	fi
+])
+
 AC_DEFUN([DM_CHECK_EVENT], [
 	AC_CHECK_HEADERS([event.h], [EVENTLIB="-levent_pthreads -levent"],[EVENTLIB="failed"], [#include <event2/event.h>])
 	if test [ "x$EVENTLIB" = "xfailed" ]; then
@@ -648,4 +658,12 @@ AC_DEFUN([DM_UPGRADE_STEPS], [dnl
 	AC_SUBST(MYSQL_35002)
 	AC_SUBST(SQLITE_35002)
 
+	PGSQL_35003=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/postgresql/upgrades/35003.psql`
+	MYSQL_35003=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/mysql/upgrades/35003.mysql`
+	SQLITE_35003=`sed -e 's/\"/\\\"/g' -e 's/^/\"/' -e 's/$/\\\n\"/' -e '$!s/$/ \\\\/'  sql/sqlite/upgrades/35003.sqlite`
+
+	AC_SUBST(PGSQL_35003)
+	AC_SUBST(MYSQL_35003)
+	AC_SUBST(SQLITE_35003)
+
 ])
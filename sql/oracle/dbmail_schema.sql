@@ -331,7 +331,8 @@ CREATE TABLE dbmail_mimeparts (
   id number(20) NOT NULL,
   hash varchar2(128) NOT NULL,
   data clob,
-  "size" number(20) DEFAULT '0' NOT NULL
+  "size" number(20) DEFAULT '0' NOT NULL,
+  refcount number(20)
 );
 CREATE UNIQUE INDEX dbmail_mimeparts_idx ON dbmail_mimeparts (id) TABLESPACE DBMAIL_TS_IDX;
 ALTER TABLE dbmail_mimeparts ADD CONSTRAINT dbmail_mimeparts_pk PRIMARY KEY (id) USING INDEX dbmail_mimeparts_idx;
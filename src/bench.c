@@ -0,0 +1,1235 @@
+/*
+ Copyright (c) 2020-2025 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * This is the dbmail-bench load generator.
+ *
+ * It drives running imap, lmtp and pop3 daemons with a mixed workload
+ * from one event loop: lmtp sessions deliver a MIME corpus, imap
+ * sessions SELECT, FETCH, SEARCH, STORE and IDLE, pop3 sessions poll.
+ * Every client has its own random generator seeded from --seed, so a
+ * run replays the same sequence of commands. Latencies are reported
+ * as percentiles per operation; --output and --baseline compare runs
+ * for CI.
+ *
+ * The tool only talks the protocols, so the daemons may use any
+ * database backend. The users must exist, e.g.
+ *
+ *   for i in $(seq 1 100); do dbmail-users -a bench$i -w secret; done
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+
+#ifdef __GNUC__
+#define UNUSED __attribute__((__unused__))
+#else
+#define UNUSED
+#endif
+
+typedef enum {
+	OP_IMAP_LOGIN,
+	OP_IMAP_SELECT,
+	OP_IMAP_FETCH_ENVELOPE,
+	OP_IMAP_FETCH_BODY,
+	OP_IMAP_SEARCH,
+	OP_IMAP_STORE,
+	OP_IMAP_IDLE,		// delivery to EXISTS notification
+	OP_LMTP_DELIVER,
+	OP_POP3_POLL,		// connect to QUIT
+	OP_LAST
+} Op_T;
+
+static const char *op_names[OP_LAST] = {
+	"imap_login",
+	"imap_select",
+	"imap_fetch_envelope",
+	"imap_fetch_body",
+	"imap_search",
+	"imap_store",
+	"imap_idle_notify",
+	"lmtp_deliver",
+	"pop3_poll"
+};
+
+typedef enum {
+	PROTO_IMAP,
+	PROTO_LMTP,
+	PROTO_POP3
+} Proto_T;
+
+typedef struct {
+	GArray *samples;	// guint32 microseconds
+	uint64_t bytes;
+	uint64_t errors;
+} Stats_T;
+
+typedef struct {
+	char *name;
+	GString *data;		// CRLF and dot-stuffed, without the final dot
+} Message_T;
+
+typedef struct {
+	int id;
+	Proto_T proto;
+	GRand *rand;
+	struct bufferevent *bev;
+	struct event *timer;
+	int state;
+	int user;
+	unsigned tagno;
+	char tag[16];
+	Op_T op;
+	gint64 started;
+	uint64_t bytes;
+	size_t literal;		// imap literal octets still to skip
+	gboolean multiline;	// pop3 multi-line response pending
+	int exists;
+	int pending;		// lmtp replies still to skip
+	int done;		// completed operations
+	gboolean finished;
+	const Message_T *msg;
+} Client_T;
+
+static struct {
+	char *host;
+	int imap_port;
+	int lmtp_port;
+	int pop3_port;
+	char *user_fmt;
+	char *password;
+	int users;
+	int imap_sessions;
+	int lmtp_sessions;
+	int pop3_sessions;
+	int duration;
+	int warmup;
+	int ops;
+	int think;
+	int poll;
+	int idle;
+	guint32 seed;
+	char *corpus;
+	char *mix;
+	char *output;
+	char *baseline;
+	double tolerance;
+	gboolean verbose;
+} cfg = {
+	.host = "127.0.0.1",
+	.imap_port = 143,
+	.lmtp_port = 24,
+	.pop3_port = 110,
+	.user_fmt = "bench%d",
+	.password = "secret",
+	.users = 100,
+	.imap_sessions = 100,
+	.lmtp_sessions = 4,
+	.pop3_sessions = 10,
+	.duration = 60,
+	.warmup = 10,
+	.think = 100,
+	.poll = 1000,
+	.idle = 5000,
+	.seed = 1,
+	.mix = "select=5,envelope=35,body=15,search=20,store=20,idle=5",
+	.tolerance = 10.0,
+};
+
+/* weights of the imap operations, see --mix */
+static struct {
+	const char *name;
+	Op_T op;
+	int weight;
+} mix[] = {
+	{ "select", OP_IMAP_SELECT, 0 },
+	{ "envelope", OP_IMAP_FETCH_ENVELOPE, 0 },
+	{ "body", OP_IMAP_FETCH_BODY, 0 },
+	{ "search", OP_IMAP_SEARCH, 0 },
+	{ "store", OP_IMAP_STORE, 0 },
+	{ "idle", OP_IMAP_IDLE, 0 },
+};
+#define MIX_SIZE (sizeof(mix) / sizeof(mix[0]))
+static int mix_total = 0;
+
+static const char *searches[] = {
+	"SEARCH UNSEEN",
+	"SEARCH FLAGGED",
+	"SEARCH SINCE 1-Jan-2020",
+	"SEARCH FROM \"example\"",
+	"SEARCH SUBJECT \"report\"",
+	"SEARCH TEXT \"benchmark\"",
+	"SEARCH LARGER 20000",
+	"UID SEARCH 1:* NOT DELETED",
+};
+#define SEARCHES (sizeof(searches) / sizeof(searches[0]))
+
+static struct event_base *base;
+static struct addrinfo *addr_imap, *addr_lmtp, *addr_pop3;
+static Stats_T stats[OP_LAST];
+static GPtrArray *corpus;
+static Client_T **clients;
+static int nclients, nfinished;
+static gint64 *delivered_at;	// per user, time of the last delivery
+static gint64 started_at, measure_from, measure_until;
+
+static void client_connect(Client_T *C);
+static void client_schedule(Client_T *C, int msec);
+
+/*
+ * statistics
+ */
+
+static void stats_record(Op_T op, gint64 start, gint64 end, uint64_t bytes)
+{
+	guint32 usec;
+
+	if (start < measure_from || (measure_until && end > measure_until))
+		return;
+	usec = (guint32)MIN(end - start, (gint64)G_MAXUINT32);
+	g_array_append_val(stats[op].samples, usec);
+	stats[op].bytes += bytes;
+}
+
+static void stats_error(Op_T op)
+{
+	gint64 now = g_get_monotonic_time();
+	if (now >= measure_from && (! measure_until || now <= measure_until))
+		stats[op].errors++;
+}
+
+static gint cmp_u32(gconstpointer a, gconstpointer b)
+{
+	guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+	return (x > y) - (x < y);
+}
+
+static double percentile(GArray *sorted, double q)
+{
+	guint i;
+	if (! sorted->len)
+		return 0;
+	i = (guint)(q * sorted->len + 0.999999);
+	i = i ? i - 1 : 0;
+	if (i >= sorted->len)
+		i = sorted->len - 1;
+	return g_array_index(sorted, guint32, i) / 1000.0;
+}
+
+typedef struct {
+	char name[64];
+	double rate, p50, p99, p999;
+} Result_T;
+
+static int report(double secs)
+{
+	FILE *out = NULL;
+	int op, regressions = 0;
+	GHashTable *base_results = NULL;
+
+	if (cfg.baseline) {
+		FILE *in;
+		char line[256];
+		if (! (in = fopen(cfg.baseline, "r"))) {
+			g_printerr("cannot read baseline [%s]: %s\n", cfg.baseline, strerror(errno));
+			return 1;
+		}
+		base_results = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+		while (fgets(line, sizeof(line), in)) {
+			Result_T *r = g_new0(Result_T, 1);
+			unsigned long count;
+			if (line[0] == '#' || sscanf(line, "%63s %lu %lf %lf %lf %lf",
+						r->name, &count, &r->rate, &r->p50, &r->p99, &r->p999) != 6) {
+				g_free(r);
+				continue;
+			}
+			g_hash_table_insert(base_results, r->name, r);
+		}
+		fclose(in);
+	}
+
+	if (cfg.output && ! (out = fopen(cfg.output, "w"))) {
+		g_printerr("cannot write [%s]: %s\n", cfg.output, strerror(errno));
+		return 1;
+	}
+	if (out)
+		fprintf(out, "# op count rate/s p50_ms p99_ms p999_ms max_ms MB/s errors\n");
+
+	printf("\n%.1f seconds measured, seed %u\n\n", secs, cfg.seed);
+	printf("%-20s %9s %9s %9s %9s %9s %9s %8s %7s\n",
+			"operation", "count", "rate/s", "p50 ms", "p99 ms", "p999 ms", "max ms", "MB/s", "errors");
+
+	for (op = 0; op < OP_LAST; op++) {
+		GArray *s = stats[op].samples;
+		double rate, p50, p99, p999, max, mbs;
+		Result_T *b;
+
+		if (! s->len && ! stats[op].errors)
+			continue;
+
+		g_array_sort(s, cmp_u32);
+		rate = s->len / secs;
+		p50 = percentile(s, 0.50);
+		p99 = percentile(s, 0.99);
+		p999 = percentile(s, 0.999);
+		max = s->len ? g_array_index(s, guint32, s->len - 1) / 1000.0 : 0;
+		mbs = stats[op].bytes / secs / (1024 * 1024);
+
+		printf("%-20s %9u %9.1f %9.2f %9.2f %9.2f %9.2f %8.2f %7" G_GUINT64_FORMAT "\n",
+				op_names[op], s->len, rate, p50, p99, p999, max, mbs, stats[op].errors);
+		if (out)
+			fprintf(out, "%s %u %.3f %.3f %.3f %.3f %.3f %.3f %" G_GUINT64_FORMAT "\n",
+					op_names[op], s->len, rate, p50, p99, p999, max, mbs, stats[op].errors);
+
+		if (base_results && (b = g_hash_table_lookup(base_results, op_names[op]))) {
+			double limit = 1.0 + cfg.tolerance / 100.0;
+			if (rate * limit < b->rate) {
+				printf("  REGRESSION %s rate %.1f/s, baseline %.1f/s\n", op_names[op], rate, b->rate);
+				regressions++;
+			}
+			if (p99 > b->p99 * limit && p99 - b->p99 > 1.0) {
+				printf("  REGRESSION %s p99 %.2f ms, baseline %.2f ms\n", op_names[op], p99, b->p99);
+				regressions++;
+			}
+		}
+	}
+
+	if (out)
+		fclose(out);
+	if (base_results)
+		g_hash_table_destroy(base_results);
+
+	return regressions ? 2 : 0;
+}
+
+/*
+ * message corpus
+ */
+
+static Message_T * corpus_add(const char *name, const char *raw, size_t len)
+{
+	Message_T *m = g_new0(Message_T, 1);
+	gboolean bol = TRUE;
+	size_t i;
+
+	m->name = g_strdup(name);
+	m->data = g_string_sized_new(len + len / 32);
+	for (i = 0; i < len; i++) {
+		char c = raw[i];
+		if (c == '\r')
+			continue;
+		if (c == '\n') {
+			g_string_append(m->data, "\r\n");
+			bol = TRUE;
+			continue;
+		}
+		if (bol && c == '.')
+			g_string_append_c(m->data, '.');
+		g_string_append_c(m->data, c);
+		bol = FALSE;
+	}
+	if (! bol)
+		g_string_append(m->data, "\r\n");
+
+	g_ptr_array_add(corpus, m);
+	return m;
+}
+
+static void corpus_base64(GString *s, GRand *rand, size_t size)
+{
+	guchar *bin = g_malloc(size);
+	gchar *b64;
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		bin[i] = (guchar)g_rand_int(rand);
+	b64 = g_base64_encode(bin, size);
+	for (i = 0; i < strlen(b64); i += 76)
+		g_string_append_printf(s, "%.76s\n", b64 + i);
+	g_free(b64);
+	g_free(bin);
+}
+
+static void corpus_text(GString *s, GRand *rand, size_t size)
+{
+	static const char *words[] = {
+		"the", "quarterly", "report", "benchmark", "meeting", "server", "mailbox",
+		"database", "please", "review", "attached", "invoice", "schedule", "thanks",
+		"delivery", "latency", "throughput", "example", "regards", "tomorrow"
+	};
+	size_t start = s->len, col = 0;
+
+	while (s->len - start < size) {
+		const char *w = words[g_rand_int_range(rand, 0, G_N_ELEMENTS(words))];
+		g_string_append(s, w);
+		col += strlen(w) + 1;
+		if (col > 68) {
+			g_string_append_c(s, '\n');
+			col = 0;
+		} else {
+			g_string_append_c(s, ' ');
+		}
+	}
+	g_string_append_c(s, '\n');
+}
+
+/* a built-in corpus of plain, alternative, 8-bit and attachment carrying mail */
+static void corpus_generate(void)
+{
+	GRand *rand = g_rand_new_with_seed(cfg.seed);
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		GString *s = g_string_new("");
+		char name[32];
+
+		g_string_append_printf(s,
+				"From: \"Sender %d\" <sender%d@example.com>\n"
+				"To: <recipient@example.org>\n"
+				"Date: Mon, %d Jan 2024 10:%02d:00 +0100\n"
+				"Message-ID: <bench-%u-%d@example.com>\n",
+				i, i, 1 + i, i, cfg.seed, i);
+		switch (i % 4) {
+		case 0:
+			g_string_append_printf(s, "Subject: benchmark report %d\n"
+					"MIME-Version: 1.0\n"
+					"Content-Type: text/plain; charset=us-ascii\n\n", i);
+			corpus_text(s, rand, 512 + g_rand_int_range(rand, 0, 4096));
+			break;
+		case 1:
+			g_string_append_printf(s, "Subject: =?iso-8859-1?Q?Pr=FCfbericht_%d?=\n"
+					"MIME-Version: 1.0\n"
+					"Content-Type: multipart/alternative; boundary=\"alt%d\"\n\n"
+					"--alt%d\nContent-Type: text/plain; charset=iso-8859-1\n"
+					"Content-Transfer-Encoding: 8bit\n\nGr\xfc\xdf" "e,\n", i, i, i);
+			corpus_text(s, rand, 2048);
+			g_string_append_printf(s, "--alt%d\nContent-Type: text/html; charset=us-ascii\n\n<html><body><p>", i);
+			corpus_text(s, rand, 4096);
+			g_string_append_printf(s, "</p></body></html>\n--alt%d--\n", i);
+			break;
+		case 2:
+			g_string_append_printf(s, "Subject: meeting schedule %d\n"
+					"MIME-Version: 1.0\n"
+					"Content-Type: multipart/mixed; boundary=\"mix%d\"\n\n"
+					"--mix%d\nContent-Type: text/plain; charset=us-ascii\n\n", i, i, i);
+			corpus_text(s, rand, 1024);
+			g_string_append_printf(s, "--mix%d\nContent-Type: application/pdf; name=\"report%d.pdf\"\n"
+					"Content-Disposition: attachment; filename=\"report%d.pdf\"\n"
+					"Content-Transfer-Encoding: base64\n\n", i, i, i);
+			corpus_base64(s, rand, 32768 << (i / 4));
+			g_string_append_printf(s, "--mix%d--\n", i);
+			break;
+		case 3:
+			g_string_append_printf(s, "Subject: Re: invoice %d\n"
+					"In-Reply-To: <bench-%u-%d@example.com>\n"
+					"MIME-Version: 1.0\n"
+					"Content-Type: text/plain; charset=utf-8\n"
+					"Content-Transfer-Encoding: 8bit\n\n"
+					"> quoted line\n.leading dot\n", i, cfg.seed, i - 1);
+			corpus_text(s, rand, 16384);
+			break;
+		}
+
+		g_snprintf(name, sizeof(name), "generated-%d", i);
+		corpus_add(name, s->str, s->len);
+		g_string_free(s, TRUE);
+	}
+	g_rand_free(rand);
+}
+
+static int corpus_load(const char *path)
+{
+	GDir *dir;
+	GError *err = NULL;
+	GList *names = NULL, *l;
+	const char *name;
+
+	if (! (dir = g_dir_open(path, 0, &err))) {
+		g_printerr("cannot open corpus [%s]: %s\n", path, err->message);
+		g_error_free(err);
+		return -1;
+	}
+	while ((name = g_dir_read_name(dir)))
+		names = g_list_prepend(names, g_strdup(name));
+	g_dir_close(dir);
+
+	/* sorted, so a seed picks the same messages on every run */
+	names = g_list_sort(names, (GCompareFunc)strcmp);
+	for (l = names; l; l = l->next) {
+		char *file = g_build_filename(path, (char *)l->data, NULL);
+		char *raw;
+		gsize len;
+		if (g_file_test(file, G_FILE_TEST_IS_REGULAR) && g_file_get_contents(file, &raw, &len, NULL)) {
+			corpus_add((char *)l->data, raw, len);
+			g_free(raw);
+		}
+		g_free(file);
+	}
+	g_list_free_full(names, g_free);
+
+	if (! corpus->len) {
+		g_printerr("no messages in corpus [%s]\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * client plumbing
+ */
+
+static void client_write(Client_T *C, const char *fmt, ...) G_GNUC_PRINTF(2, 3);
+static void client_write(Client_T *C, const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	evbuffer_add_vprintf(bufferevent_get_output(C->bev), fmt, ap);
+	va_end(ap);
+	if (cfg.verbose) {
+		va_start(ap, fmt);
+		fprintf(stderr, "[%d] > ", C->id);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+	}
+}
+
+static void client_start(Client_T *C, Op_T op)
+{
+	C->op = op;
+	C->started = g_get_monotonic_time();
+	C->bytes = 0;
+}
+
+static void client_close(Client_T *C)
+{
+	if (C->bev) {
+		bufferevent_free(C->bev);
+		C->bev = NULL;
+	}
+	C->state = 0;
+	C->literal = 0;
+	C->multiline = FALSE;
+}
+
+static void client_finish(Client_T *C)
+{
+	client_close(C);
+	if (C->finished)
+		return;
+	C->finished = TRUE;
+	if (++nfinished == nclients)
+		event_base_loopexit(base, NULL);
+}
+
+/* count an operation, and stop the client once it did its share */
+static gboolean client_done(Client_T *C)
+{
+	C->done++;
+	return cfg.ops && C->done >= cfg.ops;
+}
+
+static void client_failed(Client_T *C, const char *why)
+{
+	if (cfg.verbose)
+		fprintf(stderr, "[%d] %s\n", C->id, why);
+	stats_error(C->op);
+	client_close(C);
+	client_schedule(C, 1000);
+}
+
+/*
+ * imap
+ */
+
+enum { IMAP_GREETING = 1, IMAP_LOGIN, IMAP_READY, IMAP_BUSY, IMAP_IDLING, IMAP_IDLE_DONE };
+
+static void imap_command(Client_T *C, Op_T op, const char *fmt, ...) G_GNUC_PRINTF(3, 4);
+static void imap_command(Client_T *C, Op_T op, const char *fmt, ...)
+{
+	va_list ap;
+	char *cmd;
+
+	va_start(ap, fmt);
+	cmd = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	g_snprintf(C->tag, sizeof(C->tag), "b%u", ++C->tagno);
+	client_start(C, op);
+	client_write(C, "%s %s\r\n", C->tag, cmd);
+	g_free(cmd);
+}
+
+static void imap_next(Client_T *C)
+{
+	int pick, i, lo;
+	Op_T op = OP_IMAP_SELECT;
+
+	pick = g_rand_int_range(C->rand, 0, mix_total);
+	for (i = 0; i < (int)MIX_SIZE; i++) {
+		if (pick < mix[i].weight) {
+			op = mix[i].op;
+			break;
+		}
+		pick -= mix[i].weight;
+	}
+
+	/* an empty mailbox has nothing to fetch or store */
+	if (! C->exists && (op == OP_IMAP_FETCH_ENVELOPE || op == OP_IMAP_FETCH_BODY || op == OP_IMAP_STORE))
+		op = OP_IMAP_SEARCH;
+
+	C->state = IMAP_BUSY;
+	switch (op) {
+	case OP_IMAP_SELECT:
+		imap_command(C, op, "SELECT INBOX");
+		break;
+	case OP_IMAP_FETCH_ENVELOPE:
+		lo = g_rand_int_range(C->rand, 1, C->exists + 1);
+		imap_command(C, op, "FETCH %d:%d (UID FLAGS RFC822.SIZE INTERNALDATE ENVELOPE)",
+				lo, MIN(lo + 19, C->exists));
+		break;
+	case OP_IMAP_FETCH_BODY:
+		imap_command(C, op, "FETCH %d (BODYSTRUCTURE BODY.PEEK[])",
+				g_rand_int_range(C->rand, 1, C->exists + 1));
+		break;
+	case OP_IMAP_SEARCH:
+		imap_command(C, op, "%s", searches[g_rand_int_range(C->rand, 0, SEARCHES)]);
+		break;
+	case OP_IMAP_STORE:
+		imap_command(C, op, "STORE %d %cFLAGS (%s)",
+				g_rand_int_range(C->rand, 1, C->exists + 1),
+				g_rand_boolean(C->rand) ? '+' : '-',
+				g_rand_boolean(C->rand) ? "\\Seen" : "\\Flagged");
+		break;
+	case OP_IMAP_IDLE:
+		C->state = IMAP_IDLING;
+		imap_command(C, op, "IDLE");
+		break;
+	default:
+		break;
+	}
+}
+
+static void imap_idle_done(Client_T *C)
+{
+	if (C->state != IMAP_IDLING)
+		return;
+	C->state = IMAP_IDLE_DONE;
+	client_write(C, "DONE\r\n");
+}
+
+static void imap_line(Client_T *C, const char *line)
+{
+	if (line[0] == '*') {
+		int n;
+		if (C->state == IMAP_GREETING) {
+			char *user = g_strdup_printf(cfg.user_fmt, C->user + 1);
+			C->state = IMAP_LOGIN;
+			imap_command(C, OP_IMAP_LOGIN, "LOGIN \"%s\" \"%s\"", user, cfg.password);
+			g_free(user);
+			return;
+		}
+		if (sscanf(line, "* %d EXISTS", &n) == 1) {
+			gboolean grew = n > C->exists;
+			C->exists = n;
+			if (C->state == IMAP_IDLING && grew) {
+				gint64 now = g_get_monotonic_time();
+				gint64 sent = delivered_at[C->user];
+				if (sent && sent >= C->started)
+					stats_record(OP_IMAP_IDLE, sent, now, 0);
+				imap_idle_done(C);
+			}
+		}
+		return;
+	}
+
+	if (line[0] == '+') {
+		if (C->state == IMAP_IDLING)
+			client_schedule(C, cfg.idle);
+		return;
+	}
+
+	if (strncmp(line, C->tag, strlen(C->tag)) || line[strlen(C->tag)] != ' ')
+		return;
+
+	line += strlen(C->tag) + 1;
+	if (strncmp(line, "OK", 2)) {
+		stats_error(C->op);
+		if (C->op == OP_IMAP_LOGIN) {
+			fprintf(stderr, "[%d] login failed: %s\n", C->id, line);
+			client_finish(C);
+			return;
+		}
+	} else if (C->op != OP_IMAP_IDLE) {
+		stats_record(C->op, C->started, g_get_monotonic_time(), C->bytes);
+	}
+
+	if (C->op == OP_IMAP_LOGIN) {
+		C->state = IMAP_BUSY;
+		imap_command(C, OP_IMAP_SELECT, "SELECT INBOX");
+		return;
+	}
+
+	C->state = IMAP_READY;
+	if (client_done(C)) {
+		client_finish(C);
+		return;
+	}
+	client_schedule(C, cfg.think);
+}
+
+/*
+ * lmtp
+ */
+
+enum { LMTP_GREETING = 1, LMTP_LHLO, LMTP_READY, LMTP_MAIL, LMTP_RCPT, LMTP_DATA, LMTP_DOT, LMTP_SKIP };
+
+static void lmtp_deliver(Client_T *C)
+{
+	char *rcpt;
+
+	C->msg = g_ptr_array_index(corpus, g_rand_int_range(C->rand, 0, corpus->len));
+	C->user = g_rand_int_range(C->rand, 0, cfg.users);
+	C->state = LMTP_MAIL;
+	client_start(C, OP_LMTP_DELIVER);
+	rcpt = g_strdup_printf(cfg.user_fmt, C->user + 1);
+	/* pipelined, as LMTP allows */
+	client_write(C, "MAIL FROM:<bench@example.com>\r\nRCPT TO:<%s>\r\nDATA\r\n", rcpt);
+	g_free(rcpt);
+}
+
+static void lmtp_line(Client_T *C, const char *line)
+{
+	int code = atoi(line);
+
+	/* continuation lines of a multi-line reply */
+	if (strlen(line) > 3 && line[3] == '-')
+		return;
+
+	switch (C->state) {
+	case LMTP_GREETING:
+		if (code != 220)
+			goto fail;
+		C->state = LMTP_LHLO;
+		client_write(C, "LHLO dbmail-bench\r\n");
+		break;
+	case LMTP_LHLO:
+		if (code != 250)
+			goto fail;
+		lmtp_deliver(C);
+		break;
+	case LMTP_MAIL:
+	case LMTP_RCPT:
+		if (code == 250) {
+			C->state++;
+			break;
+		}
+		/* the replies to the rest of the pipeline are failures too */
+		stats_error(OP_LMTP_DELIVER);
+		C->pending = LMTP_DATA - C->state;
+		C->state = LMTP_SKIP;
+		break;
+	case LMTP_SKIP:
+		if (--C->pending > 0)
+			break;
+		C->state = LMTP_READY;
+		client_schedule(C, cfg.think);
+		break;
+	case LMTP_DATA:
+		if (code != 354)
+			goto fail;
+		C->state = LMTP_DOT;
+		bufferevent_write(C->bev, C->msg->data->str, C->msg->data->len);
+		client_write(C, ".\r\n");
+		C->bytes = C->msg->data->len;
+		break;
+	case LMTP_DOT:
+		if (code != 250)
+			goto fail;
+		delivered_at[C->user] = g_get_monotonic_time();
+		stats_record(OP_LMTP_DELIVER, C->started, delivered_at[C->user], C->bytes);
+		C->state = LMTP_READY;
+		if (client_done(C)) {
+			client_finish(C);
+			return;
+		}
+		client_schedule(C, cfg.think);
+		break;
+	}
+	return;
+fail:
+	client_failed(C, line);
+}
+
+/*
+ * pop3
+ */
+
+enum { POP3_GREETING = 1, POP3_USER, POP3_PASS, POP3_STAT, POP3_RETR, POP3_QUIT };
+
+static void pop3_line(Client_T *C, const char *line)
+{
+	int count = 0;
+
+	if (C->multiline) {
+		if (strcmp(line, "."))
+			return;
+		C->multiline = FALSE;
+		C->state = POP3_QUIT;
+		client_write(C, "QUIT\r\n");
+		return;
+	}
+
+	if (strncmp(line, "+OK", 3)) {
+		client_failed(C, line);
+		return;
+	}
+
+	switch (C->state) {
+	case POP3_GREETING: {
+		char *user = g_strdup_printf(cfg.user_fmt, C->user + 1);
+		C->state = POP3_USER;
+		client_write(C, "USER %s\r\n", user);
+		g_free(user);
+		break;
+	}
+	case POP3_USER:
+		C->state = POP3_PASS;
+		client_write(C, "PASS %s\r\n", cfg.password);
+		break;
+	case POP3_PASS:
+		C->state = POP3_STAT;
+		client_write(C, "STAT\r\n");
+		break;
+	case POP3_STAT:
+		sscanf(line, "+OK %d", &count);
+		if (count > 0) {
+			C->state = POP3_RETR;
+			C->multiline = TRUE;
+			client_write(C, "RETR %d\r\n", g_rand_int_range(C->rand, 1, count + 1));
+		} else {
+			C->state = POP3_QUIT;
+			client_write(C, "QUIT\r\n");
+		}
+		break;
+	case POP3_QUIT:
+		stats_record(OP_POP3_POLL, C->started, g_get_monotonic_time(), C->bytes);
+		client_close(C);
+		if (client_done(C))
+			client_finish(C);
+		else
+			client_schedule(C, cfg.poll);
+		break;
+	}
+}
+
+/*
+ * event callbacks
+ */
+
+static void client_read_cb(struct bufferevent *bev, void *arg)
+{
+	Client_T *C = (Client_T *)arg;
+	struct evbuffer *in = bufferevent_get_input(bev);
+
+	while (C->bev == bev) {
+		char *line;
+		size_t len;
+
+		if (C->literal) {
+			size_t n = MIN(C->literal, evbuffer_get_length(in));
+			if (! n)
+				break;
+			evbuffer_drain(in, n);
+			C->literal -= n;
+			C->bytes += n;
+			continue;
+		}
+
+		if (! (line = evbuffer_readln(in, &len, EVBUFFER_EOL_CRLF)))
+			break;
+		C->bytes += len + 2;
+		if (cfg.verbose)
+			fprintf(stderr, "[%d] < %s\n", C->id, line);
+
+		switch (C->proto) {
+		case PROTO_IMAP: {
+			char *brace;
+			if (len > 2 && line[len - 1] == '}' && (brace = strrchr(line, '{')))
+				C->literal = strtoul(brace + 1, NULL, 10);
+			imap_line(C, line);
+			break;
+		}
+		case PROTO_LMTP:
+			lmtp_line(C, line);
+			break;
+		case PROTO_POP3:
+			pop3_line(C, line);
+			break;
+		}
+		free(line);
+	}
+}
+
+static void client_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+	Client_T *C = (Client_T *)arg;
+
+	if (bev != C->bev)
+		return;
+	if (what & BEV_EVENT_CONNECTED)
+		return;
+	if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		client_failed(C, (what & BEV_EVENT_EOF) ? "connection closed" :
+				evutil_socket_error_to_string(EVUTIL_SOCKET_ERROR()));
+}
+
+static void client_timer_cb(evutil_socket_t fd UNUSED, short what UNUSED, void *arg)
+{
+	Client_T *C = (Client_T *)arg;
+
+	if (C->finished)
+		return;
+	if (! C->bev) {
+		client_connect(C);
+		return;
+	}
+	switch (C->proto) {
+	case PROTO_IMAP:
+		if (C->state == IMAP_IDLING)
+			imap_idle_done(C);
+		else if (C->state == IMAP_READY)
+			imap_next(C);
+		break;
+	case PROTO_LMTP:
+		if (C->state == LMTP_READY)
+			lmtp_deliver(C);
+		break;
+	case PROTO_POP3:
+		break;
+	}
+}
+
+static void client_schedule(Client_T *C, int msec)
+{
+	struct timeval tv = { msec / 1000, (msec % 1000) * 1000 };
+	evtimer_add(C->timer, &tv);
+}
+
+static void client_connect(Client_T *C)
+{
+	struct addrinfo *ai = C->proto == PROTO_IMAP ? addr_imap : C->proto == PROTO_LMTP ? addr_lmtp : addr_pop3;
+
+	C->bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+	bufferevent_setcb(C->bev, client_read_cb, NULL, client_event_cb, C);
+	bufferevent_enable(C->bev, EV_READ | EV_WRITE);
+	C->state = 1;	// *_GREETING
+	C->literal = 0;
+	C->exists = 0;
+
+	if (C->proto == PROTO_IMAP)
+		client_start(C, OP_IMAP_LOGIN);
+	else if (C->proto == PROTO_POP3)
+		client_start(C, OP_POP3_POLL);
+	else
+		client_start(C, OP_LMTP_DELIVER);
+
+	if (bufferevent_socket_connect(C->bev, ai->ai_addr, (int)ai->ai_addrlen) < 0)
+		client_failed(C, "connect failed");
+}
+
+/*
+ * setup
+ */
+
+static struct addrinfo * resolve(int port)
+{
+	struct addrinfo hints, *ai = NULL;
+	char service[16];
+	int e;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	g_snprintf(service, sizeof(service), "%d", port);
+	if ((e = getaddrinfo(cfg.host, service, &hints, &ai))) {
+		g_printerr("cannot resolve [%s:%d]: %s\n", cfg.host, port, gai_strerror(e));
+		return NULL;
+	}
+	return ai;
+}
+
+static int parse_mix(const char *spec)
+{
+	char **parts = g_strsplit(spec, ",", 0);
+	int i, result = 0;
+	unsigned m;
+
+	mix_total = 0;
+	for (m = 0; m < MIX_SIZE; m++)
+		mix[m].weight = 0;
+
+	for (i = 0; parts[i]; i++) {
+		char **kv = g_strsplit(parts[i], "=", 2);
+		gboolean found = FALSE;
+		for (m = 0; kv[0] && kv[1] && m < MIX_SIZE; m++) {
+			if (g_ascii_strcasecmp(g_strstrip(kv[0]), mix[m].name) == 0) {
+				mix[m].weight = atoi(kv[1]);
+				mix_total += mix[m].weight;
+				found = TRUE;
+			}
+		}
+		if (! found) {
+			g_printerr("invalid mix entry [%s]\n", parts[i]);
+			result = -1;
+		}
+		g_strfreev(kv);
+	}
+	g_strfreev(parts);
+
+	if (! mix_total) {
+		g_printerr("the imap mix has no weight\n");
+		result = -1;
+	}
+	return result;
+}
+
+static void sig_int(evutil_socket_t fd UNUSED, short what UNUSED, void *arg UNUSED)
+{
+	event_base_loopexit(base, NULL);
+}
+
+static void do_showhelp(void)
+{
+	printf(
+	"*** dbmail-bench ***\n"
+	"Drive the imap, lmtp and pop3 daemons with a mixed workload and\n"
+	"report throughput and latency percentiles per operation.\n"
+	"\nTarget:\n"
+	"     -H, --host host          daemon host (127.0.0.1)\n"
+	"         --imap-port port     imap port (143)\n"
+	"         --lmtp-port port     lmtp port (24)\n"
+	"         --pop3-port port     pop3 port (110)\n"
+	"     -u, --user format        printf format of the usernames (bench%%d)\n"
+	"     -w, --password passwd    password of all users (secret)\n"
+	"     -U, --users count        users bench1..benchN (100)\n"
+	"\nWorkload:\n"
+	"     -i, --imap sessions      concurrent imap sessions (100)\n"
+	"     -l, --lmtp sessions      concurrent lmtp sessions (4)\n"
+	"     -p, --pop3 sessions      concurrent pop3 sessions (10)\n"
+	"     -m, --mix weights        imap operation weights\n"
+	"                              (select=5,envelope=35,body=15,search=20,store=20,idle=5)\n"
+	"     -t, --think msec         pause between commands (100)\n"
+	"         --poll msec          pause between pop3 polls (1000)\n"
+	"         --idle msec          longest IDLE before DONE (5000)\n"
+	"     -C, --corpus dir         deliver messages picked from the files in dir,\n"
+	"                              instead of the built-in corpus\n"
+	"     -s, --seed n             seed of the command sequence (1)\n"
+	"\nRun:\n"
+	"     -d, --duration sec       measured seconds (60)\n"
+	"     -W, --warmup sec         unmeasured seconds before (10)\n"
+	"     -n, --ops n              run until every session did n operations,\n"
+	"                              instead of for a duration; no warmup\n"
+	"     -o, --output file        write the results to file\n"
+	"     -b, --baseline file      compare with results from --output, exit 2\n"
+	"                              on a regression\n"
+	"     -T, --tolerance pct      allowed regression of rate and p99 (10)\n"
+	"     -v, --verbose            show the protocol conversation\n"
+	"     -h, --help               this help\n"
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	struct event *sigint, *sigterm;
+	struct rlimit rl;
+	gint64 ended;
+	double secs;
+	int opt, i, total;
+
+	static struct option long_options[] = {
+		{"host",      required_argument, NULL, 'H'},
+		{"imap-port", required_argument, NULL, 1},
+		{"lmtp-port", required_argument, NULL, 2},
+		{"pop3-port", required_argument, NULL, 3},
+		{"poll",      required_argument, NULL, 4},
+		{"idle",      required_argument, NULL, 5},
+		{"user",      required_argument, NULL, 'u'},
+		{"password",  required_argument, NULL, 'w'},
+		{"users",     required_argument, NULL, 'U'},
+		{"imap",      required_argument, NULL, 'i'},
+		{"lmtp",      required_argument, NULL, 'l'},
+		{"pop3",      required_argument, NULL, 'p'},
+		{"mix",       required_argument, NULL, 'm'},
+		{"think",     required_argument, NULL, 't'},
+		{"corpus",    required_argument, NULL, 'C'},
+		{"seed",      required_argument, NULL, 's'},
+		{"duration",  required_argument, NULL, 'd'},
+		{"warmup",    required_argument, NULL, 'W'},
+		{"ops",       required_argument, NULL, 'n'},
+		{"output",    required_argument, NULL, 'o'},
+		{"baseline",  required_argument, NULL, 'b'},
+		{"tolerance", required_argument, NULL, 'T'},
+		{"verbose",   no_argument,       NULL, 'v'},
+		{"help",      no_argument,       NULL, 'h'},
+		{NULL,        0,                 NULL, 0}
+	};
+
+	setvbuf(stdout, 0, _IONBF, 0);
+
+	while ((opt = getopt_long(argc, argv, "H:u:w:U:i:l:p:m:t:C:s:d:W:n:o:b:T:vh",
+				long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'H': cfg.host = optarg; break;
+		case 1: cfg.imap_port = atoi(optarg); break;
+		case 2: cfg.lmtp_port = atoi(optarg); break;
+		case 3: cfg.pop3_port = atoi(optarg); break;
+		case 4: cfg.poll = atoi(optarg); break;
+		case 5: cfg.idle = atoi(optarg); break;
+		case 'u': cfg.user_fmt = optarg; break;
+		case 'w': cfg.password = optarg; break;
+		case 'U': cfg.users = atoi(optarg); break;
+		case 'i': cfg.imap_sessions = atoi(optarg); break;
+		case 'l': cfg.lmtp_sessions = atoi(optarg); break;
+		case 'p': cfg.pop3_sessions = atoi(optarg); break;
+		case 'm': cfg.mix = optarg; break;
+		case 't': cfg.think = atoi(optarg); break;
+		case 'C': cfg.corpus = optarg; break;
+		case 's': cfg.seed = (guint32)strtoul(optarg, NULL, 10); break;
+		case 'd': cfg.duration = atoi(optarg); break;
+		case 'W': cfg.warmup = atoi(optarg); break;
+		case 'n': cfg.ops = atoi(optarg); break;
+		case 'o': cfg.output = optarg; break;
+		case 'b': cfg.baseline = optarg; break;
+		case 'T': cfg.tolerance = g_ascii_strtod(optarg, NULL); break;
+		case 'v': cfg.verbose = TRUE; break;
+		case 'h': do_showhelp(); return 0;
+		default: do_showhelp(); return 1;
+		}
+	}
+
+	if (cfg.users < 1 || cfg.think < 0 || cfg.duration < 1 || cfg.warmup < 0 || parse_mix(cfg.mix))
+		return 1;
+	if (! strstr(cfg.user_fmt, "%d")) {
+		g_printerr("the user format needs a %%d\n");
+		return 1;
+	}
+
+	corpus = g_ptr_array_new();
+	if (cfg.corpus) {
+		if (corpus_load(cfg.corpus))
+			return 1;
+	} else {
+		corpus_generate();
+	}
+
+	if ((cfg.imap_sessions && ! (addr_imap = resolve(cfg.imap_port)))
+			|| (cfg.lmtp_sessions && ! (addr_lmtp = resolve(cfg.lmtp_port)))
+			|| (cfg.pop3_sessions && ! (addr_pop3 = resolve(cfg.pop3_port))))
+		return 1;
+
+	total = cfg.imap_sessions + cfg.lmtp_sessions + cfg.pop3_sessions;
+	if (! total) {
+		g_printerr("no sessions to run\n");
+		return 1;
+	}
+
+	/* thousands of sessions need as many descriptors */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	for (i = 0; i < OP_LAST; i++)
+		stats[i].samples = g_array_new(FALSE, FALSE, sizeof(guint32));
+	delivered_at = g_new0(gint64, cfg.users);
+
+	base = event_base_new();
+	sigint = evsignal_new(base, SIGINT, sig_int, NULL);
+	sigterm = evsignal_new(base, SIGTERM, sig_int, NULL);
+	evsignal_add(sigint, NULL);
+	evsignal_add(sigterm, NULL);
+
+	started_at = g_get_monotonic_time();
+	if (cfg.ops) {
+		measure_from = started_at;
+	} else {
+		struct timeval tv = { cfg.warmup + cfg.duration, 0 };
+		measure_from = started_at + (gint64)cfg.warmup * G_USEC_PER_SEC;
+		measure_until = measure_from + (gint64)cfg.duration * G_USEC_PER_SEC;
+		event_base_loopexit(base, &tv);
+	}
+
+	printf("%d imap, %d lmtp and %d pop3 sessions against %s for %d users, %u messages in corpus\n",
+			cfg.imap_sessions, cfg.lmtp_sessions, cfg.pop3_sessions, cfg.host, cfg.users, corpus->len);
+
+	/* connects are spread over the first second, sessions over the users */
+	nclients = total;
+	clients = g_new0(Client_T *, total);
+	for (i = 0; i < total; i++) {
+		Client_T *C = g_new0(Client_T, 1);
+		C->id = i;
+		C->proto = i < cfg.imap_sessions ? PROTO_IMAP :
+			i < cfg.imap_sessions + cfg.lmtp_sessions ? PROTO_LMTP : PROTO_POP3;
+		C->rand = g_rand_new_with_seed(cfg.seed * 2654435761u + i);
+		C->user = i % cfg.users;
+		C->timer = evtimer_new(base, client_timer_cb, C);
+		clients[i] = C;
+		client_schedule(C, (int)((int64_t)i * 1000 / total));
+	}
+
+	event_base_dispatch(base);
+	ended = g_get_monotonic_time();
+
+	if (cfg.ops)
+		secs = (double)(ended - measure_from) / G_USEC_PER_SEC;
+	else
+		secs = (double)(MIN(ended, measure_until) - measure_from) / G_USEC_PER_SEC;
+	if (secs <= 0) {
+		g_printerr("interrupted before measuring\n");
+		return 1;
+	}
+
+	for (i = 0; i < total; i++) {
+		client_close(clients[i]);
+		event_free(clients[i]->timer);
+		g_rand_free(clients[i]->rand);
+		g_free(clients[i]);
+	}
+	g_free(clients);
+	event_free(sigint);
+	event_free(sigterm);
+	event_base_free(base);
+
+	return report(secs);
+}
@@ -35,6 +35,12 @@ extern DBParam_T db_params;
 extern ServerConfig_T *server_conf;
 extern SSL_CTX *tls_context;
 
+/* RFC 4978 COMPRESS=DEFLATE totals for this service */
+static CompressStats compress_stats;
+G_LOCK_DEFINE_STATIC(compress_stats);
+
+#define ZBUFLEN 16384
+
 static void dm_tls_error(void)
 {
 	unsigned long e;
@@ -75,6 +81,83 @@ static void client_wbuf_scale(ClientBase_T *client)
 	}
 }
 
+static uint64_t client_cpu_usec(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void client_compress_count(uint64_t plain_tx, uint64_t wire_tx,
+		uint64_t plain_rx, uint64_t wire_rx, uint64_t usec)
+{
+	G_LOCK(compress_stats);
+	compress_stats.plain_tx += plain_tx;
+	compress_stats.wire_tx += wire_tx;
+	compress_stats.plain_rx += plain_rx;
+	compress_stats.wire_rx += wire_rx;
+	compress_stats.cpu_usec += usec;
+	G_UNLOCK(compress_stats);
+}
+
+/*
+ * compress outgoing data onto the write buffer. Anything ending
+ * in a line break completes a response or continuation request,
+ * so it is flushed to a byte boundary for the client to decode.
+ */
+static int client_deflate(ClientBase_T *client, const char *s, size_t len)
+{
+	z_stream *z = client->deflate;
+	unsigned char zbuf[ZBUFLEN];
+	uint64_t start = client_cpu_usec(), wire = 0;
+	int flush = (len && s[len-1] == '\n') ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+	z->next_in = (Bytef *)s;
+	z->avail_in = len;
+	do {
+		z->next_out = zbuf;
+		z->avail_out = sizeof(zbuf);
+		if (deflate(z, flush) == Z_STREAM_ERROR) {
+			TRACE(TRACE_ERR, "[%p] deflate failed", client);
+			return -1;
+		}
+		p_string_append_len(client->write_buffer, (char *)zbuf, sizeof(zbuf) - z->avail_out);
+		wire += sizeof(zbuf) - z->avail_out;
+	} while (z->avail_out == 0);
+
+	client_compress_count(len, wire, 0, 0, client_cpu_usec() - start);
+
+	return 0;
+}
+
+/* decompress incoming data onto the read buffer */
+static int client_inflate(ClientBase_T *client, const char *s, size_t len)
+{
+	z_stream *z = client->inflate;
+	unsigned char zbuf[ZBUFLEN];
+	uint64_t start = client_cpu_usec(), plain = 0;
+	int r;
+
+	z->next_in = (Bytef *)s;
+	z->avail_in = len;
+	do {
+		z->next_out = zbuf;
+		z->avail_out = sizeof(zbuf);
+		r = inflate(z, Z_SYNC_FLUSH);
+		if (r != Z_OK && r != Z_BUF_ERROR && r != Z_STREAM_END) {
+			TRACE(TRACE_INFO, "[%p] inflate failed [%d] %s", client, r, z->msg ? z->msg : "");
+			return -1;
+		}
+		p_string_append_len(client->read_buffer, (char *)zbuf, sizeof(zbuf) - z->avail_out);
+		plain += sizeof(zbuf) - z->avail_out;
+	} while (z->avail_out == 0);
+
+	client_compress_count(0, 0, plain, len, client_cpu_usec() - start);
+
+	return 0;
+}
+
 
 static int client_error_cb(int sock, int error, void *arg)
 {
@@ -190,6 +273,9 @@ ClientBase_T * client_init(client_sock *c)
 	client->rev = NULL;
 	client->wev = NULL;
 
+	metrics_add(METRIC_CONNECTIONS, 1);
+	metrics_add(METRIC_CONNECTIONS_TOTAL, 1);
+
 	return client;
 }
 
@@ -295,7 +381,22 @@ int ci_write(ClientBase_T *client, char * msg, ...)
 	if (state & CLIENT_ERR)
 		return -1; // disconnected
 
-	if (msg) {
+	if (msg && client->deflate) {
+		char *plain;
+		va_start(ap, msg);
+		va_copy(cp, ap);
+		plain = g_strdup_vprintf(msg, cp);
+		va_end(cp);
+		va_end(ap);
+		e = client_deflate(client, plain, strlen(plain));
+		g_free(plain);
+		if (e < 0) {
+			PLOCK(client->lock);
+			client->client_state |= CLIENT_ERR;
+			PUNLOCK(client->lock);
+			return -1;
+		}
+	} else if (msg) {
 		va_start(ap, msg);
 		va_copy(cp, ap);
 		p_string_append_vprintf(client->write_buffer, msg, cp);
@@ -312,7 +413,7 @@ int ci_write(ClientBase_T *client, char * msg, ...)
 
 		if (client->sock->ssl) {
 			if (! client->tls_wbuf_n) {
-				strncpy(client->tls_wbuf, s, n);
+				memcpy(client->tls_wbuf, s, n);
 				client->tls_wbuf_n = n;
 			}
 			t = (int64_t)SSL_write(client->sock->ssl, (gconstpointer)client->tls_wbuf, client->tls_wbuf_n);
@@ -374,9 +475,13 @@ int ci_write(ClientBase_T *client, char * msg, ...)
 			} 
 		} 
 
-		TRACE(TRACE_DEBUG, "[%p] S > [%" PRId64 "/%" PRIu64 ":%s]", client, t, left, s);
+		if (client->deflate)
+			TRACE(TRACE_DEBUG, "[%p] S > [%" PRId64 "/%" PRIu64 "] deflated", client, t, left);
+		else
+			TRACE(TRACE_DEBUG, "[%p] S > [%" PRId64 "/%" PRIu64 ":%s]", client, t, left, s);
 
 		client->bytes_tx += t;	// Update our byte counter
+		metrics_add(METRIC_BYTES_TX, t);
 		client->write_buffer_offset += t;
 		client_wbuf_scale(client);
 		if (client->sock->ssl) {
@@ -390,6 +495,38 @@ int ci_write(ClientBase_T *client, char * msg, ...)
 	return 1;
 }
 
+/*
+ * write a counted buffer. Unlike ci_write() this is safe for
+ * data holding NUL octets, like a BINARY literal8 (RFC 3516)
+ */
+int ci_write_len(ClientBase_T *client, const char *data, size_t len)
+{
+	int state;
+
+	if (! (client && client->write_buffer))
+		return -1; // stale
+
+	PLOCK(client->lock);
+	state = client->client_state;
+	PUNLOCK(client->lock);
+
+	if (state & CLIENT_ERR)
+		return -1; // disconnected
+
+	if (client->deflate) {
+		if (client_deflate(client, data, len) < 0) {
+			PLOCK(client->lock);
+			client->client_state |= CLIENT_ERR;
+			PUNLOCK(client->lock);
+			return -1;
+		}
+	} else {
+		p_string_append_len(client->write_buffer, data, len);
+	}
+
+	return ci_write(client, NULL);
+}
+
 size_t ci_wbuf_len(ClientBase_T *client)
 {
 	size_t len = 0;
@@ -419,6 +556,8 @@ void ci_read_cb(ClientBase_T *client)
 	char ibuf[IBUFLEN];
 	int state;
 
+	client_rbuf_scale(client);
+
 	while (TRUE) {
 		memset(ibuf, 0, sizeof(ibuf));
 		if (client->sock->ssl) {
@@ -462,10 +601,18 @@ void ci_read_cb(ClientBase_T *client)
 
 		} else if (t > 0) {
 			client->bytes_rx += t;	// Update our byte counter
+			metrics_add(METRIC_BYTES_RX, t);
 			PLOCK(client->lock);
 			client->client_state = CLIENT_OK; 
 			PUNLOCK(client->lock);
-			p_string_append_len(client->read_buffer, ibuf, t);
+			if (! client->inflate) {
+				p_string_append_len(client->read_buffer, ibuf, t);
+			} else if (client_inflate(client, ibuf, t) < 0) {
+				PLOCK(client->lock);
+				client->client_state |= CLIENT_ERR;
+				PUNLOCK(client->lock);
+				break;
+			}
 		}
 	}
 }
@@ -473,23 +620,12 @@ void ci_read_cb(ClientBase_T *client)
 int ci_read(ClientBase_T *client, char *buffer, size_t n)
 {
 	// fetch data from the read buffer
+	const char *s;
+
 	assert(buffer);
 
-	client->len = 0;
-	char *s = (char *)p_string_str(client->read_buffer) + client->read_buffer_offset;
-	if ((client->read_buffer_offset + n) <= p_string_len(client->read_buffer)) {
-		/*
-		size_t j,k = 0;
-
-		memset(buffer, 0, sizeof(buffer));
-		for (j=0; j<n; j++)
-			buffer[k++] = s[j];
-		*/
+	if ((s = ci_read_ref(client, n)))
 		memcpy(buffer, s, n);
-		client->read_buffer_offset += n;
-		client->len += n;
-		client_rbuf_scale(client);
-	}
 
 	return client->len;
 }
@@ -497,34 +633,155 @@ int ci_read(ClientBase_T *client, char *buffer, size_t n)
 int ci_readln(ClientBase_T *client, char * buffer)
 {
 	// fetch a line from the read buffer
-	char *nl;
+	char *s;
 
 	assert(buffer);
 
+	if ((s = ci_readln_ref(client))) {
+		memcpy(buffer, s, client->len - 1);
+		buffer[client->len - 1] = '\n';
+	}
+
+	return client->len;
+}
+
+/*
+ * Zero-copy reads: hand out data where it sits in the read buffer.
+ * The buffer is only reset on the next read, so the data stays put
+ * until then. ci_readln_ref terminates the line in place of its
+ * newline; client->len still counts the newline.
+ */
+const char * ci_read_ref(ClientBase_T *client, size_t n)
+{
+	const char *s;
+
+	client_rbuf_scale(client);
+
 	client->len = 0;
-	char *s = (char *)p_string_str(client->read_buffer) + client->read_buffer_offset;
-	if ((nl = g_strstr_len(s, -1, "\n"))) {
-		uint64_t j, k = 0, l;
-		l = stridx(s, '\n');
-		if (l >= MAX_LINESIZE) {
-			TRACE(TRACE_WARNING, "insane line-length [%" PRIu64 "]", l);
-			PLOCK(client->lock);
-			client->client_state |= CLIENT_ERR;
-			PUNLOCK(client->lock);
-			return 0;
-		}
-		for (j=0; j<=l; j++)
-			buffer[k++] = s[j];
-		client->read_buffer_offset += l+1;
-		client->len = k;
-		TRACE(TRACE_INFO, "[%p] C < [%" PRIu64 ":%s]", client, client->len, buffer);
+	if ((client->read_buffer_offset + n) > p_string_len(client->read_buffer))
+		return NULL;
+
+	s = p_string_str(client->read_buffer) + client->read_buffer_offset;
+	client->read_buffer_offset += n;
+	client->len = n;
+
+	return s;
+}
+
+char * ci_readln_ref(ClientBase_T *client)
+{
+	char *s, *nl;
+	uint64_t l;
+
+	client_rbuf_scale(client);
 
-		client_rbuf_scale(client);
+	client->len = 0;
+	s = (char *)p_string_str(client->read_buffer) + client->read_buffer_offset;
+	if (! (nl = memchr(s, '\n', p_string_len(client->read_buffer) - client->read_buffer_offset)))
+		return NULL;
+
+	l = nl - s;
+	if (l >= MAX_LINESIZE) {
+		TRACE(TRACE_WARNING, "insane line-length [%" PRIu64 "]", l);
+		PLOCK(client->lock);
+		client->client_state |= CLIENT_ERR;
+		PUNLOCK(client->lock);
+		return NULL;
 	}
 
-	return client->len;
+	*nl = '\0';
+	client->read_buffer_offset += l+1;
+	client->len = l+1;
+	TRACE(TRACE_INFO, "[%p] C < [%" PRIu64 ":%s]", client, client->len, s);
+
+	return s;
+}
+
+
+/*
+ * RFC 4978: start COMPRESS=DEFLATE on both directions, after the
+ * tagged OK has been queued. Input the client already sent past
+ * the COMPRESS command is compressed too, and is inflated here.
+ *
+ * level is the zlib compression level, window the deflate window
+ * in bits (9-15) which also caps the memory used per connection.
+ */
+int ci_compress(ClientBase_T *client, int level, int window)
+{
+	char *pending;
+	uint64_t len;
+	int memlevel;
+
+	if (client->deflate)
+		return DM_EGENERAL;
+
+	window = max(min(window, MAX_WBITS), 9);
+	memlevel = max(min(window - 7, MAX_MEM_LEVEL), 1);
+
+	client->deflate = g_new0(z_stream, 1);
+	client->inflate = g_new0(z_stream, 1);
+
+	if (deflateInit2(client->deflate, level, Z_DEFLATED, -window, memlevel, Z_DEFAULT_STRATEGY) != Z_OK) {
+		TRACE(TRACE_ERR, "[%p] deflateInit2 failed", client);
+		g_free(client->deflate);
+		g_free(client->inflate);
+		client->deflate = client->inflate = NULL;
+		return DM_EGENERAL;
+	}
+	/* the client may use any window size */
+	if (inflateInit2(client->inflate, -MAX_WBITS) != Z_OK) {
+		TRACE(TRACE_ERR, "[%p] inflateInit2 failed", client);
+		deflateEnd(client->deflate);
+		g_free(client->deflate);
+		g_free(client->inflate);
+		client->deflate = client->inflate = NULL;
+		return DM_EGENERAL;
+	}
+
+	G_LOCK(compress_stats);
+	compress_stats.sessions++;
+	G_UNLOCK(compress_stats);
+
+	len = p_string_len(client->read_buffer) - client->read_buffer_offset;
+	if (len) {
+		pending = g_malloc(len);
+		memcpy(pending, p_string_str(client->read_buffer) + client->read_buffer_offset, len);
+		p_string_truncate(client->read_buffer, 0);
+		client->read_buffer_offset = 0;
+		if (client_inflate(client, pending, len) < 0) {
+			g_free(pending);
+			return DM_EGENERAL;
+		}
+		g_free(pending);
+	}
+
+	TRACE(TRACE_DEBUG, "[%p] DEFLATE active, level [%d] window [%d]", client, level, window);
+
+	return DM_SUCCESS;
 }
 
+static void ci_compress_close(ClientBase_T *client)
+{
+	if (! client->deflate)
+		return;
+
+	TRACE(TRACE_INFO, "[%p] DEFLATE out [%lu/%lu] in [%lu/%lu]", client,
+			client->deflate->total_in, client->deflate->total_out,
+			client->inflate->total_out, client->inflate->total_in);
+
+	deflateEnd(client->deflate);
+	inflateEnd(client->inflate);
+	g_free(client->deflate);
+	g_free(client->inflate);
+	client->deflate = client->inflate = NULL;
+}
+
+void ci_compress_stats(CompressStats *stats)
+{
+	G_LOCK(compress_stats);
+	*stats = compress_stats;
+	G_UNLOCK(compress_stats);
+}
 
 void ci_authlog_init(ClientBase_T *client, const char *service, const char *username, const char *status)
 {
@@ -589,6 +846,8 @@ void ci_close(ClientBase_T *client)
 	TRACE(TRACE_DEBUG, "closing clientbase [%p] [%d] [%d]", client,
 			client->tx, client->rx);
 
+	metrics_add(METRIC_CONNECTIONS, -1);
+
 	ci_cork(client);
 
 	if (client->rev) {
@@ -626,6 +885,8 @@ void ci_close(ClientBase_T *client)
 		SSL_free(client->sock->ssl);
 	}
 
+	ci_compress_close(client);
+
 	p_string_free(client->read_buffer, TRUE);
 	p_string_free(client->write_buffer, TRUE);
 
@@ -32,6 +32,8 @@ ClientBase_T * client_init(client_sock *);
 #define IBUFLEN 65535
 
 int    ci_starttls(ClientBase_T *);
+int    ci_compress(ClientBase_T *, int, int);
+void   ci_compress_stats(CompressStats *);
 void   ci_cork(ClientBase_T *);
 void   ci_uncork(ClientBase_T *);
 void   ci_authlog_init(ClientBase_T *, const char *, const char *, const char *);
@@ -41,7 +43,10 @@ void   ci_write_cb(ClientBase_T *);
 
 int    ci_read(ClientBase_T *, char *, size_t);
 int    ci_readln(ClientBase_T *, char *);
+const char * ci_read_ref(ClientBase_T *, size_t);
+char * ci_readln_ref(ClientBase_T *);
 int    ci_write(ClientBase_T *, char *, ...);
+int    ci_write_len(ClientBase_T *, const char *, size_t);
 
 size_t ci_wbuf_len(ClientBase_T *);
 
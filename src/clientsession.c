@@ -47,7 +47,6 @@ ClientSession_T * client_session_new(client_sock *c)
 	session->args = p_list_new(pool);
 	session->from = p_list_new(pool);
 	session->rbuff = p_string_new(pool, "");
-	session->messagelst = p_list_new(pool);
 
 	gethostname(session->hostname, sizeof(session->hostname));
 
@@ -138,7 +137,6 @@ void client_session_bailout(ClientSession_T **session)
 	List_T args = NULL;
 	List_T from = NULL;
 	List_T rcpt = NULL;
-	List_T messagelst = NULL;
 
 	assert(c);
 
@@ -206,23 +204,13 @@ void client_session_bailout(ClientSession_T **session)
 		p_list_free(&args);
 	}
 
-	if (c->messagelst) {
-		messagelst = p_list_first(c->messagelst);
-		while (p_list_data(messagelst)) {
-			struct message *m = p_list_data(messagelst);
-			mempool_push(c->pool, m, sizeof(struct message));
-			if (! p_list_next(messagelst))
-				break;
-			messagelst = p_list_next(messagelst);
-		}
-		messagelst = p_list_first(messagelst);
-		p_list_free(&messagelst);
-	}
+	if (c->messages)
+		g_array_free(c->messages, TRUE);
 
 	c->args = NULL;
 	c->from = NULL;
 	c->rcpt = NULL;
-	c->messagelst = NULL;
+	c->messages = NULL;
 
 	pool = c->pool;
 	mempool_push(pool, c, sizeof(ClientSession_T));
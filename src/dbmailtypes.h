@@ -120,8 +120,52 @@ typedef struct {
 	unsigned int query_time_notice;
 	unsigned int query_time_warning;
 	unsigned int query_timeout;
+	unsigned int db_queue_max; /**< waiting threads before low priority work is refused */
+	Field_T replica_dburi;	/**< read replicas, space or comma separated */
 } DBParam_T;
 
+/** order in which threads waiting for a database connection are served */
+typedef enum {
+	DB_PRIORITY_HIGH,	/**< message delivery */
+	DB_PRIORITY_NORMAL,
+	DB_PRIORITY_LOW,	/**< bulk work like SEARCH and SORT */
+	DB_PRIORITY_COUNT
+} DbPriority_T;
+
+typedef struct {
+	unsigned limit;		/* max_db_connections, 0 for no limit */
+	unsigned active;	/* connections handed out */
+	unsigned waiting;	/* threads in the queue */
+	unsigned max_waiting;
+	uint64_t admitted;	/* db_con_get calls */
+	uint64_t waited;	/* of which had to queue */
+	uint64_t shed;		/* requests refused by db_con_shed */
+	uint64_t wait_usec;	/* total time spent queueing */
+	uint64_t max_wait_usec;
+} DbQueueStats_T;
+
+typedef struct {
+	unsigned replicas;
+	uint64_t reads;		/* db_con_get_read calls */
+	uint64_t replica_reads;	/* of which served by a replica */
+	uint64_t lagging;	/* sent to the primary because a replica was behind */
+	uint64_t failures;	/* replica errors */
+	uint64_t last_lag;	/* in mailbox seq */
+	uint64_t max_lag;
+} DbReplicaStats_T;
+
+/** per statement template counters kept by the query profiler */
+#define DB_PROFILE_BUCKETS 8	/* <10us, <100us, ... <10s, rest */
+typedef struct {
+	char *query;		/* statement template */
+	uint64_t calls;
+	uint64_t rows;		/* rows fetched */
+	uint64_t usec;		/* total execution time */
+	uint64_t max_usec;
+	uint64_t wait_usec;	/* time spent getting the connection */
+	uint64_t hist[DB_PROFILE_BUCKETS];
+} DbQueryProfile_T;
+
 enum DBMAIL_MESSAGE_CLASS {
 	DBMAIL_MESSAGE,
 	DBMAIL_MESSAGE_PART
@@ -137,6 +181,7 @@ typedef struct {
 	// Memory Pool
 	Mempool_T pool;
 	gboolean freepool;
+	Arena_T arena;		// released with the message
 
 	// ID
 	uint64_t id;
@@ -225,7 +270,9 @@ enum IMAP_COMMAND_TYPES {
 	IMAP_COMM_IDLE,                 // 37
 	IMAP_COMM_STARTTLS,             // 38
 	IMAP_COMM_ID,                   // 39
-	IMAP_COMM_LAST                  // 40
+	IMAP_COMM_COMPRESS,             // 40
+	IMAP_COMM_MOVE,                 // 41
+	IMAP_COMM_LAST                  // 42
 };
 
 typedef enum { 
@@ -272,7 +319,9 @@ enum BODY_FETCH_ITEM_TYPES {
 	BFIT_MIME               = 3,
 	BFIT_HEADER_FIELDS      = 4,
 	BFIT_HEADER_FIELDS_NOT  = 5, 
-	BFIT_ALL                = 6
+	BFIT_ALL                = 6,
+	BFIT_BINARY             = 7,
+	BFIT_BINARY_SIZE        = 8
 };
 
 
@@ -294,6 +343,14 @@ typedef struct  {
 
 //
 
+/* COMPRESS=DEFLATE octet and cpu counters */
+typedef struct {
+	uint64_t sessions;		/* connections that enabled compression */
+	uint64_t plain_tx, wire_tx;	/* octets before and after deflate */
+	uint64_t plain_rx, wire_rx;	/* octets after and before inflate */
+	uint64_t cpu_usec;		/* thread cpu time spent in zlib */
+} CompressStats;
+
 #define TLS_SEGMENT	262144
 #define CLIENT_OK	0
 #define CLIENT_AGAIN	1
@@ -337,6 +394,9 @@ typedef struct {
 	char tls_wbuf[TLS_SEGMENT];	/* buffer to write during tls session */
 	uint64_t tls_wbuf_n;		/* number of octets to write during tls session */
 
+	z_stream *deflate;		/* RFC 4978 COMPRESS=DEFLATE, outgoing */
+	z_stream *inflate;		/* RFC 4978 COMPRESS=DEFLATE, incoming */
+
 	uint64_t rbuff_size;              /* size of string-literals */
 	String_T read_buffer;		/* input buffer */
 	uint64_t read_buffer_offset;	/* input buffer offset */
@@ -380,7 +440,8 @@ typedef struct {
 	uint64_t totalmessages; 		/**< number of messages */
 	uint64_t virtual_totalmessages;
 
-	List_T messagelst;		/** list of messages */
+	uint64_t mailbox_idnr;		/**< Used by pop3 */
+	GArray *messages;		/** struct message, in message id order */
 	List_T from;			// lmtp senders
 	List_T rcpt;			// lmtp recipients
 } ClientSession_T;
@@ -410,6 +471,8 @@ typedef struct {
 	Field_T serverUser;
         Field_T serverGroup;
 	Field_T socket;
+	Field_T metrics_socket;		// prometheus metrics of this process
+	mode_t metrics_socket_mode;	// permissions of metrics_socket
 	Field_T log;
 	Field_T error_log;
 	Field_T pid_dir;
@@ -476,20 +539,49 @@ typedef enum {
 	SEARCH_THREAD_REFERENCES
 } search_order;
 
+typedef enum {
+	SORT_ARRIVAL = 1,
+	SORT_CC,
+	SORT_DATE,
+	SORT_FROM,
+	SORT_SIZE,
+	SORT_SUBJECT,
+	SORT_TO
+} sort_key;
+
+#define MAX_SORT_KEYS 16
+
+/* ESEARCH/ESORT result options (RETURN) */
+#define SEARCH_RETURN_MIN	0x01
+#define SEARCH_RETURN_MAX	0x02
+#define SEARCH_RETURN_ALL	0x04
+#define SEARCH_RETURN_COUNT	0x08
+#define SEARCH_RETURN_PARTIAL	0x10
+#define SEARCH_RETURN_SAVE	0x20	// RFC 5182 SEARCHRES
+
+/* a run of consecutive uids or message numbers in a result set */
+typedef struct {
+	uint64_t first;
+	uint64_t last;
+} IdRange;
+
 typedef struct {
 	int type;
 	uint64_t size;
-	char table[MAX_SEARCH_LEN];
-	char order[MAX_SEARCH_LEN];
+	int sort[MAX_SORT_KEYS];	// sort_key, negative for REVERSE
 	char field[MAX_SEARCH_LEN];
 	char op[MAX_SEARCH_LEN];
 	char search[MAX_SEARCH_LEN];
 	char hdrfld[MIME_FIELD_MAX];
 //	int match;
-	GTree *found;
-	gboolean reverse;
+	GArray *found;		// uids matched, as runs (IdRange)
+	gboolean reverse;	// IST_FLAG: negate the match
 	gboolean searched;
 	gboolean merged;
+	int flags_set;		// IST_FLAG: (1 << IMAP_FLAG_*) that must be set
+	int flags_clear;	// IST_FLAG: (1 << IMAP_FLAG_*) that must be clear
+	char date_low[SQL_INTERNALDATE_LEN];	// IST_IDATE: first matching internal date
+	char date_high[SQL_INTERNALDATE_LEN];	// IST_IDATE: first internal date past the window
 } search_key;
 
 
@@ -541,6 +633,17 @@ typedef struct {
 	List_T   bodyfetch;
 } fetch_items;
 
+/* chunked purge and orphan collection (dbmail-util) */
+typedef struct {
+	uint64_t batch;		/* rows per chunk */
+	uint64_t rate;		/* rows per second, 0 for no limit */
+	uint64_t resume;	/* continue after this id */
+	void (*checkpoint)(const char *table, uint64_t id);
+} GCParam_T;
+
+/* receives a message in pieces; return non-zero to stop the stream */
+typedef int (*MessageStreamFunc)(const char *buf, size_t len, void *data);
+
 typedef struct {
 	uint64_t uidvalidity;
 	uint64_t modseq;
@@ -577,6 +680,32 @@ typedef struct { // map dbmail_messages
 	GList *keywords;
 } MessageInfo;
 
+/*
+ * one message of an APPEND (RFC 3502 MULTIAPPEND)
+ */
+typedef struct {
+	const char *message;
+	uint64_t size;
+	const char *internal_date;
+	int flags[IMAP_NFLAGS];
+	GList *keywords;
+	uint64_t uid;		// set once stored
+} AppendMessage;
+
+/*
+ * cached SORT keys
+ */
+typedef struct {
+	uint64_t uid;
+	uint64_t rfcsize;
+	char *arrival;
+	char *date;
+	char *from;
+	char *to;
+	char *cc;
+	char *subject; // base subject
+} SortInfo;
+
 
 /*************************************************************************
 *                                 SIEVE
@@ -519,6 +519,13 @@ void GetDBParams(void)
 	else
 		db_params.query_timeout = 300000;
 
+	if (config_get_value("db_queue_max", "DBMAIL", query_time) < 0)
+		TRACE(TRACE_DEBUG, "no config for [db_queue_max]");
+	db_params.db_queue_max = (unsigned int) strtoul(query_time, NULL, 10);
+
+	if (config_get_value("replica_dburi", "DBMAIL", db_params.replica_dburi) < 0)
+		TRACE(TRACE_DEBUG, "no config for [replica_dburi]");
+
 
 	if (strcmp(db_params.pfx, "\"\"") == 0) {
 		/* FIXME: It appears that when the empty string is quoted
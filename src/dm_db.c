@@ -32,6 +32,10 @@
 
 #define THIS_MODULE "db"
 
+static void _stmt_cache_drop(Connection_T c);
+static void _profile_wait(uint64_t usec);
+static void _profile_release(Connection_T);
+
 // Flag order defined in dbmailtypes.h
 static const char *db_flag_desc[] = {
 	"seen_flag",
@@ -287,7 +291,10 @@ int db_connect(void)
 		return -1;
 	}
 	db_connected = 3;
-	db_con_close(c);
+	Connection_close(c);
+
+	if (strlen(db_params.replica_dburi))
+		db_replica_connect(db_params.replica_dburi);
 
 	if (! db_params.db_driver) {
 		const char *protocol = URL_getProtocol(dburi);
@@ -310,6 +317,8 @@ int db_disconnect(void)
 {
 	TRACE(TRACE_DEBUG,"Disconnecting debug");
 	TRACE(TRACE_WARNING,"Disconnecting warning");
+	_stmt_cache_drop(NULL);
+	db_replica_disconnect();
 	if(db_connected >= 3) ConnectionPool_stop(pool);
 	if(db_connected >= 2) ConnectionPool_free(&pool);
 	if(db_connected >= 1) URL_free(&dburi);
@@ -324,29 +333,357 @@ const char *db_get_db_name(void)
 	return path;
 }
 
+/*
+ * connection admission
+ *
+ * Threads that find all max_db_connections handed out wait in a FIFO
+ * queue per priority and are woken when a connection is returned, the
+ * oldest waiter of the most urgent priority first.
+ */
+static struct {
+	GMutex lock;
+	GCond cond;
+	unsigned active;
+	GList *queue[DB_PRIORITY_COUNT];
+	DbQueueStats_T stats;
+} admission;
+
+static GPrivate con_priority;
+
+void db_con_priority(DbPriority_T priority)
+{
+	g_private_set(&con_priority, GINT_TO_POINTER(priority + 1));
+}
+
+DbPriority_T db_con_get_priority(void)
+{
+	int p = GPOINTER_TO_INT(g_private_get(&con_priority));
+	return p ? (DbPriority_T)(p - 1) : DB_PRIORITY_NORMAL;
+}
+
+static gboolean _admission_head(gpointer waiter, DbPriority_T priority)
+{
+	int p;
+	for (p = 0; p < (int)priority; p++) {
+		if (admission.queue[p])
+			return FALSE;
+	}
+	return admission.queue[priority]->data == waiter;
+}
+
+static void _admission_enter(void)
+{
+	DbPriority_T priority = db_con_get_priority();
+	unsigned limit = db_params.max_db_connections;
+	gint64 start, waited;
+	gboolean warned = FALSE;
+	gint64 waiter;
+
+	g_mutex_lock(&admission.lock);
+	admission.stats.admitted++;
+	if (! limit || (admission.active < limit && ! admission.stats.waiting)) {
+		admission.active++;
+		g_mutex_unlock(&admission.lock);
+		return;
+	}
+
+	/* the address of a local is unique for as long as we wait */
+	admission.queue[priority] = g_list_append(admission.queue[priority], &waiter);
+	admission.stats.waiting++;
+	admission.stats.waited++;
+	admission.stats.max_waiting = max(admission.stats.max_waiting, admission.stats.waiting);
+
+	start = g_get_monotonic_time();
+	while (admission.active >= limit || ! _admission_head(&waiter, priority)) {
+		if (! g_cond_wait_until(&admission.cond, &admission.lock, g_get_monotonic_time() + 5 * G_TIME_SPAN_SECOND) && ! warned) {
+			TRACE(TRACE_ALERT, "Thread is having trouble obtaining a database connection. [%u] waiting", 
+					admission.stats.waiting);
+			warned = TRUE;
+		}
+	}
+
+	admission.queue[priority] = g_list_remove(admission.queue[priority], &waiter);
+	admission.stats.waiting--;
+	admission.active++;
+
+	waited = g_get_monotonic_time() - start;
+	admission.stats.wait_usec += waited;
+	admission.stats.max_wait_usec = max(admission.stats.max_wait_usec, (uint64_t)waited);
+
+	/* the next in line may fit as well */
+	g_cond_broadcast(&admission.cond);
+	g_mutex_unlock(&admission.lock);
+}
+
+static void _admission_leave(void)
+{
+	g_mutex_lock(&admission.lock);
+	if (admission.active)
+		admission.active--;
+	if (admission.stats.waiting)
+		g_cond_broadcast(&admission.cond);
+	g_mutex_unlock(&admission.lock);
+}
+
+/* load shedding: callers about to start database heavy work ask first,
+ * and answer with a temporary failure when too many threads are
+ * already waiting for a connection. Low priority work is refused at
+ * db_queue_max waiters, normal work at twice that, delivery never. */
+gboolean db_con_shed(void)
+{
+	DbPriority_T priority = db_con_get_priority();
+	unsigned limit = db_params.db_queue_max;
+	gboolean shed = FALSE;
+
+	if (! limit || priority == DB_PRIORITY_HIGH)
+		return FALSE;
+	if (priority == DB_PRIORITY_NORMAL)
+		limit *= 2;
+
+	g_mutex_lock(&admission.lock);
+	if (admission.stats.waiting >= limit) {
+		admission.stats.shed++;
+		shed = TRUE;
+	}
+	g_mutex_unlock(&admission.lock);
+
+	if (shed)
+		TRACE(TRACE_NOTICE, "shedding load, [%u] threads waiting for a database connection",
+				limit);
+	return shed;
+}
+
+void db_con_stats(DbQueueStats_T *stats)
+{
+	g_mutex_lock(&admission.lock);
+	*stats = admission.stats;
+	stats->active = admission.active;
+	stats->limit = db_params.max_db_connections;
+	g_mutex_unlock(&admission.lock);
+}
+
 /* db_con_get() is guaranteed to return a connection and will wait until one
  * is available.
  */
 Connection_T db_con_get(void)
 {
 	int i=0, k=0; Connection_T c = NULL;
+	gint64 start = g_get_monotonic_time();
+
+	_admission_enter();
+
+	/* admission keeps us within the pool size, but the pool may
+	 * still hold on to stale connections */
 	while (! c) {
 		c = ConnectionPool_getConnection(pool);
 		if (c) break;
-		if((int)(i % 5)==0) {
+		if((int)(i % 50)==0) {
 			TRACE(TRACE_ALERT, "Thread is having trouble obtaining a database connection. Try [%d]", i);
 			k = ConnectionPool_reapConnections(pool);
 			TRACE(TRACE_INFO, "Database reaper closed [%d] stale connections", k);
 		}
-		sleep(1);
+		g_usleep(100000);
 		i++;
 	}
 
 	Connection_setQueryTimeout(c, (int)db_params.query_timeout);
+	_profile_wait(g_get_monotonic_time() - start);
 	TRACE(TRACE_DATABASE,"[%p] connection from pool", c);
 	return c;
 }
 
+/*
+ * read replicas
+ *
+ * Read paths that can live with a replica ask for a connection with
+ * db_con_get_read(), passing the mailbox they read and the mailbox seq
+ * the session has already seen. A replica only serves the read if it
+ * has caught up with that seq; otherwise, or when no replica is
+ * available, the read goes to the primary. A replica found lagging
+ * is skipped for a moment.
+ */
+#define REPLICA_BACKOFF G_USEC_PER_SEC
+
+typedef struct {
+	URL_T url;
+	ConnectionPool_T pool;
+	gint64 skip_until;
+} Replica;
+
+G_LOCK_DEFINE_STATIC(replicas);
+static GList *replicas = NULL;
+static GList *replica_next = NULL;
+static GHashTable *replica_cons = NULL;	/* connections handed out by a replica */
+static DbReplicaStats_T replica_stats;
+
+int db_replica_connect(const char *uris)
+{
+	char **list, **u;
+	int n = 0;
+
+	list = g_strsplit_set(uris, " ,", 0);
+	for (u = list; *u; u++) {
+		Replica *r;
+		URL_T url;
+		ConnectionPool_T p;
+
+		if (! strlen(*u))
+			continue;
+		if (! (url = URL_new(*u))) {
+			TRACE(TRACE_ERR, "invalid replica dburi [%s]", *u);
+			continue;
+		}
+		if (! (p = ConnectionPool_new(url))) {
+			TRACE(TRACE_ERR, "error creating replica connection pool [%s]", URL_toString(url));
+			URL_free(&url);
+			continue;
+		}
+		if (db_params.max_db_connections > 0) {
+			if (db_params.max_db_connections < (unsigned int)ConnectionPool_getInitialConnections(p))
+				ConnectionPool_setInitialConnections(p, db_params.max_db_connections);
+			ConnectionPool_setMaxConnections(p, db_params.max_db_connections);
+		}
+		ConnectionPool_setReaper(p, 60);
+		ConnectionPool_setAbortHandler(p, TabortHandler);
+		ConnectionPool_start(p);
+
+		r = g_new0(Replica, 1);
+		r->url = url;
+		r->pool = p;
+
+		G_LOCK(replicas);
+		replicas = g_list_append(replicas, r);
+		if (! replica_cons)
+			replica_cons = g_hash_table_new(g_direct_hash, g_direct_equal);
+		replica_stats.replicas++;
+		G_UNLOCK(replicas);
+
+		TRACE(TRACE_INFO, "read replica [%s] added", URL_toString(url));
+		n++;
+	}
+	g_strfreev(list);
+
+	return n;
+}
+
+void db_replica_disconnect(void)
+{
+	GList *l;
+
+	G_LOCK(replicas);
+	for (l = replicas; l; l = l->next) {
+		Replica *r = (Replica *)l->data;
+		ConnectionPool_stop(r->pool);
+		ConnectionPool_free(&r->pool);
+		URL_free(&r->url);
+		g_free(r);
+	}
+	g_list_free(replicas);
+	replicas = NULL;
+	replica_next = NULL;
+	if (replica_cons)
+		g_hash_table_remove_all(replica_cons);
+	replica_stats.replicas = 0;
+	G_UNLOCK(replicas);
+}
+
+/* how far the replica is behind the seq the caller has seen, 0 if not */
+static uint64_t _replica_lag(Connection_T c, uint64_t mailbox_idnr, uint64_t seq)
+{
+	ResultSet_T r; PreparedStatement_T st;
+	volatile uint64_t rseq = 0;
+
+	st = db_stmt_prepare(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = ?", DBPFX);
+	db_stmt_set_u64(st, 1, mailbox_idnr);
+	r = db_stmt_query(st);
+	if (db_result_next(r))
+		rseq = db_result_get_u64(r, 0);
+
+	return (rseq >= seq) ? 0 : seq - rseq;
+}
+
+Connection_T db_con_get_read(uint64_t mailbox_idnr, uint64_t seq)
+{
+	Connection_T c = NULL;
+	Replica *r = NULL;
+	gint64 now = g_get_monotonic_time();
+	guint i, n;
+
+	G_LOCK(replicas);
+	n = g_list_length(replicas);
+	replica_stats.reads++;
+	/* round robin over the replicas that are not being skipped */
+	for (i = 0; i < n && ! c; i++) {
+		if (! replica_next)
+			replica_next = replicas;
+		r = (Replica *)replica_next->data;
+		replica_next = replica_next->next;
+		if (r->skip_until > now)
+			continue;
+		c = ConnectionPool_getConnection(r->pool);
+	}
+	G_UNLOCK(replicas);
+
+	if (c && mailbox_idnr && seq) {
+		volatile uint64_t lag = 0;
+		volatile gboolean failed = FALSE;
+		TRY
+			lag = _replica_lag(c, mailbox_idnr, seq);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			failed = TRUE;
+		END_TRY;
+
+		if (lag || failed) {
+			G_LOCK(replicas);
+			r->skip_until = now + (failed ? 5 : 1) * REPLICA_BACKOFF;
+			if (failed)
+				replica_stats.failures++;
+			else
+				replica_stats.lagging++;
+			replica_stats.last_lag = lag;
+			replica_stats.max_lag = max(replica_stats.max_lag, (uint64_t)lag);
+			G_UNLOCK(replicas);
+			TRACE(TRACE_INFO, "replica [%s] behind by [%" PRIu64 "] for mailbox [%" PRIu64 "]",
+					URL_toString(r->url), (uint64_t)lag, mailbox_idnr);
+			Connection_close(c);
+			c = NULL;
+		}
+	}
+
+	if (! c)
+		return db_con_get();
+
+	Connection_setQueryTimeout(c, (int)db_params.query_timeout);
+
+	G_LOCK(replicas);
+	g_hash_table_add(replica_cons, c);
+	replica_stats.replica_reads++;
+	G_UNLOCK(replicas);
+
+	TRACE(TRACE_DATABASE,"[%p] connection from replica [%s]", c, URL_toString(r->url));
+	return c;
+}
+
+gboolean db_con_is_replica(Connection_T c)
+{
+	gboolean found = FALSE;
+
+	G_LOCK(replicas);
+	if (replica_cons)
+		found = g_hash_table_contains(replica_cons, c);
+	G_UNLOCK(replicas);
+
+	return found;
+}
+
+void db_replica_stats(DbReplicaStats_T *stats)
+{
+	G_LOCK(replicas);
+	*stats = replica_stats;
+	G_UNLOCK(replicas);
+}
+
 gboolean dm_db_ping(void)
 {
 	Connection_T c; gboolean t = FALSE;
@@ -371,14 +708,28 @@ gboolean dm_db_ping(void)
 
 void db_con_close(Connection_T c)
 {
+	gboolean replica = FALSE;
+
 	TRACE(TRACE_DATABASE,"[%p] connection to pool", c);
+	_stmt_cache_drop(c);
+	_profile_release(c);
+
+	G_LOCK(replicas);
+	if (replica_cons)
+		replica = g_hash_table_remove(replica_cons, c);
+	G_UNLOCK(replicas);
+
 	Connection_close(c);
+	if (! replica)
+		_admission_leave();
 	return;
 }
 
 void db_con_clear(Connection_T c)
 {
 	TRACE(TRACE_DATABASE,"[%p] connection cleared", c);
+	_stmt_cache_drop(c);
+	_profile_release(c);
 	Connection_clear(c);
 	Connection_setQueryTimeout(c, (int)db_params.query_timeout);
 	return;
@@ -386,17 +737,337 @@ void db_con_clear(Connection_T c)
 
 void log_query_time(char *query, struct timeval before, struct timeval after)
 {
-	unsigned int elapsed = (unsigned int)diff_time(before, after);
-	TRACE(TRACE_DATABASE, "last query took [%d] seconds", elapsed);
-	if (elapsed > db_params.query_time_warning)
-		TRACE(TRACE_WARNING, "slow query [%s] took [%d] seconds", query, elapsed);
-	else if (elapsed > db_params.query_time_notice)
-		TRACE(TRACE_NOTICE, "slow query [%s] took [%d] seconds", query, elapsed);
-	else if (elapsed > db_params.query_time_info)
-		TRACE(TRACE_INFO, "slow query [%s] took [%d] seconds", query, elapsed);
+	int64_t usec = (int64_t)(after.tv_sec - before.tv_sec) * G_USEC_PER_SEC
+		+ (after.tv_usec - before.tv_usec);
+	double elapsed = (double)usec / G_USEC_PER_SEC;
+
+	TRACE(TRACE_DATABASE, "last query took [%.6f] seconds", elapsed);
+	if (usec > (int64_t)db_params.query_time_warning * G_USEC_PER_SEC)
+		TRACE(TRACE_WARNING, "slow query [%s] took [%.3f] seconds", query, elapsed);
+	else if (usec > (int64_t)db_params.query_time_notice * G_USEC_PER_SEC)
+		TRACE(TRACE_NOTICE, "slow query [%s] took [%.3f] seconds", query, elapsed);
+	else if (usec > (int64_t)db_params.query_time_info * G_USEC_PER_SEC)
+		TRACE(TRACE_INFO, "slow query [%s] took [%.3f] seconds", query, elapsed);
 	return;
 }
 
+/*
+ * query profiler
+ *
+ * Every statement run through db_exec, db_query, db_update or a
+ * prepared statement is reduced to its template: literals become '?',
+ * lists of them collapse into one and whitespace is squeezed. Per
+ * template we count calls, rows fetched, execution time in a decimal
+ * histogram from 10us up, and the time spent waiting for the
+ * connection the statement ran on.
+ *
+ * The counters live in a table per thread; the owning thread takes
+ * its own, otherwise uncontended, lock for every update so
+ * db_profile_list() can merge all tables at any time. Rows are counted
+ * against the last statement the thread executed. Prepared statements
+ * are remembered per connection, since they die with it.
+ */
+typedef struct {
+	GMutex lock;
+	GHashTable *queries;	/* template -> DbQueryProfile_T */
+	GHashTable *stmts;	/* prepared statement -> DbQueryProfile_T */
+	GHashTable *conns;	/* connection -> set of prepared statements */
+	DbQueryProfile_T *current;
+	uint64_t wait_usec;	/* not yet charged to a statement */
+} ProfileThread;
+
+static void _profile_thread_free(gpointer);
+
+G_LOCK_DEFINE_STATIC(profiles);
+static GList *profile_threads = NULL;
+static GHashTable *profile_retired = NULL;	/* totals of exited threads */
+static GPrivate profile_key = G_PRIVATE_INIT(_profile_thread_free);
+
+static void _profile_free(gpointer data)
+{
+	DbQueryProfile_T *p = (DbQueryProfile_T *)data;
+	g_free(p->query);
+	g_free(p);
+}
+
+static void _profile_merge(GHashTable *into, DbQueryProfile_T *p)
+{
+	DbQueryProfile_T *t;
+	int i;
+
+	if (! (t = g_hash_table_lookup(into, p->query))) {
+		t = g_new0(DbQueryProfile_T, 1);
+		t->query = g_strdup(p->query);
+		g_hash_table_insert(into, t->query, t);
+	}
+	t->calls += p->calls;
+	t->rows += p->rows;
+	t->usec += p->usec;
+	t->max_usec = max(t->max_usec, p->max_usec);
+	t->wait_usec += p->wait_usec;
+	for (i = 0; i < DB_PROFILE_BUCKETS; i++)
+		t->hist[i] += p->hist[i];
+}
+
+static void _profile_thread_free(gpointer data)
+{
+	ProfileThread *t = (ProfileThread *)data;
+	GHashTableIter iter;
+	gpointer value;
+
+	G_LOCK(profiles);
+	profile_threads = g_list_remove(profile_threads, t);
+	if (! profile_retired)
+		profile_retired = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _profile_free);
+	g_hash_table_iter_init(&iter, t->queries);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		_profile_merge(profile_retired, (DbQueryProfile_T *)value);
+	G_UNLOCK(profiles);
+
+	g_hash_table_destroy(t->conns);
+	g_hash_table_destroy(t->stmts);
+	g_hash_table_destroy(t->queries);
+	g_mutex_clear(&t->lock);
+	g_free(t);
+}
+
+static ProfileThread * _profile_thread(void)
+{
+	ProfileThread *t;
+
+	if ((t = g_private_get(&profile_key)))
+		return t;
+
+	t = g_new0(ProfileThread, 1);
+	g_mutex_init(&t->lock);
+	t->queries = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, _profile_free);
+	t->stmts = g_hash_table_new(g_direct_hash, g_direct_equal);
+	t->conns = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+			(GDestroyNotify)g_hash_table_destroy);
+	g_private_set(&profile_key, t);
+
+	G_LOCK(profiles);
+	profile_threads = g_list_prepend(profile_threads, t);
+	G_UNLOCK(profiles);
+
+	return t;
+}
+
+/* reduce a statement to its template */
+static char * _profile_template(const char *sql)
+{
+	GString *t = g_string_sized_new(strlen(sql));
+	const char *p = sql;
+
+	while (*p) {
+		if (*p == '\'' || g_ascii_isdigit(*p)) {
+			if (*p == '\'') {
+				for (p++; *p; p++) {
+					if (*p == '\'' && *(p+1) == '\'')
+						p++;
+					else if (*p == '\'')
+						break;
+				}
+				if (*p) p++;
+			} else if (t->len && (g_ascii_isalnum(t->str[t->len-1]) || t->str[t->len-1] == '_')) {
+				/* part of an identifier */
+				g_string_append_c(t, *p++);
+				continue;
+			} else {
+				while (g_ascii_isdigit(*p) || *p == '.')
+					p++;
+			}
+			/* a list of literals becomes a single one */
+			if (t->len > 1 && t->str[t->len-1] == ',' && t->str[t->len-2] == '?')
+				g_string_truncate(t, t->len-1);
+			else if (t->len > 2 && t->str[t->len-1] == ' ' && t->str[t->len-2] == ',' && t->str[t->len-3] == '?')
+				g_string_truncate(t, t->len-2);
+			else
+				g_string_append_c(t, '?');
+		} else if (g_ascii_isspace(*p)) {
+			while (g_ascii_isspace(*p))
+				p++;
+			if (t->len && *p)
+				g_string_append_c(t, ' ');
+		} else {
+			g_string_append_c(t, *p++);
+		}
+	}
+
+	return g_string_free(t, FALSE);
+}
+
+/* caller holds t->lock */
+static DbQueryProfile_T * _profile_lookup(ProfileThread *t, const char *sql)
+{
+	DbQueryProfile_T *p;
+	char *query = _profile_template(sql);
+
+	if ((p = g_hash_table_lookup(t->queries, query))) {
+		g_free(query);
+		return p;
+	}
+	p = g_new0(DbQueryProfile_T, 1);
+	p->query = query;
+	g_hash_table_insert(t->queries, p->query, p);
+	return p;
+}
+
+static void _profile_account(ProfileThread *t, DbQueryProfile_T *p, uint64_t usec)
+{
+	int b;
+	uint64_t bound;
+
+	for (b = 0, bound = 10; b < DB_PROFILE_BUCKETS-1 && usec >= bound; b++)
+		bound *= 10;
+
+	p->calls++;
+	p->usec += usec;
+	p->max_usec = max(p->max_usec, usec);
+	p->hist[b]++;
+	p->wait_usec += t->wait_usec;
+	t->wait_usec = 0;
+	t->current = p;
+}
+
+static void _profile_query(const char *sql, uint64_t usec)
+{
+	ProfileThread *t = _profile_thread();
+
+	g_mutex_lock(&t->lock);
+	_profile_account(t, _profile_lookup(t, sql), usec);
+	g_mutex_unlock(&t->lock);
+}
+
+static void _profile_prepare(Connection_T c, PreparedStatement_T s, const char *sql)
+{
+	ProfileThread *t = _profile_thread();
+	GHashTable *owned;
+
+	g_mutex_lock(&t->lock);
+	if (! g_hash_table_contains(t->stmts, s)) {
+		g_hash_table_insert(t->stmts, s, _profile_lookup(t, sql));
+		if (! (owned = g_hash_table_lookup(t->conns, c))) {
+			owned = g_hash_table_new(g_direct_hash, g_direct_equal);
+			g_hash_table_insert(t->conns, c, owned);
+		}
+		g_hash_table_add(owned, s);
+	}
+	g_mutex_unlock(&t->lock);
+}
+
+static void _profile_stmt(PreparedStatement_T s, uint64_t usec)
+{
+	ProfileThread *t = _profile_thread();
+	DbQueryProfile_T *p;
+
+	g_mutex_lock(&t->lock);
+	if ((p = g_hash_table_lookup(t->stmts, s)))
+		_profile_account(t, p, usec);
+	g_mutex_unlock(&t->lock);
+}
+
+static void _profile_row(void)
+{
+	ProfileThread *t = g_private_get(&profile_key);
+
+	if (! t)
+		return;
+
+	g_mutex_lock(&t->lock);
+	if (t->current)
+		t->current->rows++;
+	g_mutex_unlock(&t->lock);
+}
+
+static void _profile_wait(uint64_t usec)
+{
+	ProfileThread *t = _profile_thread();
+
+	g_mutex_lock(&t->lock);
+	t->wait_usec += usec;
+	g_mutex_unlock(&t->lock);
+}
+
+/* statements die with the connection they were prepared on */
+static void _profile_release(Connection_T c)
+{
+	ProfileThread *t;
+	GHashTable *owned;
+	GHashTableIter iter;
+	gpointer s;
+
+	if (! (t = g_private_get(&profile_key)))
+		return;
+
+	g_mutex_lock(&t->lock);
+	if ((owned = g_hash_table_lookup(t->conns, c))) {
+		g_hash_table_iter_init(&iter, owned);
+		while (g_hash_table_iter_next(&iter, &s, NULL))
+			g_hash_table_remove(t->stmts, s);
+		g_hash_table_remove(t->conns, c);
+	}
+	g_mutex_unlock(&t->lock);
+}
+
+static gint _profile_cmp(gconstpointer a, gconstpointer b)
+{
+	const DbQueryProfile_T *x = a, *y = b;
+	if (x->usec == y->usec)
+		return 0;
+	return (x->usec < y->usec) ? 1 : -1;
+}
+
+GList * db_profile_list(void)
+{
+	GHashTable *all = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, NULL);
+	GHashTableIter iter;
+	gpointer value;
+	GList *l, *result;
+
+	G_LOCK(profiles);
+	for (l = profile_threads; l; l = l->next) {
+		ProfileThread *t = (ProfileThread *)l->data;
+		g_mutex_lock(&t->lock);
+		g_hash_table_iter_init(&iter, t->queries);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			_profile_merge(all, (DbQueryProfile_T *)value);
+		g_mutex_unlock(&t->lock);
+	}
+	if (profile_retired) {
+		g_hash_table_iter_init(&iter, profile_retired);
+		while (g_hash_table_iter_next(&iter, NULL, &value))
+			_profile_merge(all, (DbQueryProfile_T *)value);
+	}
+	G_UNLOCK(profiles);
+
+	result = g_list_sort(g_hash_table_get_values(all), _profile_cmp);
+	g_hash_table_destroy(all);
+
+	return result;
+}
+
+void db_profile_free(GList *profiles)
+{
+	g_list_free_full(profiles, _profile_free);
+}
+
+void db_profile_dump(void)
+{
+	GList *l, *profiles = db_profile_list();
+
+	TRACE(TRACE_NOTICE, "query profile: [%u] statements", g_list_length(profiles));
+	for (l = profiles; l; l = l->next) {
+		DbQueryProfile_T *p = (DbQueryProfile_T *)l->data;
+		TRACE(TRACE_NOTICE, "calls [%" PRIu64 "] total [%" PRIu64 "us] "
+				"avg [%" PRIu64 "us] max [%" PRIu64 "us] rows [%" PRIu64 "] "
+				"wait [%" PRIu64 "us] [%s]",
+				p->calls, p->usec, p->calls ? p->usec / p->calls : 0,
+				p->max_usec, p->rows, p->wait_usec, p->query);
+	}
+	db_profile_free(profiles);
+}
+
 gboolean db_exec(Connection_T c, const char *q, ...)
 {
 	struct timeval before, after;
@@ -421,7 +1092,11 @@ gboolean db_exec(Connection_T c, const char *q, ...)
 		TRACE(TRACE_ERR,"failed query [%s]", query);
 	END_TRY;
 
-	if (result) log_query_time(query, before, after);
+	if (result) {
+		log_query_time(query, before, after);
+		_profile_query(query, (after.tv_sec - before.tv_sec) * G_USEC_PER_SEC
+				+ (after.tv_usec - before.tv_usec));
+	}
 	g_free(query);
 
 	return result;
@@ -454,7 +1129,11 @@ ResultSet_T db_query(Connection_T c, const char *q, ...)
 		TRACE(TRACE_ERR,"failed query [%s]", query);
 	END_TRY;
 
-	if (result) log_query_time(query, before, after);
+	if (result) {
+		log_query_time(query, before, after);
+		_profile_query(query, (after.tv_sec - before.tv_sec) * G_USEC_PER_SEC
+				+ (after.tv_usec - before.tv_usec));
+	}
 	g_free(query);
 
 	return r;
@@ -489,7 +1168,11 @@ gboolean db_update(const char *q, ...)
 		db_con_close(c);
 	END_TRY;
 
-	if (result) log_query_time(query, before, after);
+	if (result) {
+		log_query_time(query, before, after);
+		_profile_query(query, (after.tv_sec - before.tv_sec) * G_USEC_PER_SEC
+				+ (after.tv_usec - before.tv_usec));
+	}
 
 	return result;
 }
@@ -508,10 +1191,92 @@ PreparedStatement_T db_stmt_prepare(Connection_T c, const char *q, ...)
 
 	TRACE(TRACE_DATABASE,"[%p] [%s]", c, q);
 	s = Connection_prepareStatement(c, "%s", query);
+	_profile_prepare(c, s, query);
 	g_free(query);
 	return s;
 }
 
+/*
+ * statement cache
+ *
+ * db_stmt_prepare_cached() formats the SQL for a call site only once,
+ * keyed on the address of its format string, and keeps the prepared
+ * statement with the connection so that repeated use on the same
+ * connection skips the prepare round-trip. libzdb frees all prepared
+ * statements when a connection is cleared or returned to the pool, so
+ * the statements are dropped then as well.
+ *
+ * Only use it with a string literal as format, and with arguments that
+ * do not change for the life of the process: the table prefix, driver
+ * fragments from db_get_sql and the like. Values go in as parameters.
+ */
+#define DB_STMT_CACHE_MAX 64
+
+G_LOCK_DEFINE_STATIC(stmt_cache);
+static GHashTable *stmt_sql = NULL;	/* format -> sql */
+static GHashTable *stmt_cache = NULL;	/* connection -> (format -> statement) */
+
+static void _stmt_cache_drop(Connection_T c)
+{
+	G_LOCK(stmt_cache);
+	if (stmt_cache) {
+		if (c)
+			g_hash_table_remove(stmt_cache, c);
+		else {
+			g_hash_table_remove_all(stmt_cache);
+			g_hash_table_remove_all(stmt_sql);
+		}
+	}
+	G_UNLOCK(stmt_cache);
+}
+
+PreparedStatement_T db_stmt_prepare_cached(Connection_T c, const char *q, ...)
+{
+	GHashTable *stmts;
+	PreparedStatement_T s = NULL;
+	const char *query;
+
+	G_LOCK(stmt_cache);
+	if (! stmt_sql) {
+		stmt_sql = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+		stmt_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+				(GDestroyNotify)g_hash_table_destroy);
+	}
+	if (! (query = g_hash_table_lookup(stmt_sql, q))) {
+		va_list ap;
+		va_start(ap, q);
+		query = g_strdup_vprintf(q, ap);
+		va_end(ap);
+		g_hash_table_insert(stmt_sql, (gpointer)q, (gpointer)query);
+	}
+	if ((stmts = g_hash_table_lookup(stmt_cache, c)))
+		s = g_hash_table_lookup(stmts, q);
+	G_UNLOCK(stmt_cache);
+
+	if (s) {
+		TRACE(TRACE_DATABASE,"[%p] cached [%s]", c, query);
+		metrics_add(METRIC_STMT_CACHE_HIT, 1);
+		_profile_prepare(c, s, query);
+		return s;
+	}
+	metrics_add(METRIC_STMT_CACHE_MISS, 1);
+
+	TRACE(TRACE_DATABASE,"[%p] [%s]", c, query);
+	s = Connection_prepareStatement(c, "%s", query);
+	_profile_prepare(c, s, query);
+
+	G_LOCK(stmt_cache);
+	if (! (stmts = g_hash_table_lookup(stmt_cache, c))) {
+		stmts = g_hash_table_new(g_direct_hash, g_direct_equal);
+		g_hash_table_insert(stmt_cache, c, stmts);
+	}
+	if (g_hash_table_size(stmts) < DB_STMT_CACHE_MAX)
+		g_hash_table_insert(stmts, (gpointer)q, s);
+	G_UNLOCK(stmt_cache);
+
+	return s;
+}
+
 int db_stmt_set_str(PreparedStatement_T s, int index, const char *x)
 {
 	TRACE(TRACE_DATABASE,"[%p] %d:[%s]", s, index, x);
@@ -542,21 +1307,28 @@ int db_stmt_set_blob(PreparedStatement_T s, int index, const void *x, int size)
 
 inline gboolean db_stmt_exec(PreparedStatement_T s)
 {
+	gint64 start = g_get_monotonic_time();
 	PreparedStatement_execute(s);
+	_profile_stmt(s, g_get_monotonic_time() - start);
 	return TRUE;
 }
 
 inline ResultSet_T db_stmt_query(PreparedStatement_T s)
 {
-	return PreparedStatement_executeQuery(s);
+	ResultSet_T r;
+	gint64 start = g_get_monotonic_time();
+	r = PreparedStatement_executeQuery(s);
+	_profile_stmt(s, g_get_monotonic_time() - start);
+	return r;
 }
 
 int db_result_next(ResultSet_T r)
 {
-	if (r)
-		return ResultSet_next(r);
-	else
-		return FALSE;
+	if (r && ResultSet_next(r)) {
+		_profile_row();
+		return TRUE;
+	}
+	return FALSE;
 }
 
 inline unsigned db_num_fields(ResultSet_T r)
@@ -997,6 +1769,7 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32006) query = DM_SQLITE_32006;
 			if (to_version == 35001) query = DM_SQLITE_35001;
 			if (to_version == 35002) query = DM_SQLITE_35002;
+			if (to_version == 35003) query = DM_SQLITE_35003;
 			break;
 		case DM_DRIVER_MYSQL:
 			if (to_version == 32001) query = DM_MYSQL_32001;
@@ -1007,6 +1780,7 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32006) query = DM_MYSQL_32006;
 			if (to_version == 35001) query = DM_MYSQL_35001;
 			if (to_version == 35002) query = DM_MYSQL_35002;
+			if (to_version == 35003) query = DM_MYSQL_35003;
 			break;
 		case DM_DRIVER_POSTGRESQL:
 			if (to_version == 32001) query = DM_PGSQL_32001;
@@ -1017,6 +1791,7 @@ static int check_upgrade_step(int from_version, int to_version)
 			if (to_version == 32006) query = DM_PGSQL_32006;
 			if (to_version == 35001) query = DM_PGSQL_35001;
 			if (to_version == 35002) query = DM_PGSQL_35002;
+			if (to_version == 35003) query = DM_PGSQL_35003;
 			break;
 		default:
 			TRACE(TRACE_WARNING, "Migrations not supported for database driver");
@@ -1276,12 +2051,14 @@ int db_check_version(void)
 			break;
 		if ((ok = check_upgrade_step(35001, 35002)) == DM_EQUERY)
 			break;
+		if ((ok = check_upgrade_step(35002, 35003)) == DM_EQUERY)
+			break;
 		break;
 	} while (true);
 
 	db_con_close(c);
 
-	if (ok == 35002) {
+	if (ok == 35003) {
 		TRACE(TRACE_DEBUG, "Schema check successful");
 	} else {
 		TRACE(TRACE_ERR,"Schema version [%d] incompatible. Bailing out",
@@ -1742,113 +2519,303 @@ int db_empty_mailbox(uint64_t user_idnr, int only_empty)
 	return result;
 }
 
-int db_icheck_physmessages(gboolean cleanup)
+/*
+ * chunked garbage collection
+ *
+ * candidates are walked in keyset order: every chunk selects at most
+ * gc->batch ids above the last one seen, and removes them with one
+ * set-based DELETE in a transaction of its own, so no lock outlives
+ * its chunk. With gc->rate set chunks are spaced to stay below that
+ * many rows per second. The last id of each committed chunk goes to
+ * gc->checkpoint (0 once the table is done) and an interrupted run
+ * resumes from gc->resume.
+ *
+ * scan selects candidate ids above its one parameter; guard is
+ * appended to the DELETE to re-check a candidate at delete time.
+ * release runs in the same transaction, just before the DELETE.
+ */
+static int db_gc_chunked(const char *table, const char *column,
+		const char *scan, const char *guard,
+		void (*release)(Connection_T, const char *),
+		gboolean cleanup, GCParam_T *gc)
 {
-	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
-	GList *ids = NULL;
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	volatile int t = DM_SUCCESS;
+	volatile uint64_t last = cleanup ? gc->resume : 0;
+	volatile uint64_t n = 0;
+	uint64_t done = 0;
+	struct timeval start, now;
+	GString *ids = g_string_new("");
 
-	c = db_con_get();
-	TRY
-		r = db_query(c, "SELECT p.id FROM %sphysmessage p LEFT JOIN %smessages m ON p.id = m.physmessage_id "
-				"WHERE m.physmessage_id IS NULL", DBPFX, DBPFX);
-		while(db_result_next(r)) {
-			uint64_t *id = g_new0(uint64_t, 1);
-			*id = db_result_get_u64(r, 0);
-			ids = g_list_prepend(ids, id);
-		}
-		t = g_list_length(ids);
-		if (cleanup) {
-			while(ids) {
+	gettimeofday(&start, NULL);
+
+	do {
+		n = 0;
+		c = db_con_get();
+		TRY
+			g_string_truncate(ids, 0);
+			s = db_stmt_prepare(c, "%s", scan);
+			db_stmt_set_u64(s, 1, last);
+			r = db_stmt_query(s);
+			while (db_result_next(r)) {
+				last = db_result_get_u64(r, 0);
+				g_string_append_printf(ids, "%s%" PRIu64, n++ ? "," : "", last);
+			}
+
+			if (n && cleanup) {
 				db_begin_transaction(c);
-				db_exec(c, "DELETE FROM %sphysmessage WHERE id = %" PRIu64 "", DBPFX, *(uint64_t *)ids->data);
+				if (release)
+					release(c, ids->str);
+				db_exec(c, "DELETE FROM %s%s WHERE %s IN (%s)%s",
+						DBPFX, table, column, ids->str, guard ? guard : "");
 				db_commit_transaction(c);
-				if (! g_list_next(ids)) break;
-				ids = g_list_next(ids);
 			}
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			db_rollback_transaction(c);
+			t = DM_EQUERY;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+
+		if (t == DM_EQUERY)
+			break;
+
+		done += n;
+		TRACE(TRACE_DEBUG, "[%s] chunk of [%" PRIu64 "] up to [%" PRIu64 "], [%" PRIu64 "] so far",
+				table, n, last, done);
+
+		if (! cleanup)
+			continue;
+
+		if (gc->checkpoint)
+			gc->checkpoint(table, (n < gc->batch) ? 0 : last);
+
+		if (gc->rate && n) {
+			uint64_t due, spent;
+			gettimeofday(&now, NULL);
+			due = done * 1000000 / gc->rate;
+			spent = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_usec - start.tv_usec);
+			if (due > spent)
+				usleep(due - spent);
 		}
-		g_list_destroy(ids);
-	CATCH(SQLException)
-		LOG_SQLERROR;
-		db_rollback_transaction(c);
-		t = DM_EQUERY;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	} while (n == gc->batch);
+
+	g_string_free(ids, TRUE);
+
+	if (t == DM_EQUERY)
+		return t;
+
+	return (int)done;
+}
+
+int db_purge_deleted(gboolean cleanup, GCParam_T *gc)
+{
+	char *scan, *guard;
+	int t;
+
+	scan = g_strdup_printf("SELECT message_idnr FROM %smessages WHERE status = %d "
+			"AND message_idnr > ? ORDER BY message_idnr LIMIT %" PRIu64,
+			DBPFX, MESSAGE_STATUS_PURGE, gc->batch);
+	guard = g_strdup_printf(" AND status = %d", MESSAGE_STATUS_PURGE);
+
+	t = db_gc_chunked("messages", "message_idnr", scan, guard, NULL, cleanup, gc);
+
+	g_free(scan);
+	g_free(guard);
+
+	return t;
+}
+
+/*
+ * partlists rows go with their physmessage (ON DELETE CASCADE), so
+ * the references they hold on mimeparts are dropped beforehand
+ */
+static void _gc_release_parts(Connection_T c, const char *ids, const char *guard)
+{
+	db_exec(c, "UPDATE %smimeparts SET refcount = refcount - "
+			"(SELECT COUNT(*) FROM %spartlists l WHERE l.part_id = %smimeparts.id "
+			"AND l.physmessage_id IN (%s)%s) "
+			"WHERE id IN (SELECT part_id FROM %spartlists WHERE physmessage_id IN (%s))",
+			DBPFX, DBPFX, DBPFX, ids, guard, DBPFX, ids);
+}
+
+static void _gc_release_physmessages(Connection_T c, const char *ids)
+{
+	char *guard = g_strdup_printf(" AND NOT EXISTS (SELECT 1 FROM %smessages m "
+			"WHERE m.physmessage_id = l.physmessage_id)", DBPFX);
+	_gc_release_parts(c, ids, guard);
+	g_free(guard);
+}
+
+static void _gc_release_partlists(Connection_T c, const char *ids)
+{
+	_gc_release_parts(c, ids, "");
+}
+
+int db_icheck_physmessages(gboolean cleanup, GCParam_T *gc)
+{
+	char *scan, *guard;
+	int t;
+
+	scan = g_strdup_printf("SELECT p.id FROM %sphysmessage p LEFT JOIN %smessages m ON p.id = m.physmessage_id "
+			"WHERE m.physmessage_id IS NULL AND p.id > ? ORDER BY p.id LIMIT %" PRIu64,
+			DBPFX, DBPFX, gc->batch);
+	/* a COPY may have picked up the physmessage since the scan */
+	guard = g_strdup_printf(" AND NOT EXISTS (SELECT 1 FROM %smessages m "
+			"WHERE m.physmessage_id = %sphysmessage.id)", DBPFX, DBPFX);
+
+	t = db_gc_chunked("physmessage", "id", scan, guard, _gc_release_physmessages, cleanup, gc);
+
+	g_free(scan);
+	g_free(guard);
 
 	return t;
 }
 
-int db_icheck_partlists(gboolean cleanup)
-{
-	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
-	GList *ids = NULL;
+int db_icheck_partlists(gboolean cleanup, GCParam_T *gc)
+{
+	char *scan;
+	int t;
+
+	scan = g_strdup_printf("SELECT DISTINCT l.physmessage_id FROM %spartlists l "
+			"LEFT JOIN %sphysmessage p ON p.id = l.physmessage_id "
+			"WHERE p.id IS NULL AND l.physmessage_id > ? ORDER BY l.physmessage_id LIMIT %" PRIu64,
+			DBPFX, DBPFX, gc->batch);
+
+	t = db_gc_chunked("partlists", "physmessage_id", scan, NULL, _gc_release_partlists, cleanup, gc);
+
+	g_free(scan);
+
+	return t;
+}
+
+int db_icheck_mimeparts(gboolean cleanup, GCParam_T *gc)
+{
+	char *scan, *guard;
+	int t;
+
+	/* only parts whose reference count dropped to zero are looked
+	 * at. Delivery re-uses mimeparts by hash, so the count is
+	 * re-checked against partlists at delete time */
+	scan = g_strdup_printf("SELECT id FROM %smimeparts WHERE refcount = 0 "
+			"AND id > ? ORDER BY id LIMIT %" PRIu64,
+			DBPFX, gc->batch);
+	guard = g_strdup_printf(" AND refcount = 0 AND NOT EXISTS (SELECT 1 FROM %spartlists l "
+			"WHERE l.part_id = %smimeparts.id)", DBPFX, DBPFX);
+
+	t = db_gc_chunked("mimeparts", "id", scan, guard, NULL, cleanup, gc);
+
+	g_free(scan);
+	g_free(guard);
+
+	return t;
+}
+
+/*
+ * recount mimeparts references
+ *
+ * the id range is cut in chunks of gc->batch ids that are recounted
+ * by a pool of threads, each on a connection of its own. A count can
+ * be off by a delivery that ran alongside; that is harmless, as the
+ * collector re-checks partlists before deleting anything.
+ */
+typedef struct {
+	gboolean cleanup;
+	uint64_t batch;
+	volatile gint found;
+	volatile gint failed;
+} RefcountJob;
+
+static void _refcount_chunk(uint64_t *lo, RefcountJob *job)
+{
+	Connection_T c; ResultSet_T r;
+	volatile int n = 0;
+	char *stale;
+
+	stale = g_strdup_printf("id > %" PRIu64 " AND id <= %" PRIu64 " AND (refcount IS NULL OR "
+			"refcount <> (SELECT COUNT(*) FROM %spartlists l WHERE l.part_id = %smimeparts.id))",
+			*lo, *lo + job->batch, DBPFX, DBPFX);
 
 	c = db_con_get();
 	TRY
-		r = db_query(c, "SELECT COUNT(*), l.physmessage_id FROM %spartlists l LEFT JOIN %sphysmessage p ON p.id = l.physmessage_id "
-				"WHERE p.id IS NULL GROUP BY l.physmessage_id", DBPFX, DBPFX);
-
-		while(db_result_next(r)) {
-			uint64_t *id = g_new0(uint64_t, 1);
-			*id = db_result_get_u64(r, 0);
-			ids = g_list_prepend(ids, id);
-		}
-		t = g_list_length(ids);
-		if (cleanup) {
-			while(ids) {
-				db_begin_transaction(c);
-				db_exec(c, "DELETE FROM %spartlists WHERE physmessage_id = %" PRIu64 "", DBPFX, *(uint64_t *)ids->data);
-				db_commit_transaction(c);
-				if (! g_list_next(ids)) break;
-				ids = g_list_next(ids);
-			}
+		if (job->cleanup) {
+			db_begin_transaction(c);
+			db_exec(c, "UPDATE %smimeparts SET refcount = "
+					"(SELECT COUNT(*) FROM %spartlists l WHERE l.part_id = %smimeparts.id) "
+					"WHERE %s", DBPFX, DBPFX, DBPFX, stale);
+			n = Connection_rowsChanged(c);
+			db_commit_transaction(c);
+		} else {
+			r = db_query(c, "SELECT COUNT(*) FROM %smimeparts WHERE %s", DBPFX, stale);
+			if (db_result_next(r))
+				n = db_result_get_int(r, 0);
 		}
-		g_list_destroy(ids);
 	CATCH(SQLException)
 		LOG_SQLERROR;
 		db_rollback_transaction(c);
-		t = DM_EQUERY;
+		g_atomic_int_set(&job->failed, 1);
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	return t;
+	if (n)
+		TRACE(TRACE_DEBUG, "[%d] stale counts in ids [%" PRIu64 "-%" PRIu64 "]",
+				n, *lo + 1, *lo + job->batch);
+	g_atomic_int_add(&job->found, n);
+
+	g_free(stale);
+	g_free(lo);
 }
 
-int db_icheck_mimeparts(gboolean cleanup)
+int db_verify_refcounts(gboolean cleanup, GCParam_T *gc, int threads)
 {
-	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
-	GList *ids = NULL;
+	Connection_T c; ResultSet_T r;
+	volatile uint64_t top = 0;
+	volatile int t = DM_SUCCESS;
+	RefcountJob job;
+	GThreadPool *pool;
+	GError *err = NULL;
+	uint64_t lo;
 
 	c = db_con_get();
 	TRY
-		r = db_query(c, "SELECT p.id FROM %smimeparts p LEFT JOIN %spartlists l ON p.id = l.part_id "
-				"WHERE l.part_id IS NULL", DBPFX, DBPFX);
-		while(db_result_next(r)) {
-			uint64_t *id = g_new0(uint64_t, 1);
-			*id = db_result_get_u64(r, 0);
-			ids = g_list_prepend(ids, id);
-		}
-		t = g_list_length(ids);
-		if (cleanup) {
-			while(ids) {
-				db_begin_transaction(c);
-				db_exec(c, "DELETE FROM %smimeparts WHERE id = %" PRIu64 "", DBPFX, *(uint64_t *)ids->data);
-				db_commit_transaction(c);
-				if (! g_list_next(ids)) break;
-				ids = g_list_next(ids);
-			}
-		}
-		g_list_destroy(ids);
+		r = db_query(c, "SELECT MAX(id) FROM %smimeparts", DBPFX);
+		if (db_result_next(r))
+			top = db_result_get_u64(r, 0);
 	CATCH(SQLException)
 		LOG_SQLERROR;
-		db_rollback_transaction(c);
 		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
-	return t;
+	if (t == DM_EQUERY)
+		return t;
+
+	memset(&job, 0, sizeof(job));
+	job.cleanup = cleanup;
+	job.batch = gc->batch;
+
+	if (! (pool = g_thread_pool_new((GFunc)_refcount_chunk, &job, max(threads, 1), TRUE, &err))) {
+		TRACE(TRACE_ERR, "g_thread_pool creation failed [%s]", err->message);
+		g_error_free(err);
+		return DM_EQUERY;
+	}
+
+	for (lo = 0; lo < top; lo += gc->batch) {
+		uint64_t *chunk = g_new0(uint64_t, 1);
+		*chunk = lo;
+		g_thread_pool_push(pool, chunk, NULL);
+	}
+
+	/* wait for the queue to drain */
+	g_thread_pool_free(pool, FALSE, TRUE);
+
+	if (g_atomic_int_get(&job.failed))
+		return DM_EQUERY;
+
+	return g_atomic_int_get(&job.found);
 }
 
 int db_icheck_headernames(gboolean cleanup)
@@ -2242,6 +3209,8 @@ int db_delete_mailbox(uint64_t mailbox_idnr, int only_empty, int update_curmail_
 			return DM_EGENERAL;
 	}
 
+	db_listing_drop(mailbox_idnr);
+
 	/* calculate the new quotum */
 	if (! update_curmail_size)
 		return DM_SUCCESS;
@@ -2293,46 +3262,231 @@ char * db_get_message_lines(uint64_t message_idnr, long lines)
 	return out;
 }
 
+#define LINE_STREAM_CHUNK 8192
+
+typedef struct {
+	MessageStreamFunc out;
+	void *data;
+	long lines;		/* body lines wanted, < 0 for all */
+	long count;		/* body lines emitted */
+	gboolean body;		/* past the empty line ending the header */
+	gboolean done;
+	int error;
+	size_t linelen;		/* octets on the current line, CR excluded */
+	char prev;
+	size_t len;
+	char buf[LINE_STREAM_CHUNK + 3];
+} LineStream;
+
+static int _line_stream_flush(LineStream *s)
+{
+	if (s->len && (! s->error))
+		s->error = s->out(s->buf, s->len, s->data);
+	s->len = 0;
+	return s->error;
+}
+
+/* CRLF-encode and dot-stuff on the fly, the same as get_crlf_encoded_dots
+ * does on a complete message, and stop after the requested body lines */
+static int _line_stream_write(const char *data, size_t len, void *arg)
+{
+	LineStream *s = (LineStream *)arg;
+	size_t i;
+
+	for (i = 0; i < len && (! s->done); i++) {
+		char c = data[i];
+
+		if (s->len >= LINE_STREAM_CHUNK && _line_stream_flush(s))
+			return 1;
+
+		if (ISLF(c) && (! ISCR(s->prev)))
+			s->buf[s->len++] = '\r';
+		if (ISDOT(c) && ISLF(s->prev))
+			s->buf[s->len++] = '.';
+		s->buf[s->len++] = c;
+		s->prev = c;
+
+		if (! ISLF(c)) {
+			if (! ISCR(c))
+				s->linelen++;
+			continue;
+		}
+
+		if (s->body) {
+			s->count++;
+			if (s->lines >= 0 && s->count >= s->lines)
+				s->done = TRUE;
+		} else if (s->linelen == 0) {
+			s->body = TRUE;
+			if (s->lines == 0)
+				s->done = TRUE;
+		}
+		s->linelen = 0;
+	}
+
+	return s->done || s->error;
+}
+
+/* the physmessage of a live message in the given mailbox */
+static int _mailbox_physmessage_id(uint64_t mailbox_idnr, uint64_t message_idnr, uint64_t *physmessage_id)
+{
+	PreparedStatement_T stmt;
+	Connection_T c;
+	ResultSet_T r;
+	volatile int t = DM_SUCCESS;
+
+	*physmessage_id = 0;
+
+	c = db_con_get();
+	TRY
+		stmt = db_stmt_prepare_cached(c,
+				"SELECT physmessage_id FROM %smessages "
+				"WHERE message_idnr = ? AND mailbox_idnr = ? AND status < %d",
+				DBPFX, MESSAGE_STATUS_DELETE);
+		db_stmt_set_u64(stmt, 1, message_idnr);
+		db_stmt_set_u64(stmt, 2, mailbox_idnr);
+		r = db_stmt_query(stmt);
+		if (db_result_next(r))
+			*physmessage_id = db_result_get_u64(r, 0);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY)
+		return t;
+	return *physmessage_id ? DM_SUCCESS : DM_EGENERAL;
+}
+
+/* \brief stream a message, or its header and the first lines of the body,
+ * CRLF encoded and dot-stuffed to a callback.
+ * \param mailbox_idnr the message must be in this mailbox, 0 for any
+ * \param message_idnr
+ * \param lines number of body lines, or < 0 for the complete message
+ * \param out receives the encoded message in chunks
+ * \return DM_SUCCESS, DM_EGENERAL or DM_EQUERY
+ */
+int db_stream_message_lines(uint64_t mailbox_idnr, uint64_t message_idnr, long lines, MessageStreamFunc out, void *data)
+{
+	LineStream *s;
+	uint64_t physmessage_id = 0;
+	int result;
+
+	TRACE(TRACE_DEBUG, "request for [%ld] lines", lines);
+
+	if (mailbox_idnr)
+		result = _mailbox_physmessage_id(mailbox_idnr, message_idnr, &physmessage_id);
+	else
+		result = db_get_physmessage_id(message_idnr, &physmessage_id);
+	if (result != DM_SUCCESS) {
+		TRACE(TRACE_WARNING, "message [%" PRIu64 "] not found in mailbox [%" PRIu64 "]",
+				message_idnr, mailbox_idnr);
+		return result;
+	}
+
+	s = g_new0(LineStream, 1);
+	s->out = out;
+	s->data = data;
+	s->lines = lines;
+
+	result = dbmail_message_stream(physmessage_id, _line_stream_write, s);
+	if (result == DM_EGENERAL) {
+		/* legacy messageblks storage, fall back to a buffered copy */
+		char *buf;
+		if ((buf = db_get_message_lines(message_idnr, lines))) {
+			s->error = out(buf, strlen(buf), data);
+			g_free(buf);
+			result = DM_SUCCESS;
+		}
+	} else if (result == DM_SUCCESS) {
+		_line_stream_flush(s);
+	}
+
+	if (result == DM_SUCCESS && s->error)
+		result = DM_EGENERAL;
+
+	g_free(s);
+	return result;
+}
+
+#define POP_UPDATE_CHUNK 1000
+
 int db_update_pop(ClientSession_T * session_ptr)
 {
 	Connection_T c; volatile int t = DM_SUCCESS;
 	uint64_t user_idnr = 0;
-	INIT_QUERY;
+	GString *ids[MESSAGE_STATUS_DELETE + 1];
+	unsigned count[MESSAGE_STATUS_DELETE + 1];
+	volatile gboolean changed = FALSE;
+	unsigned i;
+	int status;
 
-	c = db_con_get();
-	TRY
-		session_ptr->messagelst = p_list_first(session_ptr->messagelst);
-		while (session_ptr->messagelst) {
-			/* check if they need an update in the database */
-			struct message *msg = (struct message *)p_list_data(session_ptr->messagelst);
-			if ((msg) && (msg->virtual_messagestatus != msg->messagestatus)) {
-				/* use one message to get the user_idnr that goes with the messages */
-				if (user_idnr == 0) user_idnr = db_get_useridnr(msg->realmessageid);
-
-				/* yes they need an update, do the query */
-				db_exec(c, "UPDATE %smessages set status=%d WHERE message_idnr=%" PRIu64 " AND status < %d",
-						DBPFX, msg->virtual_messagestatus, msg->realmessageid, 
-						MESSAGE_STATUS_DELETE);
-			}
+	if (! (session_ptr->messages && session_ptr->mailbox_idnr))
+		return DM_SUCCESS;
 
-			if (! p_list_next(session_ptr->messagelst))
-				break;
+	for (status = 0; status <= MESSAGE_STATUS_DELETE; status++) {
+		ids[status] = g_string_new("");
+		count[status] = 0;
+	}
 
-			session_ptr->messagelst = p_list_next(session_ptr->messagelst);
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		/* collect the changed messages by their new status, and
+		 * update each set in chunks */
+		for (i = 0; i < session_ptr->messages->len; i++) {
+			struct message *msg = &g_array_index(session_ptr->messages, struct message, i);
+			status = msg->virtual_messagestatus;
+			if (status == (int)msg->messagestatus || status > MESSAGE_STATUS_DELETE)
+				continue;
+
+			g_string_append_printf(ids[status], "%s%" PRIu64, count[status] ? "," : "", msg->realmessageid);
+			if (++count[status] < POP_UPDATE_CHUNK)
+				continue;
+
+			db_exec(c, "UPDATE %smessages SET status=%d WHERE message_idnr IN (%s) "
+					"AND mailbox_idnr = %" PRIu64 " AND status < %d",
+					DBPFX, status, ids[status]->str, session_ptr->mailbox_idnr,
+					MESSAGE_STATUS_DELETE);
+			g_string_truncate(ids[status], 0);
+			count[status] = 0;
+			changed = TRUE;
 		}
+		for (status = 0; status <= MESSAGE_STATUS_DELETE; status++) {
+			if (! count[status])
+				continue;
+			db_exec(c, "UPDATE %smessages SET status=%d WHERE message_idnr IN (%s) "
+					"AND mailbox_idnr = %" PRIu64 " AND status < %d",
+					DBPFX, status, ids[status]->str, session_ptr->mailbox_idnr,
+					MESSAGE_STATUS_DELETE);
+			changed = TRUE;
+		}
+		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
+		db_rollback_transaction(c);
 		t = DM_EQUERY;
 	FINALLY
 		db_con_close(c);
 	END_TRY;
 
+	for (status = 0; status <= MESSAGE_STATUS_DELETE; status++)
+		g_string_free(ids[status], TRUE);
+
 	if (t == DM_EQUERY) return t;
 
+	/* let cached listings of this mailbox go stale */
+	if (changed) {
+		db_mailbox_seq_update(session_ptr->mailbox_idnr, 0);
+		db_listing_drop(session_ptr->mailbox_idnr);
+	}
+
 	/* because the status of some messages might have changed (for instance
 	 * to status >= MESSAGE_STATUS_DELETE, the quotum has to be 
 	 * recalculated */
-	if (user_idnr != 0) {
+	if (changed && db_get_mailbox_owner(session_ptr->mailbox_idnr, &user_idnr) == TRUE) {
 		if (dm_quota_rebuild_user(user_idnr) == -1) {
 			TRACE(TRACE_ERR, "Could not calculate quotum used for user [%" PRIu64 "]", user_idnr);
 			return DM_EQUERY;
@@ -2341,6 +3495,56 @@ int db_update_pop(ClientSession_T * session_ptr)
 	return DM_SUCCESS;
 }
 
+char * db_listing_file(uint64_t mailbox_idnr)
+{
+	Field_T dir;
+
+	if (config_get_value("listing_cache_dir", "POP", dir) < 0)
+		g_strlcpy(dir, DEFAULT_POP_LISTING_DIR, sizeof(dir));
+	if (! strlen(dir))
+		return NULL;
+
+	return g_strdup_printf("%s/%" PRIu64 ".listing", dir, mailbox_idnr);
+}
+
+void db_listing_drop(uint64_t mailbox_idnr)
+{
+	char *file;
+
+	if (! (file = db_listing_file(mailbox_idnr)))
+		return;
+	if (unlink(file) != 0 && errno != ENOENT)
+		TRACE(TRACE_WARNING, "unable to remove listing [%s]: %s", file, strerror(errno));
+	g_free(file);
+}
+
+int db_get_mailbox_seq(uint64_t mailbox_idnr, uint64_t *seq)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T st;
+	volatile int t = DM_EGENERAL;
+
+	assert(seq);
+	*seq = 0;
+
+	c = db_con_get();
+	TRY
+		st = db_stmt_prepare(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = ?", DBPFX);
+		db_stmt_set_u64(st, 1, mailbox_idnr);
+		r = db_stmt_query(st);
+		if (db_result_next(r)) {
+			*seq = db_result_get_u64(r, 0);
+			t = DM_SUCCESS;
+		}
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	return t;
+}
+
 static int db_findmailbox_owner(const char *name, uint64_t owner_idnr,
 			 uint64_t * mailbox_idnr)
 {
@@ -3340,6 +4544,144 @@ int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to, uint64_t user_idnr,
 	return DM_EGENERAL;
 }
 
+#define MOVE_CHUNK 500
+
+/* move one chunk of uids, set-based: the new rows are inserted and
+ * the keywords copied with one statement each, and only the pairing
+ * of old and new uids is read back row by row */
+static void _move_chunk(Connection_T c, uint64_t mailbox_from, uint64_t mailbox_to,
+		GHashTable *chunk, const char *set, GList **done, GList **added)
+{
+	ResultSet_T r;
+	GHashTable *paired = g_hash_table_new(g_int64_hash, g_int64_equal);
+	uint64_t last = 0;
+
+	db_exec(c, "INSERT INTO %smessages (mailbox_idnr, physmessage_id, seen_flag, "
+			"answered_flag, deleted_flag, flagged_flag, recent_flag, draft_flag, "
+			"unique_id, status, seq) "
+			"SELECT %" PRIu64 ", physmessage_id, seen_flag, answered_flag, deleted_flag, "
+			"flagged_flag, recent_flag, draft_flag, unique_id, status, "
+			"(SELECT seq+1 FROM %smailboxes WHERE mailbox_idnr = %" PRIu64 ") "
+			"FROM %smessages WHERE message_idnr IN (%s) "
+			"AND mailbox_idnr = %" PRIu64 " AND status < %d "
+			"ORDER BY message_idnr",
+			DBPFX, mailbox_to, DBPFX, mailbox_to, DBPFX, set,
+			mailbox_from, MESSAGE_STATUS_DELETE);
+
+	/* a copy carries the physmessage and unique_id of its original
+	 * and always gets a higher message_idnr */
+	db_con_clear(c);
+	r = db_query(c, "SELECT o.message_idnr, n.message_idnr "
+			"FROM %smessages o JOIN %smessages n "
+			"ON n.physmessage_id = o.physmessage_id AND n.unique_id = o.unique_id "
+			"WHERE o.message_idnr IN (%s) AND o.mailbox_idnr = %" PRIu64 " "
+			"AND o.status < %d AND n.mailbox_idnr = %" PRIu64 " AND n.status < %d "
+			"AND n.message_idnr > o.message_idnr "
+			"ORDER BY o.message_idnr, n.message_idnr",
+			DBPFX, DBPFX, set, mailbox_from, MESSAGE_STATUS_DELETE,
+			mailbox_to, MESSAGE_STATUS_DELETE);
+	while (db_result_next(r)) {
+		uint64_t old = db_result_get_u64(r, 0), *newid;
+		uint64_t id = db_result_get_u64(r, 1);
+		uint64_t *key = g_hash_table_lookup(chunk, &old);
+
+		/* pair each original with exactly one copy */
+		if (! key || old == last || g_hash_table_contains(paired, &id))
+			continue;
+		newid = g_new0(uint64_t, 1);
+		*newid = id;
+		g_hash_table_add(paired, newid);
+
+		*done = g_list_prepend(*done, key);
+		*added = g_list_prepend(*added, newid);
+		last = old;
+		TRACE(TRACE_DEBUG, "moved uid %" PRIu64 " -> %" PRIu64, old, id);
+	}
+	g_hash_table_destroy(paired);
+
+	/* keywords travel with the message */
+	db_con_clear(c);
+	db_exec(c, "INSERT INTO %skeywords (message_idnr, keyword) "
+			"SELECT n.message_idnr, k.keyword FROM %skeywords k "
+			"JOIN %smessages o ON o.message_idnr = k.message_idnr "
+			"JOIN %smessages n ON n.physmessage_id = o.physmessage_id "
+			"AND n.unique_id = o.unique_id AND n.message_idnr > o.message_idnr "
+			"WHERE o.message_idnr IN (%s) AND o.mailbox_idnr = %" PRIu64 " "
+			"AND o.status < %d AND n.mailbox_idnr = %" PRIu64 " AND n.status < %d "
+			"AND n.seq = (SELECT seq+1 FROM %smailboxes WHERE mailbox_idnr = %" PRIu64 ")",
+			DBPFX, DBPFX, DBPFX, DBPFX, set, mailbox_from, MESSAGE_STATUS_DELETE,
+			mailbox_to, MESSAGE_STATUS_DELETE, DBPFX, mailbox_to);
+
+	/* old uids are expunged in the source mailbox, stamped with the
+	 * modseq it is about to get so other sessions see them go */
+	db_exec(c, "UPDATE %smessages SET status=%d, "
+			"seq=(SELECT seq+1 FROM %smailboxes WHERE mailbox_idnr=%" PRIu64 ") "
+			"WHERE message_idnr IN (%s) AND mailbox_idnr = %" PRIu64 " AND status < %d",
+			DBPFX, MESSAGE_STATUS_DELETE, DBPFX, mailbox_from, set,
+			mailbox_from, MESSAGE_STATUS_DELETE);
+}
+
+int db_move_messages(uint64_t mailbox_from, uint64_t mailbox_to, GList *ids,
+		GList **moved, GList **new_ids, uint64_t *modseq)
+{
+	Connection_T c;
+	GString *set = g_string_new("");
+	GHashTable *chunk = g_hash_table_new(g_int64_hash, g_int64_equal);
+	volatile int t = DM_SUCCESS;
+	GList * volatile done = NULL;
+	GList * volatile added = NULL;
+	GList *l;
+	int n;
+
+	if (! ids)
+		return DM_SUCCESS;
+
+	c = db_con_get();
+	TRY
+		db_begin_transaction(c);
+		for (l = ids; l; ) {
+			g_string_truncate(set, 0);
+			g_hash_table_remove_all(chunk);
+			for (n = 0; l && n < MOVE_CHUNK; n++, l = g_list_next(l)) {
+				g_string_append_printf(set, "%s%" PRIu64, n ? "," : "", *(uint64_t *)l->data);
+				g_hash_table_insert(chunk, l->data, l->data);
+			}
+			_move_chunk(c, mailbox_from, mailbox_to, chunk, set->str,
+					(GList **)&done, (GList **)&added);
+		}
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_string_free(set, TRUE);
+	g_hash_table_destroy(chunk);
+
+	done = g_list_reverse(done);
+	added = g_list_reverse(added);
+
+	if (t == DM_EQUERY) {
+		g_list_free(done);
+		g_list_free_full(added, g_free);
+		return t;
+	}
+
+	if (done) {
+		if (mailbox_from != mailbox_to)
+			db_mailbox_seq_update(mailbox_to, 0);
+		*modseq = db_mailbox_seq_update(mailbox_from, 0);
+	}
+
+	*moved = done;
+	*new_ids = added;
+
+	return DM_SUCCESS;
+}
+
 int db_getmailboxname(uint64_t mailbox_idnr, uint64_t user_idnr, char *name)
 {
 	Connection_T c; ResultSet_T r;
@@ -4597,17 +5939,17 @@ uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
 			TRACE(TRACE_INFO, "SEQ Strategy 1 [%d]", mailbox_update_seq_strategy);
 			/* default */
 			db_begin_transaction(c);
-			st1 = db_stmt_prepare(c, "UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr = ?",
+			st1 = db_stmt_prepare_cached(c, "UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr = ?",
 					db_get_sql(SQL_IGNORE), DBPFX);
 			db_stmt_set_u64(st1, 1, mailbox_id);
-			st2 = db_stmt_prepare(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = ?", DBPFX);
+			st2 = db_stmt_prepare_cached(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = ?", DBPFX);
 			db_stmt_set_u64(st2, 1, mailbox_id);
 			db_stmt_exec(st1);
 			r = db_stmt_query(st2);
 			if (db_result_next(r))
 				seq = db_result_get_u64(r, 0);
 			if (message_id) {
-				st3 = db_stmt_prepare(c, "UPDATE %s %smessages SET seq = ? WHERE message_idnr = ? "
+				st3 = db_stmt_prepare_cached(c, "UPDATE %s %smessages SET seq = ? WHERE message_idnr = ? "
 						"AND seq < ?",
 						db_get_sql(SQL_IGNORE), DBPFX);
 				db_stmt_set_u64(st3, 1, seq);
@@ -4620,19 +5962,19 @@ uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id)
 		if ( mailbox_update_seq_strategy == 2){
 			TRACE(TRACE_INFO, "SEQ Strategy 2 [%d]", mailbox_update_seq_strategy);
 			/* enhanced, maybe friendlier with clustered storage, eg Galera */
-			st1 = db_stmt_prepare(c, "UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr = ?",
+			st1 = db_stmt_prepare_cached(c, "UPDATE %s %smailboxes SET seq=seq+1 WHERE mailbox_idnr = ?",
 					db_get_sql(SQL_IGNORE), DBPFX);
 			db_stmt_set_u64(st1, 1, mailbox_id);
 			db_stmt_exec(st1);
 			
-			st2 = db_stmt_prepare(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = ?", DBPFX);
+			st2 = db_stmt_prepare_cached(c, "SELECT seq FROM %smailboxes WHERE mailbox_idnr = ?", DBPFX);
 			db_stmt_set_u64(st2, 1, mailbox_id);
 			db_stmt_exec(st1);
 			r = db_stmt_query(st2);
 			if (db_result_next(r))
 				seq = db_result_get_u64(r, 0);
 			if (message_id) {
-				st3 = db_stmt_prepare(c, "UPDATE %s %smessages d, %smailboxes s SET d.seq = s.seq WHERE d.message_idnr = ? "
+				st3 = db_stmt_prepare_cached(c, "UPDATE %s %smessages d, %smailboxes s SET d.seq = s.seq WHERE d.message_idnr = ? "
 						"AND s.mailbox_idnr = d.mailbox_idnr",
 						db_get_sql(SQL_IGNORE), DBPFX, DBPFX);
 				db_stmt_set_u64(st3, 1, message_id);
@@ -4776,3 +6118,119 @@ int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr
 	return (db_set_message_status(*msg_idnr, MESSAGE_STATUS_SEEN)?FALSE:TRUE);
 }
 
+int db_append_msgs(GList *messages, uint64_t mailbox_idnr, uint64_t user_idnr)
+{
+	Connection_T c; ResultSet_T r; PreparedStatement_T s;
+	GList *l, *m, *stored = NULL;
+	uint64_t size = 0;
+	char *frag;
+	char unique_id[UID_SIZE];
+	volatile int t = DM_SUCCESS;
+	int i, valid;
+
+	if (! mailbox_is_writable(mailbox_idnr)) return DM_EQUERY;
+
+	for (l = messages; l; l = g_list_next(l))
+		size += ((AppendMessage *)l->data)->size;
+
+	if ((valid = dm_quota_user_validate(user_idnr, size)) == DM_EQUERY)
+		return DM_EQUERY;
+
+	if (! valid) {
+		TRACE(TRACE_INFO, "user [%" PRIu64 "] would exceed quotum", user_idnr);
+		return DM_OVERQUOTA;
+	}
+
+	/* parse and store the mime-parts and headers first; these are
+	 * shared by physmessage, so only the messages rows remain */
+	size = 0;
+	for (l = messages; l; l = g_list_next(l)) {
+		AppendMessage *A = (AppendMessage *)l->data;
+		DbmailMessage *message = dbmail_message_new(NULL);
+		message = dbmail_message_init_with_string(message, A->message);
+		dbmail_message_set_internal_date(message, A->internal_date);
+		stored = g_list_prepend(stored, message);
+		if (dbmail_message_store(message) < 0) {
+			t = DM_EQUERY;
+			break;
+		}
+		size += dbmail_message_get_size(message, FALSE);
+	}
+	stored = g_list_reverse(stored);
+
+	if (t == DM_SUCCESS) {
+		frag = db_returning("message_idnr");
+		c = db_con_get();
+		TRY
+			db_begin_transaction(c);
+			s = db_stmt_prepare(c,
+				"INSERT INTO %smessages (\n"
+				"mailbox_idnr,\n"
+				"physmessage_id,\n"
+				"seen_flag,\n"
+				"answered_flag,\n"
+				"deleted_flag,\n"
+				"flagged_flag,\n"
+				"draft_flag,\n"
+				"recent_flag,\n"
+				"unique_id,\n"
+				"status,\n"
+				"seq)\n"
+				"VALUES(?, ?, ?, ?, ?, ?, ?, 1, ?, %d, "
+				"(SELECT seq+1 FROM %smailboxes WHERE mailbox_idnr = ?)) %s",
+				DBPFX, MESSAGE_STATUS_SEEN, DBPFX, frag);
+
+			for (l = messages, m = stored; l && m; l = g_list_next(l), m = g_list_next(m)) {
+				AppendMessage *A = (AppendMessage *)l->data;
+				DbmailMessage *message = (DbmailMessage *)m->data;
+
+				memset(unique_id, 0, sizeof(unique_id));
+				create_unique_id(unique_id, message->msg_idnr);
+
+				db_stmt_set_u64(s, 1, mailbox_idnr);
+				db_stmt_set_u64(s, 2, dbmail_message_get_physid(message));
+				for (i = IMAP_FLAG_SEEN; i < IMAP_FLAG_RECENT; i++)
+					db_stmt_set_int(s, 3 + i, A->flags[i]);
+				db_stmt_set_str(s, 8, unique_id);
+				db_stmt_set_u64(s, 9, mailbox_idnr);
+				r = db_stmt_query(s);
+				A->uid = db_insert_result(c, r);
+
+				db_set_msgkeywords(c, A->uid, A->keywords, IMAPFA_ADD, NULL);
+				TRACE(TRACE_NOTICE, "message id=%" PRIu64 " is inserted", A->uid);
+			}
+
+			db_commit_transaction(c);
+		CATCH(SQLException)
+			LOG_SQLERROR;
+			db_rollback_transaction(c);
+			t = DM_EQUERY;
+		FINALLY
+			db_con_close(c);
+		END_TRY;
+		g_free(frag);
+	}
+
+	/* drop the temporary copies */
+	for (m = stored; m; m = g_list_next(m)) {
+		DbmailMessage *message = (DbmailMessage *)m->data;
+		if (message->msg_idnr)
+			db_delete_message(message->msg_idnr);
+		dbmail_message_free(message);
+	}
+	g_list_free(stored);
+
+	if (t == DM_EQUERY) {
+		for (l = messages; l; l = g_list_next(l))
+			((AppendMessage *)l->data)->uid = 0;
+		return t;
+	}
+
+	db_mailbox_seq_update(mailbox_idnr, 0);
+
+	if (! dm_quota_user_inc(user_idnr, size))
+		return DM_EQUERY;
+
+	return DM_SUCCESS;
+}
+
@@ -74,6 +74,19 @@ int db_check_headernames(void);
 /* get a connection from the pool */
 C db_con_get(void);
 
+/* admission control in front of the pool */
+void db_con_priority(DbPriority_T priority);
+DbPriority_T db_con_get_priority(void);
+gboolean db_con_shed(void);
+void db_con_stats(DbQueueStats_T *stats);
+
+/* read replicas */
+int db_replica_connect(const char *uris);
+void db_replica_disconnect(void);
+C db_con_get_read(uint64_t mailbox_idnr, uint64_t seq);
+gboolean db_con_is_replica(C c);
+void db_replica_stats(DbReplicaStats_T *stats);
+
 gboolean dm_db_ping(void);
 void db_con_close(C c);
 void db_con_clear(C c);
@@ -86,7 +99,13 @@ int db_disconnect(void);
 
 void log_query_time(char *query, struct timeval before, struct timeval after);
 
+/* query profiler: templates sorted by total time, free with db_profile_free */
+GList * db_profile_list(void);
+void db_profile_free(GList *profiles);
+void db_profile_dump(void);
+
 PreparedStatement_T db_stmt_prepare(Connection_T, const char *, ...);
+PreparedStatement_T db_stmt_prepare_cached(Connection_T, const char *, ...);
 int db_stmt_set_str(S stmt, int index, const char *x);
 int db_stmt_set_int(S stmt, int index, int x);
 int db_stmt_set_u64(S stmt, int index, uint64_t x);
@@ -372,9 +391,26 @@ int db_get_mailbox_size(uint64_t mailbox_idnr, int only_deleted, uint64_t * mail
 * \attention caller should free this memory
 */
 
-int db_icheck_partlists(gboolean cleanup);
-int db_icheck_mimeparts(gboolean cleanup);
-int db_icheck_physmessages(gboolean cleanup);
+/**
+ * \brief delete messages with status PURGE, one chunk at a time
+ * \param cleanup count only when FALSE
+ * \param gc chunk size, rate limit and checkpointing
+ * \return number of messages found, DM_EQUERY on database error
+ */
+int db_purge_deleted(gboolean cleanup, GCParam_T *gc);
+
+int db_icheck_partlists(gboolean cleanup, GCParam_T *gc);
+int db_icheck_mimeparts(gboolean cleanup, GCParam_T *gc);
+int db_icheck_physmessages(gboolean cleanup, GCParam_T *gc);
+
+/**
+ * \brief recompute mimeparts reference counts from partlists
+ * \param cleanup report stale counts only when FALSE
+ * \param gc batch is the number of ids per chunk
+ * \param threads number of chunks recounted in parallel
+ * \return number of stale counts, DM_EQUERY on database error
+ */
+int db_verify_refcounts(gboolean cleanup, GCParam_T *gc, int threads);
 int db_icheck_headernames(gboolean cleanup);
 int db_icheck_headervalues(gboolean cleanup);
 
@@ -439,6 +475,7 @@ int db_delete_mailbox(uint64_t mailbox_idnr, int only_empty,
 		      int update_curmail_size);
 
 char * db_get_message_lines(uint64_t message_idnr, long lines);
+int db_stream_message_lines(uint64_t mailbox_idnr, uint64_t message_idnr, long lines, MessageStreamFunc out, void *data);
 
 /**
  * \brief update POP3 session
@@ -606,6 +643,22 @@ int db_noinferiors(uint64_t mailbox_idnr);
 int db_append_msg(const char *msgdata, uint64_t mailbox_idnr, uint64_t user_idnr, 
 		const char * internal_date, uint64_t * msg_idnr);
 
+/**
+ * \brief append a batch of messages to a mailbox, all or nothing
+ *
+ * The quotum is checked once for the total size, the messages get
+ * their uids, flags and keywords in a single transaction and the
+ * mailbox gets a single modseq bump.
+ * \param messages list of AppendMessage, uid is set on success
+ * \param mailbox_idnr destination mailbox
+ * \param user_idnr who is appending
+ * \return
+ * 		- -2 if the quotum is exceeded
+ * 		- -1 on failure
+ * 		- 0 on success
+ */
+int db_append_msgs(GList *messages, uint64_t mailbox_idnr, uint64_t user_idnr);
+
 /**
  * \brief move all messages from one mailbox to another.
  * \param mailbox_to idnr of mailbox to move messages from.
@@ -628,6 +681,26 @@ int db_movemsg(uint64_t mailbox_to, uint64_t mailbox_from);
 int db_copymsg(uint64_t msg_idnr, uint64_t mailbox_to,
 	       uint64_t user_idnr, uint64_t * newmsg_idnr);
 
+/**
+ * \brief move messages to another mailbox (RFC 6851)
+ *
+ * Every message gets a new uid in mailbox_to, taking its flags,
+ * keywords, physmessage and unique_id along. The old uids are expunged from
+ * mailbox_from. Both mailboxes get a single modseq bump and the
+ * message sizes are unchanged, so the quotum is left alone.
+ * \param mailbox_from source mailbox
+ * \param mailbox_to destination mailbox
+ * \param ids list of uids to move
+ * \param moved gets the uids actually moved, pointing into ids
+ * \param new_ids gets the new uids, in the same order as moved
+ * \param modseq gets the new modseq of mailbox_from
+ * \return
+ * 		- -1 on failure
+ * 		- 0 on success
+ */
+int db_move_messages(uint64_t mailbox_from, uint64_t mailbox_to, GList *ids,
+		GList **moved, GList **new_ids, uint64_t *modseq);
+
 /**
  * \brief check if mailbox already holds message with message-id
  * \param mailbox_idnr
@@ -792,6 +865,12 @@ const char * db_get_sql(sql_fragment frag);
 char * db_returning(const char *s);
 
 uint64_t db_mailbox_seq_update(uint64_t mailbox_id, uint64_t message_id);
+int db_get_mailbox_seq(uint64_t mailbox_idnr, uint64_t *seq);
+
+/* the file a mailbox's POP3 listing is cached in, NULL if disabled */
+char * db_listing_file(uint64_t mailbox_idnr);
+/* remove it, once the mailbox changed or is gone */
+void db_listing_drop(uint64_t mailbox_idnr);
 void db_message_set_seq(uint64_t message_id, uint64_t seq);
 int db_move_message(uint64_t message_id, uint64_t mailbox_id);
 
@@ -391,3 +391,62 @@ void Http_getMessages(T R)
 	dbmail_message_free(m);
 }
 
+
+//--------------------------------------------------------------------------------------//
+void Http_getProfile(T R)
+{
+	struct evbuffer *buf;
+	GList *l, *profiles;
+	int i;
+
+	/*
+	 * query profile of this process, slowest templates first
+	 * C < GET /profile
+	 */
+
+	buf = evbuffer_new();
+	Request_setContentType(R,"application/json; charset=utf-8");
+
+	profiles = db_profile_list();
+	evbuffer_add_printf(buf, "{\"queries\": [\n");
+	for (l = profiles; l; l = l->next) {
+		DbQueryProfile_T *p = (DbQueryProfile_T *)l->data;
+		char *query = g_strescape(p->query, NULL);
+
+		evbuffer_add_printf(buf, "    {\"query\":\"%s\",\"calls\":%" PRIu64 ",\"rows\":%" PRIu64 ","
+				"\"usec\":%" PRIu64 ",\"max_usec\":%" PRIu64 ",\"wait_usec\":%" PRIu64 ",\"histogram\":[",
+				query, p->calls, p->rows, p->usec, p->max_usec, p->wait_usec);
+		for (i = 0; i < DB_PROFILE_BUCKETS; i++)
+			evbuffer_add_printf(buf, "%s%" PRIu64, i ? "," : "", p->hist[i]);
+		evbuffer_add_printf(buf, "]}%s\n", l->next ? "," : "");
+		g_free(query);
+	}
+	evbuffer_add_printf(buf, "]}\n");
+	db_profile_free(profiles);
+
+	Request_send(R, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
+//--------------------------------------------------------------------------------------//
+void Http_getMetrics(T R)
+{
+	struct evbuffer *buf;
+	GString *out;
+
+	/*
+	 * metrics of this process in the Prometheus text format
+	 * C < GET /metrics
+	 */
+
+	out = g_string_new("");
+	metrics_render(out);
+
+	buf = evbuffer_new();
+	Request_setContentType(R, "text/plain; version=0.0.4");
+	evbuffer_add(buf, out->str, out->len);
+	g_string_free(out, TRUE);
+
+	Request_send(R, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
@@ -28,6 +28,8 @@
 void Http_getUsers(Request_T);
 void Http_getMailboxes(Request_T);
 void Http_getMessages(Request_T);
+void Http_getProfile(Request_T);
+void Http_getMetrics(Request_T);
 
 #endif
 
@@ -30,23 +30,102 @@ static GOnce iconv_once = G_ONCE_INIT;
 
 struct DbmailIconv *ic;
 
-G_LOCK_DEFINE_STATIC(mutex);
+/*
+ * Converters are opened once per thread and charset pair and kept, so
+ * header decoding neither pays for iconv_open per string nor shares a
+ * converter behind a lock. Failed opens are cached as well, to not
+ * retry a bogus charset for every header of a message.
+ */
+#define ICONV_CACHE_MAX 32
+
+static void iconv_cache_close(gpointer data)
+{
+	iconv_t cd = (iconv_t)data;
+	if (cd != (iconv_t)-1)
+		g_mime_iconv_close(cd);
+}
 
-static void dbmail_iconv_close(void)
+static void iconv_cache_free(gpointer data)
 {
-	TRACE(TRACE_DEBUG,"closing");
-	if(ic->to_db){
-		g_mime_iconv_close(ic->to_db);
+	g_hash_table_destroy((GHashTable *)data);
+}
+
+static GPrivate iconv_cache = G_PRIVATE_INIT(iconv_cache_free);
+
+static iconv_t dbmail_iconv_get(const char *to, const char *from)
+{
+	GHashTable *cache;
+	gpointer cd;
+	char *key;
+
+	if (! (cache = g_private_get(&iconv_cache))) {
+		cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, iconv_cache_close);
+		g_private_set(&iconv_cache, cache);
+	}
+
+	key = g_strconcat(to, "\n", from, NULL);
+	if (g_hash_table_lookup_extended(cache, key, NULL, &cd)) {
+		g_free(key);
+		if ((iconv_t)cd != (iconv_t)-1)
+			iconv((iconv_t)cd, NULL, NULL, NULL, NULL); // reset shift state
+		return (iconv_t)cd;
 	}
-	if(ic->from_db){
-		g_mime_iconv_close(ic->from_db);
+
+	/* mail carries few distinct charsets; a thread that has seen too
+	 * many simply starts over */
+	if (g_hash_table_size(cache) >= ICONV_CACHE_MAX)
+		g_hash_table_remove_all(cache);
+
+	cd = (gpointer)g_mime_iconv_open(to, from);
+	if ((iconv_t)cd == (iconv_t)-1)
+		TRACE(TRACE_DEBUG, "no converter [%s..%s]", from, to);
+	g_hash_table_insert(cache, key, cd);
+
+	return (iconv_t)cd;
+}
+
+static char * dbmail_iconv_strdup(const char *to, const char *from, const char *str_in)
+{
+	iconv_t cd = dbmail_iconv_get(to, from);
+	if (cd == (iconv_t)-1)
+		return NULL;
+	return g_mime_iconv_strdup(cd, str_in);
+}
+
+/*
+ * true if str is 7-bit, scanning a word at a time; *len is set to the
+ * length of str. Most headers are plain ASCII and need no conversion.
+ */
+static gboolean dbmail_iconv_is_ascii(const char *str, size_t *len)
+{
+	const uint64_t high = UINT64_C(0x8080808080808080);
+	const uint64_t ones = UINT64_C(0x0101010101010101);
+	const unsigned char *p = (const unsigned char *)str;
+	uint64_t acc = 0;
+
+	/* aligned words never cross into an unmapped page */
+	for (; ((uintptr_t)p & (sizeof(uint64_t) - 1)); p++) {
+		if (! *p)
+			goto done;
+		acc |= *p;
 	}
-	if(ic->from_msg){
-		g_mime_iconv_close(ic->from_msg);
+	for (;; p += sizeof(uint64_t)) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(w));
+		if ((w - ones) & ~w & high)
+			break;	// this word holds the terminating nul
+		acc |= w;
 	}
-	ic->to_db = NULL;
-	ic->from_db = NULL;
-	ic->from_msg = NULL;
+	for (; *p; p++)
+		acc |= *p;
+done:
+	*len = (const char *)p - str;
+	return ! (acc & high);
+}
+
+static void dbmail_iconv_close(void)
+{
+	TRACE(TRACE_DEBUG,"closing");
 	g_free(ic);
 	ic = NULL;
 }
@@ -58,9 +137,6 @@ static gpointer dbmail_iconv_once(gpointer UNUSED data)
 	memset(ic->db_charset,'\0', FIELDSIZE);
 	memset(ic->msg_charset,'\0', FIELDSIZE);
 
-	ic->to_db = (iconv_t)-1;
-	ic->from_msg = (iconv_t)-1;
-
 	GETCONFIGVALUE("ENCODING", "DBMAIL", ic->db_charset);
 	GETCONFIGVALUE("DEFAULT_MSG_ENCODING", "DBMAIL", ic->msg_charset);
 
@@ -70,20 +146,15 @@ static gpointer dbmail_iconv_once(gpointer UNUSED data)
 	if (! ic->msg_charset[0])
 		g_strlcpy(ic->msg_charset, g_mime_locale_charset(), FIELDSIZE-1);
 
-	TRACE(TRACE_DEBUG,"Initialize DB encoding surface [UTF-8..%s]", ic->db_charset);
-	ic->to_db = g_mime_iconv_open(ic->db_charset,"UTF-8");
-	if (ic->to_db == (iconv_t)-1)
-		TRACE(TRACE_EMERG, "iconv failure");
-
-	TRACE(TRACE_DEBUG,"Initialize DB decoding surface [%s..UTF-8]", ic->db_charset);
-	ic->from_db = g_mime_iconv_open("UTF-8", ic->db_charset);
-	if (ic->to_db == (iconv_t)-1)
-		TRACE(TRACE_EMERG, "iconv failure");
+	TRACE(TRACE_DEBUG,"DB encoding [%s], default MSG encoding [%s]",
+			ic->db_charset, ic->msg_charset);
 
-	TRACE(TRACE_DEBUG,"Initialize default MSG decoding surface [%s..UTF-8]", ic->msg_charset);
-	ic->from_msg=g_mime_iconv_open("UTF-8",ic->msg_charset);
-	if (ic->from_msg == (iconv_t)-1)
-		TRACE(TRACE_EMERG, "iconv failure");
+	if (dbmail_iconv_get(ic->db_charset, "UTF-8") == (iconv_t)-1)
+		TRACE(TRACE_EMERG, "iconv failure [UTF-8..%s]", ic->db_charset);
+	if (dbmail_iconv_get("UTF-8", ic->db_charset) == (iconv_t)-1)
+		TRACE(TRACE_EMERG, "iconv failure [%s..UTF-8]", ic->db_charset);
+	if (dbmail_iconv_get("UTF-8", ic->msg_charset) == (iconv_t)-1)
+		TRACE(TRACE_EMERG, "iconv failure [%s..UTF-8]", ic->msg_charset);
 
 	atexit(dbmail_iconv_close);
 
@@ -99,28 +170,21 @@ void dbmail_iconv_init(void)
 char * dbmail_iconv_str_to_utf8(const char* str_in, const char *charset)
 {
 	char * subj=NULL;
-	iconv_t conv_iconv = (iconv_t)-1;
+	size_t len;
 
 	dbmail_iconv_init();
 
 	if (str_in==NULL)
 		return NULL;
 
-	if (g_utf8_validate((const gchar *)str_in, -1, NULL) || !g_mime_utils_text_is_8bit((unsigned char *)str_in, strlen(str_in)))
+	if (dbmail_iconv_is_ascii(str_in, &len) || g_utf8_validate((const gchar *)str_in, len, NULL))
 		return g_strdup(str_in);
 
-	if (charset) {
-		if ((conv_iconv=g_mime_iconv_open("UTF-8",charset)) != (iconv_t)-1) {
-			subj = g_mime_iconv_strdup(conv_iconv,str_in);
-			g_mime_iconv_close(conv_iconv);
-		}
-	}
+	if (charset)
+		subj = dbmail_iconv_strdup("UTF-8", charset, str_in);
 
-	if (subj==NULL) {
-		G_LOCK(mutex);
-		subj=g_mime_iconv_strdup(ic->from_msg,str_in);
-		G_UNLOCK(mutex);
-	}
+	if (subj==NULL)
+		subj = dbmail_iconv_strdup("UTF-8", ic->msg_charset, str_in);
 
 	if (subj==NULL) {
 		subj=g_strdup(str_in);
@@ -136,42 +200,31 @@ char * dbmail_iconv_str_to_utf8(const char* str_in, const char *charset)
 char * dbmail_iconv_str_to_db(const char* str_in, const char *charset)
 {
 	char * subj=NULL;
-	iconv_t conv_iconv;
+	size_t len;
 
 	dbmail_iconv_init();
 
 	if ( str_in == NULL )
 		return NULL;
 
-	if (! g_mime_utils_text_is_8bit((unsigned char *)str_in, strlen(str_in)) )
+	if (dbmail_iconv_is_ascii(str_in, &len))
 		return g_strdup(str_in);
 
-	G_LOCK(mutex);
-	subj = g_mime_iconv_strdup(ic->to_db,str_in);
-	G_UNLOCK(mutex);
+	subj = dbmail_iconv_strdup(ic->db_charset, "UTF-8", str_in);
 
 	if (subj != NULL)
 		return subj;
 
-	if (charset) {
-		conv_iconv = g_mime_iconv_open(ic->db_charset,charset);
-		if (conv_iconv != (iconv_t)-1) {
-			subj=g_mime_iconv_strdup(conv_iconv,str_in);
-			g_mime_iconv_close(conv_iconv);
-		}
-	}
+	if (charset)
+		subj = dbmail_iconv_strdup(ic->db_charset, charset, str_in);
 
 	if (subj==NULL) {
 		char *subj2;
 
-		G_LOCK(mutex);
-		subj2 = g_mime_iconv_strdup(ic->from_msg,str_in);
-		G_UNLOCK(mutex);
+		subj2 = dbmail_iconv_strdup("UTF-8", ic->msg_charset, str_in);
 
 		if (subj2 != NULL) {
-			G_LOCK(mutex);
-			subj = g_mime_iconv_strdup(ic->to_db, subj2);
-			G_UNLOCK(mutex);
+			subj = dbmail_iconv_strdup(ic->db_charset, "UTF-8", subj2);
 			g_free(subj2);
 		}
 	}
@@ -189,19 +242,18 @@ char * dbmail_iconv_str_to_db(const char* str_in, const char *charset)
 char * dbmail_iconv_db_to_utf7(const char* str_in)
 {
 	char * subj=NULL;
+	size_t len;
 
 	dbmail_iconv_init();
 
 	if (str_in==NULL)
 		return NULL;
 
-	if (!g_mime_utils_text_is_8bit((unsigned char *)str_in, strlen(str_in)))
+	if (dbmail_iconv_is_ascii(str_in, &len))
 		return g_strdup(str_in);
 
-	if (! g_utf8_validate((const char *)str_in,-1,NULL)) {
-		G_LOCK(mutex);
-		subj = g_mime_iconv_strdup(ic->from_db, str_in);
-		G_UNLOCK(mutex);
+	if (! g_utf8_validate((const char *)str_in, len, NULL)) {
+		subj = dbmail_iconv_strdup("UTF-8", ic->db_charset, str_in);
 		if (subj != NULL){
 			gchar *subj2;
 			subj2 = g_mime_utils_header_encode_text(NULL, (const char *)subj, NULL);
@@ -103,6 +103,7 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 		self->buff = p_string_new(queue_pool, "");
 
 	self->pool = pool;
+	self->arena = arena_new(0);
 
 	pthread_mutex_init(&self->lock, NULL);
 
@@ -130,10 +131,13 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 	Capa_remove(self->preauth_capa, "UNSELECT");
 	Capa_remove(self->preauth_capa, "IDLE");
 	Capa_remove(self->preauth_capa, "UIDPLUS");
+	Capa_remove(self->preauth_capa, "MOVE");
+	Capa_remove(self->preauth_capa, "MULTIAPPEND");
 	Capa_remove(self->preauth_capa, "WITHIN");
 	Capa_remove(self->preauth_capa, "CONDSTORE");
 	Capa_remove(self->preauth_capa, "ENABLE");
 	Capa_remove(self->preauth_capa, "QRESYNC");
+	Capa_remove(self->preauth_capa, "COMPRESS=DEFLATE");
 
 	Capa_remove(self->capa, "STARTTLS");
 	Capa_remove(self->capa, "LOGINDISABLED");
@@ -146,6 +150,9 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 		login_disabled = FALSE;
 	}
 
+	if (config_get_value_default_int("compress_level", "IMAP", Z_DEFAULT_COMPRESSION) == 0)
+		Capa_remove(self->capa, "COMPRESS=DEFLATE");
+
 	if ((! enable_cram_md5) || MATCH(db_params.authdriver, "LDAP")) {
 		Capa_remove(self->preauth_capa, "AUTH=CRAM-MD5");
 	}
@@ -159,12 +166,52 @@ ImapSession * dbmail_imap_session_new(Mempool_T pool)
 	}
 
 	self->physids = g_tree_new((GCompareFunc)ucmp);
+	self->binsizes = g_tree_new_full((GCompareDataFunc)dm_strcmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
 	self->mbxinfo = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)mailboxstate_destroy);
 
 	TRACE(TRACE_DEBUG,"imap session [%p] created", self);
 	return self;
 }
 
+/*
+ * session for a pipelined command: it borrows the connection, the
+ * login and the selected mailbox from parent, but has its own
+ * arguments, fetch state and output buffer, so it can run next to
+ * the command parent is executing.
+ */
+ImapSession * dbmail_imap_session_fork(ImapSession *parent)
+{
+	ImapSession * self;
+	Mempool_T pool = mempool_open();
+
+	self = mempool_pop(pool, sizeof(ImapSession));
+	self->pool = pool;
+	self->arena = arena_new(0);
+	self->buff = p_string_new(queue_pool ? queue_pool : pool, "");
+
+	pthread_mutex_init(&self->lock, NULL);
+
+	PLOCK(parent->lock);
+	self->state = parent->state;
+	PUNLOCK(parent->lock);
+
+	self->parent = parent;
+	self->ci = parent->ci;
+	self->capa = parent->capa;
+	self->preauth_capa = parent->preauth_capa;
+	self->userid = parent->userid;
+	self->mailbox = parent->mailbox;
+	self->enabled = parent->enabled;
+
+	self->args = mempool_pop(self->pool, sizeof(String_T) * MAX_ARGS);
+	self->fi = mempool_pop(self->pool, sizeof(fetch_items));
+	self->physids = g_tree_new((GCompareFunc)ucmp);
+	self->binsizes = g_tree_new_full((GCompareDataFunc)dm_strcmpdata,NULL,(GDestroyNotify)g_free,(GDestroyNotify)g_free);
+
+	TRACE(TRACE_DEBUG,"imap session [%p] forked from [%p]", self, parent);
+	return self;
+}
+
 void dbmail_imap_session_encrypted(ImapSession *self)
 {
 	Field_T val;
@@ -263,8 +310,15 @@ void dbmail_imap_session_delete(ImapSession ** s)
 	Mempool_T pool;
 
 	TRACE(TRACE_DEBUG, "[%p]", self);
-	Capa_free(&self->preauth_capa);
-	Capa_free(&self->capa);
+	if (self->parent) {
+		/* borrowed from the parent session */
+		self->preauth_capa = NULL;
+		self->capa = NULL;
+		self->mailbox = NULL;
+	} else {
+		Capa_free(&self->preauth_capa);
+		Capa_free(&self->capa);
+	}
 
 	dbmail_imap_session_args_free(self, TRUE);
 	dbmail_imap_session_fetch_free(self, TRUE);
@@ -286,10 +340,27 @@ void dbmail_imap_session_delete(ImapSession ** s)
 		g_tree_destroy(self->physids);
 		self->physids = NULL;
 	}
+	if (self->binsizes) {
+		g_tree_destroy(self->binsizes);
+		self->binsizes = NULL;
+	}
 	if (self->buff) {
 		p_string_free(self->buff, TRUE);
 		self->buff = NULL;
 	}
+	if (self->out) {
+		GList *l;
+		for (l = self->out; l; l = g_list_next(l))
+			p_string_free((String_T)l->data, TRUE);
+		g_list_free(self->out);
+		self->out = NULL;
+	}
+	if (self->pipeline) {
+		g_list_free(self->pipeline);
+		self->pipeline = NULL;
+	}
+
+	arena_free(&self->arena);
 
 	pthread_mutex_destroy(&self->lock);
 	pool = self->pool;
@@ -551,6 +622,29 @@ static int _imap_session_fetch_parse_octet_range(ImapSession *self)
 	return 0;	/* DONE */
 }
 
+/* section-binary: part numbers only, no HEADER/TEXT/MIME (RFC 3516) */
+static int _imap_session_fetch_parse_binary_section(ImapSession *self)
+{
+	const char *token = p_string_str(self->args[self->args_idx]);
+	unsigned int j;
+	int indigit = 0;
+
+	for (j = 0; token[j]; j++) {
+		if (isdigit((unsigned char) token[j])) {
+			if (token[j] == '0' && ! indigit) return -2;
+			indigit = 1;
+		} else if (token[j] == '.' && indigit) {
+			indigit = 0;
+		} else {
+			return -2;
+		}
+	}
+	if (! indigit || j >= IMAP_MAX_PARTSPEC_LEN) return -2;
+
+	dbmail_imap_session_bodyfetch_set_partspec(self, (char *)token, j);
+	return 0;
+}
+
 /**
  * Tokens are stored in a c array accessed via a pointer
  * that doesn't know about the array.
@@ -666,6 +760,45 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self)
 				TRACE(TRACE_DEBUG,"[%p] fetch_parse_octet_range return with error", self);
 			return res;
 		}
+	} else if (MATCH(token,"binary") || MATCH(token,"binary.peek") || MATCH(token,"binary.size")) {
+
+		body_fetch *bodyfetch = mempool_pop(self->pool, sizeof(body_fetch));
+		self->fi->bodyfetch = p_list_append(self->fi->bodyfetch, bodyfetch);
+		self->fi->msgparse_needed = 1;
+
+		if (MATCH(token,"binary.size"))
+			dbmail_imap_session_bodyfetch_set_itemtype(self, BFIT_BINARY_SIZE);
+		else
+			dbmail_imap_session_bodyfetch_set_itemtype(self, BFIT_BINARY);
+
+		if (MATCH(token,"binary.peek")) self->fi->noseen = 1;
+
+		if (! nexttoken || ! MATCH(nexttoken,"["))
+			return -2;
+
+		self->args_idx++;	/* now pointing at '[' */
+		self->args_idx++;	/* now pointing at the section or ']' */
+
+		if (! (token = token_first(self)))
+			return -2;
+		if (! MATCH(token,"]")) {
+			if (_imap_session_fetch_parse_binary_section(self) < 0)
+				return -2;
+			self->args_idx++;
+			if (! ((token = token_first(self)) && MATCH(token,"]")))
+				return -2;
+		}
+
+		/* only BINARY[] and BINARY.PEEK[] take a partial */
+		nexttoken = token_next(self);
+		if (nexttoken && nexttoken[0] == '<') {
+			if (bodyfetch->itemtype == BFIT_BINARY_SIZE)
+				return -2;
+			self->args_idx++;
+			if (_imap_session_fetch_parse_octet_range(self) < 0)
+				return -2;
+			self->args_idx--;	/* back at the range */
+		}
 	} else if (MATCH(token,"all")) {		
 		self->fi->msgparse_needed=1; // because of getEnvelope
 		self->fi->getInternalDate = 1;
@@ -776,7 +909,7 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 
 	if (! bodyfetch->headers) {
 		TRACE(TRACE_DEBUG, "[%p] init bodyfetch->headers", self);
-		bodyfetch->headers = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
+		bodyfetch->headers = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,NULL,(GDestroyNotify)g_free);
 		self->ceiling = 0;
 		self->hi = 0;
 		self->lo = 0;
@@ -902,7 +1035,7 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 		g_string_free(fieldorder, TRUE);
 	if (headerIDs)
 		g_string_free(headerIDs, TRUE);
-	c = db_con_get();	
+	c = db_con_get_read(self->mailbox->id, self->mailbox->mbstate ? MailboxState_getSeq(self->mailbox->mbstate) : 0);
 	TRY
 		r = db_query(c, p_string_str(query));
 		while (db_result_next(r)) {
@@ -916,14 +1049,19 @@ static void _fetch_headers(ImapSession *self, body_fetch *bodyfetch, gboolean no
 
 			fld = db_result_get(r, 1);
 			blob = db_result_get_blob(r, 2, &l);
-			char *str = g_new0(char, l + 1);
-			str = strncpy(str, blob, l);
+			/* scratch copy, freed per row: a FETCH over a large
+			 * mailbox goes through a lot of header values */
+			char buf[1024];
+			char *str = (l < (int)sizeof(buf)) ? buf : g_malloc(l + 1);
+			memcpy(str, blob, l);
+			str[l] = '\0';
 			val = dbmail_iconv_db_to_utf7(str);
-			g_free(str);
+			if (str != buf)
+				g_free(str);
 			if (! val) {
 				TRACE(TRACE_DEBUG, "[%p] [%" PRIu64 "] no headervalue [%s]", self, id, fld);
 			} else {
-				mid = mempool_pop(small_pool, sizeof(uint64_t));
+				mid = arena_alloc(self->arena, sizeof(uint64_t));
 				*mid = id;
 
 				old = g_tree_lookup(bodyfetch->headers, (gconstpointer)mid);
@@ -996,6 +1134,145 @@ static void _imap_send_part(ImapSession *self, GMimeObject *part, body_fetch *bo
 }
 
 
+/*
+ * BINARY (RFC 3516)
+ *
+ * leaf parts stored base64, quoted-printable or uuencoded are sent
+ * with the transfer encoding undone. The decoder is read a chunk at
+ * a time straight into the output buffer, so an attachment is never
+ * held decoded in full. Everything else goes out as BODY would.
+ */
+static GMimeStream * _binary_open(GMimeObject *part)
+{
+	GMimeDataWrapper *content;
+	GMimeContentEncoding encoding;
+	GMimeStream *stream;
+	GMimeFilter *filter;
+
+	if (! (part && GMIME_IS_PART(part)))
+		return NULL;
+
+	encoding = g_mime_part_get_content_encoding((GMimePart *)part);
+	switch (encoding) {
+		case GMIME_CONTENT_ENCODING_BASE64:
+		case GMIME_CONTENT_ENCODING_QUOTEDPRINTABLE:
+		case GMIME_CONTENT_ENCODING_UUENCODE:
+			break;
+		default:
+			return NULL;
+	}
+
+	if (! (content = g_mime_part_get_content((GMimePart *)part)))
+		return NULL;
+
+	stream = g_mime_stream_filter_new(g_mime_data_wrapper_get_stream(content));
+	filter = g_mime_filter_basic_new(encoding, FALSE);
+	g_mime_stream_filter_add((GMimeStreamFilter *)stream, filter);
+	g_object_unref(filter);
+	g_mime_stream_reset(stream);
+
+	return stream;
+}
+
+/* decoded size of a section, cached per physmessage for the session */
+static uint64_t _binary_size(ImapSession *self, GMimeObject *part, body_fetch *bodyfetch)
+{
+	GMimeStream *stream;
+	uint64_t *size;
+	char *key;
+
+	if (! bodyfetch->partspec[0])
+		return p_string_len(self->message->crlf);
+	if (! part)
+		return 0;
+
+	key = g_strdup_printf("%" PRIu64 ":%s", self->message->id, bodyfetch->partspec);
+	if ((size = g_tree_lookup(self->binsizes, key))) {
+		g_free(key);
+		return *size;
+	}
+
+	size = g_new0(uint64_t, 1);
+	if ((stream = _binary_open(part))) {
+		char buf[SEND_BUF_SIZE];
+		ssize_t l;
+		while ((l = g_mime_stream_read(stream, buf, sizeof(buf))) > 0)
+			*size += l;
+		g_object_unref(stream);
+	} else {
+		char *tmp = imap_get_logical_part(part, NULL);
+		*size = strlen(tmp);
+		g_free(tmp);
+	}
+
+	TRACE(TRACE_DEBUG, "[%p] [%s] decoded size [%" PRIu64 "]", self, key, *size);
+	g_tree_insert(self->binsizes, key, size);
+
+	return *size;
+}
+
+static void _imap_show_binary_section(ImapSession *self, GMimeObject *part, body_fetch *bodyfetch)
+{
+	GMimeStream *stream = NULL;
+	uint64_t size, start = 0, cnt;
+
+	SEND_SPACE;
+
+	size = _binary_size(self, part, bodyfetch);
+
+	if (bodyfetch->itemtype == BFIT_BINARY_SIZE) {
+		dbmail_imap_session_buff_printf(self, "BINARY.SIZE[%s] %" PRIu64, bodyfetch->partspec, size);
+		return;
+	}
+
+	if (! self->fi->noseen) self->fi->setseen = 1;
+	dbmail_imap_session_buff_printf(self, "BINARY[%s]", bodyfetch->partspec);
+
+	if (bodyfetch->partspec[0] && ! part) {
+		dbmail_imap_session_buff_printf(self, " NIL");
+		return;
+	}
+
+	cnt = size;
+	if (bodyfetch->octetcnt > 0) {
+		start = min(bodyfetch->octetstart, size);
+		cnt = min(bodyfetch->octetcnt, size - start);
+		dbmail_imap_session_buff_printf(self, "<%" PRIu64 ">", bodyfetch->octetstart);
+	}
+
+	if (bodyfetch->partspec[0])
+		stream = _binary_open(part);
+
+	/* decoded content may hold NUL octets: use a literal8 */
+	dbmail_imap_session_buff_printf(self, " %s{%" PRIu64 "}\r\n", stream ? "~" : "", cnt);
+
+	if (stream) {
+		char buf[SEND_BUF_SIZE];
+		ssize_t l;
+		while (cnt > 0 && (l = g_mime_stream_read(stream, buf, sizeof(buf))) > 0) {
+			char *p = buf;
+			if ((uint64_t)l <= start) {
+				start -= l;
+				continue;
+			}
+			p += start;
+			l -= start;
+			start = 0;
+			if ((uint64_t)l > cnt)
+				l = cnt;
+			dbmail_imap_session_buff_append(self, p, l);
+			cnt -= l;
+		}
+		g_object_unref(stream);
+	} else if (! bodyfetch->partspec[0]) {
+		send_data(self, self->message->crlf, start, cnt);
+	} else {
+		char *tmp = imap_get_logical_part(part, NULL);
+		dbmail_imap_session_buff_append(self, tmp + start, cnt);
+		g_free(tmp);
+	}
+}
+
 static int _imap_show_body_section(body_fetch *bodyfetch, gpointer data) 
 {
 	GMimeObject *part = NULL;
@@ -1020,6 +1297,11 @@ static int _imap_show_body_section(body_fetch *bodyfetch, gpointer data)
 		}
 	}
 
+	if (bodyfetch->itemtype >= BFIT_BINARY) {
+		_imap_show_binary_section(self, part, bodyfetch);
+		return 0;
+	}
+
 	SEND_SPACE;
 
 	if (! self->fi->noseen) self->fi->setseen = 1;
@@ -1071,7 +1353,7 @@ static void _fetch_envelopes(ImapSession *self)
 	memset(range,0,sizeof(range));
 
 	if (! self->envelopes) {
-		self->envelopes = g_tree_new_full((GCompareDataFunc)ucmpdata,NULL,(GDestroyNotify)uint64_free,(GDestroyNotify)g_free);
+		self->envelopes = g_tree_new((GCompareFunc)ucmp);
 		self->lo = 0;
 		self->hi = 0;
 	}
@@ -1099,7 +1381,7 @@ static void _fetch_envelopes(ImapSession *self)
 			"AND message_idnr %s",
 			DBPFX, DBPFX,  
 			self->mailbox->id, range);
-	c = db_con_get();
+	c = db_con_get_read(self->mailbox->id, self->mailbox->mbstate ? MailboxState_getSeq(self->mailbox->mbstate) : 0);
 	TRY
 		r = db_query(c, query);
 		while (db_result_next(r)) {
@@ -1108,10 +1390,10 @@ static void _fetch_envelopes(ImapSession *self)
 			if (! g_tree_lookup(self->ids,&id))
 				continue;
 			
-			mid = mempool_pop(small_pool, sizeof(uint64_t));
+			mid = arena_alloc(self->arena, sizeof(uint64_t));
 			*mid = id;
 			
-			g_tree_insert(self->envelopes,mid,g_strdup(ResultSet_getString(r, 2)));
+			g_tree_insert(self->envelopes,mid,arena_strdup(self->arena, ResultSet_getString(r, 2)));
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -1389,6 +1671,13 @@ void dbmail_imap_session_buff_flush(ImapSession *self)
 	else
 		self->buff = p_string_new(queue_pool, "");
 
+	/* a pipelined command holds its output until the commands
+	 * before it have answered */
+	if (self->parent) {
+		self->out = g_list_prepend(self->out, data);
+		return;
+	}
+
 	dm_queue_push(dm_thread_data_sendmessage, session, data);
 }
 
@@ -1414,6 +1703,14 @@ int dbmail_imap_session_buff_printf(ImapSession * self, char * message, ...)
 	return (int)(l-j);
 }
 
+/* like dbmail_imap_session_buff_printf, for data that may hold NUL octets */
+void dbmail_imap_session_buff_append(ImapSession * self, const char *data, size_t len)
+{
+	p_string_append_len(self->buff, data, len);
+
+	if (p_string_len(self->buff) >= IMAP_BUF_SIZE) dbmail_imap_session_buff_flush(self);
+}
+
 int dbmail_imap_session_handle_auth(ImapSession * self, const char * username, const char * password)
 {
 	uint64_t userid = 0;
@@ -1637,6 +1934,9 @@ static void mailbox_notify_fetch(ImapSession *self, MailboxState_T N)
 	}
 	g_list_free(g_list_first(ids));
 
+	// the sort keys of a message never change
+	MailboxState_takeSortinfo(N, self->mailbox->mbstate);
+
 	// switch active mailbox view
 	self->mailbox->mbstate = N;
 	id = mempool_pop(small_pool, sizeof(uint64_t));
@@ -1855,7 +2155,10 @@ static gboolean _do_expunge(uint64_t *id, ImapSession *self)
 
 	if (! msginfo->flags[IMAP_FLAG_DELETED]) return FALSE;
 
-	if (db_exec(self->c, "UPDATE %smessages SET status=%d WHERE message_idnr=%" PRIu64 " ", DBPFX, MESSAGE_STATUS_DELETE, *id) == DM_EQUERY)
+	/* stamp the modseq the mailbox is about to get, so differential
+	 * reloads in other sessions pick up the expunge */
+	if (db_exec(self->c, "UPDATE %smessages SET status=%d, seq=(SELECT seq+1 FROM %smailboxes WHERE mailbox_idnr=%" PRIu64 ") "
+				"WHERE message_idnr=%" PRIu64 " ", DBPFX, MESSAGE_STATUS_DELETE, DBPFX, self->mailbox->id, *id) == DM_EQUERY)
 		return TRUE;
 
 	return notify_expunge(self, id);
@@ -1907,6 +2210,63 @@ int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint
 	return 0;
 }
 
+/*
+ * move the messages in self->ids to mailbox_to. The expunges are
+ * left to dbmail_imap_session_mailbox_moved.
+ */
+int dbmail_imap_session_mailbox_move(ImapSession *self, uint64_t mailbox_to, GList **moved, GList **new_ids, uint64_t *modseq)
+{
+	GList *ids, *l;
+	MailboxState_T M = self->mailbox->mbstate;
+	uint64_t mailbox_from = self->mailbox->id;
+
+	*moved = NULL;
+	*new_ids = NULL;
+	*modseq = 0;
+
+	/* only move what this session can see */
+	ids = g_tree_keys(self->ids);
+	for (l = ids; l; ) {
+		GList *next = g_list_next(l);
+		if (! g_tree_lookup(MailboxState_getMsginfo(M), l->data))
+			ids = g_list_delete_link(ids, l);
+		l = next;
+	}
+
+	if (! ids)
+		return DM_SUCCESS;
+
+	if (db_move_messages(mailbox_from, mailbox_to, ids, moved, new_ids, modseq) == DM_EQUERY) {
+		g_list_free(ids);
+		return DM_EQUERY;
+	}
+	g_list_free(ids);
+
+	return DM_SUCCESS;
+}
+
+/*
+ * send the expunges for the messages moved out of the selected
+ * mailbox. MOVE calls this after its COPYUID response.
+ */
+void dbmail_imap_session_mailbox_moved(ImapSession *self, uint64_t mailbox_to, GList *moved)
+{
+	GList *l;
+
+	if (! moved)
+		return;
+
+	/* highest uid first, so the msn of the ones still to go don't shift */
+	l = g_list_last(moved);
+	while (l) {
+		notify_expunge(self, (uint64_t *)l->data);
+		l = g_list_previous(l);
+	}
+
+	if (self->mailbox->id == mailbox_to)
+		dbmail_imap_session_mailbox_status(self, TRUE);
+}
+
 /*****************************************************************************
  *
  *
@@ -1953,6 +2313,49 @@ void dbmail_imap_session_bodyfetch_free(ImapSession *self)
 #define SQUAREPAR 2
 #define NOPAR 0
 
+/* open parentheses, one bit per level: set for '[', clear for '(' */
+#define PARLIST_SET(l, i, t) \
+	((t) == SQUAREPAR ? (l[(i) >> 3] |= (1 << ((i) & 7))) : (l[(i) >> 3] &= ~(1 << ((i) & 7))))
+#define PARLIST_GET(l, i) \
+	((l[(i) >> 3] & (1 << ((i) & 7))) ? SQUAREPAR : NORMPAR)
+
+/* 
+ * add the argument found at s[offset] of length len. Tokens are
+ * located in place on the command line and copied only once, into
+ * the argument list.
+ */
+static void imap4_tokenizer_arg(ImapSession *self, const char *s, size_t offset, size_t len)
+{
+	self->args[self->args_idx] = p_string_new_len(self->pool, s + offset, len);
+	TRACE(TRACE_DEBUG, "arg[%" PRIu64 "] [%s]", self->args_idx, p_string_str(self->args[self->args_idx]));
+	self->args_idx++;
+}
+
+/*
+ * imap4_tokenizer_literal()
+ *
+ * store (part of) a string literal as the current argument. data
+ * points into the read buffer, so the literal is copied straight
+ * from there into an argument of the right size.
+ */
+int imap4_tokenizer_literal(ImapSession *self, const char *data, size_t len)
+{
+	assert(len <= self->ci->rbuff_size);
+
+	if (! self->args[self->args_idx])
+		self->args[self->args_idx] = p_string_new_len(self->pool, data, len);
+	else
+		p_string_append_len(self->args[self->args_idx], data, len);
+
+	self->ci->rbuff_size -= len;
+	if (self->ci->rbuff_size == 0) {
+		self->args_idx++; // move on to next token
+		TRACE(TRACE_DEBUG, "string literal complete. [%" PRIu64 "] octets", (uint64_t)len);
+	}
+
+	return 0;
+}
+
 /*
  * imap4_tokenizer_main()
  *
@@ -1978,6 +2381,9 @@ void dbmail_imap_session_bodyfetch_free(ImapSession *self)
  * parentheses loose their special meaning if inside (double)quotation marks;
  * data should be 'clarified' (see clarify_data() function below)
  *
+ * The line is scanned in place: every argument is found as an offset
+ * and length into buffer and copied once into the argument list.
+ *
  * The returned array will be NULL-terminated.
  * Will return NULL upon errors.
  */
@@ -1988,7 +2394,7 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer)
 	int paridx = 0, argstart = 0;
 	unsigned int i = 0;
 	size_t max;
-	char parlist[MAX_LINESIZE];
+	unsigned char parlist[MAX_ARGS / 8];
 	char *s, *lastchar;
 
 	assert(buffer);
@@ -1999,35 +2405,17 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer)
 	if (max < 1)
 		goto finalize;
 
-
-//	assert(max <= MAX_LINESIZE);
-
 	/* find the arguments */
 	paridx = 0;
-	parlist[paridx] = NOPAR;
 
 	inquote = 0;
 
 	// if we're not fetching string-literals it's safe to strip NL
-	if (self->ci->rbuff_size) {
-		assert(max <= self->ci->rbuff_size);
-
-		if (! self->args[self->args_idx])
-			self->args[self->args_idx] = p_string_new(self->pool, "");
+	if (self->ci->rbuff_size)
+		return imap4_tokenizer_literal(self, buffer, max);
 
-		p_string_append_len(self->args[self->args_idx], buffer, max);
-		self->ci->rbuff_size -= max;
-		if (self->ci->rbuff_size == 0) {
-			self->args_idx++; // move on to next token
-			TRACE(TRACE_DEBUG, "string literal complete. last-char [%c]", s[max-1]);
-		}
-
-		return 0;
-
-	} else {
-		g_strchomp(s); 
-		max = strlen(s);
-	}
+	g_strchomp(s); 
+	max = strlen(s);
 
 	TRACE(TRACE_DEBUG,"[%p] tokenize [%" PRIu64 "/%" PRIu64 "] [%s]", self, 
 			(uint64_t)max, (uint64_t)self->ci->rbuff_size, s);
@@ -2099,10 +2487,7 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer)
 		if ((s[i] == '"') && ((i > 0 && s[i - 1] != '\\') || i == 0)) {
 			if (inquote) {
 				/* quotation end, treat quoted string as argument */
-				self->args[self->args_idx] = p_string_new(self->pool, "");
-				p_string_append_len(self->args[self->args_idx], &s[quotestart + 1], i - quotestart - 1);
-				TRACE(TRACE_DEBUG, "arg[%" PRIu64 "] [%s]", self->args_idx, p_string_str(self->args[self->args_idx]));
-				self->args_idx++;
+				imap4_tokenizer_arg(self, s, quotestart + 1, i - quotestart - 1);
 				inquote = 0;
 			} else {
 				inquote = 1;
@@ -2113,50 +2498,34 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer)
 
 		if (inquote) continue;
 
-		//if strchr("[]()",s[i]) {
 		if (s[i] == '(' || s[i] == ')' || s[i] == '[' || s[i] == ']') {
 			switch (s[i]) {
 				/* check parenthese structure */
 				case ')':
-					
-				if (paridx < 0 || parlist[paridx] != NORMPAR)
-					paridx = -1;
-				else {
-					paridx--;
-				}
-
+				if (paridx < 1 || PARLIST_GET(parlist, paridx) != NORMPAR)
+					return -1;
+				paridx--;
 				break;
 
 				case ']':
-				
-				if (paridx < 0 || parlist[paridx] != SQUAREPAR)
-					paridx = -1;
-				else {
-					paridx--;
-				}
-
+				if (paridx < 1 || PARLIST_GET(parlist, paridx) != SQUAREPAR)
+					return -1;
+				paridx--;
 				break;
 
 				case '(':
-				
-				parlist[++paridx] = NORMPAR;
-				
+				paridx++;
+				PARLIST_SET(parlist, paridx, NORMPAR);
 				break;
 
 				case '[':
-				
-				parlist[++paridx] = SQUAREPAR;
-
+				paridx++;
+				PARLIST_SET(parlist, paridx, SQUAREPAR);
 				break;
 			}
 
-			if (paridx < 0) return -1; /* error in parenthesis structure */
-				
 			/* add this parenthesis to the arg list and continue */
-			self->args[self->args_idx] = p_string_new(self->pool, "");
-			p_string_printf(self->args[self->args_idx], "%c", s[i]);
-			TRACE(TRACE_DEBUG, "arg[%" PRIu64 "] [%s]", self->args_idx, p_string_str(self->args[self->args_idx]));
-			self->args_idx++;
+			imap4_tokenizer_arg(self, s, i, 1);
 			continue;
 		}
 
@@ -2197,7 +2566,7 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer)
 		/* at an argument start now, walk on until next delimiter
 		 * and save argument 
 		 */
-		for (argstart = i; i < strlen(s) && !strchr(" []()", s[i]); i++) {
+		for (argstart = i; i < max && !strchr(" []()", s[i]); i++) {
 			if (s[i] == '"') {
 				if (s[i - 1] == '\\')
 					continue;
@@ -2206,10 +2575,7 @@ int imap4_tokenizer_main(ImapSession *self, const char *buffer)
 			}
 		}
 
-		self->args[self->args_idx] = p_string_new(self->pool, "");
-		p_string_append_len(self->args[self->args_idx], &s[argstart], i - argstart);
-		TRACE(TRACE_DEBUG, "arg[%" PRIu64 "] [%s]", self->args_idx, p_string_str(self->args[self->args_idx]));
-		self->args_idx++;
+		imap4_tokenizer_arg(self, s, argstart, i - argstart);
 		i--;		/* walked one too far */
 	}
 
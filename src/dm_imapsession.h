@@ -13,8 +13,9 @@
 #define IDLE -1 
 
 /* ImapSession definition */
-typedef struct {
+typedef struct imap_session {
 	Mempool_T pool;
+	Arena_T arena;         // per command, reset when the command completes
 	pthread_mutex_t lock;
 	ClientBase_T *ci;
 	Capa_T preauth_capa;   // CAPABILITY
@@ -23,6 +24,7 @@ typedef struct {
 	char command[16];
 	int command_type;
 	int command_state;
+	gint64 command_start;  // dispatch time, for the command latency metrics
 
 	gboolean use_uid;
 	uint64_t msg_idnr;
@@ -51,6 +53,7 @@ typedef struct {
 	GTree *ids;
 	GList *new_ids; // store new uids after a COPY command
 	GTree *physids;		// cache physmessage_ids for uids 
+	GTree *binsizes;	// cache decoded part sizes for BINARY.SIZE
 	GTree *envelopes;
 	GTree *mbxinfo; 	// cache MailboxState_T 
 	GList *ids_list;
@@ -61,8 +64,25 @@ typedef struct {
 	ClientState_T state; // session status 
 	ImapEnabled_T enabled; // qresync/condstore enabled
 	Connection_T c; // database-connection;
+
+	/* pipelining */
+	struct imap_session *parent; // set on the session of a pipelined command
+	GList *pipeline;       // pipelined commands in flight, oldest first
+	GList *out;            // output of a pipelined command, newest first
+	int pipe_class;        // how the running command may overlap others
+	gboolean pipe_done;
+	int pipe_status;
+	gboolean pipe_cleanup; // cleanup waits for the pipeline to drain
+	gboolean pipe_busy;    // main command running until _ic_cb_leave, under lock
 } ImapSession;
 
+/* how a pipelined command may overlap others */
+enum {
+	PIPE_NONE,		// changes session state; runs alone
+	PIPE_INDEPENDENT,	// doesn't touch the selected mailbox
+	PIPE_READER		// only reads the selected mailbox
+};
+
 
 typedef int (*IMAP_COMMAND_HANDLER) (ImapSession *);
 
@@ -81,6 +101,7 @@ typedef struct {
 /* public methods */
 
 ImapSession * dbmail_imap_session_new(Mempool_T);
+ImapSession * dbmail_imap_session_fork(ImapSession *parent);
 ImapSession * dbmail_imap_session_set_command(ImapSession * self, const char * command);
 
 void dbmail_imap_session_encrypted(ImapSession *session);
@@ -92,6 +113,7 @@ void dbmail_imap_session_delete(ImapSession ** self);
 void dbmail_imap_session_buff_clear(ImapSession *self);
 void dbmail_imap_session_buff_flush(ImapSession *self);
 int dbmail_imap_session_buff_printf(ImapSession * self, char * message, ...);
+void dbmail_imap_session_buff_append(ImapSession * self, const char *data, size_t len);
 
 int dbmail_imap_session_set_state(ImapSession *self, ClientState_T state);
 int dbmail_imap_session_handle_auth(ImapSession * self, const char * username, const char * password);
@@ -100,6 +122,8 @@ MailboxState_T dbmail_imap_session_mbxinfo_lookup(ImapSession *self, uint64_t ma
 
 int dbmail_imap_session_mailbox_status(ImapSession * self, gboolean update);
 int dbmail_imap_session_mailbox_expunge(ImapSession *self, const char *set, uint64_t *modseq);
+int dbmail_imap_session_mailbox_move(ImapSession *self, uint64_t mailbox_to, GList **moved, GList **new_ids, uint64_t *modseq);
+void dbmail_imap_session_mailbox_moved(ImapSession *self, uint64_t mailbox_to, GList *moved);
 
 int dbmail_imap_session_fetch_get_items(ImapSession *self);
 int dbmail_imap_session_fetch_parse_args(ImapSession * self);
@@ -107,10 +131,16 @@ int dbmail_imap_session_fetch_parse_args(ImapSession * self);
 void dbmail_imap_session_bodyfetch_free(ImapSession *self);
 
 int imap4_tokenizer_main(ImapSession *self, const char *buffer);
+int imap4_tokenizer_literal(ImapSession *self, const char *data, size_t len);
 
 
 void _ic_cb_leave(gpointer data);
 
+/* pipelining, see imap4.c */
+int imap_pipeline_class(ImapSession *session, const char *line);
+gboolean imap_pipeline_admit(ImapSession *session, int class);
+void imap_pipeline_done(ImapSession *child, int status);
+
 const char * token_first(ImapSession * self);
 const char * token_next(ImapSession * self);
 
@@ -34,6 +34,182 @@ extern Mempool_T small_pool;
 
 /* internal utilities */
 
+/*
+ * search results are ascending runs of uids (IdRange). Large results
+ * stay small, criteria combine in one linear pass and membership is a
+ * binary search, so no per-message tree is needed.
+ */
+static GArray * _ranges_new(void) {
+	return g_array_new(FALSE, FALSE, sizeof(IdRange));
+}
+
+static void _ranges_free(GArray **ranges) {
+	if (*ranges)
+		g_array_free(*ranges, TRUE);
+	*ranges = NULL;
+}
+
+static GArray * _ranges_copy(GArray *ranges) {
+	GArray *copy = _ranges_new();
+	if (ranges)
+		g_array_append_vals(copy, ranges->data, ranges->len);
+	return copy;
+}
+
+/* append a run at the end, joining it to the last one where they touch */
+static void _ranges_append(GArray *ranges, uint64_t first, uint64_t last) {
+	IdRange range;
+
+	if (ranges->len) {
+		IdRange *prev = &g_array_index(ranges, IdRange, ranges->len - 1);
+		if (first <= prev->last + 1) {
+			prev->last = max(prev->last, last);
+			return;
+		}
+	}
+	range.first = first;
+	range.last = last;
+	g_array_append_val(ranges, range);
+}
+
+static void _ranges_add(GArray *ranges, uint64_t id) {
+	_ranges_append(ranges, id, id);
+}
+
+static uint64_t _ranges_count(GArray *ranges) {
+	uint64_t count = 0;
+	guint i;
+
+	for (i = 0; ranges && i < ranges->len; i++) {
+		IdRange *r = &g_array_index(ranges, IdRange, i);
+		count += r->last - r->first + 1;
+	}
+	return count;
+}
+
+static gboolean _ranges_contains(GArray *ranges, uint64_t id) {
+	guint lo = 0, hi = ranges ? ranges->len : 0, mid;
+
+	while (lo < hi) {
+		IdRange *r;
+		mid = lo + (hi - lo) / 2;
+		r = &g_array_index(ranges, IdRange, mid);
+		if (id < r->first)
+			hi = mid;
+		else if (id > r->last)
+			lo = mid + 1;
+		else
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* a AND b, a OR b, or a NOT b (the ids of a that are not in b) */
+static GArray * _ranges_merge(GArray *a, GArray *b, int condition) {
+	GArray *res = _ranges_new();
+	guint i = 0, j = 0, k;
+
+	switch (condition) {
+		case IST_SUBSEARCH_AND:
+			while (i < a->len && j < b->len) {
+				IdRange *x = &g_array_index(a, IdRange, i);
+				IdRange *y = &g_array_index(b, IdRange, j);
+				uint64_t lo = max(x->first, y->first), hi = min(x->last, y->last);
+				if (lo <= hi)
+					_ranges_append(res, lo, hi);
+				if (x->last < y->last)
+					i++;
+				else
+					j++;
+			}
+			break;
+
+		case IST_SUBSEARCH_OR:
+			while (i < a->len || j < b->len) {
+				IdRange *r;
+				if (j >= b->len || (i < a->len &&
+						g_array_index(a, IdRange, i).first < g_array_index(b, IdRange, j).first))
+					r = &g_array_index(a, IdRange, i++);
+				else
+					r = &g_array_index(b, IdRange, j++);
+				_ranges_append(res, r->first, r->last);
+			}
+			break;
+
+		case IST_SUBSEARCH_NOT:
+			for (i = 0; i < a->len; i++) {
+				IdRange *x = &g_array_index(a, IdRange, i);
+				uint64_t cur = x->first;
+				gboolean covered = FALSE;
+
+				while (j < b->len && g_array_index(b, IdRange, j).last < cur)
+					j++;
+				for (k = j; k < b->len && g_array_index(b, IdRange, k).first <= x->last; k++) {
+					IdRange *y = &g_array_index(b, IdRange, k);
+					if (y->first > cur)
+						_ranges_append(res, cur, y->first - 1);
+					if (y->last >= x->last) {
+						covered = TRUE;
+						break;
+					}
+					cur = y->last + 1;
+				}
+				if (! covered)
+					_ranges_append(res, cur, x->last);
+			}
+			break;
+	}
+
+	return res;
+}
+
+/* replace *found by its combination with other */
+static void _ranges_narrow(GArray **found, GArray *other, int condition) {
+	GArray *res = _ranges_merge(*found, other, condition);
+	_ranges_free(found);
+	*found = res;
+}
+
+static gboolean _ranges_collect(uint64_t *uid, gpointer value UNUSED, GArray *ranges) {
+	_ranges_add(ranges, *uid);
+	return FALSE;
+}
+
+/* the uids of a message set from the mailbox state */
+static GArray * _ranges_from_set(GTree *set) {
+	GArray *ranges = _ranges_new();
+	if (set) {
+		g_tree_foreach(set, (GTraverseFunc) _ranges_collect, ranges);
+		g_tree_destroy(set);
+	}
+	return ranges;
+}
+
+/* message number of a uid in the search result, 0 if it is gone */
+static uint64_t _found_msn(DbmailMailbox *self, uint64_t uid) {
+	uint64_t *msn = g_tree_lookup(MailboxState_getIds(self->mbstate), &uid);
+	return msn ? *msn : 0;
+}
+
+/*
+ * call func(uid, msn, data) for every message in the search result, in
+ * uid order, like g_tree_foreach. A run of uids in the result has no
+ * gaps in the mailbox, so its message numbers are consecutive as well.
+ */
+static void _found_foreach(DbmailMailbox *self, GTraverseFunc func, gpointer data) {
+	guint i;
+
+	for (i = 0; self->found && i < self->found->len; i++) {
+		IdRange *r = &g_array_index(self->found, IdRange, i);
+		uint64_t uid, msn = _found_msn(self, r->first);
+
+		for (uid = r->first; uid <= r->last; uid++, msn++) {
+			if (func(&uid, &msn, data))
+				return;
+		}
+	}
+}
+
 /* class methods */
 
 DbmailMailbox * dbmail_mailbox_new(Mempool_T pool, uint64_t id) {
@@ -59,25 +235,32 @@ DbmailMailbox * dbmail_mailbox_new(Mempool_T pool, uint64_t id) {
 static gboolean _node_free(GNode *node, gpointer data) {
 	DbmailMailbox *self = (DbmailMailbox *) data;
 	search_key *s = (search_key *) node->data;
-	if (s->found) {
-		g_tree_destroy(s->found);
-	}
+	_ranges_free(&s->found);
 	mempool_push(self->pool, s, sizeof (search_key));
 	return FALSE;
 }
 
-void dbmail_mailbox_free(DbmailMailbox *self) {
-	Mempool_T pool = self->pool;
-	gboolean freepool = self->freepool;
-	if (self->found) {
-		g_tree_destroy(self->found);
-	}
+/* drop the search tree and results of the previous SEARCH/SORT/THREAD */
+static void _search_free(DbmailMailbox *self) {
+	_ranges_free(&self->found);
 	if (self->sorted) {
 		g_list_free_full(g_steal_pointer (&self->sorted), g_free);
 	}
 	if (self->search) {
-		g_node_traverse(g_node_get_root(self->search), G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc) _node_free, self);
-		g_node_destroy(self->search);
+		GNode *root = g_node_get_root(self->search);
+		g_node_traverse(root, G_POST_ORDER, G_TRAVERSE_ALL, -1, (GNodeTraverseFunc) _node_free, self);
+		g_node_destroy(root);
+		self->search = NULL;
+	}
+}
+
+void dbmail_mailbox_free(DbmailMailbox *self) {
+	Mempool_T pool = self->pool;
+	gboolean freepool = self->freepool;
+
+	_search_free(self);
+	if (self->saved) {
+		g_array_free(self->saved, TRUE);
 	}
 
 	mempool_push(pool, self, sizeof (DbmailMailbox));
@@ -176,7 +359,7 @@ static int _mimeparts_dump(DbmailMailbox *self, GMimeStream *ostream) {
 	List_T ids = NULL;
 	uint64_t msgid, physid, *id;
 	DbmailMessage *m;
-	GTree *uids;
+	GArray *uids;
 	volatile int count = 0;
 	PreparedStatement_T stmt;
 	Connection_T c;
@@ -200,7 +383,7 @@ static int _mimeparts_dump(DbmailMailbox *self, GMimeStream *ostream) {
 	while (db_result_next(r)) {
 		physid = db_result_get_u64(r, 0);
 		msgid = db_result_get_u64(r, 1);
-		if (g_tree_lookup(uids, &msgid)) {
+		if (_ranges_contains(uids, msgid)) {
 			id = mempool_pop(self->pool, sizeof (uint64_t));
 			*id = physid;
 			ids = p_list_append(ids, id);
@@ -243,15 +426,11 @@ int dbmail_mailbox_dump(DbmailMailbox *self, FILE *file) {
 
 	dbmail_mailbox_open(self);
 
-	GTree *ids = self->found;
-
-	if (ids == NULL || g_tree_nnodes(ids) == 0) {
+	if (_ranges_count(self->found) == 0) {
 		TRACE(TRACE_DEBUG, "cannot dump empty mailbox");
 		return 0;
 	}
 
-	assert(ids);
-
 	ostream = g_mime_stream_file_new(file);
 	g_mime_stream_file_set_owner((GMimeStreamFile *) ostream, FALSE);
 
@@ -262,30 +441,36 @@ int dbmail_mailbox_dump(DbmailMailbox *self, FILE *file) {
 	return count;
 }
 
+/*
+ * RFC 5256 ORDEREDSUBJECT: the first message of a subject group is the
+ * parent and all others are its children, so a single child follows
+ * its parent directly and several children are sibling subthreads:
+ * (1)  (1 2)  (1 (2)(4))
+ */
 static gboolean _tree_foreach(gpointer key UNUSED, gpointer value, GString * data) {
-	gboolean res = FALSE;
-	uint64_t *id;
 	GList *sublist = g_list_first((GList *) value);
-	GString *t = g_string_new("");
-	int m = g_list_length(sublist);
+	GList *l;
+	guint m = g_list_length(sublist);
 
-	sublist = g_list_first(sublist);
-	while (sublist) {
-		id = sublist->data;
-		g_string_append_printf(t, "(%" PRIu64 ")", *id);
+	if (! m)
+		return FALSE;
 
-		if (!g_list_next(sublist))
-			break;
-		sublist = g_list_next(sublist);
+	g_string_append_printf(data, "(%" PRIu64, *(uint64_t *) sublist->data);
+	if (m == 2) {
+		g_string_append_printf(data, " %" PRIu64, *(uint64_t *) sublist->next->data);
+	} else if (m > 2) {
+		g_string_append_c(data, ' ');
+		for (l = sublist->next; l; l = g_list_next(l))
+			g_string_append_printf(data, "(%" PRIu64 ")", *(uint64_t *) l->data);
 	}
-	if (m > 1)
-		g_string_append_printf(data, "(%s)", t->str);
-	else
-		g_string_append_printf(data, "%s", t->str);
+	g_string_append_c(data, ')');
 
-	g_string_free(t, TRUE);
+	return FALSE;
+}
 
-	return res;
+static gboolean _tree_free(gpointer key UNUSED, gpointer value, gpointer data UNUSED) {
+	g_list_free_full((GList *) value, g_free);
+	return FALSE;
 }
 
 char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
@@ -293,7 +478,7 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
 	volatile uint64_t i = 0, idnr = 0;
 	char *subj;
 	char *res = NULL;
-	uint64_t *id, *msn;
+	uint64_t *id;
 	GTree *tree;
 	GString *threads;
 	PreparedStatement_T stmt;
@@ -325,7 +510,7 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
 	while (db_result_next(r)) {
 		i++;
 		idnr = db_result_get_u64(r, 0);
-		if (!g_tree_lookup(self->found, (gconstpointer) & idnr))
+		if (! _ranges_contains(self->found, idnr))
 			continue;
 		subj = (char *) db_result_get(r, 1);
 		g_tree_insert(tree, g_strdup(subj), NULL);
@@ -353,7 +538,7 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
 		"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
 		"WHERE m.mailbox_idnr = ? "
 		"AND n.headername = 'subject' AND m.status < %d "
-		"ORDER BY v.sortfield, v.datefield",
+		"ORDER BY v.sortfield, v.datefield, m.message_idnr",
 		DBPFX, DBPFX, DBPFX, DBPFX,
 		MESSAGE_STATUS_DELETE);
 	db_stmt_set_u64(stmt, 1, self->id);
@@ -363,7 +548,7 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
 	while (db_result_next(r)) {
 		i++;
 		idnr = db_result_get_u64(r, 0);
-		if (!(msn = g_tree_lookup(self->found, (gconstpointer) & idnr)))
+		if (! _ranges_contains(self->found, idnr))
 			continue;
 		subj = (char *) db_result_get(r, 1);
 
@@ -371,7 +556,7 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
 		if (dbmail_mailbox_get_uid(self))
 			*id = idnr;
 		else
-			*id = *msn;
+			*id = _found_msn(self, idnr);
 
 		sublist = g_tree_lookup(tree, (gconstpointer) subj);
 		sublist = g_list_append(sublist, id);
@@ -385,6 +570,7 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
 	END_TRY;
 
 	if ((t == DM_EQUERY) || (!i)) {
+		g_tree_foreach(tree, (GTraverseFunc) _tree_free, NULL);
 		g_tree_destroy(tree);
 		return res;
 	}
@@ -394,69 +580,641 @@ char * dbmail_mailbox_orderedsubject(DbmailMailbox *self) {
 	res = threads->str;
 
 	g_string_free(threads, FALSE);
+	g_tree_foreach(tree, (GTraverseFunc) _tree_free, NULL);
 	g_tree_destroy(tree);
 
 	return res;
 }
 
 /*
- * Returns imap modseq response for a user's mailbox
- * 
- * This function came from and is used with dbmail_mailbox_ids_as_string
+ * THREAD=REFERENCES (RFC 5256)
+ *
+ * The per-message threading data (message-id, references, base subject
+ * and sent date) is cached per mailbox and shared by all sessions in the
+ * process. On every THREAD call the index is synced against the mailbox
+ * state: expunged uids are dropped and only newly delivered messages are
+ * read from the database. The thread forest itself is then built in memory
+ * over the search result.
  */
-char * dbmail_mailbox_imap_modseq_as_string(DbmailMailbox *self, gboolean uid) {
-	TRACE(TRACE_DEBUG, "Call: dbmail_mailbox_imap_modseq_as_string");
-	GString *t;
-	gchar *s = NULL;
-	GList *l = NULL;
-	GTree *msginfo;
-	GTree *msn;
-	uint64_t maxseq = 0;
 
-	if ((self->found == NULL) || g_tree_nnodes(self->found) <= 0) {
-		TRACE(TRACE_DEBUG, "no ids found");
-		return s;
-	}
+#define THREAD_CACHE_SIZE 32
+
+typedef struct {
+	uint64_t uid;
+	char *msgid;
+	char *subject;		// base subject
+	char *date;		// sent date (YYYY-MM-DD HH:MM:SS)
+	gboolean reply;
+	GList *refs;		// referenced message-ids, oldest first
+} ThreadMessage;
+
+typedef struct {
+	uint64_t mailbox_id;
+	GTree *messages;	// uid -> ThreadMessage
+	GMutex lock;
+	int refs;
+	time_t used;
+} ThreadIndex;
+
+typedef struct ThreadContainer {
+	ThreadMessage *message;
+	uint64_t id;		// uid or msn, as reported to the client
+	struct ThreadContainer *parent;
+	struct ThreadContainer *child;
+	struct ThreadContainer *next;
+} ThreadContainer;
+
+G_LOCK_DEFINE_STATIC(thread_cache_lock);
+static GTree *thread_cache = NULL;
+
+static void _thread_message_free(ThreadMessage *m)
+{
+	g_free(m->msgid);
+	g_free(m->subject);
+	g_free(m->date);
+	g_list_free_full(m->refs, g_free);
+	g_free(m);
+}
 
-	if (uid || dbmail_mailbox_get_uid(self)) {
-		l = g_tree_keys(self->found);
-	} else {
-		l = g_tree_values(self->found);
+static void _thread_index_free(ThreadIndex *index)
+{
+	g_tree_destroy(index->messages);
+	g_mutex_clear(&index->lock);
+	g_free(index);
+}
+
+static gboolean _thread_index_oldest(gpointer key UNUSED, ThreadIndex *index, ThreadIndex **oldest)
+{
+	if (index->refs)
+		return FALSE;
+	if ((! *oldest) || index->used < (*oldest)->used)
+		*oldest = index;
+	return FALSE;
+}
+
+static ThreadIndex * _thread_index_get(uint64_t mailbox_id)
+{
+	ThreadIndex *index;
+
+	G_LOCK(thread_cache_lock);
+	if (! thread_cache)
+		thread_cache = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)_thread_index_free);
+
+	if (! (index = g_tree_lookup(thread_cache, &mailbox_id))) {
+		if (g_tree_nnodes(thread_cache) >= THREAD_CACHE_SIZE) {
+			ThreadIndex *oldest = NULL;
+			g_tree_foreach(thread_cache, (GTraverseFunc)_thread_index_oldest, &oldest);
+			if (oldest) {
+				TRACE(TRACE_DEBUG, "evict thread index [%" PRIu64 "]", oldest->mailbox_id);
+				g_tree_remove(thread_cache, &oldest->mailbox_id);
+			}
+		}
+		index = g_new0(ThreadIndex, 1);
+		index->mailbox_id = mailbox_id;
+		index->messages = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)_thread_message_free);
+		g_mutex_init(&index->lock);
+		g_tree_insert(thread_cache, &index->mailbox_id, index);
 	}
+	index->refs++;
+	index->used = time(NULL);
+	G_UNLOCK(thread_cache_lock);
 
-	msginfo = MailboxState_getMsginfo(self->mbstate);
-	msn = MailboxState_getMsn(self->mbstate);
+	g_mutex_lock(&index->lock);
 
-	while (l->data) {
-		uint64_t *key = (uint64_t *) l->data;
-		if (self->modseq) {
-			uint64_t *id;
-			if (uid || dbmail_mailbox_get_uid(self)) {
-				id = key;
-			} else {
-				id = g_tree_lookup(msn, key);
+	return index;
+}
+
+static void _thread_index_release(ThreadIndex *index)
+{
+	g_mutex_unlock(&index->lock);
+	G_LOCK(thread_cache_lock);
+	index->refs--;
+	G_UNLOCK(thread_cache_lock);
+}
+
+struct thread_sync {
+	GTree *other;
+	GList *uids;
+};
+
+static gboolean _thread_collect_missing(uint64_t *uid, gpointer value UNUSED, struct thread_sync *sync)
+{
+	if (! g_tree_lookup(sync->other, uid))
+		sync->uids = g_list_prepend(sync->uids, uid);
+	return FALSE;
+}
+
+static gboolean _thread_drop(uint64_t *uid, gpointer value UNUSED, GTree *messages)
+{
+	g_tree_remove(messages, uid);
+	return FALSE;
+}
+
+static char * _thread_msgid(const char *value)
+{
+	const char *start, *end;
+
+	if (! value)
+		return NULL;
+	if ((start = strchr(value, '<')) && (end = strchr(start, '>')) && (end > start + 1))
+		return g_strndup(start + 1, end - start - 1);
+
+	return g_strstrip(g_strdup(value));
+}
+
+/*
+ * bring the cached threading data in line with the live messages in the
+ * mailbox state: drop what was expunged, load what was delivered since.
+ */
+static int _thread_index_sync(ThreadIndex *index, MailboxState_T state)
+{
+	GTree *ids = MailboxState_getIds(state);
+	GTree *missing;
+	GList *l;
+	struct thread_sync sync;
+	uint64_t first;
+	Connection_T c;
+	PreparedStatement_T stmt;
+	ResultSet_T r;
+	Field_T frag;
+	volatile int t = DM_SUCCESS;
+
+	// expunged
+	sync.other = ids;
+	sync.uids = NULL;
+	g_tree_foreach(index->messages, (GTraverseFunc)_thread_collect_missing, &sync);
+	for (l = sync.uids; l; l = g_list_next(l))
+		g_tree_remove(index->messages, l->data);
+	g_list_free(sync.uids);
+
+	// delivered
+	sync.other = index->messages;
+	sync.uids = NULL;
+	g_tree_foreach(ids, (GTraverseFunc)_thread_collect_missing, &sync);
+	if (! sync.uids)
+		return t;
+
+	TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] load [%u] messages into thread index",
+			index->mailbox_id, g_list_length(sync.uids));
+
+	// collected in ascending order, so the lowest uid is last
+	first = *(uint64_t *)g_list_last(sync.uids)->data;
+	missing = g_tree_new((GCompareFunc)ucmp);
+	for (l = sync.uids; l; l = g_list_next(l))
+		g_tree_insert(missing, l->data, l->data);
+	g_list_free(sync.uids);
+
+	date2char_str("p.internal_date", &frag);
+
+	c = db_con_get();
+	TRY
+		ThreadMessage *m;
+		uint64_t uid;
+		const char *name, *value;
+
+		stmt = db_stmt_prepare(c,
+				"SELECT m.message_idnr, %s FROM %smessages m "
+				"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
+				"WHERE m.mailbox_idnr = ? AND m.status < %d "
+				"AND m.message_idnr >= ?",
+				frag, DBPFX, DBPFX, MESSAGE_STATUS_DELETE);
+		db_stmt_set_u64(stmt, 1, index->mailbox_id);
+		db_stmt_set_u64(stmt, 2, first);
+		r = db_stmt_query(stmt);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			if (! g_tree_lookup(missing, &uid))
+				continue;
+			m = g_new0(ThreadMessage, 1);
+			m->uid = uid;
+			m->date = g_strdup(db_result_get(r, 1));
+			g_tree_insert(index->messages, &m->uid, m);
+		}
+
+		db_con_clear(c);
+
+		stmt = db_stmt_prepare(c,
+				"SELECT m.message_idnr, n.headername, v.headervalue, v.sortfield "
+				"FROM %smessages m "
+				"LEFT JOIN %sheader h USING (physmessage_id) "
+				"LEFT JOIN %sheadername n ON h.headername_id = n.id "
+				"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
+				"WHERE m.mailbox_idnr = ? AND m.status < %d "
+				"AND m.message_idnr >= ? "
+				"AND n.headername IN ('message-id','subject','date')",
+				DBPFX, DBPFX, DBPFX, DBPFX, MESSAGE_STATUS_DELETE);
+		db_stmt_set_u64(stmt, 1, index->mailbox_id);
+		db_stmt_set_u64(stmt, 2, first);
+		r = db_stmt_query(stmt);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			if (! g_tree_lookup(missing, &uid))
+				continue;
+			if (! (m = g_tree_lookup(index->messages, &uid)))
+				continue;
+			name = db_result_get(r, 1);
+			value = db_result_get(r, 2);
+			if (MATCH(name, "message-id") && ! m->msgid) {
+				m->msgid = _thread_msgid(value);
+			} else if (MATCH(name, "subject") && value && ! m->subject) {
+				char *s = g_utf8_strdown(value, -1);
+				dm_pack_spaces(s);
+				m->subject = dm_base_subject(value);
+				m->reply = ! MATCH(g_strstrip(s), m->subject);
+				g_free(s);
+			} else if (MATCH(name, "date")) {
+				g_free(m->date);
+				m->date = g_strdup(db_result_get(r, 3));
 			}
+		}
 
-			MessageInfo *info = g_tree_lookup(msginfo, id);
-			maxseq = max(maxseq, info->seq);
+		db_con_clear(c);
+
+		stmt = db_stmt_prepare(c,
+				"SELECT m.message_idnr, r.referencesfield "
+				"FROM %smessages m "
+				"JOIN %sreferencesfield r USING (physmessage_id) "
+				"WHERE m.mailbox_idnr = ? AND m.status < %d "
+				"AND m.message_idnr >= ? "
+				"ORDER BY m.message_idnr, r.id",
+				DBPFX, DBPFX, MESSAGE_STATUS_DELETE);
+		db_stmt_set_u64(stmt, 1, index->mailbox_id);
+		db_stmt_set_u64(stmt, 2, first);
+		r = db_stmt_query(stmt);
+		while (db_result_next(r)) {
+			uid = db_result_get_u64(r, 0);
+			if (! g_tree_lookup(missing, &uid))
+				continue;
+			if (! (m = g_tree_lookup(index->messages, &uid)))
+				continue;
+			m->refs = g_list_append(m->refs, g_strdup(db_result_get(r, 1)));
 		}
-		if (!g_list_next(l))
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	if (t == DM_EQUERY) // don't keep partially loaded entries around
+		g_tree_foreach(missing, (GTraverseFunc)_thread_drop, index->messages);
+
+	g_tree_destroy(missing);
+
+	return t;
+}
+
+struct thread_build {
+	DbmailMailbox *self;
+	ThreadIndex *index;
+	GHashTable *ids;	// message-id -> container
+	GList *containers;
+};
+
+static ThreadContainer * _thread_container_new(struct thread_build *build)
+{
+	ThreadContainer *c = g_new0(ThreadContainer, 1);
+	build->containers = g_list_prepend(build->containers, c);
+	return c;
+}
+
+static ThreadContainer * _thread_container_get(struct thread_build *build, const char *msgid)
+{
+	ThreadContainer *c;
+	if (! (c = g_hash_table_lookup(build->ids, msgid))) {
+		c = _thread_container_new(build);
+		g_hash_table_insert(build->ids, (gpointer)msgid, c);
+	}
+	return c;
+}
+
+static gboolean _thread_is_ancestor(ThreadContainer *a, ThreadContainer *b)
+{
+	for (; b; b = b->parent)
+		if (a == b)
+			return TRUE;
+	return FALSE;
+}
+
+static void _thread_unlink(ThreadContainer *c)
+{
+	ThreadContainer **p;
+	if (! c->parent)
+		return;
+	for (p = &c->parent->child; *p; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
 			break;
-		l = g_list_next(l);
+		}
 	}
+	c->parent = NULL;
+	c->next = NULL;
+}
+
+static void _thread_link(ThreadContainer *parent, ThreadContainer *c)
+{
+	c->parent = parent;
+	c->next = parent->child;
+	parent->child = c;
+}
+
+/* step 1: link messages and their references into the id table */
+static gboolean _thread_add_message(uint64_t *uid, uint64_t *msn, struct thread_build *build)
+{
+	ThreadMessage *m;
+	ThreadContainer *c = NULL, *r, *prev = NULL;
+	GList *l;
+
+	if (! (m = g_tree_lookup(build->index->messages, uid)))
+		return FALSE;
+
+	if (m->msgid && m->msgid[0]) {
+		c = _thread_container_get(build, m->msgid);
+		if (c->message) // duplicate message-id: thread it on its own
+			c = NULL;
+	}
+	if (! c)
+		c = _thread_container_new(build);
+
+	c->message = m;
+	c->id = dbmail_mailbox_get_uid(build->self) ? *uid : *msn;
+
+	for (l = m->refs; l; l = g_list_next(l)) {
+		r = _thread_container_get(build, (const char *)l->data);
+		if (r == c)
+			continue;
+		if (prev && ! r->parent && ! _thread_is_ancestor(r, prev))
+			_thread_link(prev, r);
+		prev = r;
+	}
+
+	_thread_unlink(c);
+	if (prev && ! _thread_is_ancestor(c, prev))
+		_thread_link(prev, c);
+
+	return FALSE;
+}
 
-	l = g_list_first(l);
-	g_list_free(l);
+/* step 4: prune dummy containers */
+static void _thread_prune(ThreadContainer *parent, gboolean isroot)
+{
+	ThreadContainer **p = &parent->child, *c, *last;
+
+	while ((c = *p)) {
+		_thread_prune(c, FALSE);
+
+		if (! c->message && ! c->child) {
+			*p = c->next;
+			continue;
+		}
+
+		if (! c->message && (! isroot || ! c->child->next)) {
+			for (last = c->child; ; last = last->next) {
+				last->parent = isroot ? NULL : parent;
+				if (! last->next)
+					break;
+			}
+			last->next = c->next;
+			*p = c->child;
+			p = &last->next;
+			continue;
+		}
+
+		p = &c->next;
+	}
+}
+
+static ThreadMessage * _thread_first(ThreadContainer *c)
+{
+	while (! c->message && c->child)
+		c = c->child;
+	return c->message;
+}
+
+static const char * _thread_subject(ThreadContainer *c)
+{
+	ThreadMessage *m = _thread_first(c);
+	if (! m || ! m->subject || ! m->subject[0])
+		return NULL;
+	return m->subject;
+}
+
+/* step 5: gather threads with the same base subject */
+static void _thread_group_subjects(struct thread_build *build, ThreadContainer *root)
+{
+	GHashTable *subjects;
+	ThreadContainer **p, *c, *e, *n, *k;
+	const char *s;
+
+	subjects = g_hash_table_new(g_str_hash, g_str_equal);
+
+	for (c = root->child; c; c = c->next) {
+		if (! (s = _thread_subject(c)))
+			continue;
+		e = g_hash_table_lookup(subjects, s);
+		if ((! e) || (! c->message && e->message) || (c->message && e->message
+					&& e->message->reply && ! c->message->reply))
+			g_hash_table_insert(subjects, (gpointer)s, c);
+	}
+
+	p = &root->child;
+	while ((c = *p)) {
+		if (! (s = _thread_subject(c)) || ! (e = g_hash_table_lookup(subjects, s)) || e == c) {
+			p = &c->next;
+			continue;
+		}
+
+		*p = c->next;
+		c->next = NULL;
+
+		if (! e->message && ! c->message) {
+			while ((k = c->child)) {
+				c->child = k->next;
+				_thread_link(e, k);
+			}
+		} else if (! e->message) {
+			_thread_link(e, c);
+		} else if (c->message->reply && ! e->message->reply) {
+			_thread_link(e, c);
+		} else {
+			// turn the table entry into a dummy holding both threads
+			n = _thread_container_new(build);
+			n->message = e->message;
+			n->id = e->id;
+			while ((k = e->child)) {
+				e->child = k->next;
+				_thread_link(n, k);
+			}
+			e->message = NULL;
+			_thread_link(e, n);
+			_thread_link(e, c);
+		}
+	}
+
+	g_hash_table_destroy(subjects);
+}
+
+static gint _thread_compare(ThreadContainer *a, ThreadContainer *b)
+{
+	ThreadMessage *x = _thread_first(a), *y = _thread_first(b);
+	int r = g_strcmp0(x->date, y->date);
+	if (r)
+		return r;
+	return ucmp(&x->uid, &y->uid);
+}
+
+/* step 6: sort siblings by sent date */
+static void _thread_sort(ThreadContainer *parent)
+{
+	GList *l, *siblings = NULL;
+	ThreadContainer *c, **p;
+
+	for (c = parent->child; c; c = c->next) {
+		_thread_sort(c);
+		siblings = g_list_prepend(siblings, c);
+	}
+	siblings = g_list_sort(siblings, (GCompareFunc)_thread_compare);
+
+	p = &parent->child;
+	for (l = siblings; l; l = g_list_next(l)) {
+		*p = l->data;
+		p = &(*p)->next;
+	}
+	*p = NULL;
+	g_list_free(siblings);
+}
+
+static void _thread_print(ThreadContainer *c, GString *threads)
+{
+	ThreadContainer *k;
+
+	if (c->message) {
+		g_string_append_printf(threads, "%" PRIu64, c->id);
+		if (! c->child)
+			return;
+		g_string_append_c(threads, ' ');
+		if (! c->child->next) {
+			_thread_print(c->child, threads);
+			return;
+		}
+	}
+
+	for (k = c->child; k; k = k->next) {
+		g_string_append_c(threads, '(');
+		_thread_print(k, threads);
+		g_string_append_c(threads, ')');
+	}
+}
+
+char * dbmail_mailbox_threadreferences(DbmailMailbox *self)
+{
+	struct thread_build build;
+	ThreadContainer root, *c;
+	GString *threads;
+	GList *l;
+	char *res = NULL;
+
+	if (! _ranges_count(self->found))
+		return res;
+
+	memset(&build, 0, sizeof(build));
+	memset(&root, 0, sizeof(root));
+
+	build.self = self;
+	build.index = _thread_index_get(self->id);
+
+	if (_thread_index_sync(build.index, self->mbstate) != DM_SUCCESS) {
+		_thread_index_release(build.index);
+		return res;
+	}
+
+	build.ids = g_hash_table_new(g_str_hash, g_str_equal);
+	_found_foreach(self, (GTraverseFunc)_thread_add_message, &build);
+
+	/* step 2: the root set */
+	for (l = build.containers; l; l = g_list_next(l)) {
+		c = (ThreadContainer *)l->data;
+		if (! c->parent) {
+			c->next = root.child;
+			root.child = c;
+		}
+	}
+
+	_thread_prune(&root, TRUE);
+	_thread_group_subjects(&build, &root);
+	_thread_sort(&root);
+
+	threads = g_string_new("");
+	_thread_print(&root, threads);
+
+	_thread_index_release(build.index);
+	g_hash_table_destroy(build.ids);
+	g_list_free_full(build.containers, g_free);
+
+	if (threads->len)
+		res = g_string_free(threads, FALSE);
+	else
+		g_string_free(threads, TRUE);
+
+	return res;
+}
+
+struct found_modseq {
+	GTree *msginfo;
+	uint64_t maxseq;
+};
+
+static gboolean _found_maxseq(uint64_t *uid, gpointer value UNUSED, struct found_modseq *data) {
+	MessageInfo *info = g_tree_lookup(data->msginfo, uid);
+
+	if (info)
+		data->maxseq = max(data->maxseq, info->seq);
+	return FALSE;
+}
+
+/* highest modseq of the messages in the search result */
+static uint64_t _found_modseq(DbmailMailbox *self) {
+	struct found_modseq data;
+
+	data.msginfo = MailboxState_getMsginfo(self->mbstate);
+	data.maxseq = 0;
+	_found_foreach(self, (GTraverseFunc) _found_maxseq, &data);
+
+	return data.maxseq;
+}
+
+/*
+ * Returns imap modseq response for a user's mailbox
+ * 
+ * This function came from and is used with dbmail_mailbox_ids_as_string
+ */
+char * dbmail_mailbox_imap_modseq_as_string(DbmailMailbox *self, gboolean uid UNUSED) {
+	TRACE(TRACE_DEBUG, "Call: dbmail_mailbox_imap_modseq_as_string");
+	GString *t;
+
+	if (! _ranges_count(self->found)) {
+		TRACE(TRACE_DEBUG, "no ids found");
+		return NULL;
+	}
 
 	t = g_string_new("");
 	if (self->modseq)
-		g_string_append_printf(t, " (MODSEQ %" PRIu64 ")", maxseq);
+		g_string_append_printf(t, " (MODSEQ %" PRIu64 ")", _found_modseq(self));
 
-	s = t->str;
-	g_string_free(t, FALSE);
+	return g_strchomp(g_string_free(t, FALSE));
+}
 
-	return g_strchomp(s);
+struct ids_string {
+	GString *t;
+	gboolean uid;
+	const char *sep;
+};
 
+static gboolean _ids_append(uint64_t *uid, uint64_t *msn, struct ids_string *ids) {
+	if (ids->t->len)
+		g_string_append(ids->t, ids->sep);
+	g_string_append_printf(ids->t, "%" PRIu64, ids->uid ? *uid : *msn);
+	return FALSE;
 }
 
 /*
@@ -470,54 +1228,21 @@ char * dbmail_mailbox_ids_as_string(
 		const char *sep
 	) {
 	TRACE(TRACE_DEBUG, "Call: dbmail_mailbox_ids_as_string");
-	GString *t;
-	gchar *s = NULL;
-	GList *l = NULL;
-	GTree *msginfo;
-	GTree *msn;
-	uint64_t maxseq = 0;
+	struct ids_string ids;
+	uint64_t count = _ranges_count(self->found);
 
-	if ((self->found == NULL) || g_tree_nnodes(self->found) <= 0) {
+	if (! count) {
 		TRACE(TRACE_DEBUG, "no ids found");
-		return s;
-	}
-
-	t = g_string_new("");
-	if (uid || dbmail_mailbox_get_uid(self)) {
-		l = g_tree_keys(self->found);
-	} else {
-		l = g_tree_values(self->found);
-	}
-
-	msginfo = MailboxState_getMsginfo(self->mbstate);
-	msn = MailboxState_getMsn(self->mbstate);
-
-	while (l->data) {
-		uint64_t *key = (uint64_t *) l->data;
-		if (self->modseq) {
-			uint64_t *id;
-			if (uid || dbmail_mailbox_get_uid(self)) {
-				id = key;
-			} else {
-				id = g_tree_lookup(msn, key);
-			}
-
-			MessageInfo *info = g_tree_lookup(msginfo, id);
-			maxseq = max(maxseq, info->seq);
-		}
-		g_string_append_printf(t, "%" PRIu64 "", *key);
-		if (!g_list_next(l))
-			break;
-		g_string_append_printf(t, "%s", sep);
-		l = g_list_next(l);
+		return NULL;
 	}
 
-	l = g_list_first(l);
-	g_list_free(l);
+	ids.t = g_string_sized_new(count * 8);
+	ids.uid = uid || dbmail_mailbox_get_uid(self);
+	ids.sep = sep;
 
-	s = g_string_free(t, FALSE);
+	_found_foreach(self, (GTraverseFunc) _ids_append, &ids);
 
-	return g_strchomp(s);
+	return g_strchomp(g_string_free(ids.t, FALSE));
 }
 
 char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self) {
@@ -525,7 +1250,7 @@ char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self) {
 	gchar *s = NULL;
 	GList *l = NULL;
 	gboolean uid;
-	uint64_t *msn;
+	uint64_t id;
 
 	l = g_list_first(self->sorted);
 	if (!(g_list_length(l) > 0))
@@ -535,12 +1260,12 @@ char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self) {
 	uid = dbmail_mailbox_get_uid(self);
 
 	while (l->data) {
-		msn = g_tree_lookup(self->found, l->data);
-		if (msn) {
+		id = *(uint64_t *) l->data;
+		if (_ranges_contains(self->found, id)) {
 			if (uid)
-				g_string_append_printf(t, "%" PRIu64 " ", *(uint64_t *) l->data);
+				g_string_append_printf(t, "%" PRIu64 " ", id);
 			else
-				g_string_append_printf(t, "%" PRIu64 " ", *(uint64_t *) msn);
+				g_string_append_printf(t, "%" PRIu64 " ", _found_msn(self, id));
 		}
 		if (!g_list_next(l))
 			break;
@@ -553,6 +1278,230 @@ char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self) {
 	return g_strchomp(s);
 }
 
+static void _append_range(GString *t, uint64_t first, uint64_t last) {
+	if (last > first)
+		g_string_append_printf(t, "%" PRIu64 ":%" PRIu64, first, last);
+	else
+		g_string_append_printf(t, "%" PRIu64, first);
+}
+
+/* append ids as a sequence-set, collapsing ascending runs */
+static void _append_sequence_set(GString *t, const uint64_t *ids, guint len) {
+	guint i, j;
+
+	for (i = 0; i < len; i = j + 1) {
+		for (j = i; (j + 1 < len) && (ids[j + 1] == ids[j] + 1); j++);
+		if (i)
+			g_string_append_c(t, ',');
+		_append_range(t, ids[i], ids[j]);
+	}
+}
+
+/*
+ * append the items at positions first to last (counting from 1)
+ * of a run-length set as a sequence-set
+ */
+static void _append_ranges(GString *t, GArray *ranges, int64_t first, int64_t last) {
+	int64_t pos = 1;
+	gboolean sep = FALSE;
+	guint i;
+
+	for (i = 0; (i < ranges->len) && (pos <= last); i++) {
+		IdRange *r = &g_array_index(ranges, IdRange, i);
+		int64_t size = r->last - r->first + 1;
+		int64_t from = max(first, pos), to = min(last, pos + size - 1);
+
+		if (from <= to) {
+			if (sep)
+				g_string_append_c(t, ',');
+			_append_range(t, r->first + (from - pos), r->first + (to - pos));
+			sep = TRUE;
+		}
+		pos += size;
+	}
+}
+
+/* the search result as ascending runs of uids or message numbers */
+static GArray * _found_ranges(DbmailMailbox *self, gboolean uid) {
+	GArray *ranges;
+	guint i;
+
+	if (uid)
+		return _ranges_copy(self->found);
+
+	ranges = _ranges_new();
+	for (i = 0; self->found && i < self->found->len; i++) {
+		IdRange *r = &g_array_index(self->found, IdRange, i);
+		uint64_t msn = _found_msn(self, r->first);
+		_ranges_append(ranges, msn, msn + (r->last - r->first));
+	}
+
+	return ranges;
+}
+
+/* resolve the PARTIAL range against a result of len items */
+static gboolean _partial_window(DbmailMailbox *self, int64_t len, int64_t *first, int64_t *last) {
+	int64_t f = self->partial_first, l = self->partial_last;
+
+	if (f < 0) {
+		/* counted from the end of the result */
+		int64_t from = len + l + 1;
+		l = len + f + 1;
+		f = from;
+	}
+	*first = max(f, 1);
+	*last = min(l, len);
+
+	return (*first <= *last);
+}
+
+/*
+ * RFC 5267 ESORT result data for the sorted search result,
+ * with RFC 9394 PARTIAL windowing.
+ */
+char * dbmail_mailbox_esort_as_string(DbmailMailbox *self) {
+	GString *t;
+	GArray *ids;
+	GList *l;
+	uint64_t id;
+	gboolean uid = dbmail_mailbox_get_uid(self);
+	int options = self->result_options;
+	int64_t first, last;
+
+	ids = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	for (l = g_list_first(self->sorted); l; l = g_list_next(l)) {
+		id = *(uint64_t *) l->data;
+		if (! _ranges_contains(self->found, id))
+			continue;
+		if (! uid)
+			id = _found_msn(self, id);
+		g_array_append_val(ids, id);
+	}
+
+	t = g_string_new("");
+	if ((options & SEARCH_RETURN_MIN) && ids->len)
+		g_string_append_printf(t, " MIN %" PRIu64, g_array_index(ids, uint64_t, 0));
+	if ((options & SEARCH_RETURN_MAX) && ids->len)
+		g_string_append_printf(t, " MAX %" PRIu64, g_array_index(ids, uint64_t, ids->len - 1));
+	if ((options & SEARCH_RETURN_ALL) && ids->len) {
+		g_string_append(t, " ALL ");
+		_append_sequence_set(t, (uint64_t *) ids->data, ids->len);
+	}
+	if (options & SEARCH_RETURN_COUNT)
+		g_string_append_printf(t, " COUNT %u", ids->len);
+	if (options & SEARCH_RETURN_PARTIAL) {
+		g_string_append_printf(t, " PARTIAL (%" PRId64 ":%" PRId64 " ",
+				self->partial_first, self->partial_last);
+		if (_partial_window(self, ids->len, &first, &last))
+			_append_sequence_set(t, &g_array_index(ids, uint64_t, first - 1), last - first + 1);
+		else
+			g_string_append(t, "NIL");
+		g_string_append_c(t, ')');
+	}
+
+	g_array_free(ids, TRUE);
+
+	return g_strstrip(g_string_free(t, FALSE));
+}
+
+/*
+ * RFC 4731 ESEARCH result data for the search result. The result
+ * is encoded from runs of consecutive ids, so large results
+ * collapse into a short sequence-set.
+ */
+char * dbmail_mailbox_esearch_as_string(DbmailMailbox *self) {
+	GString *t;
+	GArray *ranges;
+	gboolean uid = dbmail_mailbox_get_uid(self);
+	int options = self->result_options;
+	int64_t count, first, last;
+
+	count = _ranges_count(self->found);
+	ranges = _found_ranges(self, uid);
+
+	t = g_string_new("");
+	if ((options & SEARCH_RETURN_MIN) && count)
+		g_string_append_printf(t, " MIN %" PRIu64, g_array_index(ranges, IdRange, 0).first);
+	if ((options & SEARCH_RETURN_MAX) && count)
+		g_string_append_printf(t, " MAX %" PRIu64, g_array_index(ranges, IdRange, ranges->len - 1).last);
+	if ((options & SEARCH_RETURN_ALL) && count) {
+		g_string_append(t, " ALL ");
+		_append_ranges(t, ranges, 1, count);
+	}
+	if (options & SEARCH_RETURN_COUNT)
+		g_string_append_printf(t, " COUNT %" PRId64, count);
+	if (options & SEARCH_RETURN_PARTIAL) {
+		g_string_append_printf(t, " PARTIAL (%" PRId64 ":%" PRId64 " ",
+				self->partial_first, self->partial_last);
+		if (_partial_window(self, count, &first, &last))
+			_append_ranges(t, ranges, first, last);
+		else
+			g_string_append(t, "NIL");
+		g_string_append_c(t, ')');
+	}
+	if (self->modseq && count && (options & ~SEARCH_RETURN_SAVE))
+		g_string_append_printf(t, " MODSEQ %" PRIu64, _found_modseq(self));
+
+	g_array_free(ranges, TRUE);
+
+	return g_strstrip(g_string_free(t, FALSE));
+}
+
+/*
+ * RFC 5182 SEARCHRES: keep the result of a SEARCH or SORT with
+ * RETURN (SAVE) as runs of uids, for use as "$" in later commands.
+ * If only MIN and/or MAX accompany SAVE, only those are kept.
+ */
+void dbmail_mailbox_save_result(DbmailMailbox *self) {
+	int options = self->result_options;
+	GArray *ranges;
+	GList *l, *lowest = NULL, *highest = NULL;
+	uint64_t low, high, keep[2];
+	int i, n;
+
+	ranges = _found_ranges(self, TRUE);
+
+	if ((options & (SEARCH_RETURN_MIN | SEARCH_RETURN_MAX)) &&
+			! (options & (SEARCH_RETURN_ALL | SEARCH_RETURN_COUNT | SEARCH_RETURN_PARTIAL)) &&
+			ranges->len) {
+		low = g_array_index(ranges, IdRange, 0).first;
+		high = g_array_index(ranges, IdRange, ranges->len - 1).last;
+
+		/* a sorted result has its own notion of first and last */
+		for (l = g_list_first(self->sorted); l; l = g_list_next(l)) {
+			if (! _ranges_contains(self->found, *(uint64_t *) l->data))
+				continue;
+			if (! lowest)
+				lowest = l;
+			highest = l;
+		}
+		if (lowest) {
+			low = *(uint64_t *) lowest->data;
+			high = *(uint64_t *) highest->data;
+		}
+
+		n = 0;
+		if (options & SEARCH_RETURN_MIN)
+			keep[n++] = low;
+		if ((options & SEARCH_RETURN_MAX) && ! (n && (high == low)))
+			keep[n++] = high;
+		if ((n == 2) && (keep[0] > keep[1])) {
+			keep[0] = high;
+			keep[1] = low;
+		}
+
+		g_array_set_size(ranges, 0);
+		for (i = 0; i < n; i++)
+			_ranges_add(ranges, keep[i]);
+	}
+
+	if (self->saved)
+		g_array_free(self->saved, TRUE);
+	self->saved = ranges;
+
+	TRACE(TRACE_DEBUG, "saved [%u] ranges", ranges->len);
+}
+
 /* imap sorted search */
 static int append_search(DbmailMailbox *self, search_key *value, gboolean descend) {
 	GNode *n;
@@ -573,20 +1522,15 @@ static int append_search(DbmailMailbox *self, search_key *value, gboolean descen
 	return 0;
 }
 
-#define BUFSIZE 255
-
-static void _append_join(char *join, char *table) {
-	char tmp[BUFSIZE + 1];
-	memset(tmp, 0, sizeof (tmp));
-	g_snprintf(tmp, BUFSIZE, "LEFT JOIN %s%s ON m.physmessage_id=%s%s.physmessage_id ", DBPFX, table, DBPFX, table);
-	g_strlcat(join, tmp, MAX_SEARCH_LEN);
-}
-
-static void _append_sort(char *order, char *field, gboolean reverse) {
-	char tmp[BUFSIZE + 1];
-	memset(tmp, 0, sizeof (tmp));
-	g_snprintf(tmp, BUFSIZE, "%s%s,", field, reverse ? " DESC" : "");
-	g_strlcat(order, tmp, MAX_SEARCH_LEN);
+static void _append_sort(search_key *value, sort_key key, gboolean reverse) {
+	int i;
+	for (i = 0; i < MAX_SORT_KEYS; i++) {
+		if (value->sort[i])
+			continue;
+		value->sort[i] = reverse ? -key : key;
+		return;
+	}
+	TRACE(TRACE_INFO, "too many sort criteria, ignoring [%d]", key);
 }
 
 static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_key *value, uint64_t *idx) {
@@ -606,30 +1550,25 @@ static int _handle_sort_args(DbmailMailbox *self, String_T *search_keys, search_
 	}
 
 	if (MATCH(key, "arrival")) {
-		_append_sort(value->order, "internal_date", reverse);
+		_append_sort(value, SORT_ARRIVAL, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "size")) {
-		_append_sort(value->order, "messagesize", reverse);
+		_append_sort(value, SORT_SIZE, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "from")) {
-		_append_join(value->table, "fromfield");
-		_append_sort(value->order, "fromfield", reverse);
+		_append_sort(value, SORT_FROM, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "subject")) {
-		_append_join(value->table, "subjectfield");
-		_append_sort(value->order, "sortfield", reverse);
+		_append_sort(value, SORT_SUBJECT, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "cc")) {
-		_append_join(value->table, "ccfield");
-		_append_sort(value->order, "ccfield", reverse);
+		_append_sort(value, SORT_CC, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "to")) {
-		_append_join(value->table, "tofield");
-		_append_sort(value->order, "tofield", reverse);
+		_append_sort(value, SORT_TO, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "date")) {
-		_append_join(value->table, "datefield");
-		_append_sort(value->order, "sortfield", reverse);
+		_append_sort(value, SORT_DATE, reverse);
 		(*idx)++;
 	} else if (MATCH(key, "("))
 		(*idx)++;
@@ -661,6 +1600,68 @@ static void pop_search(DbmailMailbox *self) {
 		self->search = self->search->parent;
 }
 
+#define FLAG_BIT(f) (1 << IMAP_FLAG_##f)
+
+static const struct {
+	const char *key;
+	int set;
+	int clear;
+} flag_search_keys[] = {
+	{ "answered",	FLAG_BIT(ANSWERED),	0 },
+	{ "deleted",	FLAG_BIT(DELETED),	0 },
+	{ "flagged",	FLAG_BIT(FLAGGED),	0 },
+	{ "recent",	FLAG_BIT(RECENT),	0 },
+	{ "seen",	FLAG_BIT(SEEN),		0 },
+	{ "draft",	FLAG_BIT(DRAFT),	0 },
+	{ "new",	FLAG_BIT(RECENT),	FLAG_BIT(SEEN) },
+	{ "old",	0,			FLAG_BIT(RECENT) },
+	{ "unanswered",	0,			FLAG_BIT(ANSWERED) },
+	{ "undeleted",	0,			FLAG_BIT(DELETED) },
+	{ "unflagged",	0,			FLAG_BIT(FLAGGED) },
+	{ "unseen",	0,			FLAG_BIT(SEEN) },
+	{ "undraft",	0,			FLAG_BIT(DRAFT) },
+	{ NULL, 0, 0 }
+};
+
+/* FLAG search keys are matched against the flags in the mailbox state */
+static gboolean _handle_flag_search(search_key *value, const char *key, gboolean negate) {
+	int i;
+	for (i = 0; flag_search_keys[i].key; i++) {
+		if (! MATCH(key, flag_search_keys[i].key))
+			continue;
+		value->type = IST_FLAG;
+		value->flags_set = flag_search_keys[i].set;
+		value->flags_clear = flag_search_keys[i].clear;
+		value->reverse = negate;
+		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "%s%s", negate ? "not " : "", key);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void _next_day(const char *sqldate, char *next) {
+	struct tm tm;
+	memset(&tm, 0, sizeof(struct tm));
+	if (sscanf(sqldate, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) != 3)
+		return;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	tm.tm_mday++;
+	tm.tm_isdst = -1;
+	mktime(&tm);
+	strftime(next, SQL_INTERNALDATE_LEN - 1, "%Y-%m-%d 00:00:00", &tm);
+}
+
+/* OLDER/YOUNGER: the internal date <seconds> ago */
+static void _within(uint64_t seconds, gboolean younger, char *date) {
+	struct tm tm;
+	time_t t = time(NULL) - (time_t) seconds;
+	if (younger)
+		t++;
+	localtime_r(&t, &tm);
+	strftime(date, SQL_INTERNALDATE_LEN - 1, "%Y-%m-%d %H:%M:%S", &tm);
+}
+
 static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint64_t *idx) {
 	int result = 0;
 
@@ -699,71 +1700,8 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 	 * FLAG search keys
 	 */
 
-	else if (MATCH(key, "answered")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "answered_flag=1", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "deleted")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "deleted_flag=1", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "flagged")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "flagged_flag=1", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "recent")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "seen")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "seen_flag=1", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "draft")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "draft_flag=1", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "new")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "(seen_flag=0 AND recent_flag=1)", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "old")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "unanswered")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "undeleted")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "unflagged")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "unseen")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN - 1);
-		(*idx)++;
-
-	} else if (MATCH(key, "undraft")) {
-		value->type = IST_FLAG;
-		strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN - 1);
+	else if (_handle_flag_search(value, key, FALSE)) {
 		(*idx)++;
-
 	}
 #define IMAP_SET_SEARCH  (*idx)++; \
 		if ((p = dbmail_iconv_str_to_db(p_string_str(search_keys[*idx]), self->charset)) == NULL) {  \
@@ -862,20 +1800,21 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		value->type = IST_IDATE;
 		(*idx)++;
 		date_imap2sql(p_string_str(search_keys[*idx]), s);
-		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "p.internal_date < '%s'", s);
+		g_strlcpy(value->date_high, s, SQL_INTERNALDATE_LEN);
+		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "internal_date < '%s'", s);
 		(*idx)++;
 
 	} else if (MATCH(key, "on")) {
-		char s[SQL_INTERNALDATE_LEN], d[MIME_FIELD_MAX];
+		char s[SQL_INTERNALDATE_LEN];
 		memset(s, 0, sizeof (s));
-		memset(d, 0, sizeof (d));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		RETURN_IF_FAIL(check_date(p_string_str(search_keys[*idx + 1])), -1);
 		value->type = IST_IDATE;
 		(*idx)++;
 		date_imap2sql(p_string_str(search_keys[*idx]), s);
-		g_snprintf(d, MIME_FIELD_MAX - 1, db_get_sql(SQL_TO_DATE), "p.internal_date");
-		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "%s = '%s'", d, s);
+		g_strlcpy(value->date_low, s, SQL_INTERNALDATE_LEN);
+		_next_day(s, value->date_high);
+		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "internal_date = '%s'", s);
 		(*idx)++;
 
 	} else if (MATCH(key, "since")) {
@@ -886,13 +1825,12 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		value->type = IST_IDATE;
 		(*idx)++;
 		date_imap2sql(p_string_str(search_keys[*idx]), s);
-		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "p.internal_date > '%s'", s);
+		g_strlcpy(value->date_low, s, SQL_INTERNALDATE_LEN);
+		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "internal_date >= '%s'", s);
 		(*idx)++;
 
 	} else if (MATCH(key, "older")) {
 		uint64_t seconds;
-		char partial[DEF_FRAGSIZE];
-		memset(partial, 0, sizeof (partial));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		errno = 0;
 		seconds = dm_strtoull(p_string_str(search_keys[*idx + 1]), NULL, 10);
@@ -903,14 +1841,12 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		}
 		value->type = IST_IDATE;
 		(*idx)++;
-		g_snprintf(partial, DEF_FRAGSIZE - 1, db_get_sql(SQL_WITHIN), seconds);
-		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "p.internal_date < %s", partial);
+		_within(seconds, FALSE, value->date_high);
+		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "internal_date < '%s'", value->date_high);
 		(*idx)++;
 
 	} else if (MATCH(key, "younger")) {
 		uint64_t seconds;
-		char partial[DEF_FRAGSIZE];
-		memset(partial, 0, sizeof (partial));
 		RETURN_IF_FAIL(search_keys[*idx + 1], -1);
 		errno = 0;
 		seconds = dm_strtoull(p_string_str(search_keys[*idx + 1]), NULL, 10);
@@ -921,8 +1857,8 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		}
 		value->type = IST_IDATE;
 		(*idx)++;
-		g_snprintf(partial, DEF_FRAGSIZE - 1, db_get_sql(SQL_WITHIN), seconds);
-		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "p.internal_date > %s", partial);
+		_within(seconds, TRUE, value->date_low);
+		g_snprintf(value->search, MAX_SEARCH_LEN - 1, "internal_date > '%s'", value->date_low);
 		(*idx)++;
 
 	} else if (MATCH(key, "modseq")) {
@@ -992,44 +1928,7 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 
 		nextkey = p_string_str(search_keys[*idx + 1]);
 
-		if (MATCH(nextkey, "answered")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "answered_flag=0", MAX_SEARCH_LEN - 1);
-			(*idx) += 2;
-
-		} else if (MATCH(nextkey, "deleted")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "deleted_flag=0", MAX_SEARCH_LEN - 1);
-			(*idx) += 2;
-
-		} else if (MATCH(nextkey, "flagged")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "flagged_flag=0", MAX_SEARCH_LEN - 1);
-			(*idx) += 2;
-
-		} else if (MATCH(nextkey, "recent")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "recent_flag=0", MAX_SEARCH_LEN - 1);
-			(*idx) += 2;
-
-		} else if (MATCH(nextkey, "seen")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "seen_flag=0", MAX_SEARCH_LEN - 1);
-			(*idx) += 2;
-
-		} else if (MATCH(nextkey, "draft")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "draft_flag=0", MAX_SEARCH_LEN - 1);
-			(*idx) += 2;
-
-		} else if (MATCH(nextkey, "new")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "(seen_flag=1 AND recent_flag=0)", MAX_SEARCH_LEN - 1);
-			(*idx) += 2;
-
-		} else if (MATCH(nextkey, "old")) {
-			value->type = IST_FLAG;
-			strncpy(value->search, "recent_flag=1", MAX_SEARCH_LEN - 1);
+		if (_handle_flag_search(value, nextkey, TRUE)) {
 			(*idx) += 2;
 
 		} else {
@@ -1072,6 +1971,12 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
 		mempool_push(self->pool, value, sizeof (search_key));
 		return 1;
 
+	} else if (MATCH(key, "$")) {
+		/* RFC 5182 saved search result, always uids */
+		value->type = IST_UIDSET;
+		strncpy(value->search, key, MAX_SEARCH_LEN - 1);
+		(*idx)++;
+
 	} else if (check_msg_set(key)) {
 		value->type = IST_SET;
 		strncpy(value->search, key, MAX_SEARCH_LEN - 1);
@@ -1106,6 +2011,74 @@ static int _handle_search_args(DbmailMailbox *self, String_T *search_keys, uint6
  *
  * returns -1 on syntax error, -2 on memory error; 0 on success, 1 if ')' has been encountered
  */
+static int _handle_partial_range(DbmailMailbox *self, const char *range) {
+	int64_t first, last;
+	char *end;
+
+	first = strtoll(range, &end, 10);
+	if (*end != ':')
+		return -1;
+	last = strtoll(end + 1, &end, 10);
+	if (*end || first == 0 || last == 0 || ((first < 0) != (last < 0)))
+		return -1;
+
+	if (llabs(first) > llabs(last)) {
+		int64_t t = first;
+		first = last;
+		last = t;
+	}
+	self->partial_first = first;
+	self->partial_last = last;
+
+	return 0;
+}
+
+/*
+ * RETURN ( [MIN] [MAX] [ALL] [COUNT] [SAVE] [PARTIAL range] )
+ */
+static int _handle_return_args(DbmailMailbox *self, String_T *search_keys, uint64_t *idx) {
+	const char *key;
+
+	(*idx)++;
+	if (! (search_keys[*idx] && MATCH(p_string_str(search_keys[*idx]), "(")))
+		return -1;
+	(*idx)++;
+
+	self->result_options = 0;
+	while (search_keys[*idx] && ! MATCH((key = p_string_str(search_keys[*idx])), ")")) {
+		if (MATCH(key, "min"))
+			self->result_options |= SEARCH_RETURN_MIN;
+		else if (MATCH(key, "max"))
+			self->result_options |= SEARCH_RETURN_MAX;
+		else if (MATCH(key, "all"))
+			self->result_options |= SEARCH_RETURN_ALL;
+		else if (MATCH(key, "count"))
+			self->result_options |= SEARCH_RETURN_COUNT;
+		else if (MATCH(key, "save"))
+			self->result_options |= SEARCH_RETURN_SAVE;
+		else if (MATCH(key, "partial") && search_keys[*idx + 1]) {
+			(*idx)++;
+			if (_handle_partial_range(self, p_string_str(search_keys[*idx])) < 0)
+				return -1;
+			self->result_options |= SEARCH_RETURN_PARTIAL;
+		} else
+			return -1;
+		(*idx)++;
+	}
+
+	if (! search_keys[*idx])
+		return -1;
+	(*idx)++;
+
+	/* RETURN () is the same as RETURN (ALL) */
+	if (! self->result_options)
+		self->result_options = SEARCH_RETURN_ALL;
+
+	TRACE(TRACE_DEBUG, "result options [%d] partial [%" PRId64 ":%" PRId64 "]",
+			self->result_options, self->partial_first, self->partial_last);
+	return 0;
+}
+
 int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys, uint64_t *idx, search_order order) {
 	int result = 0;
 	search_key * value, * s;
@@ -1113,6 +2086,16 @@ int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys,
 	if (!(search_keys && search_keys[*idx]))
 		return 1;
 
+	_search_free(self);
+
+	/* ESEARCH/ESORT result options */
+	self->result_options = 0;
+	if ((order == SEARCH_SORTED || order == SEARCH_UNORDERED) &&
+			MATCH(p_string_str(search_keys[*idx]), "return")) {
+		if (_handle_return_args(self, search_keys, idx) < 0)
+			return -1;
+	}
+
 	/* default initial key for ANDing */
 	value = mempool_pop(self->pool, sizeof (search_key));
 	value->type = IST_SET;
@@ -1158,22 +2141,76 @@ int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys,
 
 	}
 
-	/* SEARCH */
-	while (search_keys[*idx] && ((result = _handle_search_args(self, search_keys, idx)) == 0));
+	/* SEARCH */
+	while (search_keys[*idx] && ((result = _handle_search_args(self, search_keys, idx)) == 0));
+
+	TRACE(TRACE_DEBUG, "done [%d] at idx [%" PRIu64 "]", result, *idx);
+	return result;
+}
+
+struct sort_ctx {
+	GTree *sortinfo;
+	int *keys;
+};
+
+static const SortInfo empty_sortinfo;
+
+#define SORTFIELD(s) ((s) ? (s) : "")
+
+static gint _sort_compare(const uint64_t *a, const uint64_t *b, struct sort_ctx *ctx) {
+	const SortInfo *x, *y;
+	int i, r = 0;
+
+	if (! (x = g_tree_lookup(ctx->sortinfo, a)))
+		x = &empty_sortinfo;
+	if (! (y = g_tree_lookup(ctx->sortinfo, b)))
+		y = &empty_sortinfo;
+
+	for (i = 0; i < MAX_SORT_KEYS && ctx->keys[i]; i++) {
+		switch (abs(ctx->keys[i])) {
+			case SORT_ARRIVAL:
+				r = strcmp(SORTFIELD(x->arrival), SORTFIELD(y->arrival));
+				break;
+			case SORT_DATE:
+				/* messages without a Date header sort by arrival */
+				r = strcmp(SORTFIELD(x->date ? x->date : x->arrival),
+						SORTFIELD(y->date ? y->date : y->arrival));
+				break;
+			case SORT_SIZE:
+				r = (x->rfcsize > y->rfcsize) - (x->rfcsize < y->rfcsize);
+				break;
+			case SORT_FROM:
+				r = g_ascii_strcasecmp(SORTFIELD(x->from), SORTFIELD(y->from));
+				break;
+			case SORT_TO:
+				r = g_ascii_strcasecmp(SORTFIELD(x->to), SORTFIELD(y->to));
+				break;
+			case SORT_CC:
+				r = g_ascii_strcasecmp(SORTFIELD(x->cc), SORTFIELD(y->cc));
+				break;
+			case SORT_SUBJECT:
+				r = strcmp(SORTFIELD(x->subject), SORTFIELD(y->subject));
+				break;
+		}
+		if (r)
+			return ctx->keys[i] < 0 ? -r : r;
+	}
+
+	/* ties are broken by mailbox order */
+	return ucmp(a, b);
+}
 
-	TRACE(TRACE_DEBUG, "done [%d] at idx [%" PRIu64 "]", result, *idx);
-	return result;
+static gboolean _sort_collect(uint64_t *uid, gpointer value UNUSED, GList **sorted) {
+	uint64_t *id = g_new0(uint64_t, 1);
+	*id = *uid;
+	*sorted = g_list_prepend(*sorted, id);
+	return FALSE;
 }
 
 static gboolean _do_sort(GNode *node, DbmailMailbox *self) {
 	TRACE(TRACE_DEBUG, "Call: _do_sort");
-	GString *q;
-	uint64_t tid, *id;
-	Connection_T c;
-	ResultSet_T r;
-	volatile int t = FALSE;
 	search_key *s = (search_key *) node->data;
-	GTree *z;
+	struct sort_ctx ctx;
 
 	TRACE(TRACE_DEBUG, "type [%d]", s->type);
 
@@ -1181,57 +2218,29 @@ static gboolean _do_sort(GNode *node, DbmailMailbox *self) {
 
 	if (s->searched) return FALSE;
 
-	q = g_string_new("");
-	g_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-		"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
-		"%s"
-		"WHERE m.mailbox_idnr = %" PRIu64 " AND m.status < %d "
-		"ORDER BY %smessage_idnr", DBPFX, DBPFX, s->table,
-		dbmail_mailbox_get_id(self), MESSAGE_STATUS_DELETE, s->order);
-
-	if (self->sorted) {
-		g_list_destroy(self->sorted);
-		self->sorted = NULL;
-	}
-
-	z = g_tree_new((GCompareFunc) ucmp);
+	if (self->sorted)
+		g_list_free_full(g_steal_pointer (&self->sorted), g_free);
 
-	c = db_con_get();
-	TRY
-	r = db_query(c, q->str);
-	while (db_result_next(r)) {
-		tid = db_result_get_u64(r, 0);
-		if (g_tree_lookup(self->found, &tid) && (!g_tree_lookup(z, &tid))) {
-			id = g_new0(uint64_t, 1);
-			*id = tid;
-			g_tree_insert(z, id, id);
-			self->sorted = g_list_prepend(self->sorted, id);
-		}
-	}
-	CATCH(SQLException)
-	LOG_SQLERROR;
-	t = DM_EQUERY;
-	FINALLY
-	db_con_close(c);
-	g_tree_destroy(z);
-	END_TRY;
+	if (! self->mbstate)
+		dbmail_mailbox_open(self);
 
-	if (t == DM_EQUERY) return TRUE;
+	/* sort keys are cached on the mailbox state; only new messages hit the database */
+	if (! (ctx.sortinfo = MailboxState_getSortinfo(self->mbstate)))
+		return TRUE;
+	ctx.keys = s->sort;
 
-	self->sorted = g_list_reverse(self->sorted);
+	_found_foreach(self, (GTraverseFunc) _sort_collect, &self->sorted);
 
-	g_string_free(q, TRUE);
+	self->sorted = g_list_sort_with_data(self->sorted, (GCompareDataFunc) _sort_compare, &ctx);
 
 	s->searched = TRUE;
 
 	return FALSE;
 }
 
-static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
+static GArray * mailbox_search(DbmailMailbox *self, search_key *s) {
 	TRACE(TRACE_DEBUG, "Call: mailbox_search");
-	uint64_t *k, *v, *w;
 	uint64_t id;
-	char gt_lt = 0;
 	const char *op;
 	char partial[DEF_FRAGSIZE];
 	Connection_T c;
@@ -1239,22 +2248,11 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 	PreparedStatement_T st = NULL;
 	GTree *ids;
 	volatile char *inset = NULL;
-	/* helper for some operations in TREE mode search */
-	char *cond = NULL;
-	cond = malloc(30);
-	memset(cond, 0, 30);
-	int searchPerformed = 0;
-	/* if the query will be performed in sql mode */
-	int sql;
-	sql = 1;
 
 	GString *t;
 	String_T q;
 
-	int mailbox_search_strategy = config_get_value_default_int("mailbox_search_strategy", "IMAP", 1);
-	TRACE(TRACE_DEBUG, "mailbox_search_strategy %d", mailbox_search_strategy);
-
-	if (self->found && g_tree_nnodes(self->found) <= 200) {
+	if (_ranges_count(self->found) <= 200) {
 		char *setlist = dbmail_mailbox_ids_as_string(self, TRUE, ",");
 		if (setlist) {
 			inset = g_strdup_printf("AND m.message_idnr IN (%s)", setlist);
@@ -1262,21 +2260,21 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 		}
 	}
 
-	c = db_con_get();
+	c = db_con_get_read(self->id, self->mbstate ? MailboxState_getSeq(self->mbstate) : 0);
 	t = g_string_new("");
 	q = p_string_new(self->pool, "");
-	s->found = g_tree_new_full((GCompareDataFunc) ucmpdata, NULL, (GDestroyNotify) uint64_free, (GDestroyNotify) uint64_free);
-
+	/* every query is ordered by message_idnr, so the runs are
+	 * built straight from the result rows */
+	s->found = _ranges_new();
 
 
 	TRY
-		/* this searches cannot be made via state */
+		/* these searches cannot be made via state */
 	switch (s->type) {
 		case IST_HDRDATE_ON:
 		case IST_HDRDATE_SINCE:
 		case IST_HDRDATE_BEFORE:
 		{
-			searchPerformed = 1;
 			char qs[DEF_FRAGSIZE];
 			char field[DEF_FRAGSIZE];
 			char d[SQL_INTERNALDATE_LEN];
@@ -1318,7 +2316,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 			break;
 
 		case IST_HDR:
-			searchPerformed = 1;
 			TRACE(TRACE_DEBUG, "IST_HDR sql");
 			p_string_printf(q, "SELECT message_idnr FROM %smessages m "
 				"LEFT JOIN %sheader h USING (physmessage_id) "
@@ -1343,7 +2340,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 			break;
 
 		case IST_DATA_TEXT:
-			searchPerformed = 1;
 			TRACE(TRACE_DEBUG, "IST_DATA_TEXT sql");
 			p_string_printf(q, "SELECT DISTINCT m.message_idnr "
 				"FROM %smimeparts k "
@@ -1374,7 +2370,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 			break;
 
 		case IST_DATA_BODY:
-			searchPerformed = 1;
 			TRACE(TRACE_DEBUG, "IST_DATA_BODY sql %s", t->str);
 			g_string_printf(t, db_get_sql(SQL_ENCODE_ESCAPE), "p.data");
 			p_string_printf(q, "SELECT DISTINCT m.message_idnr FROM %smimeparts p "
@@ -1403,358 +2398,24 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 
 			break;
 
-		case IST_KEYWORD:
-		case IST_UNKEYWORD:
-			searchPerformed = 1;
-			TRACE(TRACE_DEBUG, "IST_KEYWORD/IST_UNKEYWORD sql %s", s->search);
-			p_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-				"JOIN %skeywords k ON m.message_idnr=k.message_idnr "
-				"WHERE mailbox_idnr=? AND status < ? "
-				"%s "
-				"AND k.keyword = ? ORDER BY message_idnr",
-				DBPFX, DBPFX,
-				inset ? inset : "");
-
-			st = db_stmt_prepare(c, p_string_str(q));
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
-			db_stmt_set_str(st, 3, s->search);
-			break;
-	}
-
-
-	if (searchPerformed == 0 && mailbox_search_strategy == 1) {
-		/* general queries have not been executed and strategy is sql */
-		switch (s->type) {
-			case IST_IDATE:
-				TRACE(TRACE_DEBUG, "IST_IDATE sql %s", s->search);
-				/* implemented search by state, avoiding queries in DB */
-				p_string_printf(q, "SELECT message_idnr FROM %smessages m "
-					"LEFT JOIN %sphysmessage p ON m.physmessage_id=p.id "
-					"WHERE mailbox_idnr = ? AND status < ? "
-					"%s "
-					"AND %s "
-					"ORDER BY message_idnr",
-					DBPFX, DBPFX,
-					inset ? inset : "",
-					s->search);
-
-				st = db_stmt_prepare(c, p_string_str(q));
-				db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-				db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
-
-				break;
-			case IST_SIZE_LARGER:
-				searchPerformed = 1;
-				gt_lt = '>';
-				// fallthrough
-
-			case IST_SIZE_SMALLER:
-				if (!gt_lt) gt_lt = '<';
-				TRACE(TRACE_DEBUG, "IST_SIZE_SMALLER/IST_SIZE_LARGER sql %ld", s->size);
-				p_string_printf(q, "SELECT m.message_idnr FROM %smessages m "
-					"LEFT JOIN %sphysmessage p ON m.physmessage_id = p.id "
-					"WHERE m.mailbox_idnr = ? AND m.status < ? "
-					"%s "
-					"AND p.rfcsize %c ? "
-					"ORDER BY message_idnr",
-					DBPFX, DBPFX,
-					inset ? inset : "",
-					gt_lt);
-
-				st = db_stmt_prepare(c, p_string_str(q));
-				db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-				db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
-				db_stmt_set_u64(st, 3, s->size);
-
-				break;
-
-
-			default:
-				TRACE(TRACE_DEBUG, "IST* sql %s", s->search);
-				/* other searches */
-				p_string_printf(q, "SELECT message_idnr FROM %smessages "
-					"WHERE mailbox_idnr = ? AND status < ? AND %s "
-					"ORDER BY message_idnr", DBPFX,
-					s->search); // FIXME: Sometimes s->search is ""
-
-				st = db_stmt_prepare(c, p_string_str(q));
-				db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-				db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
-		}
 	}
-	if (searchPerformed == 0 && mailbox_search_strategy == 2) {
-		int IST_MBS_COND = 0;
-		/* general queries have not been executed and strategy is tree/state */
-		/* handle old default case, we need to test it the hard way */
-		if (strcmp(s->search, "answered_flag=1") == 0) {
-			TRACE(TRACE_DEBUG, "IST* answered_flag=1");
-			sql = 0;
-			IST_MBS_COND = 1;
-		}
-		if (strcmp(s->search, "deleted_flag=1") == 0) {
-			TRACE(TRACE_DEBUG, "IST* deleted_flag=1");
-			sql = 0;
-			IST_MBS_COND = 2;
-		}
-		if (strcmp(s->search, "flagged_flag=1") == 0) {
-			TRACE(TRACE_DEBUG, "IST* flagged_flag=1");
-			sql = 0;
-			IST_MBS_COND = 3;
-		}
-		if (strcmp(s->search, "recent_flag=1") == 0) {
-			TRACE(TRACE_DEBUG, "IST* recent_flag=1");
-			sql = 0;
-			IST_MBS_COND = 4;
-		}
-		if (strcmp(s->search, "seen_flag=1") == 0) {
-			TRACE(TRACE_DEBUG, "IST* seen_flag=1");
-			sql = 0;
-			IST_MBS_COND = 5;
-		}
-		if (strcmp(s->search, "draft_flag=1") == 0) {
-			TRACE(TRACE_DEBUG, "IST* draft_flag=1");
-			sql = 0;
-			IST_MBS_COND = 6;
-		}
-		if (strcmp(s->search, "(seen_flag=0 AND recent_flag=1)") == 0) {
-			TRACE(TRACE_DEBUG, "IST* (seen_flag=0 AND recent_flag=1)");
-			sql = 0;
-			IST_MBS_COND = 7;
-		}
-		if (strcmp(s->search, "recent_flag=0") == 0) {
-			TRACE(TRACE_DEBUG, "IST* recent_flag=1");
-			sql = 0;
-			IST_MBS_COND = 8;
-		}
-		if (strcmp(s->search, "answered_flag=0") == 0) {
-			TRACE(TRACE_DEBUG, "IST* answered_flag=1");
-			sql = 0;
-			IST_MBS_COND = 9;
-		}
-		if (strcmp(s->search, "deleted_flag=0") == 0) {
-			TRACE(TRACE_DEBUG, "IST* deleted_flag=1");
-			sql = 0;
-			IST_MBS_COND = 10;
-		}
-		if (strcmp(s->search, "flagged_flag=0") == 0) {
-			TRACE(TRACE_DEBUG, "IST* flagged_flag=1");
-			sql = 0;
-			IST_MBS_COND = 11;
-		}
-		if (strcmp(s->search, "seen_flag=0") == 0) {
-			TRACE(TRACE_DEBUG, "IST* seen_flag=1");
-			sql = 0;
-			IST_MBS_COND = 12;
-		}
-		if (strcmp(s->search, "draft_flag=0") == 0) {
-			TRACE(TRACE_DEBUG, "IST* draft_flag=1");
-			sql = 0;
-			IST_MBS_COND = 13;
-		}
-		/* handle IST_DATE */
-		if (strstr(s->search, "p.internal_date")) {
-			/* the equivalent in query is at IST_IDATE, see above */
-			if (strstr(s->search, ">")) {
-				sql = 0;
-				IST_MBS_COND = 14;
-				strcpy(cond, strstr(s->search, ">") + 1);
-				TRACE(TRACE_DEBUG, "IST_IDATE [>]");
-			}
-			if (strstr(s->search, "=")) {
-				sql = 0;
-				IST_MBS_COND = 15;
-				strcpy(cond, strstr(s->search, "=") + 1);
-				TRACE(TRACE_DEBUG, "IST_IDATE [=]");
-			}
-			if (strstr(s->search, "<")) {
-				sql = 0;
-				IST_MBS_COND = 16;
-				strcpy(cond, strstr(s->search, "<") + 1);
-				TRACE(TRACE_DEBUG, "IST_IDATE [<]");
-			}
-			if (IST_MBS_COND != 0) {
-				p_trim(cond, " '><="); //trimming, just a safety precaution
-				TRACE(TRACE_DEBUG, "IST_IDATE %s -> %s ", s->search, cond);
-			}
-
-		}
-		if (s->type == IST_SIZE_LARGER) {
-			TRACE(TRACE_DEBUG, "IST_SIZE_LARGER");
-			sql = 0;
-			IST_MBS_COND = 17;
-
-		}
-		if (s->type == IST_SIZE_SMALLER) {
-			TRACE(TRACE_DEBUG, "IST_SIZE_SMALLER");
-			sql = 0;
-			IST_MBS_COND = 18;
-		}		
-		//TRACE(TRACE_DEBUG,"IST_IDATE %s -> %d %d", s->search, sql,IST_MBS_COND);
-		if (sql == 0) {
-			int foundItems = 0;
-			ids = MailboxState_getIds(self->mbstate);
-			GList *uids = g_tree_keys(ids);
-			uids = g_list_first(uids);
-			/* creating another tree by rebuilding it against a condition */
-			/* we shoud have used g_tree_foreach?! may have been faster and more memory efficient */
-			/* @todo  g_tree_foreach */
-			while (uids) {
-				uint64_t id = *(uint64_t *) uids->data;
-				/* no need to check it, is the same list*/
-				/*if (! (w = g_tree_lookup(ids, &id))) {
-					TRACE(TRACE_ERR, "key missing in ids: [%" PRIu64 "]", id);
-					if (! g_list_next(uids)) break;
-					uids = g_list_next(uids);
-					continue;
-				}*/
-				MessageInfo *msginfo = g_tree_lookup(MailboxState_getMsginfo(self->mbstate), &id);
-
-				int found = 0;
-				switch (IST_MBS_COND) {
-					case 1: found = (int) (msginfo->flags[IMAP_FLAG_ANSWERED] == 1);
-						break;
-					case 2: found = (int) (msginfo->flags[IMAP_FLAG_DELETED] == 1);
-						break;
-					case 3: found = (int) (msginfo->flags[IMAP_FLAG_FLAGGED] == 1);
-						break;
-					case 4: found = (int) (msginfo->flags[IMAP_FLAG_RECENT] == 1);
-						break;
-					case 5: found = (int) (msginfo->flags[IMAP_FLAG_SEEN] == 1);
-						break;
-					case 6: found = (int) (msginfo->flags[IMAP_FLAG_DRAFT] == 1);
-						break;
-					case 7: found = (int) (msginfo->flags[IMAP_FLAG_SEEN] == 0 && msginfo->flags[IMAP_FLAG_RECENT] == 1);
-						break;
-					case 8: found = (int) (msginfo->flags[IMAP_FLAG_RECENT] == 0);
-						break;
-					case 9: found = (int) (msginfo->flags[IMAP_FLAG_ANSWERED] == 0);
-						break;
-					case 10: found = (int) (msginfo->flags[IMAP_FLAG_DELETED] == 0);
-						break;
-					case 11: found = (int) (msginfo->flags[IMAP_FLAG_FLAGGED] == 0);
-						break;
-					case 12: found = (int) (msginfo->flags[IMAP_FLAG_SEEN] == 0);
-						break;
-					case 13: found = (int) (msginfo->flags[IMAP_FLAG_DRAFT] == 0);
-						break;
-					case 14: found = (int) (strcmp(msginfo->internaldate, cond) > 0);
-						break;
-					case 15: found = (int) (strcmp(msginfo->internaldate, cond) == 0);
-						break;
-					case 16: found = (int) (strcmp(msginfo->internaldate, cond) < 0);
-						break;
-						//IST_SIZE_LARGER
-					case 17: found = (int) (msginfo->rfcsize > s->size);
-						break;
-						//IST_SIZE_SMALLER
-					case 18: found = (int) (msginfo->rfcsize < s->size);
-						break;
-
-				}
-				if (found == 1) {
-					//TRACE(TRACE_DEBUG, "Found (%d) %ld vs %ld ",IST_MBS_COND,id,msginfo->uid); 
-					k = mempool_pop(small_pool, sizeof (uint64_t));
-					v = mempool_pop(small_pool, sizeof (uint64_t));
-					*k = id;
-					*v = id;
-
-					g_tree_insert(s->found, k, v);
-					foundItems++;
-				}
-				if (!g_list_next(uids)) break;
-				uids = g_list_next(uids);
-			}
-			g_list_free(g_list_first(uids));
-			if (cond) {
-				TRACE(TRACE_DEBUG, "IST RESULT TREE (message_search_strategy=2) found %s (%s), found  %d",
-					s->search,
-					cond,
-					foundItems);
-			} else {
-				TRACE(TRACE_DEBUG, "IST RESULT TREE (message_search_strategy=2) found %s, found  %d", s->search, foundItems);
-			}
-		} else {
-			TRACE(TRACE_WARNING, "IST unhandled search for message_search_strategy=2 so fall back (should be handled)");
-			p_string_printf(q, "SELECT message_idnr FROM %smessages "
-				"WHERE mailbox_idnr = ? AND status < ? AND %s "
-				"ORDER BY message_idnr", DBPFX,
-				s->search); // FIXME: Sometimes s->search is ""
-
-			st = db_stmt_prepare(c, p_string_str(q));
-			db_stmt_set_u64(st, 1, dbmail_mailbox_get_id(self));
-			db_stmt_set_int(st, 2, MESSAGE_STATUS_DELETE);
-		}
 
-
-	}
-	/* due to the fact that may be some issues related to the redirecting of queries for strategy = 2*/
-	/* we may need to test for st not being null */
-	if (st && sql == 1) {
+	if (st) {
 		int foundItems = 0;
 		r = db_stmt_query(st);
 
 		ids = MailboxState_getIds(self->mbstate);
 		while (db_result_next(r)) {
 			id = db_result_get_u64(r, 0);
-			if (!(w = g_tree_lookup(ids, &id))) {
+			if (! g_tree_lookup(ids, &id)) {
 				TRACE(TRACE_ERR, "key missing in ids: [%" PRIu64 "]\n", id);
 				continue;
 			}
-			assert(w);
-
-			k = mempool_pop(small_pool, sizeof (uint64_t));
-			v = mempool_pop(small_pool, sizeof (uint64_t));
-			*k = id;
-			*v = *w;
-			g_tree_insert(s->found, k, v);
+			_ranges_add(s->found, id);
 			foundItems++;
 		}
 		TRACE(TRACE_DEBUG, "IST RESULT SQL found %s, found  %d", s->search, foundItems);
 	}
-	if (s->type == IST_UNKEYWORD) {
-		GTree *old = NULL;
-		GTree *invert = g_tree_new_full((GCompareDataFunc) ucmpdata, NULL, (GDestroyNotify) uint64_free, (GDestroyNotify) uint64_free);
-		GList *uids = g_tree_keys(ids);
-		uids = g_list_first(uids);
-		while (uids) {
-			uint64_t id = *(uint64_t *) uids->data;
-			if (!(w = g_tree_lookup(ids, &id))) {
-				TRACE(TRACE_ERR, "key missing in ids: [%" PRIu64 "]", id);
-
-				if (!g_list_next(uids)) break;
-				uids = g_list_next(uids);
-				continue;
-			}
-
-			assert(w);
-
-			if (g_tree_lookup(s->found, &id)) {
-				TRACE(TRACE_DEBUG, "skip key [%" PRIu64 "]", id);
-
-				if (!g_list_next(uids)) break;
-				uids = g_list_next(uids);
-				continue;
-			}
-
-			k = mempool_pop(small_pool, sizeof (uint64_t));
-			v = mempool_pop(small_pool, sizeof (uint64_t));
-			*k = id;
-			*v = *w;
-
-			g_tree_insert(invert, k, v);
-
-
-			if (!g_list_next(uids)) break;
-			uids = g_list_next(uids);
-
-		}
-
-		old = s->found;
-		s->found = invert;
-		g_tree_destroy(old);
-		g_list_free(g_list_first(uids));
-	}
 
 	CATCH(SQLException)
 	LOG_SQLERROR;
@@ -1767,7 +2428,6 @@ static GTree * mailbox_search(DbmailMailbox *self, search_key *s) {
 
 	p_string_free(q, TRUE);
 	g_string_free(t, TRUE);
-	free(cond);
 
 	return s->found;
 }
@@ -1823,6 +2483,26 @@ GTree * find_modseq(DbmailMailbox *self, GTree *in) {
 	return in;
 }
 
+/*
+ * RFC 5182: "$" refers to the uids of the saved search result,
+ * whether or not the command is a UID command. Expunged messages
+ * simply drop out.
+ */
+static GTree * _get_saved_set(DbmailMailbox *self, GTree *uids) {
+	GString *t;
+	GTree *b;
+
+	if (! (self->saved && self->saved->len && g_tree_nnodes(uids)))
+		return g_tree_new_full((GCompareDataFunc) ucmpdata, NULL, (GDestroyNotify) uint64_free, (GDestroyNotify) uint64_free);
+
+	t = g_string_new("");
+	_append_ranges(t, self->saved, 1, INT64_MAX);
+	b = MailboxState_get_set(self->mbstate, t->str, TRUE);
+	g_string_free(t, TRUE);
+
+	return find_modseq(self, b);
+}
+
 GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean uid) {
 	GTree *uids;
 	GTree *b;
@@ -1835,6 +2515,9 @@ GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean ui
 	assert(self && self->mbstate && set);
 
 	uids = MailboxState_getIds(self->mbstate);
+
+	if (MATCH(set, "$"))
+		return _get_saved_set(self, uids);
 	if ((!uid) && (g_tree_nnodes(uids) == 0))
 		return NULL;
 
@@ -1846,33 +2529,16 @@ GTree * dbmail_mailbox_get_set(DbmailMailbox *self, const char *set, gboolean ui
 	return find_modseq(self, b);
 }
 
-static gboolean _found_tree_copy(uint64_t *key, uint64_t *val, GTree *tree) {
-	uint64_t *a, *b;
-	a = g_new0(uint64_t, 1);
-	b = g_new0(uint64_t, 1);
-	*a = *key;
-	*b = *val;
-	g_tree_insert(tree, a, b);
-	return FALSE;
-}
-
-static gboolean _shallow_tree_copy(uint64_t *key, uint64_t *val, GTree *tree) {
-	g_tree_insert(tree, key, val);
-	return FALSE;
-}
-
 static gboolean _prescan_search(GNode *node, DbmailMailbox *self) {
 	search_key *s = (search_key *) node->data;
+	GTree *set;
 
 	if (s->searched) return FALSE;
 
 	switch (s->type) {
 		case IST_SET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 0)))
-				return TRUE;
-			break;
 		case IST_UIDSET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 1)))
+			if (!(set = dbmail_mailbox_get_set(self, (const char *) s->search, s->type == IST_UIDSET)))
 				return TRUE;
 			break;
 		default:
@@ -1880,21 +2546,215 @@ static gboolean _prescan_search(GNode *node, DbmailMailbox *self) {
 
 	}
 	s->searched = TRUE;
+	s->found = _ranges_from_set(set);
 
-	g_tree_merge(self->found, s->found, IST_SUBSEARCH_AND);
+	_ranges_narrow(&self->found, s->found, IST_SUBSEARCH_AND);
 	s->merged = TRUE;
 
-	TRACE(TRACE_DEBUG, "[%p] depth [%d] type [%d] rows [%d]\n",
-		s, g_node_depth(node), s->type, s->found ? g_tree_nnodes(s->found) : 0);
+	TRACE(TRACE_DEBUG, "[%p] depth [%d] type [%d] rows [%" PRIu64 "]\n",
+		s, g_node_depth(node), s->type, _ranges_count(s->found));
+
+	_ranges_free(&s->found);
+
+	return FALSE;
+}
+
+/*
+ * in-memory search
+ *
+ * flag, keyword, size and internal date criteria are evaluated against
+ * the MessageInfo entries of the mailbox state, without going to the
+ * database.
+ */
+static gboolean _state_match_key(search_key *s, MessageInfo *info) {
+	GList *k;
+	int i, flags = 0;
+
+	switch (s->type) {
+		case IST_FLAG:
+			for (i = 0; i < IMAP_NFLAGS; i++)
+				if (info->flags[i])
+					flags |= (1 << i);
+			return (((flags & s->flags_set) == s->flags_set) && ! (flags & s->flags_clear)) != s->reverse;
+
+		case IST_KEYWORD:
+		case IST_UNKEYWORD:
+			for (k = info->keywords; k; k = g_list_next(k))
+				if (MATCH((char *) k->data, s->search))
+					return s->type == IST_KEYWORD;
+			return s->type == IST_UNKEYWORD;
+
+		case IST_SIZE_LARGER:
+			return info->rfcsize > s->size;
+
+		case IST_SIZE_SMALLER:
+			return info->rfcsize < s->size;
+
+		case IST_IDATE:
+			if (s->date_low[0] && strcmp(info->internaldate, s->date_low) < 0)
+				return FALSE;
+			if (s->date_high[0] && strcmp(info->internaldate, s->date_high) >= 0)
+				return FALSE;
+			return TRUE;
+	}
+
+	return TRUE;
+}
+
+static gboolean _state_searchable_key(search_key *s) {
+	switch (s->type) {
+		case IST_HDR:
+		case IST_HDRDATE_BEFORE:
+		case IST_HDRDATE_ON:
+		case IST_HDRDATE_SINCE:
+		case IST_DATA_BODY:
+		case IST_DATA_TEXT:
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static gboolean _state_unsearchable(GNode *node, gboolean *unsearchable) {
+	if (_state_searchable_key((search_key *) node->data))
+		return FALSE;
+	*unsearchable = TRUE;
+	return TRUE;
+}
+
+/* evaluate a complete search program for one message */
+static gboolean _state_match(GNode *node, MessageInfo *info, uint64_t *uid) {
+	search_key *s = (search_key *) node->data;
+	GNode *child;
+
+	switch (s->type) {
+		case IST_SET:
+		case IST_UIDSET:
+			/* sets merged by the prescan have already narrowed the result */
+			if (! s->merged && ! _ranges_contains(s->found, *uid))
+				return FALSE;
+			break;
+
+		case IST_SUBSEARCH_OR:
+			for (child = node->children; child; child = child->next)
+				if (_state_match(child, info, uid))
+					return TRUE;
+			return FALSE;
+
+		case IST_SUBSEARCH_NOT:
+			for (child = node->children; child; child = child->next)
+				if (! _state_match(child, info, uid))
+					return TRUE;
+			return FALSE;
+
+		case IST_SORT:
+		case IST_SUBSEARCH_AND:
+			break;
+
+		default:
+			if (! _state_match_key(s, info))
+				return FALSE;
+			break;
+	}
+
+	for (child = node->children; child; child = child->next)
+		if (! _state_match(child, info, uid))
+			return FALSE;
+
+	return TRUE;
+}
+
+static gboolean _state_prepare_sets(GNode *node, DbmailMailbox *self) {
+	search_key *s = (search_key *) node->data;
+
+	if (s->searched)
+		return FALSE;
+
+	if (s->type == IST_SET || s->type == IST_UIDSET)
+		s->found = _ranges_from_set(dbmail_mailbox_get_set(self, (const char *) s->search, s->type == IST_UIDSET));
+
+	return FALSE;
+}
+
+static gboolean _state_finish(GNode *node, gpointer data UNUSED) {
+	search_key *s = (search_key *) node->data;
+
+	if (s->type != IST_SORT) {
+		_ranges_free(&s->found);
+		s->searched = TRUE;
+		s->merged = TRUE;
+	}
+
+	return FALSE;
+}
+
+struct state_search {
+	DbmailMailbox *self;
+	GNode *node;
+	search_key *key;
+	GTree *msginfo;
+	GArray *found;
+};
+
+static gboolean _state_filter(uint64_t *uid, gpointer value UNUSED, struct state_search *search) {
+	MessageInfo *info = g_tree_lookup(search->msginfo, uid);
+	if (info && _state_match(search->node, info, uid))
+		_ranges_add(search->found, *uid);
+	return FALSE;
+}
+
+/* run the whole search tree as one pass over the candidate messages */
+static void mailbox_search_state_all(DbmailMailbox *self) {
+	struct state_search search;
+	GNode *root = g_node_get_root(self->search);
+
+	memset(&search, 0, sizeof(search));
+	search.self = self;
+	search.node = root;
+	search.msginfo = MailboxState_getMsginfo(self->mbstate);
+
+	g_node_traverse(root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc) _state_prepare_sets, (gpointer) self);
+
+	search.found = _ranges_new();
+	_found_foreach(self, (GTraverseFunc) _state_filter, &search);
+	_ranges_free(&self->found);
+	self->found = search.found;
+
+	g_node_traverse(root, G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+		(GNodeTraverseFunc) _state_finish, NULL);
+
+	TRACE(TRACE_DEBUG, "IST RESULT STATE found [%" PRIu64 "]", _ranges_count(self->found));
+}
+
+static gboolean _state_search_leaf(uint64_t *uid, uint64_t *msn UNUSED, struct state_search *search) {
+	MessageInfo *info = g_tree_lookup(search->msginfo, uid);
 
-	g_tree_destroy(s->found);
-	s->found = NULL;
+	if (info && _state_match_key(search->key, info))
+		_ranges_add(search->key->found, *uid);
 
 	return FALSE;
 }
 
+/* a single state criterion inside a search that also needs sql */
+static GArray * mailbox_search_state(DbmailMailbox *self, search_key *s) {
+	struct state_search search;
+
+	memset(&search, 0, sizeof(search));
+	search.self = self;
+	search.key = s;
+	search.msginfo = MailboxState_getMsginfo(self->mbstate);
+
+	s->found = _ranges_new();
+	g_tree_foreach(MailboxState_getIds(self->mbstate), (GTraverseFunc) _state_search_leaf, &search);
+
+	TRACE(TRACE_DEBUG, "IST RESULT STATE found %s, found  %" PRIu64, s->search, _ranges_count(s->found));
+
+	return s->found;
+}
+
 static gboolean _do_search(GNode *node, DbmailMailbox *self) {
 	search_key *s = (search_key *) node->data;
+	GTree *set;
 
 	if (s->searched) return FALSE;
 
@@ -1904,23 +2764,24 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self) {
 			break;
 
 		case IST_SET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 0)))
-				return TRUE;
-			break;
 		case IST_UIDSET:
-			if (!(s->found = dbmail_mailbox_get_set(self, (const char *) s->search, 1)))
+			if (!(set = dbmail_mailbox_get_set(self, (const char *) s->search, s->type == IST_UIDSET)))
 				return TRUE;
+			s->found = _ranges_from_set(set);
 			break;
 
 		case IST_KEYWORD:
 		case IST_UNKEYWORD:
 		case IST_SIZE_LARGER:
 		case IST_SIZE_SMALLER:
+		case IST_IDATE:
+		case IST_FLAG:
+			mailbox_search_state(self, s);
+			break;
+
 		case IST_HDRDATE_BEFORE:
 		case IST_HDRDATE_SINCE:
 		case IST_HDRDATE_ON:
-		case IST_IDATE:
-		case IST_FLAG:
 		case IST_HDR:
 		case IST_DATA_TEXT:
 		case IST_DATA_BODY:
@@ -1931,7 +2792,7 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self) {
 		case IST_SUBSEARCH_AND:
 		case IST_SUBSEARCH_OR:
 			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc) _do_search, (gpointer) self);
-			s->found = g_tree_new_full((GCompareDataFunc) ucmpdata, NULL, (GDestroyNotify) g_free, (GDestroyNotify) g_free);
+			s->found = _ranges_new();
 			break;
 
 
@@ -1941,13 +2802,14 @@ static gboolean _do_search(GNode *node, DbmailMailbox *self) {
 
 	s->searched = TRUE;
 
-	TRACE(TRACE_DEBUG, "[%p] depth [%d] type [%d] rows [%d]\n",
-		s, g_node_depth(node), s->type, s->found ? g_tree_nnodes(s->found) : 0);
+	TRACE(TRACE_DEBUG, "[%p] depth [%d] type [%d] rows [%" PRIu64 "]\n",
+		s, g_node_depth(node), s->type, _ranges_count(s->found));
 
 	return FALSE;
 }
 
-static gboolean _merge_search(GNode *node, GTree *found) {
+/* narrow *found down with the results of the search tree below node */
+static gboolean _merge_search(GNode *node, GArray **found) {
 	search_key *s = (search_key *) node->data;
 	search_key *a, *b;
 	GNode *x, *y;
@@ -1965,12 +2827,12 @@ static gboolean _merge_search(GNode *node, GTree *found) {
 			break;
 
 		case IST_SUBSEARCH_NOT:
-			g_tree_foreach(found, (GTraverseFunc) _found_tree_copy, s->found);
-			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc) _merge_search, (gpointer) s->found);
-			g_tree_merge(found, s->found, IST_SUBSEARCH_NOT);
+			_ranges_free(&s->found);
+			s->found = _ranges_copy(*found);
+			g_node_children_foreach(node, G_TRAVERSE_ALL, (GNodeForeachFunc) _merge_search, (gpointer) &s->found);
+			_ranges_narrow(found, s->found, IST_SUBSEARCH_NOT);
 			s->merged = TRUE;
-			g_tree_destroy(s->found);
-			s->found = NULL;
+			_ranges_free(&s->found);
 
 			break;
 
@@ -1981,43 +2843,40 @@ static gboolean _merge_search(GNode *node, GTree *found) {
 			b = (search_key *) y->data;
 
 			if (a->type == IST_SUBSEARCH_AND) {
-				g_tree_foreach(found, (GTraverseFunc) _found_tree_copy, a->found);
-				g_node_children_foreach(x, G_TRAVERSE_ALL, (GNodeForeachFunc) _merge_search, (gpointer) a->found);
+				_ranges_free(&a->found);
+				a->found = _ranges_copy(*found);
+				g_node_children_foreach(x, G_TRAVERSE_ALL, (GNodeForeachFunc) _merge_search, (gpointer) &a->found);
 			}
 
 			if (b->type == IST_SUBSEARCH_AND) {
-				g_tree_foreach(found, (GTraverseFunc) _found_tree_copy, b->found);
-				g_node_children_foreach(y, G_TRAVERSE_ALL, (GNodeForeachFunc) _merge_search, (gpointer) b->found);
+				_ranges_free(&b->found);
+				b->found = _ranges_copy(*found);
+				g_node_children_foreach(y, G_TRAVERSE_ALL, (GNodeForeachFunc) _merge_search, (gpointer) &b->found);
 			}
 
-			g_tree_merge(a->found, b->found, IST_SUBSEARCH_OR);
-			b->merged = TRUE;
-			g_tree_destroy(b->found);
-			b->found = NULL;
-
-			g_tree_merge(s->found, a->found, IST_SUBSEARCH_OR);
+			_ranges_narrow(&s->found, a->found, IST_SUBSEARCH_OR);
+			_ranges_narrow(&s->found, b->found, IST_SUBSEARCH_OR);
 			a->merged = TRUE;
-			g_tree_destroy(a->found);
-			a->found = NULL;
+			b->merged = TRUE;
+			_ranges_free(&a->found);
+			_ranges_free(&b->found);
 
-			g_tree_merge(found, s->found, IST_SUBSEARCH_AND);
+			_ranges_narrow(found, s->found, IST_SUBSEARCH_AND);
 			s->merged = TRUE;
-			g_tree_destroy(s->found);
-			s->found = NULL;
+			_ranges_free(&s->found);
 
 			break;
 
 		default:
-			g_tree_merge(found, s->found, IST_SUBSEARCH_AND);
+			_ranges_narrow(found, s->found, IST_SUBSEARCH_AND);
 			s->merged = TRUE;
-			g_tree_destroy(s->found);
-			s->found = NULL;
+			_ranges_free(&s->found);
 
 			break;
 	}
 
-	TRACE(TRACE_DEBUG, "[%p] leaf [%d] depth [%d] type [%d] found [%d]",
-		s, G_NODE_IS_LEAF(node), g_node_depth(node), s->type, found ? g_tree_nnodes(found) : 0);
+	TRACE(TRACE_DEBUG, "[%p] leaf [%d] depth [%d] type [%d] found [%" PRIu64 "]",
+		s, G_NODE_IS_LEAF(node), g_node_depth(node), s->type, _ranges_count(*found));
 
 	return FALSE;
 }
@@ -2034,31 +2893,37 @@ int dbmail_mailbox_sort(DbmailMailbox *self) {
 int dbmail_mailbox_search(DbmailMailbox *self) {
 	TRACE(TRACE_DEBUG, "Call: dbmail_mailbox_search");
 	GTree *ids;
+	gboolean unsearchable = FALSE;
 	if (!self->search) return 0;
 
 	if (!self->mbstate)
 		dbmail_mailbox_open(self);
 
-	if (self->found) g_tree_destroy(self->found);
-	self->found = g_tree_new_full((GCompareDataFunc) ucmpdata, NULL, NULL, NULL);
+	_ranges_free(&self->found);
+	self->found = _ranges_new();
 
 	ids = MailboxState_getIds(self->mbstate);
 
-	g_tree_foreach(ids, (GTraverseFunc) _shallow_tree_copy, self->found);
+	g_tree_foreach(ids, (GTraverseFunc) _ranges_collect, self->found);
 
 	g_node_traverse(g_node_get_root(self->search), G_LEVEL_ORDER, G_TRAVERSE_ALL, 2,
 		(GNodeTraverseFunc) _prescan_search, (gpointer) self);
 
 	g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-		(GNodeTraverseFunc) _do_search, (gpointer) self);
+		(GNodeTraverseFunc) _state_unsearchable, (gpointer) &unsearchable);
 
-	g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1,
-		(GNodeTraverseFunc) _merge_search, (gpointer) self->found);
+	if (! unsearchable) {
+		/* nothing needs the database */
+		mailbox_search_state_all(self);
+	} else {
+		g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			(GNodeTraverseFunc) _do_search, (gpointer) self);
 
-	if (self->found == NULL)
-		TRACE(TRACE_DEBUG, "found no ids\n");
-	else
-		TRACE(TRACE_DEBUG, "found [%d] ids\n", self->found ? g_tree_nnodes(self->found) : 0);
+		g_node_traverse(g_node_get_root(self->search), G_PRE_ORDER, G_TRAVERSE_ALL, -1,
+			(GNodeTraverseFunc) _merge_search, (gpointer) &self->found);
+	}
+
+	TRACE(TRACE_DEBUG, "found [%" PRIu64 "] ids\n", _ranges_count(self->found));
 
 	return 0;
 }
@@ -49,10 +49,15 @@ typedef struct {
 	MailboxState_T mbstate;	// cache mailbox metadata;
 
 	GList *sorted;		// ordered list of UID values
-	GTree *found;		// search result (key: uid, value: msn)
+	GArray *found;		// search result, as runs of uids (IdRange)
 	GNode *search;
 	const char *charset;		// charset used during search/sort
 
+	int result_options;	// SEARCH_RETURN_* for ESEARCH/ESORT
+	int64_t partial_first;	// PARTIAL range, negative counts from the end
+	int64_t partial_last;
+	GArray *saved;		// SEARCHRES result ($), as runs of uids (IdRange)
+
 } DbmailMailbox;
 
 
@@ -75,7 +80,11 @@ void dbmail_mailbox_free(DbmailMailbox *self);
 char * dbmail_mailbox_imap_modseq_as_string(DbmailMailbox *self, gboolean uid);
 char * dbmail_mailbox_ids_as_string(DbmailMailbox *self, gboolean uid, const char *sep);
 char * dbmail_mailbox_sorted_as_string(DbmailMailbox *self);
+char * dbmail_mailbox_esort_as_string(DbmailMailbox *self);
+char * dbmail_mailbox_esearch_as_string(DbmailMailbox *self);
+void dbmail_mailbox_save_result(DbmailMailbox *self);
 char * dbmail_mailbox_orderedsubject(DbmailMailbox *self);
+char * dbmail_mailbox_threadreferences(DbmailMailbox *self);
 
 int dbmail_mailbox_build_imap_search(DbmailMailbox *self, String_T *search_keys, uint64_t *idx, search_order order);
 
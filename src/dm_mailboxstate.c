@@ -41,6 +41,7 @@ static void db_getmailbox_seq(T M, Connection_T c);
 static void db_getmailbox_permission(T M, Connection_T c);
 static void state_load_metadata(T M, Connection_T c);
 static void MailboxState_setMsginfo(T M, GTree *msginfo);
+static void state_remap_tail(T M, uint64_t from, GList *entered);
 /* */
 
 static void MailboxState_uid_msn_new(T M)
@@ -59,11 +60,66 @@ static void MessageInfo_free(MessageInfo *m)
 }
 
 
-static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
+static MessageInfo * MessageInfo_copy(MessageInfo *m)
+{
+	GList *k;
+	MessageInfo *copy = g_new0(MessageInfo,1);
+
+	*copy = *m;
+	copy->keywords = NULL;
+	k = g_list_first(m->keywords);
+	while (k) {
+		copy->keywords = g_list_prepend(copy->keywords, g_strdup((char *)k->data));
+		if (! g_list_next(k)) break;
+		k = g_list_next(k);
+	}
+	copy->keywords = g_list_reverse(copy->keywords);
+
+	return copy;
+}
+
+static void state_fill_msginfo(T M, MessageInfo *result, ResultSet_T r)
 {
-	unsigned nrows = 0, i = 0, j;
-	struct timeval before, after; 
 	const char *query_result;
+	int j;
+
+	/* id */
+	result->uid = db_result_get_u64(r, IMAP_NFLAGS + 3);
+
+	/* mailbox_id */
+	result->mailbox_id = M->id;
+
+	/* flags */
+	for (j = 0; j < IMAP_NFLAGS; j++)
+		result->flags[j] = db_result_get_bool(r,j);
+
+	/* internal date */
+	query_result = db_result_get(r,IMAP_NFLAGS);
+	strncpy(result->internaldate,
+			(query_result) ? query_result :
+			"01-Jan-1970 00:00:01 +0100",
+			IMAP_INTERNALDATE_LEN-1);
+
+	/* rfcsize */
+	result->rfcsize = db_result_get_u64(r,IMAP_NFLAGS + 1);
+	/* modseq */
+	result->seq = db_result_get_u64(r,IMAP_NFLAGS + 2);
+	/* status */
+	result->status = db_result_get_int(r, IMAP_NFLAGS + 4);
+	/* physmessage_id */
+	result->phys_id = db_result_get_int(r, IMAP_NFLAGS + 5);
+
+	/* add Seen as flag when IMAP_FLAGS_SEEN=1 */
+	if (result->flags[IMAP_FLAG_SEEN]==1) {
+		/* some strange clients like it this way */
+		result->keywords = g_list_append(result->keywords, g_strdup("\\Seen"));
+	}
+}
+
+static void state_load_messages(T M, Connection_T c)
+{
+	unsigned nrows = 0, i = 0;
+	struct timeval before, after; 
 	uint64_t tempId;
 	MessageInfo *result = NULL;
 	GTree *msginfo;
@@ -72,119 +128,40 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 	PreparedStatement_T stmt;
 	Field_T frag;
 	INIT_QUERY;
-	int idsAdded = 0;
-	char filterCondition[96];  memset(filterCondition,0,96);
 	int mailbox_sync_deleted = config_get_value_default_int("mailbox_sync_deleted", "IMAP", 1); 
 	int mailbox_sync_batch_size= config_get_value_default_int("mailbox_sync_batch_size", "IMAP", 64); 
-	/* the initialization should be done elsewhere, see ols MailboxState_new and MailboxState_update */
 	msginfo=MailboxState_getMsginfo(M);
 	uint64_t seq=MailboxState_getSeq(M);
-	if (coldLoad){
-	    //msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free,(GDestroyNotify)MessageInfo_free);    
-	    TRACE(TRACE_DEBUG, "SEQ Cold Load [ %" PRIu64 " ]", seq);
-	    snprintf(filterCondition,64-1,"/*SEQ New*/ AND m.status < %d ", MESSAGE_STATUS_DELETE);
-	}else{
-		uint64_t state_seq=M->state_seq;
-	    //msginfo=MailboxState_getMsginfo(M);
-	    
-	    TRACE(TRACE_DEBUG, "SEQ RENEW [ %" PRIu64 " %" PRIu64 " ]",state_seq , seq);
-	    //MailboxState_uid_msn_new(M);
-	    /* use seq to select only changed elements, event this which are deleted*/
-	    snprintf(filterCondition,64-1,"/*SEQ ReNew*/ AND m.seq >= %" PRIu64 "-1 AND m.status <= %d ", state_seq, MESSAGE_STATUS_DELETE );    
-	}
-	
-	
+
+	TRACE(TRACE_DEBUG, "SEQ Cold Load [ %" PRIu64 " ]", seq);
+
 	date2char_str("internal_date", &frag);
-	snprintf(query, DEF_QUERYSIZE-1,
+	stmt = db_stmt_prepare_cached(c,
 			"SELECT seen_flag, answered_flag, deleted_flag, flagged_flag, "
 			"draft_flag, recent_flag, %s, rfcsize, seq, m.message_idnr, status, m.physmessage_id "
 			"FROM %smessages m "
 			"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
-			"WHERE m.mailbox_idnr = ? %s "
+			"WHERE m.mailbox_idnr = ? AND m.status < %d "
 			"ORDER BY m.seq DESC",
 			frag,  
 			DBPFX, DBPFX, 
-			filterCondition);
-
-	
-
-	stmt = db_stmt_prepare(c, query);
+			MESSAGE_STATUS_DELETE);
 	db_stmt_set_u64(stmt, 1, M->id);
 	gettimeofday(&before, NULL); 
 	r = db_stmt_query(stmt);
 	gettimeofday(&after, NULL); 
-	log_query_time(query,before,after);
+	log_query_time("Loading State ",before,after);
 	i = 0;
 	gettimeofday(&before, NULL); 
 	
 	while (db_result_next(r)) {
 		i++;
 
-		id = db_result_get_u64(r, IMAP_NFLAGS + 3);
-		
-		/* reset */
-		idsAdded=0;
-		if (coldLoad){
-		    /* new element*/
-		    result = g_new0(MessageInfo,1);
-			uid = g_new0(uint64_t,1); 
-			*uid = id;
-		    idsAdded=1;
-		    result->expunge=0;
-		    result->expunged=0;
-			//TRACE(TRACE_DEBUG, "SEQ CREATED %ld",id);
-		}else{
-		    /* soft renew, so search */
-		    result = g_tree_lookup(msginfo, &id);     
-		    if (result == NULL){
-				/* check deletion */
-				if (db_result_get_int(r, IMAP_NFLAGS + 4)>=MESSAGE_STATUS_DELETE){
-					// item is already deleted and is not in tree, so do not even add it. 
-					continue;
-				}	
-				/* not found so create*/
-				result = g_new0(MessageInfo,1);
-				uid = g_new0(uint64_t,1); 
-				*uid = id;
-				idsAdded=1;
-				result->expunge=0;
-				result->expunged=0;
-		    }else{
-				/* initialize uid, result is not null */
-				uid = g_new0(uint64_t,1); 
-				*uid = id;
-				//TRACE(TRACE_DEBUG, "SEQ FOUND %ld",id);
-				/* free all keywords, it will be added later again */
-				g_list_destroy(result->keywords);
-				result->keywords = NULL;
-		    }
-		}
+		result = g_new0(MessageInfo,1);
+		state_fill_msginfo(M, result, r);
+		uid = g_new0(uint64_t,1); 
+		*uid = id = result->uid;
 
-		/* id */
-		result->uid = id;
-
-		/* mailbox_id */
-		result->mailbox_id = M->id;
-
-		/* flags */
-		for (j = 0; j < IMAP_NFLAGS; j++)
-			result->flags[j] = db_result_get_bool(r,j);
-
-		/* internal date */
-		query_result = db_result_get(r,IMAP_NFLAGS);
-		strncpy(result->internaldate,
-				(query_result) ? query_result :
-				"01-Jan-1970 00:00:01 +0100",
-				IMAP_INTERNALDATE_LEN-1);
-
-		/* rfcsize */
-		result->rfcsize = db_result_get_u64(r,IMAP_NFLAGS + 1);
-		/* modseq */
-		result->seq = db_result_get_u64(r,IMAP_NFLAGS + 2);
-		/* status */
-		result->status = db_result_get_int(r, IMAP_NFLAGS + 4);
-		/* physmessage_id */
-		result->phys_id = db_result_get_int(r, IMAP_NFLAGS + 5);
 		if (result->flags[IMAP_FLAG_DELETED]==1 && result->status < MESSAGE_STATUS_DELETE){
 			TRACE(TRACE_DEBUG, "DESYNC Meessage marked as deleted but not deleted [ %" PRIu64 " ] consider using `mailbox_sync_deleted`", *uid);
 			if (mailbox_sync_deleted==2  && mailbox_sync_batch_size>0){
@@ -194,34 +171,10 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 				TRACE(TRACE_DEBUG, "DESYNC marked as deleted[ %" PRIu64 " ]", *uid);
 			}
 		}
-		if (result->status >= MESSAGE_STATUS_DELETE || result->flags[IMAP_FLAG_DELETED]==1 || result->expunged==1 || result->expunge>=1){
+		if (result->status >= MESSAGE_STATUS_DELETE || result->flags[IMAP_FLAG_DELETED]==1)
 			result->expunge ++;
-			if (result->expunged == 1){
-				//TRACE(TRACE_DEBUG, "SEQ Remove MSG EXPUNGED [ %" PRIu64 " ]", *uid);
-				/* result does not need to be freed, it is freed in tree remove */
-				g_tree_remove(msginfo, uid);
-				g_free(uid);
-				continue;
-			}else{
-				//TRACE(TRACE_DEBUG, "SEQ Remove MSG EXPUNGING [ %" PRIu64 " expunge flag %d, was expunged %d]", *uid, result->expunge, result->expunged);
-			}
-		}
-		/* add Seen as flag when IMAP_FLAGS_SEEN=1 */
-		if (result->flags[IMAP_FLAG_SEEN]==1){
-			gchar *value = g_strdup("\\Seen");
-			result->keywords = g_list_append(result->keywords, value);
-			/* some strange clients like it this way */
-		}
-		/* cleaning up */
-		if (idsAdded==1){
-			//TRACE(TRACE_DEBUG, "SEQ ADDED %ld",id);
-		    /* it's new */
-			g_tree_insert(msginfo, uid, result);  
-		}else{
-		    /* no need, result was updated */
-			/* free uid, is it always allocated */
-			g_free(uid);
-		}
+
+		g_tree_insert(msginfo, uid, result);  
 	}
 	gettimeofday(&after, NULL); 
 	log_query_time("Parsing State ",before,after);
@@ -229,7 +182,7 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 		/* update the state seq */
 		M->state_seq = seq;
 		MailboxState_setMsginfo(M, msginfo);
-		return M;
+		return;
 	}
 
 	db_con_clear(c);
@@ -238,11 +191,11 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 	snprintf(query, DEF_QUERYSIZE-1,
 		"SELECT k.message_idnr, k.keyword FROM %skeywords k "
 		"LEFT JOIN %smessages m ON k.message_idnr=m.message_idnr "
-		"WHERE m.mailbox_idnr = ? %s "
+		"WHERE m.mailbox_idnr = ? AND m.status < %d "
 		"order by m.message_idnr "
 		,
 		DBPFX, DBPFX,
-		filterCondition);
+		MESSAGE_STATUS_DELETE);
 
 	nrows = 0;
 	stmt = db_stmt_prepare(c, query);
@@ -257,7 +210,6 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 		
 		const char * keyword = db_result_get(r,1);
 		if (strlen(keyword)>0){
-			// TRACE(TRACE_INFO, "Keyword line [%d %s]", nrows, keyword);
 			/* use tempId a temporary store the id of the item in order to avoid unnecessary lookups */
 			if ( tempId!=id || tempId==0 ){
 				result = g_tree_lookup(msginfo, &id);
@@ -278,9 +230,225 @@ static T state_load_messages(T M, Connection_T c, gboolean coldLoad)
 	/* update the state seq */
 	M->state_seq = seq;
 	TRACE(TRACE_DEBUG, "SEQ STATE [ %" PRIu64 " %" PRIu64 " ]", M->state_seq , seq);
-	/* on both cases can use the same function due to some checks at MailboxState_setMsgInfo*/ 
 	MailboxState_setMsginfo(M, msginfo);
-	return M;
+}
+
+/*
+ * Differential reload
+ *
+ * Only rows with a modseq at or beyond the seq the state was last loaded
+ * at are read, including messages that were expunged since. They are
+ * collected in a changelog first and patched into the message map once
+ * the transaction is done, so a failed refresh leaves the state as is.
+ */
+
+static gboolean _free_changes(uint64_t UNUSED *uid, MessageInfo *info, gpointer UNUSED data)
+{
+	MessageInfo_free(info);
+	return FALSE;
+}
+
+static void state_changes_free(GTree **changes)
+{
+	GTree *t = *changes;
+	if (! t) return;
+	g_tree_foreach(t, (GTraverseFunc)_free_changes, NULL);
+	g_tree_destroy(t);
+	*changes = NULL;
+}
+
+static GTree * state_load_changes(T M, uint64_t state_seq, Connection_T c)
+{
+	unsigned i = 0, nrows = 0;
+	struct timeval before, after; 
+	MessageInfo *result = NULL;
+	GTree *changes;
+	uint64_t *uid, id = 0, tempId = 0;
+	ResultSet_T r;
+	PreparedStatement_T stmt;
+	Field_T frag;
+	INIT_QUERY;
+
+	TRACE(TRACE_DEBUG, "SEQ Delta [ %" PRIu64 " %" PRIu64 " ]", state_seq, M->seq);
+
+	changes = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, (GDestroyNotify)g_free, NULL);
+
+	date2char_str("internal_date", &frag);
+	snprintf(query, DEF_QUERYSIZE-1,
+			"SELECT seen_flag, answered_flag, deleted_flag, flagged_flag, "
+			"draft_flag, recent_flag, %s, rfcsize, seq, m.message_idnr, status, m.physmessage_id "
+			"FROM %smessages m "
+			"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
+			"WHERE m.mailbox_idnr = ? AND m.seq >= ?",
+			frag, DBPFX, DBPFX);
+
+	stmt = db_stmt_prepare(c, query);
+	db_stmt_set_u64(stmt, 1, M->id);
+	db_stmt_set_u64(stmt, 2, state_seq);
+	gettimeofday(&before, NULL); 
+	r = db_stmt_query(stmt);
+	gettimeofday(&after, NULL); 
+	log_query_time(query,before,after);
+
+	while (db_result_next(r)) {
+		i++;
+		result = g_new0(MessageInfo,1);
+		state_fill_msginfo(M, result, r);
+		uid = g_new0(uint64_t,1); 
+		*uid = result->uid;
+		g_tree_insert(changes, uid, result);
+	}
+
+	TRACE(TRACE_DEBUG, "SEQ Delta Rows [ %u ]", i);
+	if (! i)
+		return changes;
+
+	db_con_clear(c);
+
+	memset(query, 0, sizeof(query));
+	snprintf(query, DEF_QUERYSIZE-1,
+		"SELECT k.message_idnr, k.keyword FROM %skeywords k "
+		"LEFT JOIN %smessages m ON k.message_idnr=m.message_idnr "
+		"WHERE m.mailbox_idnr = ? AND m.seq >= ? "
+		"ORDER BY m.message_idnr",
+		DBPFX, DBPFX);
+
+	stmt = db_stmt_prepare(c, query);
+	db_stmt_set_u64(stmt, 1, M->id);
+	db_stmt_set_u64(stmt, 2, state_seq);
+	r = db_stmt_query(stmt);
+
+	result = NULL;
+	while (db_result_next(r)) {
+		const char *keyword;
+		nrows++;
+		id = db_result_get_u64(r,0);
+		keyword = db_result_get(r,1);
+		if (! (keyword && strlen(keyword)))
+			continue;
+		if (tempId != id) {
+			result = g_tree_lookup(changes, &id);
+			tempId = id;
+		}
+		if (! result)
+			continue;
+		result->keywords = g_list_append(result->keywords, g_strdup(keyword));
+		if (! MailboxState_hasKeyword(M, keyword))
+			MailboxState_addKeyword(M, keyword);
+	}
+	TRACE(TRACE_DEBUG, "SEQ Delta Keywords Rows [ %u ]", nrows);
+
+	return changes;
+}
+
+struct state_delta {
+	T M;		// state receiving the changes
+	T O;		// previous state, collects snapshots of changed messages
+	uint64_t first;	// lowest uid entering or leaving the msn map
+	GList *entered;	// uids entering the msn map, highest first
+};
+
+static gboolean _apply_change(uint64_t *uid, MessageInfo *info, struct state_delta *d)
+{
+	T M = d->M, O = d->O;
+	MessageInfo *old;
+	uint64_t *msn, *key = NULL;
+	gboolean was_live, now_live;
+
+	now_live = (info->status < MESSAGE_STATUS_DELETE) ? TRUE : FALSE;
+	msn = g_tree_lookup(M->ids, uid);
+	was_live = msn ? TRUE : FALSE;
+
+	if (*uid >= M->uidnext)
+		M->uidnext = *uid + 1;
+
+	if (! (old = g_tree_lookup(M->msginfo, uid))) {
+		if (! now_live) {
+			// expunged before it was ever part of this state
+			MessageInfo_free(info);
+			return FALSE;
+		}
+		key = g_new0(uint64_t,1);
+		*key = *uid;
+		g_tree_insert(M->msginfo, key, info);
+	} else {
+		gpointer orig;
+		g_tree_lookup_extended(M->msginfo, uid, &orig, NULL);
+		key = orig;
+
+		if ((! was_live) && (! now_live)) {
+			// already gone from the msn map
+			g_tree_remove(M->msginfo, uid);
+			MessageInfo_free(info);
+			return FALSE;
+		}
+
+		if (! g_tree_lookup(O->msginfo, uid)) {
+			// keep the client's view of this message for the 
+			// FETCH/EXPUNGE notifications
+			uint64_t *oldkey = g_new0(uint64_t,1);
+			*oldkey = *uid;
+			g_tree_insert(O->msginfo, oldkey, MessageInfo_copy(old));
+			if (msn) {
+				uint64_t *oldmsn = g_new0(uint64_t,1);
+				*oldmsn = *msn;
+				g_tree_insert(O->ids, oldkey, oldmsn);
+				g_tree_insert(O->msn, oldmsn, oldkey);
+			}
+		}
+
+		if (was_live) {
+			if ((! old->flags[IMAP_FLAG_SEEN]) && M->unseen) M->unseen--;
+			if (old->flags[IMAP_FLAG_RECENT] && M->recent) M->recent--;
+		}
+
+		g_list_free_full(g_steal_pointer (&old->keywords), g_free);
+		old->keywords = g_steal_pointer (&info->keywords);
+		memcpy(old->flags, info->flags, sizeof(old->flags));
+		memcpy(old->internaldate, info->internaldate, sizeof(old->internaldate));
+		old->rfcsize = info->rfcsize;
+		old->seq = info->seq;
+		old->status = info->status;
+		old->phys_id = info->phys_id;
+		MessageInfo_free(info);
+		info = old;
+	}
+
+	if (info->status >= MESSAGE_STATUS_DELETE || info->flags[IMAP_FLAG_DELETED]==1)
+		info->expunge++;
+
+	if (now_live) {
+		if (! info->flags[IMAP_FLAG_SEEN]) M->unseen++;
+		if (info->flags[IMAP_FLAG_RECENT]) M->recent++;
+		if (! was_live)
+			d->entered = g_list_prepend(d->entered, key);
+	} else {
+		// leaves the msn map; dropped on the next refresh
+		uint64_t *gone = g_new0(uint64_t,1);
+		*gone = *uid;
+		M->expunged = g_list_prepend(M->expunged, gone);
+	}
+
+	if ((was_live != now_live) && ((! d->first) || (*uid < d->first)))
+		d->first = *uid;
+
+	return FALSE;
+}
+
+static void state_drop_expunged(T M)
+{
+	GList *l = g_list_first(M->expunged);
+
+	while (l) {
+		uint64_t *uid = l->data;
+		MessageInfo *info = g_tree_lookup(M->msginfo, uid);
+		if (info && (info->status >= MESSAGE_STATUS_DELETE) && (! g_tree_lookup(M->ids, uid)))
+			g_tree_remove(M->msginfo, uid);
+		if (! g_list_next(l)) break;
+		l = g_list_next(l);
+	}
+
+	g_list_free_full(g_steal_pointer (&M->expunged), g_free);
 }
 
 gboolean _compare_data(gconstpointer a, gconstpointer b, gpointer UNUSED data)
@@ -314,7 +482,7 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 	TRY
 		db_begin_transaction(c); // we need read-committed isolation
 		state_load_metadata(M, c);
-		state_load_messages(M, c, true);
+		state_load_messages(M, c);
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -334,6 +502,12 @@ T MailboxState_new(Mempool_T pool, uint64_t id)
 
 /**
  * Update only the mailbox. 
+ *
+ * The message map of OldM is handed over to the new state and patched in
+ * place with the rows that changed since OldM was loaded. OldM is left
+ * with copies of the entries that changed, so the session can still diff
+ * the old view against the new one for its FETCH and EXPUNGE updates.
+ *
  * @param M
  * @return 
  */
@@ -343,7 +517,11 @@ T MailboxState_update(Mempool_T pool, T OldM)
 	T M; Connection_T c;
 	volatile int t = DM_SUCCESS;
 	gboolean freepool = FALSE;
+	Mempool_T mpool = pool;
 	uint64_t id;
+	GTree * volatile changes = NULL;
+	struct state_delta delta;
+	GList *k;
 	
 	/* differential mode, evaluate max iterations */
 	int mailbox_diffential_max_iterations = config_get_value_default_int("mailbox_update_strategy_2_max_iterations", "IMAP", 300); 
@@ -352,14 +530,13 @@ T MailboxState_update(Mempool_T pool, T OldM)
 		return MailboxState_new(pool, OldM->id);
 	} 
 
-	
-	if (! pool) {
-		pool = mempool_open();
+	if (! mpool) {
+		mpool = mempool_open();
 		freepool = TRUE;
 	}
 	id = OldM->id;
-	M = mempool_pop(pool, sizeof(*M));
-	M->pool = pool;
+	M = mempool_pop(mpool, sizeof(*M));
+	M->pool = mpool;
 	M->freepool = freepool;
 
 	if (! id) return M;
@@ -367,36 +544,38 @@ T MailboxState_update(Mempool_T pool, T OldM)
 	M->id = id;
 	M->recent_queue = g_tree_new((GCompareFunc)ucmp);
 
-	if (M->keywords) {
-		g_list_free_full(g_steal_pointer (&M->keywords), g_free);
-		M->keywords    = NULL;
-		//no need, those keywords will be populated at metadata
-		//@todo change this behaviour in state_load_metadata
-		//g_tree_copy_String(M->keywords,OldM->keywords);
+	/* the mailbox metadata is carried over and adjusted per change */
+	M->uidnext = OldM->uidnext;
+	M->owner_id = OldM->owner_id;
+	M->no_select = OldM->no_select;
+	M->no_children = OldM->no_children;
+	M->no_inferiors = OldM->no_inferiors;
+	M->recent = OldM->recent;
+	M->unseen = OldM->unseen;
+	M->is_subscribed = OldM->is_subscribed;
+	M->is_public = OldM->is_public;
+	M->is_users = OldM->is_users;
+	M->is_inbox = OldM->is_inbox;
+	if (OldM->name)
+		MailboxState_setName(M, p_string_str(OldM->name));
+	k = g_list_first(OldM->keywords);
+	while (k) {
+		MailboxState_addKeyword(M, (const char *)k->data);
+		if (! g_list_next(k)) break;
+		k = g_list_next(k);
 	}
-	M->msginfo     = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free, (GDestroyNotify)MessageInfo_free);
+
 	// increase differential iterations in order to apply mailbox_update_strategy_2_max_iterations
 	M->differential_iterations = OldM->differential_iterations + 1;
 	
-	// copy state_seq
-	M->state_seq = OldM->state_seq;
-	
 	TRACE(TRACE_DEBUG, "Strategy SEQ UPDATE, iterations %d", M->differential_iterations);
-	//M->ids     = g_tree_new_full((GCompareDataFunc)_compare_data,NULL,g_free,NULL);
-	//M->msn     = g_tree_new_full((GCompareDataFunc)_compare_data,NULL,g_free,NULL);
-
-	g_tree_merge(M->msginfo, OldM->msginfo, IST_SUBSEARCH_OR);
 
-	//MailboxState_remap(M);
-	/* reset the sequence */ 
-	MailboxState_resetSeq(OldM);
-	//uint64_t seq = MailboxState_getSeq(OldM);
-			
 	c = db_con_get();
 	TRY 
 		db_begin_transaction(c); // we need read-committed isolation
-		state_load_metadata(M, c);
-		state_load_messages(M, c, false); // do a soft refresh
+		db_getmailbox_seq(M, c);
+		db_getmailbox_permission(M, c);
+		changes = state_load_changes(M, OldM->state_seq, c);
 		db_commit_transaction(c);
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -407,10 +586,41 @@ T MailboxState_update(Mempool_T pool, T OldM)
 	END_TRY;
 
 	if (t == DM_EQUERY) {
-		TRACE(TRACE_ERR, "SEQ Error opening mailbox");
+		TRACE(TRACE_ERR, "SEQ Error updating mailbox");
+		state_changes_free((GTree **)&changes);
 		MailboxState_free(&M);
+		return MailboxState_new(pool, id);
 	}
 
+	/* take over the message map */
+	M->msginfo = OldM->msginfo;
+	M->ids = OldM->ids;
+	M->msn = OldM->msn;
+	M->expunged = g_steal_pointer (&OldM->expunged);
+	OldM->msginfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL,(GDestroyNotify)g_free,(GDestroyNotify)MessageInfo_free);
+	OldM->ids = NULL;
+	OldM->msn = NULL;
+	MailboxState_uid_msn_new(OldM);
+
+	state_drop_expunged(M);
+
+	memset(&delta, 0, sizeof(delta));
+	delta.M = M;
+	delta.O = OldM;
+	g_tree_foreach(changes, (GTraverseFunc)_apply_change, &delta);
+	g_tree_destroy(changes);
+
+	if (delta.first)
+		state_remap_tail(M, delta.first, g_list_reverse(delta.entered));
+	else
+		g_list_free(delta.entered);
+
+	M->exists = g_tree_nnodes(M->ids);
+	M->state_seq = M->seq;
+
+	TRACE(TRACE_DEBUG, "SEQ STATE [ %" PRIu64 " ] exists [%u] unseen [%u] recent [%u]", 
+			M->state_seq, M->exists, M->unseen, M->recent);
+
 	return M;
 }
 
@@ -442,7 +652,73 @@ void MailboxState_remap(T M)
 
 	g_list_free(g_list_first(ids));
 }
-	
+
+/* position of the first live uid >= from, or one past the end */
+static uint64_t state_msn_from(T M, uint64_t from)
+{
+	uint64_t lo = 1, hi = g_tree_nnodes(M->msn) + 1, mid, *uid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		uid = g_tree_lookup(M->msn, &mid);
+		if (*uid < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * renumber the msn map from the first position at or after uid from.
+ * The old tail is walked by msn, which is dense, so the cost is the
+ * length of the tail plus the entering uids; appends never touch
+ * existing entries. Takes ownership of the entered list.
+ */
+static void state_remap_tail(T M, uint64_t from, GList *entered)
+{
+	uint64_t last = g_tree_nnodes(M->msn);
+	uint64_t start = state_msn_from(M, from), rows, k;
+	GList *tail = NULL, *merged = NULL, *l;
+
+	for (k = start; k <= last; k++) {
+		uint64_t *uid = g_tree_lookup(M->msn, &k);
+		MessageInfo *msginfo = g_tree_lookup(M->msginfo, uid);
+		uint64_t *msn = g_tree_lookup(M->ids, uid);
+
+		if (msginfo && msginfo->status < MESSAGE_STATUS_DELETE)
+			tail = g_list_prepend(tail, uid);
+		g_tree_remove(M->msn, msn);
+		g_tree_remove(M->ids, uid);
+	}
+	tail = g_list_reverse(tail);
+
+	/* both lists are in uid order */
+	while (tail || entered) {
+		GList **from_list;
+		if (! entered || (tail && *(uint64_t *)tail->data < *(uint64_t *)entered->data))
+			from_list = &tail;
+		else
+			from_list = &entered;
+		l = *from_list;
+		*from_list = g_list_remove_link(*from_list, l);
+		merged = g_list_concat(l, merged);
+	}
+	merged = g_list_reverse(merged);
+
+	rows = start;
+	for (l = merged; l; l = g_list_next(l)) {
+		uint64_t *uid = l->data;
+		MessageInfo *msginfo = g_tree_lookup(M->msginfo, uid);
+		uint64_t *msn = g_new0(uint64_t,1);
+
+		*msn = msginfo->msn = rows++;
+		g_tree_insert(M->ids, uid, msn);
+		g_tree_insert(M->msn, msn, uid);
+	}
+	g_list_free(merged);
+}
+
 GTree * MailboxState_getMsginfo(T M)
 {
 	return M->msginfo;
@@ -475,6 +751,7 @@ void MailboxState_addMsginfo(T M, uint64_t uid, MessageInfo *msginfo)
 
 int MailboxState_removeUid(T M, uint64_t uid)
 {
+	uint64_t *msn;
 	MessageInfo *msginfo = g_tree_lookup(M->msginfo, &uid);
 	if (! msginfo) {
 		TRACE(TRACE_WARNING,"trying to remove unknown UID [%" PRIu64 "]", uid);
@@ -483,11 +760,176 @@ int MailboxState_removeUid(T M, uint64_t uid)
 	msginfo->status = MESSAGE_STATUS_DELETE;
 	M->exists--;
 
-	MailboxState_remap(M);
+	if ((msn = g_tree_lookup(M->ids, &uid))) {
+		uint64_t k, removed = *msn, last = g_tree_nnodes(M->msn);
+		g_tree_remove(M->msn, msn);
+		g_tree_remove(M->ids, &uid);
+		/* messages after the removed one move up one position; the
+		 * msn keys are dense, so only the tail is visited, and
+		 * shifting them in order keeps the tree sorted */
+		for (k = removed + 1; k <= last; k++) {
+			gpointer key, value;
+			if (g_tree_lookup_extended(M->msn, &k, &key, &value))
+				(*(uint64_t *)key)--;
+		}
+	}
 
 	return DM_SUCCESS;
 }
 
+static void SortInfo_free(SortInfo *s)
+{
+	g_free(s->arrival);
+	g_free(s->date);
+	g_free(s->from);
+	g_free(s->to);
+	g_free(s->cc);
+	g_free(s->subject);
+	g_free(s);
+}
+
+struct sortinfo_sync {
+	GTree *other;
+	GList *uids;
+};
+
+static gboolean _sortinfo_missing(uint64_t *uid, gpointer value UNUSED, struct sortinfo_sync *sync)
+{
+	if (! g_tree_lookup(sync->other, uid))
+		sync->uids = g_list_prepend(sync->uids, uid);
+	return FALSE;
+}
+
+static void state_load_sortinfo(T M, GTree *missing, uint64_t first, Connection_T c)
+{
+	PreparedStatement_T stmt;
+	ResultSet_T r;
+	Field_T frag;
+	SortInfo *info;
+	uint64_t uid;
+	const char *name, *value;
+	char **field;
+
+	date2char_str("p.internal_date", &frag);
+
+	/* one row per cached sort header, or a single row without any */
+	stmt = db_stmt_prepare(c,
+			"SELECT m.message_idnr, p.rfcsize, %s, n.headername, v.sortfield "
+			"FROM %smessages m "
+			"LEFT JOIN %sphysmessage p ON p.id = m.physmessage_id "
+			"LEFT JOIN %sheader h ON h.physmessage_id = m.physmessage_id "
+			"AND h.headername_id IN (SELECT id FROM %sheadername "
+			"WHERE headername IN ('from','to','cc','subject','date')) "
+			"LEFT JOIN %sheadername n ON h.headername_id = n.id "
+			"LEFT JOIN %sheadervalue v ON h.headervalue_id = v.id "
+			"WHERE m.mailbox_idnr = ? AND m.status < %d "
+			"AND m.message_idnr >= ?",
+			frag, DBPFX, DBPFX, DBPFX, DBPFX, DBPFX, DBPFX,
+			MESSAGE_STATUS_DELETE);
+	db_stmt_set_u64(stmt, 1, M->id);
+	db_stmt_set_u64(stmt, 2, first);
+	r = db_stmt_query(stmt);
+	while (db_result_next(r)) {
+		uid = db_result_get_u64(r, 0);
+		if (! g_tree_lookup(missing, &uid))
+			continue;
+		if (! (info = g_tree_lookup(M->sortinfo, &uid))) {
+			info = g_new0(SortInfo, 1);
+			info->uid = uid;
+			info->rfcsize = db_result_get_u64(r, 1);
+			info->arrival = g_strdup(db_result_get(r, 2));
+			g_tree_insert(M->sortinfo, &info->uid, info);
+		}
+
+		name = db_result_get(r, 3);
+		if (! (name && *name))
+			continue;
+
+		if (MATCH(name, "from"))
+			field = &info->from;
+		else if (MATCH(name, "to"))
+			field = &info->to;
+		else if (MATCH(name, "cc"))
+			field = &info->cc;
+		else if (MATCH(name, "subject"))
+			field = &info->subject;
+		else if (MATCH(name, "date"))
+			field = &info->date;
+		else
+			continue;
+
+		/* only the first header of a kind counts */
+		if (! *field && (value = db_result_get(r, 4)))
+			*field = g_strdup(value);
+	}
+}
+
+GTree * MailboxState_getSortinfo(T M)
+{
+	struct sortinfo_sync sync;
+	GTree *missing;
+	GList *l;
+	uint64_t first;
+	Connection_T c;
+	volatile int t = DM_SUCCESS;
+
+	if (! M->sortinfo)
+		M->sortinfo = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, NULL, (GDestroyNotify)SortInfo_free);
+
+	/* drop expunged messages */
+	sync.other = M->ids;
+	sync.uids = NULL;
+	g_tree_foreach(M->sortinfo, (GTraverseFunc)_sortinfo_missing, &sync);
+	for (l = sync.uids; l; l = g_list_next(l))
+		g_tree_remove(M->sortinfo, l->data);
+	g_list_free(sync.uids);
+
+	/* load newly arrived ones */
+	sync.other = M->sortinfo;
+	sync.uids = NULL;
+	g_tree_foreach(M->ids, (GTraverseFunc)_sortinfo_missing, &sync);
+	if (! sync.uids)
+		return M->sortinfo;
+
+	TRACE(TRACE_DEBUG, "mailbox [%" PRIu64 "] load sort keys for [%u] messages", 
+			M->id, g_list_length(sync.uids));
+
+	// collected in ascending order, so the lowest uid is last
+	first = *(uint64_t *)g_list_last(sync.uids)->data;
+	missing = g_tree_new((GCompareFunc)ucmp);
+	for (l = sync.uids; l; l = g_list_next(l))
+		g_tree_insert(missing, l->data, l->data);
+	g_list_free(sync.uids);
+
+	c = db_con_get();
+	TRY
+		state_load_sortinfo(M, missing, first, c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		t = DM_EQUERY;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	g_tree_destroy(missing);
+
+	if (t == DM_EQUERY) {
+		g_tree_destroy(M->sortinfo);
+		M->sortinfo = NULL;
+	}
+
+	return M->sortinfo;
+}
+
+void MailboxState_takeSortinfo(T M, T OldM)
+{
+	if (M == OldM || ! OldM->sortinfo || M->id != OldM->id)
+		return;
+	if (M->sortinfo)
+		g_tree_destroy(M->sortinfo);
+	M->sortinfo = g_steal_pointer (&OldM->sortinfo);
+}
+
 GTree * MailboxState_getIds(T M)
 {
 	return M->ids;
@@ -884,6 +1326,12 @@ void MailboxState_free(T *M)
 	if (s->msginfo) g_tree_destroy(s->msginfo);
 	s->msginfo = NULL;
 
+	if (s->expunged)
+		g_list_free_full(g_steal_pointer (&s->expunged), g_free);
+
+	if (s->sortinfo) g_tree_destroy(s->sortinfo);
+	s->sortinfo = NULL;
+
 	if (s->recent_queue) {
 		g_tree_foreach(s->recent_queue, (GTraverseFunc)_free_recent_queue, s);
 		g_tree_destroy(s->recent_queue);
@@ -58,6 +58,10 @@ struct MailboxState_T {
 	GTree *ids;
 	GTree *msn;
 	GTree *recent_queue;
+	// uids that left the msn map in the last differential reload
+	GList *expunged;
+	// SORT keys, loaded on demand and kept across reloads
+	GTree *sortinfo;
 };
 
 typedef struct T *T;
@@ -78,6 +82,8 @@ extern void         MailboxState_addMsginfo(T, uint64_t, MessageInfo *);
 extern GTree *      MailboxState_getMsginfo(T);
 extern GTree *      MailboxState_getIds(T);
 extern GTree *      MailboxState_getMsn(T);
+extern GTree *      MailboxState_getSortinfo(T);
+extern void         MailboxState_takeSortinfo(T, T);
 
 
 extern void         MailboxState_setId(T, uint64_t);
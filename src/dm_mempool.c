@@ -135,3 +135,124 @@ void mempool_close(M *MP)
 }
 
 #undef M
+
+/*
+ * Arena_T
+ *
+ * Memory is handed out from chunks by bumping an offset. Requests
+ * larger than a quarter chunk get a chunk of their own so they do not
+ * waste the rest of the current one. A reset keeps the first chunk for
+ * the next round and frees the others.
+ */
+#define A Arena_T
+
+#define ARENA_ALIGN 16
+#define ARENA_CHUNK 8192
+
+typedef struct Chunk {
+	struct Chunk *next;
+	size_t size;
+	size_t used;
+} Chunk;
+
+/* the data follows the header, rounded up to keep it aligned */
+#define CHUNK_HEADER ((sizeof(Chunk) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+#define CHUNK_DATA(c) ((char *)(c) + CHUNK_HEADER)
+
+struct A {
+	Chunk *head;		/* chunk being filled, older ones follow */
+	Chunk *first;		/* kept across resets */
+	size_t chunksize;
+};
+
+static Chunk * arena_chunk(size_t size)
+{
+	void *p;
+	Chunk *c;
+
+	if (posix_memalign(&p, ARENA_ALIGN, CHUNK_HEADER + size))
+		TRACE(TRACE_EMERG, "arena chunk of %zu bytes failed", size);
+	c = p;
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+A arena_new(size_t chunksize)
+{
+	A a = g_new0(struct A, 1);
+	a->chunksize = chunksize ? chunksize : ARENA_CHUNK;
+	a->head = a->first = arena_chunk(a->chunksize);
+	return a;
+}
+
+void * arena_alloc(A a, size_t size)
+{
+	Chunk *c = a->head;
+	void *block;
+
+	size = (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+
+	if (c->size - c->used < size) {
+		if (size > a->chunksize / 4) {
+			/* keep filling the current chunk */
+			c = arena_chunk(size);
+			c->next = a->head->next;
+			a->head->next = c;
+		} else {
+			c = arena_chunk(a->chunksize);
+			c->next = a->head;
+			a->head = c;
+		}
+	}
+
+	block = CHUNK_DATA(c) + c->used;
+	c->used += size;
+	memset(block, 0, size);
+	return block;
+}
+
+char * arena_strdup(A a, const char *s)
+{
+	size_t l;
+	char *d;
+
+	if (! s)
+		return NULL;
+	l = strlen(s);
+	d = arena_alloc(a, l + 1);
+	memcpy(d, s, l);
+	return d;
+}
+
+void arena_reset(A a)
+{
+	Chunk *c, *next;
+
+	for (c = a->head; c; c = next) {
+		next = c->next;
+		if (c != a->first)
+			free(c);
+	}
+	a->head = a->first;
+	a->first->next = NULL;
+	a->first->used = 0;
+}
+
+void arena_free(A *a)
+{
+	A arena = *a;
+	Chunk *c, *next;
+
+	if (! arena)
+		return;
+	for (c = arena->head; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	g_free(arena);
+	*a = NULL;
+}
+
+#undef A
@@ -36,4 +36,22 @@ extern void   mempool_close(M *);
 
 #undef M
 
+/*
+ * arena: bump allocator without locking, for memory that dies all at
+ * once with a command or a message. An arena must only be used by one
+ * thread at a time. Blocks are zeroed and aligned for any type; there
+ * is no free of a single block.
+ */
+#define A Arena_T
+
+typedef struct A *A;
+
+extern A      arena_new(size_t chunksize);
+extern void * arena_alloc(A, size_t);
+extern char * arena_strdup(A, const char *);
+extern void   arena_reset(A);
+extern void   arena_free(A *);
+
+#undef A
+
 #endif
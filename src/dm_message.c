@@ -155,7 +155,7 @@ static uint64_t blob_exists(const char *buf, const char *hash)
 			switch(message_part_hash){
 			case 0:
 				snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "data");
-				s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? AND %s limit 1",
+				s = db_stmt_prepare_cached(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? AND %s limit 1",
 						DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN),
 						blob_cmp);
 				db_stmt_set_str(s,1,hash);
@@ -163,7 +163,7 @@ static uint64_t blob_exists(const char *buf, const char *hash)
 				db_stmt_set_blob(s,3,buf,l);
 				break;
 			case 1:
-				s = db_stmt_prepare(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? limit 1",
+				s = db_stmt_prepare_cached(c,"SELECT id FROM %smimeparts WHERE hash=? AND %ssize%s=? limit 1",
 						DBPFX,db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN)
 					);
 				db_stmt_set_str(s,1,hash);
@@ -203,7 +203,8 @@ static uint64_t blob_insert(const char *buf, const char *hash)
 	c = db_con_get();
 	TRY
 		db_begin_transaction(c);
-		s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s) VALUES (?, ?, ?) %s",
+		/* counted for the partlists row register_blob is about to add */
+		s = db_stmt_prepare(c, "INSERT INTO %smimeparts (hash, data, %ssize%s, refcount) VALUES (?, ?, ?, 1) %s",
 				DBPFX, db_get_sql(SQL_ESCAPE_COLUMN), db_get_sql(SQL_ESCAPE_COLUMN), frag);
 		db_stmt_set_str(s, 1, hash);
 
@@ -230,7 +231,7 @@ static uint64_t blob_insert(const char *buf, const char *hash)
 	return id;
 }
 
-static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
+static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header, gboolean counted)
 {
 	Connection_T c; volatile gboolean t = FALSE;
 	c = db_con_get();
@@ -243,6 +244,10 @@ static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
 
 	TRY
 		db_begin_transaction(c);
+		/* a re-used part gains a reference. Parts that were never
+		 * counted (refcount NULL) stay that way until verified */
+		if (! counted)
+			db_exec(c, "UPDATE %smimeparts SET refcount = refcount + 1 WHERE id = %" PRIu64 "", DBPFX, id);
 		t = db_exec(c, "INSERT INTO %spartlists (physmessage_id, is_header, part_key, part_depth, part_order, part_id) "
 				"VALUES (%" PRIu64 ",%d,%d,%d,%d,%" PRIu64 ")", DBPFX,
 				dbmail_message_get_physid(m), is_header, m->part_key, m->part_depth, m->part_order, id);	
@@ -257,7 +262,7 @@ static int register_blob(DbmailMessage *m, uint64_t id, gboolean is_header)
 	return t;
 }
 
-static uint64_t blob_store(const char *buf)
+static uint64_t blob_store(const char *buf, gboolean *counted)
 {
 	uint64_t id;
 	char hash[FIELDSIZE];
@@ -269,11 +274,13 @@ static uint64_t blob_store(const char *buf)
 		return 0;
 
 	// store this message fragment
+	*counted = FALSE;
 	if ((id = blob_exists(buf, (const char *)hash)) != 0) {
 		return id;
 	}
 
 	if ((id = blob_insert(buf, (const char *)hash)) != 0) {
+		*counted = TRUE;
 		return id;
 	}
 	
@@ -283,6 +290,7 @@ static uint64_t blob_store(const char *buf)
 static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
 {
 	uint64_t id;
+	gboolean counted;
 
 	if (! buf) return 0;
 
@@ -296,11 +304,11 @@ static int store_blob(DbmailMessage *m, const char *buf, gboolean is_header)
 	TRACE(TRACE_DEBUG, "<blob is_header=\"%d\" part_depth=\"%d\" part_key=\"%d\" part_order=\"%d\">\n%s\n</blob>\n",
 			is_header, m->part_depth, m->part_key, m->part_order, buf);
 
-	if (! (id = blob_store(buf)))
+	if (! (id = blob_store(buf, &counted)))
 		return DM_EQUERY;
 
 	// register this message fragment
-	if (! register_blob(m, id, is_header))
+	if (! register_blob(m, id, is_header, counted))
 		return DM_EQUERY;
 
 	m->part_order++;
@@ -373,30 +381,33 @@ static gboolean find_boundary(const char *s, char *boundary)
 	return true;
 }
 
-static DbmailMessage * _mime_retrieve(DbmailMessage *self)
+/* \brief walk the mimeparts of a physmessage in order and hand the
+ * re-assembled message to a callback, one part or boundary at a time.
+ * The callback may return non-zero to stop the walk early.
+ * \return number of rows seen, or DM_EQUERY
+ */
+static int _mime_walk(uint64_t physid, char *internal_date, MessageStreamFunc emit, void *data)
 {
 	PreparedStatement_T stmt;
 	Connection_T c;
        	ResultSet_T r;
-	char internal_date[SQL_INTERNALDATE_LEN];
 	GMimeContentType *mimetype = NULL;
 	volatile int prevdepth, depth = 0, row = 0;
 	volatile int t = FALSE;
 	volatile gboolean got_boundary = FALSE, prev_boundary = FALSE, is_header = TRUE, prev_header;
-	volatile gboolean prev_is_message = FALSE, is_message = FALSE;
-	volatile String_T m = NULL, n = NULL;
+	volatile gboolean prev_is_message = FALSE, is_message = FALSE, stopped = FALSE;
 	const void *blob;
-	Field_T frag;
+	Field_T frag, escape;
 
-	assert(dbmail_message_get_physid(self));
+	memset(escape, 0, sizeof(escape));
 	date2char_str("ph.internal_date", &frag);
-	n = p_string_new(self->pool, "");
-	p_string_printf(n,db_get_sql(SQL_ENCODE_ESCAPE), "data");
+	snprintf(escape, sizeof(escape), db_get_sql(SQL_ENCODE_ESCAPE), "data");
 
 	c = db_con_get();
 	TRY
 		char boundary[MAX_MIME_BLEN];
 		char blist[MAX_MIME_DEPTH+1][MAX_MIME_BLEN];
+		char line[MAX_MIME_BLEN+8];
 
 		memset(&boundary, 0, sizeof(boundary));
 		memset(&blist, 0, sizeof(blist));
@@ -407,17 +418,16 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 				"JOIN %spartlists l ON p.id = l.part_id "
 				"JOIN %sphysmessage ph ON ph.id = l.physmessage_id "
 				"WHERE l.physmessage_id = ? ORDER BY l.part_key, l.part_order ASC, l.part_depth DESC", 
-				frag, p_string_str(n), DBPFX, DBPFX, DBPFX);
-		db_stmt_set_u64(stmt, 1, self->id);
+				frag, escape, DBPFX, DBPFX, DBPFX);
+		db_stmt_set_u64(stmt, 1, physid);
 		r = db_stmt_query(stmt);
 		
-		m = p_string_new(self->pool, "");
-
 		row = 0;
-		while (db_result_next(r)) {
+		while ((! stopped) && db_result_next(r)) {
 			int l;
 			int order;
 			int key;
+			char *str = NULL;
 
 			prevdepth	= depth;
 			prev_header	= is_header;
@@ -431,15 +441,16 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 
 			order		= db_result_get_int(r,2);
 			is_header	= db_result_get_bool(r,3);
-			if (row == 0) {
-				memset(internal_date, 0, sizeof(internal_date));
+			if (row == 0 && internal_date) {
+				memset(internal_date, 0, SQL_INTERNALDATE_LEN);
 				g_strlcpy(internal_date, db_result_get(r,4), SQL_INTERNALDATE_LEN-1);
 			}
 			blob		= db_result_get_blob(r,5,&l);
-			char *str = g_new0(char, l + 1);
-			str = strncpy(str, blob, l);
+			l		= strnlen(blob, l);
 
 			if (is_header) {
+				/* only headers need a terminated copy for parsing */
+				str = g_strndup(blob, l);
 				prev_boundary = got_boundary;
 				prev_is_message = is_message;
 				if ((mimetype = find_type(str))) {
@@ -456,9 +467,10 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 				strncpy(blist[depth], boundary, MAX_MIME_BLEN-1);
 			}
 
-			while ((prevdepth > 0) && (prevdepth-1 >= depth) && blist[prevdepth-1][0]) {
+			while ((! stopped) && (prevdepth > 0) && (prevdepth-1 >= depth) && blist[prevdepth-1][0]) {
 				TRACE(TRACE_DEBUG, "\n--%s at %d -> %d--\n", blist[prevdepth-1], prevdepth, prevdepth-1);
-				p_string_append_printf(m, "\n--%s--\n", blist[prevdepth-1]);
+				snprintf(line, sizeof(line), "\n--%s--\n", blist[prevdepth-1]);
+				stopped = emit(line, strlen(line), data);
 				memset(blist[prevdepth-1], 0, MAX_MIME_BLEN);
 				prevdepth--;
 			}
@@ -466,31 +478,35 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 			if ((depth > 0) && (blist[depth-1][0]))
 				strncpy(boundary, blist[depth-1], MAX_MIME_BLEN-1);
 
-			if (is_header){
+			if (is_header && (! stopped)) {
 				if (prev_header && depth>0 && !prev_is_message) {
 					TRACE(TRACE_DEBUG, "--%s\n", boundary);
-					p_string_append_printf(m, "--%s\n", boundary);
+					snprintf(line, sizeof(line), "--%s\n", boundary);
+					stopped = emit(line, strlen(line), data);
 				}else if (!prev_header || prev_boundary) {
 					TRACE(TRACE_DEBUG, "\n--%s\n", boundary);
-					p_string_append_printf(m, "\n--%s\n", boundary);
+					snprintf(line, sizeof(line), "\n--%s\n", boundary);
+					stopped = emit(line, strlen(line), data);
 				}
 			}
 
-			p_string_append_printf(m, "%s", str);
-			TRACE(TRACE_DEBUG, "<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%s\n</part>\n",
-				is_header, depth, key, order, str);
+			if (! stopped)
+				stopped = emit(blob, l, data);
+			TRACE(TRACE_DEBUG, "<part is_header=\"%d\" depth=\"%d\" key=\"%d\" order=\"%d\">\n%.*s\n</part>\n",
+				is_header, depth, key, order, l, (const char *)blob);
 
-			if (is_header)
-				p_string_append_printf(m,"\n");
+			if (is_header && (! stopped))
+				stopped = emit("\n", 1, data);
 			
 			g_free(str);
 			row++;
 		}
 
 		// Add final boundary delimiter line if required
-		if (row > 2 && blist[0][0]) {
+		if ((! stopped) && row > 2 && blist[0][0]) {
 			TRACE(TRACE_DEBUG, "\n--%s-- final\n", blist[0]);
-			p_string_append_printf(m, "\n--%s--\n", blist[0]);
+			snprintf(line, sizeof(line), "\n--%s--\n", blist[0]);
+			emit(line, strlen(line), data);
 		}
 
 	CATCH(SQLException)
@@ -500,19 +516,60 @@ static DbmailMessage * _mime_retrieve(DbmailMessage *self)
 		db_con_close(c);
 	END_TRY;
 
-	if ((row == 0) || (t == DM_EQUERY)) {
-		if (m) p_string_free(m, TRUE);
-		p_string_free(n, TRUE);
+	if (t == DM_EQUERY)
+		return t;
+
+	return row;
+}
+
+static int _mime_append(const char *buf, size_t len, void *data)
+{
+	p_string_append_len((String_T)data, buf, len);
+	return 0;
+}
+
+static DbmailMessage * _mime_retrieve(DbmailMessage *self)
+{
+	char internal_date[SQL_INTERNALDATE_LEN];
+	String_T m;
+	int rows;
+
+	assert(dbmail_message_get_physid(self));
+
+	m = p_string_new(self->pool, "");
+	rows = _mime_walk(self->id, internal_date, _mime_append, (void *)m);
+	if (rows <= 0) {
+		p_string_free(m, TRUE);
 		return NULL;
 	}
 
 	self = dbmail_message_init_with_string(self,p_string_str(m));
 	dbmail_message_set_internal_date(self, internal_date);
 	p_string_free(m,TRUE);
-	p_string_free(n,TRUE);
+
 	return self;
 }
 
+/* \brief stream a stored message to a callback part by part, without
+ * building it in memory first.
+ * \return
+ * 	- DM_SUCCESS on success, also when the callback stopped the walk
+ * 	- DM_EGENERAL if the message is not stored as mimeparts
+ * 	- DM_EQUERY on database failure
+ */
+int dbmail_message_stream(uint64_t physid, MessageStreamFunc emit, void *data)
+{
+	int rows;
+
+	assert(physid);
+	rows = _mime_walk(physid, NULL, emit, data);
+	if (rows == DM_EQUERY)
+		return DM_EQUERY;
+	if (rows == 0)
+		return DM_EGENERAL;
+	return DM_SUCCESS;
+}
+
 static gboolean store_mime_object(GMimeObject *parent, GMimeObject *object, DbmailMessage *m);
 
 static int store_head(GMimeObject *object, DbmailMessage *m)
@@ -694,6 +751,7 @@ DbmailMessage * dbmail_message_new(Mempool_T pool)
 	DbmailMessage *self = mempool_pop(pool, sizeof(DbmailMessage));
 	self->pool = pool;
 	self->freepool = freepool;
+	self->arena = arena_new(0);
 	
 	self->internal_date = time(NULL);
 	self->envelope_recipient = p_string_new(self->pool, "");
@@ -704,9 +762,9 @@ DbmailMessage * dbmail_message_new(Mempool_T pool)
 	/* provide quick case-sensitive header value searches */
 	self->header_value = g_tree_new((GCompareFunc)strcmp);
 	
-	/* internal cache: header_dict[headername.name] = headername.id */
-	self->header_dict = g_hash_table_new_full((GHashFunc)g_str_hash,
-			(GEqualFunc)g_str_equal, (GDestroyNotify)g_free, (GDestroyNotify)g_free);
+	/* internal cache: header_dict[headername.name] = headername.id,
+	 * keys and values live in the message arena */
+	self->header_dict = g_hash_table_new((GHashFunc)g_str_hash, (GEqualFunc)g_str_equal);
 	
 	/* set the charset */
 	self->charset = "utf-8";
@@ -741,6 +799,7 @@ void dbmail_message_free(DbmailMessage *self)
 	g_hash_table_destroy(self->header_dict);
 	g_tree_destroy(self->header_name);
 	g_tree_destroy(self->header_value);
+	arena_free(&self->arena);
 	
 	self->id=0;
 
@@ -1500,7 +1559,7 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 	}
 
 	case_header = g_strdup_printf(db_get_sql(SQL_STRCASE),"headername");
-	tmp = g_new0(uint64_t,1);
+	tmp = arena_alloc(self->arena, sizeof(uint64_t));
 
 	c = db_con_get();
 
@@ -1549,13 +1608,13 @@ static int _header_name_get_id(const DbmailMessage *self, const char *header, ui
 
 	if (t == DM_EQUERY) {
 		g_free(safe_header);
-		g_free(tmp);
 		return t;
 	}
 
 	*id = *tmp;
 	TRACE(TRACE_DEBUG,"Adding cache: [%s] [%lu]", safe_header, *tmp);
-	g_hash_table_insert(self->header_dict, (gpointer)(safe_header), (gpointer)(tmp));
+	g_hash_table_insert(self->header_dict, arena_strdup(self->arena, safe_header), (gpointer)(tmp));
+	g_free(safe_header);
 	return 1;
 }
 
@@ -1570,10 +1629,9 @@ static uint64_t _header_value_exists(Connection_T c, const char *value, const ch
 		/** Value greater then DM_ORA_MAX_BYTES_LOB_CMP will cause SQL exception */
 		return 0;
 	}
-	db_con_clear(c);
 	snprintf(blob_cmp, DEF_FRAGSIZE-1, db_get_sql(SQL_COMPARE_BLOB), "headervalue");
 
-	s = db_stmt_prepare(c, "SELECT id FROM %sheadervalue WHERE hash=? AND %s", DBPFX, blob_cmp);
+	s = db_stmt_prepare_cached(c, "SELECT id FROM %sheadervalue WHERE hash=? AND %s", DBPFX, blob_cmp);
 	db_stmt_set_str(s, 1, hash);
 	db_stmt_set_blob(s, 2, value, strlen(value));
 
@@ -1595,13 +1653,11 @@ static uint64_t _header_value_insert(Connection_T c, const char *value, const ch
 	if (datefield)
 		datesize = strlen(datefield);
 
-	db_con_clear(c);
-
 	frag = db_returning("id");
 	if (datesize)
-		s = db_stmt_prepare(c, "INSERT INTO %sheadervalue (hash, headervalue, sortfield, datefield) VALUES (?,?,?,?) %s", DBPFX, frag);
+		s = db_stmt_prepare_cached(c, "INSERT INTO %sheadervalue (hash, headervalue, sortfield, datefield) VALUES (?,?,?,?) %s", DBPFX, frag);
 	else
-		s = db_stmt_prepare(c, "INSERT INTO %sheadervalue (hash, headervalue, sortfield) VALUES (?,?,?) %s", DBPFX, frag);
+		s = db_stmt_prepare_cached(c, "INSERT INTO %sheadervalue (hash, headervalue, sortfield) VALUES (?,?,?) %s", DBPFX, frag);
 	g_free(frag);
 
 	db_stmt_set_str(s, 1, hash);
@@ -2997,7 +3053,7 @@ int send_forward_list(DbmailMessage *message, GList *targets, const char *from)
  *   - -1 on full failure
  */
 
-int insert_messages(DbmailMessage *message, List_T dsnusers)
+static int _insert_messages(DbmailMessage *message, List_T dsnusers)
 {
 	uint64_t tmpid;
 	int result=0;
@@ -3142,3 +3198,16 @@ int insert_messages(DbmailMessage *message, List_T dsnusers)
 	return 0;
 }
 
+/* delivery goes ahead of other work waiting for a database connection */
+int insert_messages(DbmailMessage *message, List_T dsnusers)
+{
+	DbPriority_T priority = db_con_get_priority();
+	int result;
+
+	db_con_priority(DB_PRIORITY_HIGH);
+	result = _insert_messages(message, dsnusers);
+	db_con_priority(priority);
+
+	return result;
+}
+
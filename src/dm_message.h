@@ -60,6 +60,7 @@ int dbmail_message_cache_headers(const DbmailMessage *message);
 gboolean dm_message_store(DbmailMessage *m);
 
 DbmailMessage * dbmail_message_retrieve(DbmailMessage *self, uint64_t physid);
+int dbmail_message_stream(uint64_t physid, MessageStreamFunc emit, void *data);
 
 /*
  * attribute accessors
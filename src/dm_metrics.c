@@ -0,0 +1,206 @@
+/*
+ Copyright (c) 2020-2025 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Counters are plain atomics. Command latencies go in a table keyed
+ * on the address of the command name, updated under a lock that is
+ * taken once per completed command. Everything else is gathered only
+ * when the metrics are rendered.
+ */
+
+#include "dbmail.h"
+#include "dm_metrics.h"
+
+#define THIS_MODULE "metrics"
+
+/* upper bounds of the latency buckets, in microseconds */
+static const uint64_t buckets[] = { 100, 1000, 10000, 100000, 1000000, 10000000 };
+#define BUCKETS (sizeof(buckets) / sizeof(buckets[0]))
+
+typedef struct {
+	const char *protocol;
+	const char *command;
+	uint64_t count;
+	uint64_t usec;
+	uint64_t hist[BUCKETS + 1];
+} CommandStats;
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} metric_desc[METRIC_LAST] = {
+	{ "dbmail_connections", "gauge", "Open client connections." },
+	{ "dbmail_connections_total", "counter", "Client connections accepted." },
+	{ "dbmail_received_bytes_total", "counter", "Octets read from clients." },
+	{ "dbmail_sent_bytes_total", "counter", "Octets written to clients." },
+	{ NULL, NULL, NULL },	/* caches are rendered together */
+	{ NULL, NULL, NULL },
+	{ NULL, NULL, NULL },
+	{ NULL, NULL, NULL },
+};
+
+static volatile gsize counters[METRIC_LAST];
+
+G_LOCK_DEFINE_STATIC(commands);
+static GHashTable *commands = NULL;	/* command name -> CommandStats */
+G_LOCK_DEFINE_STATIC(collectors);
+static GList *collectors = NULL;
+
+void metrics_add(Metric_T metric, gssize value)
+{
+	g_atomic_pointer_add(&counters[metric], value);
+}
+
+static uint64_t metrics_get(Metric_T metric)
+{
+	return (uint64_t)(gsize)g_atomic_pointer_get(&counters[metric]);
+}
+
+void metrics_command(const char *protocol, const char *command, uint64_t usec)
+{
+	CommandStats *s;
+	unsigned b;
+
+	for (b = 0; b < BUCKETS && usec > buckets[b]; b++)
+		;
+
+	G_LOCK(commands);
+	if (! commands)
+		commands = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	if (! (s = g_hash_table_lookup(commands, command))) {
+		s = g_new0(CommandStats, 1);
+		s->protocol = protocol;
+		s->command = command;
+		g_hash_table_insert(commands, (gpointer)command, s);
+	}
+	s->count++;
+	s->usec += usec;
+	s->hist[b]++;
+	G_UNLOCK(commands);
+}
+
+void metrics_collector(MetricsCollector collector)
+{
+	G_LOCK(collectors);
+	collectors = g_list_append(collectors, (gpointer)collector);
+	G_UNLOCK(collectors);
+}
+
+static void metrics_header(GString *out, const char *name, const char *type, const char *help)
+{
+	g_string_append_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_render_commands(GString *out)
+{
+	GHashTableIter iter;
+	gpointer value;
+	const char *name = "dbmail_command_duration_seconds";
+
+	metrics_header(out, name, "histogram", "Time from dispatch to completion of client commands.");
+
+	G_LOCK(commands);
+	if (commands) {
+		g_hash_table_iter_init(&iter, commands);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			CommandStats *s = (CommandStats *)value;
+			uint64_t cumulative = 0;
+			unsigned b;
+
+			for (b = 0; b < BUCKETS; b++) {
+				cumulative += s->hist[b];
+				g_string_append_printf(out, "%s_bucket{protocol=\"%s\",command=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+						name, s->protocol, s->command, (double)buckets[b] / G_USEC_PER_SEC, cumulative);
+			}
+			g_string_append_printf(out, "%s_bucket{protocol=\"%s\",command=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+					name, s->protocol, s->command, s->count);
+			g_string_append_printf(out, "%s_sum{protocol=\"%s\",command=\"%s\"} %.6f\n",
+					name, s->protocol, s->command, (double)s->usec / G_USEC_PER_SEC);
+			g_string_append_printf(out, "%s_count{protocol=\"%s\",command=\"%s\"} %" PRIu64 "\n",
+					name, s->protocol, s->command, s->count);
+		}
+	}
+	G_UNLOCK(commands);
+}
+
+static void metrics_render_db(GString *out)
+{
+	DbQueueStats_T q;
+	DbReplicaStats_T r;
+
+	db_con_stats(&q);
+	metrics_header(out, "dbmail_db_connections_limit", "gauge", "Database connections this process may hold.");
+	g_string_append_printf(out, "dbmail_db_connections_limit %u\n", q.limit);
+	metrics_header(out, "dbmail_db_connections_active", "gauge", "Database connections in use.");
+	g_string_append_printf(out, "dbmail_db_connections_active %u\n", q.active);
+	metrics_header(out, "dbmail_db_connections_waiting", "gauge", "Threads waiting for a database connection.");
+	g_string_append_printf(out, "dbmail_db_connections_waiting %u\n", q.waiting);
+	metrics_header(out, "dbmail_db_connections_admitted_total", "counter", "Database connections handed out.");
+	g_string_append_printf(out, "dbmail_db_connections_admitted_total %" PRIu64 "\n", q.admitted);
+	metrics_header(out, "dbmail_db_connections_waited_total", "counter", "Database connections that had to be waited for.");
+	g_string_append_printf(out, "dbmail_db_connections_waited_total %" PRIu64 "\n", q.waited);
+	metrics_header(out, "dbmail_db_connections_shed_total", "counter", "Requests refused because the database was busy.");
+	g_string_append_printf(out, "dbmail_db_connections_shed_total %" PRIu64 "\n", q.shed);
+	metrics_header(out, "dbmail_db_connection_wait_seconds_total", "counter", "Time spent waiting for database connections.");
+	g_string_append_printf(out, "dbmail_db_connection_wait_seconds_total %.6f\n", (double)q.wait_usec / G_USEC_PER_SEC);
+
+	db_replica_stats(&r);
+	if (! r.replicas)
+		return;
+	metrics_header(out, "dbmail_db_replica_reads_total", "counter", "Reads routed by the read replica logic.");
+	g_string_append_printf(out, "dbmail_db_replica_reads_total{target=\"replica\"} %" PRIu64 "\n", r.replica_reads);
+	g_string_append_printf(out, "dbmail_db_replica_reads_total{target=\"primary\"} %" PRIu64 "\n", r.reads - r.replica_reads);
+	metrics_header(out, "dbmail_db_replica_skipped_total", "counter", "Replicas passed over for lagging or failing.");
+	g_string_append_printf(out, "dbmail_db_replica_skipped_total{reason=\"lag\"} %" PRIu64 "\n", r.lagging);
+	g_string_append_printf(out, "dbmail_db_replica_skipped_total{reason=\"error\"} %" PRIu64 "\n", r.failures);
+	metrics_header(out, "dbmail_db_replica_lag", "gauge", "Mailbox modseq lag last seen on a replica.");
+	g_string_append_printf(out, "dbmail_db_replica_lag %" PRIu64 "\n", r.last_lag);
+}
+
+void metrics_render(GString *out)
+{
+	GList *l;
+	int i;
+
+	for (i = 0; i < METRIC_LAST; i++) {
+		if (! metric_desc[i].name)
+			continue;
+		metrics_header(out, metric_desc[i].name, metric_desc[i].type, metric_desc[i].help);
+		g_string_append_printf(out, "%s %" PRIu64 "\n", metric_desc[i].name, metrics_get(i));
+	}
+
+	metrics_header(out, "dbmail_cache_requests_total", "counter", "Cache lookups by outcome.");
+	g_string_append_printf(out, "dbmail_cache_requests_total{cache=\"statement\",result=\"hit\"} %" PRIu64 "\n",
+			metrics_get(METRIC_STMT_CACHE_HIT));
+	g_string_append_printf(out, "dbmail_cache_requests_total{cache=\"statement\",result=\"miss\"} %" PRIu64 "\n",
+			metrics_get(METRIC_STMT_CACHE_MISS));
+	g_string_append_printf(out, "dbmail_cache_requests_total{cache=\"pop3_listing\",result=\"hit\"} %" PRIu64 "\n",
+			metrics_get(METRIC_LISTING_CACHE_HIT));
+	g_string_append_printf(out, "dbmail_cache_requests_total{cache=\"pop3_listing\",result=\"miss\"} %" PRIu64 "\n",
+			metrics_get(METRIC_LISTING_CACHE_MISS));
+
+	metrics_render_commands(out);
+	metrics_render_db(out);
+
+	G_LOCK(collectors);
+	for (l = collectors; l; l = l->next)
+		((MetricsCollector)l->data)(out);
+	G_UNLOCK(collectors);
+}
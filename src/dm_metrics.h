@@ -0,0 +1,57 @@
+/*
+ Copyright (c) 2020-2025 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either
+ version 2 of the License, or (at your option) any later
+ version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * process wide metrics, rendered in the Prometheus text format
+ */
+
+#ifndef DM_METRICS_H
+#define DM_METRICS_H
+
+#include <glib.h>
+
+typedef enum {
+	METRIC_CONNECTIONS,		/* gauge: open client connections */
+	METRIC_CONNECTIONS_TOTAL,
+	METRIC_BYTES_RX,
+	METRIC_BYTES_TX,
+	METRIC_STMT_CACHE_HIT,
+	METRIC_STMT_CACHE_MISS,
+	METRIC_LISTING_CACHE_HIT,
+	METRIC_LISTING_CACHE_MISS,
+	METRIC_LAST
+} Metric_T;
+
+/* adds to a counter or gauge, atomically */
+void metrics_add(Metric_T metric, gssize value);
+
+/*
+ * count a completed command and its latency. protocol and command
+ * must be static strings, the command tables of the daemons.
+ */
+void metrics_command(const char *protocol, const char *command, uint64_t usec);
+
+/* append further metrics when rendering, e.g. thread pool state */
+typedef void (*MetricsCollector)(GString *out);
+void metrics_collector(MetricsCollector collector);
+
+/* render all metrics of this process */
+void metrics_render(GString *out);
+
+#endif
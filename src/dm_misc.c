@@ -162,6 +162,26 @@ int get_opened_fd_count(void)
 	#endif
 }
 
+int dm_private_dir(const char *dir)
+{
+	struct stat st;
+
+	if (g_mkdir_with_parents(dir, 0700) != 0) {
+		TRACE(TRACE_WARNING, "unable to create [%s]: %s", dir, strerror(errno));
+		return -1;
+	}
+	if (lstat(dir, &st) != 0) {
+		TRACE(TRACE_WARNING, "unable to stat [%s]: %s", dir, strerror(errno));
+		return -1;
+	}
+	if ((! S_ISDIR(st.st_mode)) || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		TRACE(TRACE_ERR, "refusing to use [%s]: not a directory owned by uid [%u] "
+				"and writable by it alone", dir, (unsigned)geteuid());
+		return -1;
+	}
+	return 0;
+}
+
 void create_unique_id(char *target, uint64_t message_idnr)
 {
 	char md5_str[FIELDSIZE];
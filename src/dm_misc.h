@@ -54,6 +54,17 @@ int drop_privileges(char *newuser, char *newgroup);
 */
 int get_opened_fd_count(void);
 
+/**
+   \brief check that a directory is private to the effective user,
+   creating it (mode 0700) if it does not exist
+   \param dir directory
+   \return
+        - -1 if it is missing, a symlink, owned by another user or
+	  writable by group or others
+	-  0 if it can be used for private state
+*/
+int dm_private_dir(const char *dir);
+
 /**
  * \brief create a unique id for a message (used for pop, stored per message)
  * \param target target string. Length should be UID_SIZE 
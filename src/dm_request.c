@@ -307,6 +307,10 @@ void Request_handle(T R)
 			R->cb = Http_getMailboxes;
 		else if (MATCH(R->controller,"messages"))
 			R->cb = Http_getMessages;
+		else if (MATCH(R->controller,"profile"))
+			R->cb = Http_getProfile;
+		else if (MATCH(R->controller,"metrics"))
+			R->cb = Http_getMetrics;
 	}
 
 	if (R->cb) {
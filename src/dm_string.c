@@ -67,11 +67,16 @@ static inline void append(T S, const char *s, va_list ap)
 }
 
 T p_string_new(Mempool_T pool, const char * s)
+{
+	assert(s);
+	return p_string_new_len(pool, s, strlen(s));
+}
+
+T p_string_new_len(Mempool_T pool, const char * s, size_t l)
 {
 	T S;
 	assert(pool);
 	assert(s);
-	size_t l = strlen(s);
 	S = mempool_pop(pool, sizeof(*S));
 	S->pool = pool;
 	S->len = l;
@@ -34,6 +34,7 @@
 typedef struct String_T *String_T;
 
 extern String_T        p_string_new(Mempool_T, const char *);
+extern String_T        p_string_new_len(Mempool_T, const char *, size_t);
 extern String_T        p_string_assign(String_T, const char *);
 extern void            p_string_printf(String_T, const char *, ...);
 extern void            p_string_append_printf(String_T, const char *, ...);
@@ -82,6 +82,8 @@ const char *IMAP_COMMANDS[] = {
 	"idle",
 	"starttls",
 	"id",
+	"compress",
+	"move",
 	"***NOMORE***"
 };
 
@@ -126,6 +128,8 @@ const IMAP_COMMAND_HANDLER imap_handler_functions[] = {
 	_ic_idle,
 	_ic_starttls,
 	_ic_id,
+	_ic_compress,
+	_ic_move,
 	NULL
 };
 
@@ -136,9 +140,23 @@ static int imap4_tokenizer(ImapSession *, char *);
 static int imap4(ImapSession *);
 static void imap_handle_input(ImapSession *);
 static void imap_handle_abort(ImapSession *);
+static void imap_unescape_args(ImapSession *);
+static void imap_pipeline_flush(ImapSession *);
 
 #define DEFERRED_MAX_LOOP 100
 
+/*
+ * pipelining (RFC 3501 5.5)
+ *
+ * While a command runs, complete commands already read from the
+ * client may start next to it, each on a forked session. Only
+ * commands that leave the session alone qualify: STATUS, NOOP
+ * outside a selected mailbox, and FETCH that doesn't set \Seen.
+ * Their output is held back and written in the order the commands
+ * were received.
+ */
+#define PIPELINE_MAX 16
+
 void imap_cleanup_deferred(gpointer data)
 {
 	int rx;
@@ -146,6 +164,14 @@ void imap_cleanup_deferred(gpointer data)
 	ImapSession *session = (ImapSession *)D->session;
 	ClientBase_T *ci = session->ci;
 
+	/* pipelined commands still use the session, the last one to
+	 * finish queues the cleanup again */
+	if (session->pipeline) {
+		TRACE(TRACE_DEBUG, "[%p] pipelined commands pending; defer cleanup", session);
+		session->pipe_cleanup = TRUE;
+		return;
+	}
+
 	ci->deferred++;
 
 	if (ci->rev) event_del(ci->rev);
@@ -271,10 +297,20 @@ void socket_read_cb(int UNUSED fd, short what, void *arg)
 
 // helpers
 //
+static void imap_command_done(ImapSession *session)
+{
+	if (session->command_type > IMAP_COMM_NONE && session->command_start) {
+		metrics_command("imap", IMAP_COMMANDS[session->command_type],
+				g_get_monotonic_time() - session->command_start);
+		session->command_start = 0;
+	}
+}
+
 static void imap_session_reset(ImapSession *session)
 {
 	ClientState_T current;
 
+	imap_command_done(session);
 	memset(session->tag, 0, sizeof(session->tag));
 	memset(session->command, 0, sizeof(session->command));
 
@@ -282,7 +318,9 @@ static void imap_session_reset(ImapSession *session)
 	session->command_type = 0;
 	session->command_state = FALSE;
 	session->parser_state = FALSE;
+	session->pipe_class = PIPE_NONE;
 	dbmail_imap_session_args_free(session, FALSE);
+	arena_reset(session->arena);
 
 	PLOCK(session->lock);
 	current = session->state;
@@ -415,7 +453,7 @@ static void imap_handle_continue(ImapSession *session)
 	if (session->state < CLIENTSTATE_LOGOUT) {
 		if (session->buff && p_string_len(session->buff) > 0) {
 			int e = 0;
-			if ((e = ci_write(session->ci, "%s", (char *)p_string_str(session->buff))) < 0) {
+			if ((e = ci_write_len(session->ci, p_string_str(session->buff), p_string_len(session->buff))) < 0) {
 				int serr = errno;
 				TRACE(TRACE_DEBUG,"ci_write returned error [%s]", strerror(serr));
 				imap_handle_abort(session);
@@ -427,6 +465,7 @@ static void imap_handle_continue(ImapSession *session)
 			ci_write(session->ci, NULL);
 		if (session->command_state == TRUE)
 			imap_session_reset(session);
+		imap_pipeline_flush(session);
 	} else {
 		dbmail_imap_session_buff_clear(session);
 	}				
@@ -447,6 +486,7 @@ static void imap_handle_retry(ImapSession *session)
 	dbmail_imap_session_buff_flush(session);
 	session->error_count++;	/* server returned BAD or NO response */
 	imap_session_reset(session);
+	imap_pipeline_flush(session);
 }
 
 static void imap_handle_done(ImapSession *session)
@@ -477,26 +517,265 @@ static void imap_handle_exit(ImapSession *session, int status)
 		case 2:
 			imap_handle_done(session);
 			break;
-		case 3: /* returning from starttls */
+		case 3: /* returning from starttls or compress */
 			imap_session_reset(session);
 			break;
 	}
 }
 
-#define FREE_ALLOC_BUF \
-	if (alloc_buf != NULL) { \
-		mempool_push(session->pool, alloc_buf, alloc_size); \
-		alloc_buf = NULL; \
-		alloc_size = 0; \
+static gboolean imap_fetch_readonly(const char *items)
+{
+	gchar *s, *p;
+	gboolean readonly = TRUE;
+
+	s = g_ascii_strup(items, -1);
+	if (strstr(s, "BODY[") || strstr(s, "BINARY[") || strstr(s, "VANISHED"))
+		readonly = FALSE;
+	for (p = s; readonly && (p = strstr(p, "RFC822")); p += 6) {
+		if (strncmp(p + 6, ".SIZE", 5) && strncmp(p + 6, ".HEADER", 7))
+			readonly = FALSE;
 	}
+	g_free(s);
 
+	return readonly;
+}
+
+int imap_pipeline_class(ImapSession *session, const char *line)
+{
+	gchar **tokens;
+	const char *command;
+	int class = PIPE_NONE;
+	size_t l = strlen(line);
+	ClientState_T state;
+
+	/* literals need a continuation, leave those to the main session */
+	while (l && (line[l-1] == '\n' || line[l-1] == '\r'))
+		l--;
+	if (l == 0 || line[l-1] == '}')
+		return PIPE_NONE;
+
+	tokens = g_strsplit(line, " ", 4);
+	if (! (tokens[0] && tokens[1]) || strlen(tokens[0]) >= sizeof(session->tag) || (! checktag(tokens[0]))) {
+		g_strfreev(tokens);
+		return PIPE_NONE;
+	}
+
+	PLOCK(session->lock);
+	state = session->state;
+	PUNLOCK(session->lock);
+
+	command = tokens[1];
+	g_strchomp(tokens[1]);
+	if (MATCH(command, "status")) {
+		if (state == CLIENTSTATE_AUTHENTICATED || state == CLIENTSTATE_SELECTED)
+			class = PIPE_INDEPENDENT;
+	} else if (MATCH(command, "noop")) {
+		if (state == CLIENTSTATE_AUTHENTICATED)
+			class = PIPE_INDEPENDENT;
+	} else if (state == CLIENTSTATE_SELECTED) {
+		if (MATCH(command, "fetch") && tokens[2] && tokens[3]) {
+			if (imap_fetch_readonly(tokens[3]))
+				class = PIPE_READER;
+		} else if (MATCH(command, "uid") && tokens[2] && tokens[3]) {
+			if (MATCH(tokens[2], "fetch") && imap_fetch_readonly(tokens[3]))
+				class = PIPE_READER;
+		}
+	}
+	g_strfreev(tokens);
+
+	return class;
+}
+
+/* class of the n-th complete line waiting in the read buffer */
+static int imap_pipeline_peek(ImapSession *session, int n)
+{
+	char line[MAX_LINESIZE];
+	const char *s, *nl;
+	size_t l;
+
+	if (session->ci->rbuff_size > 0)
+		return PIPE_NONE;
+
+	s = p_string_str(session->ci->read_buffer) + session->ci->read_buffer_offset;
+	while ((nl = strchr(s, '\n')) && n--)
+		s = nl + 1;
+	if (! nl)
+		return PIPE_NONE;
+
+	l = nl - s + 1;
+	if (l >= sizeof(line))
+		return PIPE_NONE;
+	memcpy(line, s, l);
+	line[l] = '\0';
+
+	return imap_pipeline_class(session, line);
+}
+
+/*
+ * the main session is busy from handing its command to a worker
+ * until _ic_cb_leave runs on the event thread. By then everything
+ * the worker queued for the client has been written.
+ */
+static gboolean imap_pipeline_busy(ImapSession *session)
+{
+	gboolean busy;
+
+	PLOCK(session->lock);
+	busy = session->pipe_busy;
+	PUNLOCK(session->lock);
+
+	return busy;
+}
+
+static gboolean imap_pipeline_pending(ImapSession *session)
+{
+	return (session->pipeline != NULL);
+}
+
+gboolean imap_pipeline_admit(ImapSession *session, int class)
+{
+	if (class == PIPE_NONE)
+		return FALSE;
+	if (g_list_length(session->pipeline) >= PIPELINE_MAX)
+		return FALSE;
+	if (! imap_pipeline_busy(session))
+		return TRUE;
+
+	/* a running FETCH refreshes the mailbox state first, so it
+	 * can't have readers next to it */
+	switch (session->pipe_class) {
+		case PIPE_INDEPENDENT:
+			return TRUE;
+		case PIPE_READER:
+			return (class == PIPE_INDEPENDENT);
+		default:
+			return FALSE;
+	}
+}
+
+/*
+ * send the output of finished pipelined commands, oldest first,
+ * once the command running on the main session has answered. It
+ * goes through the same queue as the output of the main session.
+ */
+static void imap_pipeline_flush(ImapSession *session)
+{
+	ImapSession *child;
+	GList *l;
+	int status;
+
+	if (imap_pipeline_busy(session))
+		return;
+
+	while (session->pipeline && (child = session->pipeline->data)->pipe_done) {
+		session->pipeline = g_list_delete_link(session->pipeline, session->pipeline);
+
+		child->out = g_list_reverse(child->out);
+		for (l = child->out; l; l = g_list_next(l)) {
+			if (session->state < CLIENTSTATE_LOGOUT)
+				dm_queue_push(dm_thread_data_sendmessage, session, l->data);
+			else
+				p_string_free((String_T)l->data, TRUE);
+		}
+		g_list_free(child->out);
+		child->out = NULL;
+
+		/* STATUS (HIGHESTMODSEQ) enables CONDSTORE */
+		if (child->enabled.condstore)
+			session->enabled.condstore = true;
+
+		status = child->pipe_status;
+		dbmail_imap_session_delete(&child);
+
+		if (status == 1)
+			session->error_count++;
+		else if (status < 0)
+			imap_handle_abort(session);
+	}
+}
+
+static void imap_pipeline_finish(ImapSession *child, int status)
+{
+	imap_command_done(child);
+	child->pipe_done = TRUE;
+	child->pipe_status = status;
+	dbmail_imap_session_buff_flush(child);
+	imap_pipeline_flush(child->parent);
+}
+
+void imap_pipeline_done(ImapSession *child, int status)
+{
+	ImapSession *session = child->parent;
+
+	imap_pipeline_finish(child, status);
+
+	if (imap_pipeline_pending(session))
+		return;
+
+	if (session->pipe_cleanup) {
+		session->pipe_cleanup = FALSE;
+		dm_queue_push(imap_cleanup_deferred, session, NULL);
+		return;
+	}
+
+	if (imap_pipeline_busy(session))
+		return;
+
+	if (session->state < CLIENTSTATE_LOGOUT) {
+		ci_uncork(session->ci);
+		if (p_string_len(session->ci->read_buffer) > 0)
+			imap_handle_input(session);
+	}
+}
+
+static void imap_pipeline_dispatch(ImapSession *session, char *line)
+{
+	ImapSession *child;
+	int j, result;
+
+	child = dbmail_imap_session_fork(session);
+	session->pipeline = g_list_append(session->pipeline, child);
+
+	if ((imap4_tokenizer(child, line) <= 0) || (! child->args)) {
+		dbmail_imap_session_buff_printf(child, "%s BAD parse error\r\n", child->tag);
+		imap_pipeline_finish(child, 1);
+		return;
+	}
+
+	for (j = IMAP_COMM_NONE; j < IMAP_COMM_LAST && strcasecmp(child->command, IMAP_COMMANDS[j]); j++);
+	if (j <= IMAP_COMM_NONE || j >= IMAP_COMM_LAST) {
+		dbmail_imap_session_buff_printf(child, "%s BAD no valid command\r\n", child->tag);
+		imap_pipeline_finish(child, 1);
+		return;
+	}
+
+	child->command_type = j;
+	child->command_state = FALSE;
+	child->command_start = g_get_monotonic_time();
+	imap_unescape_args(child);
+
+	TRACE(TRACE_INFO, "[%p] pipeline [%p] dispatch [%s]...\n", session, child, IMAP_COMMANDS[j]);
+	if ((result = (*imap_handler_functions[j]) (child)))
+		imap_pipeline_finish(child, result);
+}
+
+/* start what can run now from the commands the client already sent */
+static void imap_pipeline_input(ImapSession *session)
+{
+	char *line;
+
+	while (imap_pipeline_admit(session, imap_pipeline_peek(session, 0))) {
+		if (! (line = ci_readln_ref(session->ci)))
+			break;
+		imap_pipeline_dispatch(session, line);
+		if (session->state >= CLIENTSTATE_LOGOUT)
+			break;
+	}
+}
 
 void imap_handle_input(ImapSession *session)
 {
-	char buffer[MAX_LINESIZE];
-	char *alloc_buf = NULL;
-	uint64_t alloc_size = 0;
-	int l, result;
+	int result;
 
 	assert(session && session->ci && session->ci->write_buffer);
 
@@ -513,8 +792,9 @@ void imap_handle_input(ImapSession *session)
 	}
 
 	// command in progress
-	if (session->command_state == FALSE && session->parser_state == TRUE) {
+	if (imap_pipeline_busy(session)) {
 		TRACE(TRACE_DEBUG,"[%p] command in-progress", session);
+		imap_pipeline_input(session);
 		return;
 	}
 
@@ -522,23 +802,30 @@ void imap_handle_input(ImapSession *session)
 	if (session->command_state == TRUE)
 		imap_session_reset(session);
 
+	// pipelined commands running, or a run of them waiting
+	if ((! session->tag[0]) && (imap_pipeline_pending(session) ||
+				(imap_pipeline_peek(session, 0) == PIPE_READER && imap_pipeline_peek(session, 1) != PIPE_NONE))) {
+		TRACE(TRACE_DEBUG,"[%p] pipelining", session);
+		imap_pipeline_input(session);
+		if (imap_pipeline_pending(session))
+			return;
+	}
+
 
 	// Read in a line at a time if we don't have a string literal size defined
-	// Otherwise read in rbuff_size amount of data
+	// Otherwise read in rbuff_size amount of data. Both are used where they
+	// sit in the read buffer, without copying them out first.
 	while (TRUE) {
+		const char *literal = NULL;
 		char *input = NULL;
-		FREE_ALLOC_BUF
-		memset(buffer, 0, sizeof(buffer));
-
-		if (session->ci->rbuff_size <= 0) {
-			l = ci_readln(session->ci, buffer);
-		} else {
-			alloc_size = session->ci->rbuff_size+1;
-			alloc_buf = mempool_pop(session->pool, alloc_size);
-			l = ci_read(session->ci, alloc_buf, session->ci->rbuff_size);
-		}
+		size_t size = session->ci->rbuff_size;
+
+		if (size > 0)
+			literal = ci_read_ref(session->ci, size);
+		else
+			input = ci_readln_ref(session->ci);
 
-		if (l == 0) break; // done
+		if (! (input || literal)) break; // done
 
 		if (session->error_count >= MAX_FAULTY_RESPONSES) {
 			imap_session_printf(session, "* BYE [TRY RFC]\r\n");
@@ -546,9 +833,14 @@ void imap_handle_input(ImapSession *session)
 			break;
 		}
 
+		if (literal) {
+			imap4_tokenizer_literal(session, literal, size);
+			continue;
+		}
+
 		// session is in a IDLE loop
 		if (session->command_type == IMAP_COMM_IDLE  && session->command_state == IDLE) { 
-			if (strlen(buffer) > 4 && strncasecmp(buffer,"DONE",4)==0)
+			if (strlen(input) >= 4 && strncasecmp(input,"DONE",4)==0)
 				imap_session_printf(session, "%s OK IDLE terminated\r\n", session->tag);
 			else
 				imap_session_printf(session,"%s BAD Expecting DONE\r\n", session->tag);
@@ -559,15 +851,11 @@ void imap_handle_input(ImapSession *session)
 			continue;
 		}
 
-		if (alloc_buf != NULL)
-			input = alloc_buf;
-		else
-			input = buffer;
+		if (! session->tag[0])
+			session->pipe_class = imap_pipeline_class(session, input);
 
-		if (! imap4_tokenizer(session, input)) {
-			FREE_ALLOC_BUF
+		if (! imap4_tokenizer(session, input))
 			continue;
-		}
 
 		if ( session->parser_state < 0 ) {
 			imap_session_printf(session, "%s BAD parse error\r\n", session->tag);
@@ -580,6 +868,8 @@ void imap_handle_input(ImapSession *session)
 			TRACE(TRACE_DEBUG,"imap4 returned [%d]", result);
 			if (result || (session->command_type == IMAP_COMM_IDLE && session->command_state == IDLE)) { 
 				imap_handle_exit(session, result);
+			} else if (imap_pipeline_busy(session)) {
+				imap_pipeline_input(session);
 			}
 			break;
 		}
@@ -590,8 +880,6 @@ void imap_handle_input(ImapSession *session)
 		}
 	}
 
-	FREE_ALLOC_BUF
-
 	return;
 }
 
@@ -663,7 +951,7 @@ int imap4_tokenizer (ImapSession *session, char *buffer)
 	/* fetch the tag and command */
 	if (! *session->tag) {
 
-		if (strncmp(buffer, "\n", 1)==0 || strncmp(buffer, "\r\n", 2)==0)
+		if (strcmp(buffer, "\r")==0 || strncmp(buffer, "\n", 1)==0 || strncmp(buffer, "\r\n", 2)==0)
 			return 0;
 
 		session->parser_state = 0;
@@ -717,6 +1005,15 @@ void _ic_cb_leave(gpointer data)
 	dm_thread_data *D = (dm_thread_data *)data;
 	ImapSession *session = D->session;
 
+	if (session->parent) {
+		imap_pipeline_done(session, D->status);
+		return;
+	}
+
+	PLOCK(session->lock);
+	session->pipe_busy = FALSE;
+	PUNLOCK(session->lock);
+
 	PLOCK(session->ci->lock);
 	state = session->ci->client_state;
 	PUNLOCK(session->ci->lock);
@@ -751,6 +1048,7 @@ static void imap_unescape_args(ImapSession *session)
 		case IMAP_COMM_UNSUBSCRIBE:
 		case IMAP_COMM_STATUS:
 		case IMAP_COMM_COPY:
+		case IMAP_COMM_MOVE:
 		case IMAP_COMM_LOGIN:
 
 		for (i = 0; session->args[i]; i++) { 
@@ -806,6 +1104,7 @@ int imap4(ImapSession *session)
 	session->error_count = 0;
 	session->command_type = j;
 	session->command_state=FALSE; // unset command-is-done-state while command in progress
+	session->command_start = g_get_monotonic_time();
 
 	imap_unescape_args(session);
 
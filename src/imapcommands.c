@@ -134,6 +134,22 @@ static int check_state_and_args(ImapSession * self, int minargs, int maxargs, Cl
 
 
 
+/*
+ * load shedding: commands that read a lot from the database answer
+ * with a temporary failure while too many threads are queued for a
+ * connection, instead of making the queue longer
+ */
+static gboolean _ic_shed(dm_thread_data *D)
+{
+	SESSION_GET;
+	if (! db_con_shed())
+		return FALSE;
+	dbmail_imap_session_buff_printf(self, "%s NO [UNAVAILABLE] server busy, try again later\r\n", self->tag);
+	D->status = 1;
+	return TRUE;
+}
+
+
 /*
  * RETURN VALUES _ic_ functions:
  *
@@ -192,6 +208,39 @@ int _ic_starttls(ImapSession *self)
 	return i;
 }
 
+/*
+ * _ic_compress()
+ *
+ * RFC 4978 COMPRESS=DEFLATE
+ */
+int _ic_compress(ImapSession *self)
+{
+	int level, window;
+
+	if (!check_state_and_args(self, 1, 1, CLIENTSTATE_AUTHENTICATED)) return 1;
+	if (! MATCH(p_string_str(self->args[self->args_idx]), "DEFLATE")) {
+		ci_write(self->ci, "%s BAD unknown compression mechanism\r\n", self->tag);
+		return 1;
+	}
+	if (self->ci->deflate) {
+		ci_write(self->ci, "%s NO [COMPRESSIONACTIVE] DEFLATE active via COMPRESS\r\n", self->tag);
+		return 1;
+	}
+
+	level = config_get_value_default_int("compress_level", "IMAP", Z_DEFAULT_COMPRESSION);
+	window = config_get_value_default_int("compress_window", "IMAP", MAX_WBITS);
+	if (level == 0) {
+		ci_write(self->ci, "%s NO COMPRESS not available\r\n", self->tag);
+		return 1;
+	}
+
+	ci_write(self->ci, "%s OK DEFLATE active\r\n", self->tag);
+	if (ci_compress(self->ci, level, window) != DM_SUCCESS)
+		return -1;
+
+	return 3; /* done */
+}
+
 /*
  * _ic_noop()
  *
@@ -665,6 +714,10 @@ static void _ic_select_enter(dm_thread_data *D)
 	MailboxState_T S;
 	SESSION_GET;
 
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
 	if (_ic_select_parse_args(self)) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid parameter\r\n",
 				self->tag);
@@ -1280,6 +1333,10 @@ void _ic_list_enter(dm_thread_data *D)
 	char mailbox[IMAP_MAX_MAILBOX_NAMELEN];
 	const char *refname;
 
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
 	/* check if self->args are both empty strings, i.e. A001 LIST "" "" 
 	   this has special meaning; show root & delimiter */
 	if (p_string_len(self->args[0]) == 0 && p_string_len(self->args[1]) == 0) {
@@ -1457,6 +1514,10 @@ static void _ic_status_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
 	/* check final arg: should be ')' and no new '(' in between */
 	for (i = 2, endfound = 0; self->args[i]; i++) {
 		if (p_string_str(self->args[i])[0] == ')') {
@@ -1591,21 +1652,78 @@ int _ic_idle(ImapSession *self)
 
 /* _ic_append()
  *
- * append a message to a mailbox
+ * append one or more messages to a mailbox (RFC 3502 MULTIAPPEND)
  */
 
+/* only a full RFC 3501 date-time ("17-Jul-1996 02:44:25 -0700", the day
+ * may be space padded) is taken as one; any other string is a message,
+ * however short it is */
+static gboolean _append_is_date(const char *s)
+{
+	struct tm tm;
+	const char *end;
+
+	if (strlen(s) > 32)
+		return FALSE;
+
+	while (*s == ' ')
+		s++;
+
+	memset(&tm, 0, sizeof(tm));
+	if (! (end = strptime(s, "%d-%b-%Y %H:%M:%S %z", &tm)))
+		return FALSE;
+
+	while (*end == ' ')
+		end++;
+
+	return (*end == '\0');
+}
+
+static void _append_free(AppendMessage *A)
+{
+	if (A->keywords)
+		g_list_free_full(A->keywords, g_free);
+	g_free(A);
+}
+
+static GString * _append_uidset(GList *appends)
+{
+	GString *s = g_string_new("");
+	uint64_t first = 0, last = 0;
+
+	for (; appends; appends = g_list_next(appends)) {
+		uint64_t uid = ((AppendMessage *)appends->data)->uid;
+		if (first && uid == last + 1) {
+			last = uid;
+			continue;
+		}
+		if (first)
+			g_string_append_printf(s, "%s%" PRIu64, s->len ? "," : "", first);
+		if (first && last != first)
+			g_string_append_printf(s, ":%" PRIu64, last);
+		first = last = uid;
+	}
+	if (first)
+		g_string_append_printf(s, "%s%" PRIu64, s->len ? "," : "", first);
+	if (first && last != first)
+		g_string_append_printf(s, ":%" PRIu64, last);
+
+	return s;
+}
+
 void _ic_append_enter(dm_thread_data *D)
 {
-	uint64_t mboxid, message_id = 0;
+	uint64_t mboxid;
 	int i, j, result;
-	const char *internal_date = NULL;
-	int flaglist[IMAP_NFLAGS], flagcount = 0;
-	GList *keywords = NULL;
+	int flaglist[IMAP_NFLAGS];
+	gboolean haskeywords = FALSE;
+	GList *appends = NULL, *l;
+	GString *uidset;
 	MailboxState_T M;
 	SESSION_GET;
-	const char *message;
-	// gboolean recent = TRUE;
+	AppendMessage *A;
 	MessageInfo *info;
+	String_T buffer;
 
 	memset(flaglist,0,sizeof(flaglist));
 
@@ -1632,136 +1750,139 @@ void _ic_append_enter(dm_thread_data *D)
 		SESSION_RETURN;
 	}
 
+	/* each message: [flag-list] [date-time] literal */
 	i = 1;
+	while (self->args[i]) {
+		A = g_new0(AppendMessage, 1);
+		appends = g_list_append(appends, A);
 
-	/* check if a flag list has been specified */
-	if (p_string_str(self->args[i])[0] == '(') {
-		/* ok fetch the flags specified */
-		TRACE(TRACE_DEBUG, "[%p] flag list found:", self);
+		/* check if a flag list has been specified */
+		if (p_string_str(self->args[i])[0] == '(') {
+			/* ok fetch the flags specified */
+			TRACE(TRACE_DEBUG, "[%p] flag list found:", self);
 
-		i++;
-		while (self->args[i] && p_string_str(self->args[i])[0] != ')') {
-			const char *arg = p_string_str(self->args[i]);
-			TRACE(TRACE_DEBUG, "[%p] [%s]", self, arg);
-			for (j = 0; j < IMAP_NFLAGS; j++) {
-				if (MATCH(arg, imap_flag_desc_escaped[j])) {
-					flaglist[j] = 1;
-					flagcount++;
-					break;
+			i++;
+			while (self->args[i] && p_string_str(self->args[i])[0] != ')') {
+				const char *arg = p_string_str(self->args[i]);
+				TRACE(TRACE_DEBUG, "[%p] [%s]", self, arg);
+				for (j = 0; j < IMAP_NFLAGS; j++) {
+					if (MATCH(arg, imap_flag_desc_escaped[j])) {
+						A->flags[j] = 1;
+						flaglist[j] = 1;
+						break;
+					}
 				}
+				if (j == IMAP_NFLAGS) {
+					TRACE(TRACE_DEBUG,"[%p] found keyword [%s]", self, arg);
+					A->keywords = g_list_append(A->keywords,g_strdup(arg));
+					haskeywords = TRUE;
+				}
+
+				i++;
 			}
-			if (j == IMAP_NFLAGS) {
-				TRACE(TRACE_DEBUG,"[%p] found keyword [%s]", self, arg);
-				keywords = g_list_append(keywords,g_strdup(arg));
-				flagcount++;
-			}
 
+			if (self->args[i])
+				i++;
+			TRACE(TRACE_DEBUG, "[%p] )", self);
+		}
+
+		if (!self->args[i]) {
+			TRACE(TRACE_INFO, "[%p] unexpected end of arguments", self);
+			dbmail_imap_session_buff_printf(self, "%s BAD invalid arguments specified to APPEND\r\n", self->tag);
+			g_list_free_full(appends, (GDestroyNotify)_append_free);
+			D->status = 1;
+			SESSION_RETURN;
+		}
+
+		/* there could be a date here, followed by the message */
+		if (self->args[i + 1] && _append_is_date(p_string_str(self->args[i]))) {
+			A->internal_date = p_string_str(self->args[i]);
 			i++;
+			TRACE(TRACE_DEBUG, "[%p] internal date [%s] found, next arg [%s]",
+					self, A->internal_date, p_string_str(self->args[i]));
 		}
 
+		A->message = p_string_str(self->args[i]);
+		A->size = p_string_len(self->args[i]);
 		i++;
-		TRACE(TRACE_DEBUG, "[%p] )", self);
 	}
 
-	if (!self->args[i]) {
-		TRACE(TRACE_INFO, "[%p] unexpected end of arguments", self);
+	if (! appends) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid arguments specified to APPEND\r\n", self->tag);
 		D->status = 1;
 		SESSION_RETURN;
 	}
 
 	/** check ACL's for STORE */
-	if (flaglist[IMAP_FLAG_SEEN] == 1) {
-		if ((result = mailbox_check_acl(self, M, ACL_RIGHT_SEEN))) {
-			D->status = result;
-			SESSION_RETURN;
-		}
-	}
-	if (flaglist[IMAP_FLAG_DELETED] == 1) {
-		if ((result = mailbox_check_acl(self, M, ACL_RIGHT_DELETED))) {
-			D->status = result;
-			SESSION_RETURN;
-		}
-	}
-	if (flaglist[IMAP_FLAG_ANSWERED] == 1 ||
+	result = 0;
+	if (flaglist[IMAP_FLAG_SEEN] == 1)
+		result = mailbox_check_acl(self, M, ACL_RIGHT_SEEN);
+	if ((! result) && flaglist[IMAP_FLAG_DELETED] == 1)
+		result = mailbox_check_acl(self, M, ACL_RIGHT_DELETED);
+	if ((! result) && (flaglist[IMAP_FLAG_ANSWERED] == 1 ||
 	    flaglist[IMAP_FLAG_FLAGGED] == 1 ||
 	    flaglist[IMAP_FLAG_RECENT] == 1 ||
 	    flaglist[IMAP_FLAG_DRAFT] == 1 ||
-	    g_list_length(keywords) > 0) {
-		if ((result = mailbox_check_acl(self, M, ACL_RIGHT_WRITE))) {
-			D->status = result;
-			SESSION_RETURN;
-		}
-	}
-
-
-	/* there could be a literal date here, check if the next argument exists
-	 * if so, assume this is the literal date.
-	 */
-	if (self->args[i + 1]) {
-		internal_date = p_string_str(self->args[i]);
-		i++;
-		TRACE(TRACE_DEBUG, "[%p] internal date [%s] found, next arg [%s]",
-				self, internal_date, p_string_str(self->args[i]));
+	    haskeywords))
+		result = mailbox_check_acl(self, M, ACL_RIGHT_WRITE);
+	if (result) {
+		g_list_free_full(appends, (GDestroyNotify)_append_free);
+		D->status = result;
+		SESSION_RETURN;
 	}
 
-	message = p_string_str(self->args[i]);
-
-	D->status = db_append_msg(message, mboxid, self->userid, internal_date, &message_id);
+	TRACE(TRACE_DEBUG, "[%p] appending [%u] messages", self, g_list_length(appends));
 
-	switch (D->status) {
-	case -1:
+	switch (db_append_msgs(appends, mboxid, self->userid)) {
+	case DM_EQUERY:
 		TRACE(TRACE_ERR, "[%p] error appending msg", self);
 		dbmail_imap_session_buff_printf(self, "* BYE internal dbase error storing message\r\n");
+		g_list_free_full(appends, (GDestroyNotify)_append_free);
 		D->status=1;
 		SESSION_RETURN;
 		break;
 
-	case -2:
+	case DM_OVERQUOTA:
 		TRACE(TRACE_INFO, "[%p] quotum would exceed", self);
 		dbmail_imap_session_buff_printf(self, "%s NO not enough quotum left\r\n", self->tag);
+		g_list_free_full(appends, (GDestroyNotify)_append_free);
 		D->status=1;
 		SESSION_RETURN;
 		break;
-
-	case TRUE:
-		TRACE(TRACE_ERR, "[%p] faulty msg", self);
-		dbmail_imap_session_buff_printf(self, "%s NO invalid message specified\r\n", self->tag);
-		SESSION_RETURN;
-		break;
-	case FALSE:
-		if (flagcount) {
-			if (db_set_msgflag(message_id, flaglist, keywords, IMAPFA_ADD, 0, NULL) < 0)
-				TRACE(TRACE_ERR, "[%p] error setting flags for message [%" PRIu64 "]", self, message_id);
-			else
-				db_mailbox_seq_update(mboxid, message_id);
-		}
-		break;
 	}
 
-	if (message_id && self->state == CLIENTSTATE_SELECTED && self->mailbox->id == mboxid) {
+	if (self->state == CLIENTSTATE_SELECTED && self->mailbox->id == mboxid) {
 		dbmail_imap_session_mailbox_status(self, TRUE);
 	}
 
 	// MessageInfo
-	info = g_new0(MessageInfo,1);
-	info->uid = message_id;
-	info->mailbox_id = mboxid;
-	for (flagcount = 0; flagcount < IMAP_NFLAGS; flagcount++)
-		info->flags[flagcount] = flaglist[flagcount];
-	info->flags[IMAP_FLAG_RECENT] = 1;
-	strncpy(info->internaldate, 
-			internal_date?internal_date:"01-Jan-1970 00:00:01 +0100",
-		       	IMAP_INTERNALDATE_LEN-1);
-	info->rfcsize = strlen(message);
-	info->keywords = keywords;
-
-	MailboxState_addMsginfo(M, message_id, info);
-
-	char buffer[1024];
-	memset(buffer, 0, sizeof(buffer));
-	g_snprintf(buffer, 1023, "APPENDUID %" PRIu64 " %" PRIu64, mboxid, message_id);
-	SESSION_OK_WITH_RESP_CODE(buffer);
+	for (l = appends; l; l = g_list_next(l)) {
+		A = (AppendMessage *)l->data;
+		info = g_new0(MessageInfo,1);
+		info->uid = A->uid;
+		info->mailbox_id = mboxid;
+		for (j = 0; j < IMAP_NFLAGS; j++)
+			info->flags[j] = A->flags[j];
+		info->flags[IMAP_FLAG_RECENT] = 1;
+		strncpy(info->internaldate, 
+				A->internal_date?A->internal_date:"01-Jan-1970 00:00:01 +0100",
+				IMAP_INTERNALDATE_LEN-1);
+		info->rfcsize = A->size;
+		info->keywords = A->keywords;
+		A->keywords = NULL;
+
+		MailboxState_addMsginfo(M, A->uid, info);
+	}
+
+	uidset = _append_uidset(appends);
+	g_list_free_full(appends, (GDestroyNotify)_append_free);
+
+	buffer = p_string_new(self->pool, "");
+	p_string_printf(buffer, "APPENDUID %" PRIu64 " %s", mboxid, uidset->str);
+	g_string_free(uidset, TRUE);
+
+	SESSION_OK_WITH_RESP_CODE(p_string_str(buffer));
+	p_string_free(buffer, TRUE);
 	SESSION_RETURN;
 }
 
@@ -1933,6 +2054,11 @@ static void sorted_search_enter(dm_thread_data *D)
 
 	search_order order = self->order;
 
+	db_con_priority(DB_PRIORITY_LOW);
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
 	if ((result = mailbox_check_acl(self, self->mailbox->mbstate, ACL_RIGHT_READ))) {
 		D->status = result;
 		SESSION_RETURN;
@@ -1962,6 +2088,9 @@ static void sorted_search_enter(dm_thread_data *D)
 		dbmail_mailbox_set_uid(mb,self->use_uid);
 
 		if (dbmail_mailbox_build_imap_search(mb, self->args, &(self->args_idx), order) < 0) {
+			/* a failed SAVE leaves an empty saved result */
+			if (mb->result_options & SEARCH_RETURN_SAVE)
+				dbmail_mailbox_save_result(mb);
 			dbmail_imap_session_buff_printf(self, "%s BAD invalid arguments to %s\r\n",
 				self->tag, cmd);
 			D->status = 1;
@@ -1972,9 +2101,16 @@ static void sorted_search_enter(dm_thread_data *D)
 		switch(order) {
 			case SEARCH_SORTED:
 				dbmail_mailbox_sort(mb);
-				s = dbmail_mailbox_sorted_as_string(mb);
+				if (mb->result_options)
+					s = dbmail_mailbox_esort_as_string(mb);
+				else
+					s = dbmail_mailbox_sorted_as_string(mb);
 			break;
 			case SEARCH_UNORDERED:
+				if (mb->result_options) {
+					s = dbmail_mailbox_esearch_as_string(mb);
+					break;
+				}
 				t = dbmail_mailbox_ids_as_string(mb, FALSE, " ");
 				imap_modseq = dbmail_mailbox_imap_modseq_as_string(mb, FALSE);
 				s = g_strconcat(t, imap_modseq, NULL);
@@ -1985,14 +2121,43 @@ static void sorted_search_enter(dm_thread_data *D)
 				s = dbmail_mailbox_orderedsubject(mb);
 			break;
 			case SEARCH_THREAD_REFERENCES:
-				s = NULL; // TODO: unsupported
+				s = dbmail_mailbox_threadreferences(mb);
 			break;
 		}
 	} else {
 		TRACE(TRACE_DEBUG, "empty mailbox?");
+		mb->result_options = 0;
+		if ((order == SEARCH_SORTED || order == SEARCH_UNORDERED) &&
+				MATCH(p_string_str(self->args[self->args_idx]), "return")) {
+			/* still answer ESEARCH/ESORT with an empty result */
+			if (dbmail_mailbox_build_imap_search(mb, self->args, &(self->args_idx), order) < 0) {
+				if (mb->result_options & SEARCH_RETURN_SAVE)
+					dbmail_mailbox_save_result(mb);
+				dbmail_imap_session_buff_printf(self, "%s BAD invalid arguments to %s\r\n",
+					self->tag, cmd);
+				D->status = 1;
+				SESSION_RETURN;
+			}
+			if (order == SEARCH_SORTED)
+				s = dbmail_mailbox_esort_as_string(mb);
+			else
+				s = dbmail_mailbox_esearch_as_string(mb);
+		}
 	}
 
-	if (s) {
+	if (mb->result_options & SEARCH_RETURN_SAVE)
+		dbmail_mailbox_save_result(mb);
+
+	if (mb->result_options == SEARCH_RETURN_SAVE) {
+		/* RFC 5182: SAVE on its own returns no result data */
+		g_free(s);
+	} else if (mb->result_options) {
+		/* RFC 4731/5267 extended result */
+		dbmail_imap_session_buff_printf(self, "* ESEARCH (TAG \"%s\")%s%s%s\r\n",
+				self->tag, self->use_uid ? " UID" : "",
+				(s && *s) ? " " : "", s ? s : "");
+		g_free(s);
+	} else if (s) {
 		dbmail_imap_session_buff_printf(self, "* %s %s\r\n", cmd, s);
 		g_free(s);
 	} else {
@@ -2026,8 +2191,7 @@ int _ic_thread(ImapSession *self)
 	if (MATCH(p_string_str(self->args[self->args_idx]),"ORDEREDSUBJECT"))
 		return sorted_search(self,SEARCH_THREAD_ORDEREDSUBJECT);
 	if (MATCH(p_string_str(self->args[self->args_idx]),"REFERENCES"))
-		dbmail_imap_session_buff_printf(self, "%s BAD THREAD=REFERENCES not supported\r\n",self->tag);
-		//return sorted_search(self,SEARCH_THREAD_REFERENCES);
+		return sorted_search(self,SEARCH_THREAD_REFERENCES);
 
 	return 1;
 }
@@ -2036,7 +2200,9 @@ int _dm_imapsession_get_ids(ImapSession *self, const char *set)
 {
 	gboolean found = FALSE;
 	
-	dbmail_mailbox_set_uid(self->mailbox,self->use_uid);
+	/* the mailbox is shared with the main session when pipelined */
+	if (! self->parent)
+		dbmail_mailbox_set_uid(self->mailbox,self->use_uid);
 
 	if (self->ids) {
 		g_tree_destroy(self->ids);
@@ -2047,7 +2213,8 @@ int _dm_imapsession_get_ids(ImapSession *self, const char *set)
 
 	found = ( self->ids && (g_tree_nnodes(self->ids) > 0) );
 
-	if ( (! self->use_uid) && (! found)) {
+	/* "$" may well be empty */
+	if ( (! self->use_uid) && (! found) && (! MATCH(set, "$"))) {
 		dbmail_imap_session_buff_printf(self, "%s BAD invalid sequence in msn set [%s]\r\n", self->tag, set);
 		return DM_EGENERAL;
 	}
@@ -2074,6 +2241,10 @@ static void _ic_fetch_enter(dm_thread_data *D)
 	SESSION_GET;
 	int result, state, setidx;
 
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
 	self->fi->bodyfetch = p_list_new(self->pool);
 	self->fi->getUID = self->use_uid;
 
@@ -2109,7 +2280,10 @@ static void _ic_fetch_enter(dm_thread_data *D)
 		g_tree_destroy(vanished);
 	}
 
-	dbmail_imap_session_mailbox_status(self, FALSE);
+	/* pipelined fetches share the mailbox state read-only, the
+	 * next command on the main session picks up any changes */
+	if (! self->parent)
+		dbmail_imap_session_mailbox_status(self, FALSE);
 
 	if ((result = _dm_imapsession_get_ids(self, p_string_str(self->args[setidx]))) == DM_SUCCESS) {
 		self->ids_list = g_tree_keys(self->ids);
@@ -2119,7 +2293,8 @@ static void _ic_fetch_enter(dm_thread_data *D)
 	dbmail_imap_session_fetch_free(self, FALSE);
 	dbmail_imap_session_args_free(self, FALSE);
 
-	MailboxState_flush_recent(self->mailbox->mbstate);
+	if (! self->parent)
+		MailboxState_flush_recent(self->mailbox->mbstate);
 
 	if (result) {
 		D->status = result;
@@ -2257,6 +2432,10 @@ static void _ic_store_enter(dm_thread_data *D)
 	int startflags = 0, endflags = 0;
 	String_T buffer = NULL;
 
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
 	k = self->args_idx;
 
 	memset(&cmd, 0, sizeof(cmd));
@@ -2498,6 +2677,10 @@ static void _ic_copy_enter(dm_thread_data *D)
 	struct cmd_t cmd;
 	const char *src, *dst;
 
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
 	src = p_string_str(self->args[self->args_idx]);
 	dst = p_string_str(self->args[self->args_idx+1]);
 
@@ -2575,10 +2758,102 @@ int _ic_copy(ImapSession *self)
 	return 0;
 }
 
+/*
+ * _ic_move()
+ *
+ * move messages to another mailbox (RFC 6851)
+ */
+static void _ic_move_enter(dm_thread_data *D)
+{
+	SESSION_GET;
+	uint64_t destmboxid, modseq = 0;
+	int result;
+	MailboxState_T S;
+	const char *src, *dst;
+	GList *moved = NULL, *new_ids = NULL;
+	GString *old_ids_buff, *new_ids_buff;
+
+	if (_ic_shed(D)) {
+		SESSION_RETURN;
+	}
+
+	src = p_string_str(self->args[self->args_idx]);
+	dst = p_string_str(self->args[self->args_idx+1]);
+
+	if (! db_findmailbox(dst, self->userid, &destmboxid)) {
+		dbmail_imap_session_buff_printf(self, "%s NO [TRYCREATE] specified mailbox does not exist\r\n", self->tag);
+		D->status = 1;
+		SESSION_RETURN;
+	}
+
+	/* a move is a copy, a store of \Deleted and an expunge */
+	if ((result = mailbox_check_acl(self, self->mailbox->mbstate, ACL_RIGHT_READ)) ||
+			(result = mailbox_check_acl(self, self->mailbox->mbstate, ACL_RIGHT_DELETED)) ||
+			(result = mailbox_check_acl(self, self->mailbox->mbstate, ACL_RIGHT_EXPUNGE))) {
+		D->status = result;
+		SESSION_RETURN;
+	}
+
+	S = dbmail_imap_session_mbxinfo_lookup(self, destmboxid);
+	if ((result = mailbox_check_acl(self, S, ACL_RIGHT_INSERT))) {
+		D->status = result;
+		SESSION_RETURN;
+	}
+
+	if ((result = _dm_imapsession_get_ids(self, src)) == DM_SUCCESS && self->ids) {
+		if (dbmail_imap_session_mailbox_move(self, destmboxid, &moved, &new_ids, &modseq) != DM_SUCCESS) {
+			dbmail_imap_session_buff_printf(self, "* BYE move failed\r\n");
+			D->status = DM_EQUERY;
+			SESSION_RETURN;
+		}
+	}
+
+	if (result) {
+		D->status = result;
+		SESSION_RETURN;
+	}
+
+	if (moved) {
+		/* COPYUID goes out untagged, before the expunges it refers to */
+		old_ids_buff = g_list_join_u64(moved, ",");
+		new_ids_buff = g_list_join_u64(new_ids, ",");
+		dbmail_imap_session_buff_printf(self, "* OK [COPYUID %" PRIu64 " %s %s] moved\r\n",
+				destmboxid, old_ids_buff->str, new_ids_buff->str);
+		g_string_free(old_ids_buff, TRUE);
+		g_string_free(new_ids_buff, TRUE);
+		dbmail_imap_session_mailbox_moved(self, destmboxid, moved);
+	}
+
+	g_list_free(moved);
+	g_list_free_full(new_ids, g_free);
+
+	if (self->enabled.qresync && modseq) {
+		char *response = g_strdup_printf("HIGHESTMODSEQ %" PRIu64, modseq);
+		SESSION_OK_WITH_RESP_CODE(response);
+		g_free(response);
+	} else {
+		SESSION_OK;
+	}
+	SESSION_RETURN;
+}
+
+int _ic_move(ImapSession *self)
+{
+	if (!check_state_and_args(self, 2, 2, CLIENTSTATE_SELECTED)) return 1;
+
+	if (MailboxState_getPermission(self->mailbox->mbstate) != IMAPPERM_READWRITE) {
+		dbmail_imap_session_buff_printf(self, "%s NO you do not have write permission on this folder\r\n", self->tag);
+		return 1;
+	}
+
+	dm_thread_data_push((gpointer)self, _ic_move_enter, _ic_cb_leave, NULL);
+	return 0;
+}
+
 /*
  * _ic_uid()
  *
- * fetch/store/copy/search message UID's
+ * fetch/store/copy/move/search message UID's
  */
 int _ic_uid(ImapSession *self)
 {
@@ -2607,6 +2882,10 @@ int _ic_uid(ImapSession *self)
 		dbmail_imap_session_set_command(self, command);
 		self->args_idx++;
 		result = _ic_copy(self);
+	} else if (MATCH(command, "move")) {
+		dbmail_imap_session_set_command(self, command);
+		self->args_idx++;
+		result = _ic_move(self);
 	} else if (MATCH(command, "store")) {
 		dbmail_imap_session_set_command(self, command);
 		self->args_idx++;
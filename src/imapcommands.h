@@ -33,6 +33,7 @@
 
 /* any-state commands */
 int _ic_starttls(ImapSession *self);
+int _ic_compress(ImapSession *self);
 int _ic_capability(ImapSession *self);
 int _ic_noop(ImapSession *self);
 int _ic_logout(ImapSession *self);
@@ -67,6 +68,7 @@ int _ic_search(ImapSession *self);
 int _ic_fetch(ImapSession *self);
 int _ic_store(ImapSession *self);
 int _ic_copy(ImapSession *self);
+int _ic_move(ImapSession *self);
 int _ic_uid(ImapSession *self);
 int _ic_thread(ImapSession *self);
 
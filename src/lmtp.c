@@ -104,8 +104,13 @@ static void lmtp_handle_input(void *arg)
 			}
 
 			if (l > 0) {
+				int command_type = session->command_type, result;
+				gint64 start = g_get_monotonic_time();
+
 				ci_cork(session->ci);
-				if (lmtp(session) == -3) {
+				result = lmtp(session);
+				metrics_command("lmtp", commands[command_type], g_get_monotonic_time() - start);
+				if (result == -3) {
 					client_session_bailout(&session);
 					return;
 				}
@@ -91,6 +91,8 @@ static int do_vacuum_db(void);
 static int do_rehash(void);
 static int do_migrate(int migrate_limit);
 static int do_check_empty_envelope(void);
+static int do_verify_refcounts(void);
+static void gc_init(void);
 
 int do_showhelp(void) {
 	printf("*** dbmail-util ***\n");
@@ -120,6 +122,8 @@ int do_showhelp(void) {
 	"                              limit migration to [limit] number of\n"
 	"                              physmessages. Default 10000 per run\n"
 	"     --rehash                 Rebuild hash keys for stored messages\n"
+	"     --verify-refcounts       recount mimepart references, needed once after\n"
+	"                              upgrading before unused mimeparts are found\n"
 	"     --erase days             Delete messages older than date in INBOX/Trash \n"
 	"     --move  days             Move messages from INBOX to INBOX/Trash\n"
 	"     --inbox name             Inbox folder to move from, used in conjunction with --move\n"
@@ -147,6 +151,7 @@ int main(int argc, char *argv[])
 	int check_empty_envelope = 0;
 	char *timespec_iplog = NULL, *timespec_replycache = NULL;
 	int vacuum_db = 0, purge_deleted = 0, set_deleted = 0, dangling_aliases = 0, rehash = 0, move_old = 0, erase_old = 0;
+	int verify_refcounts = 0;
 	int show_help = 0;
 	int do_nothing = 1;
 	int is_header = 0;
@@ -165,6 +170,7 @@ int main(int argc, char *argv[])
 		{"migrate-legacy", no_argument, NULL, 'M'},
 		{"migrate-limit", required_argument, 0, 'm'},
 		{"rehash", no_argument, NULL, 0},
+		{"verify-refcounts", no_argument, NULL, 0},
 		{"move", required_argument, NULL, 0},
 		{"erase", required_argument, NULL, 0},
 		{"trash", required_argument, NULL, 0},
@@ -201,6 +207,8 @@ int main(int argc, char *argv[])
 			do_nothing = 0;
 			if (strcmp(long_options[opt_index].name,"rehash")==0)
 				rehash = 1;
+			if (strcmp(long_options[opt_index].name,"verify-refcounts")==0)
+				verify_refcounts = 1;
 
 			if (strcmp(long_options[opt_index].name,"move")==0) {
 				move_old = 1;
@@ -378,8 +386,11 @@ int main(int argc, char *argv[])
 	qverbosef("Ok. Connected.\n");
 	TRACE(TRACE_INFO, "Ok. Connected.");
 
+	gc_init();
+
 	if (erase_old) do_erase_old(days_erase, mbtrash_name);
 	if (move_old) do_move_old(days_move, mbinbox_name, mbtrash_name);
+	if (verify_refcounts) do_verify_refcounts();
 	if (check_integrity) do_check_integrity();
 	if (purge_deleted) do_purge_deleted();
 	if (is_header) do_header_cache();
@@ -522,63 +533,151 @@ static int db_set_deleted(void)
 	return db_update("UPDATE %smessages SET status = %d WHERE status = %d", DBPFX, MESSAGE_STATUS_PURGE, MESSAGE_STATUS_DELETE);
 }
 
-static int db_deleted_purge(void)
+/*
+ * purge and orphan collection run in chunks (see db_gc_chunked).
+ * The id reached in every table is written to the checkpoint file
+ * after each chunk, so a run that is interrupted resumes there.
+ */
+static GCParam_T gc;
+static GTree *gc_resume = NULL;
+static Field_T gc_file;
+
+static gboolean gc_print(const char *table, uint64_t *id, GString *s)
 {
-	return db_update("DELETE FROM %smessages WHERE status=%d", DBPFX, MESSAGE_STATUS_PURGE);
+	g_string_append_printf(s, "%s %" PRIu64 "\n", table, *id);
+	return FALSE;
 }
 
-static int db_deleted_count(uint64_t * rows)
+static void gc_save(const char *table, uint64_t id)
 {
-	Connection_T c; ResultSet_T r; volatile int t = FALSE;
-	assert(rows); *rows = 0;
+	GString *s = g_string_new("");
+	GError *err = NULL;
+	uint64_t *val = g_new0(uint64_t, 1);
 
-	c = db_con_get();
-	r = db_query(c, "SELECT COUNT(*) FROM %smessages WHERE status=%d", DBPFX, MESSAGE_STATUS_PURGE);
-	TRY
-		if (db_result_next(r)) {
-			*rows = db_result_get_int(r,0);
-			t = TRUE;
-		}
-	CATCH(SQLException)
-		LOG_SQLERROR;
-	FINALLY
-		db_con_close(c);
-	END_TRY;
+	*val = id;
+	g_tree_replace(gc_resume, g_strdup(table), val);
 
-	return t;
+	g_tree_foreach(gc_resume, (GTraverseFunc)gc_print, s);
+	if (! g_file_set_contents(gc_file, s->str, s->len, &err)) {
+		TRACE(TRACE_WARNING, "unable to write checkpoint [%s]: %s", gc_file, err->message);
+		g_error_free(err);
+	}
+	g_string_free(s, TRUE);
+}
+
+static uint64_t gc_load(const char *table)
+{
+	uint64_t *id = g_tree_lookup(gc_resume, table);
+	if (id && *id)
+		TRACE(TRACE_INFO, "resuming [%s] after id [%" PRIu64 "]", table, *id);
+	return id ? *id : 0;
+}
+
+static void gc_init(void)
+{
+	gchar *buf = NULL, *dir;
+	gchar **lines, **l;
+
+	gc.batch = max(config_get_value_default_int("gc_batch_size", "DBMAIL", 1000), 1);
+	gc.rate = max(config_get_value_default_int("gc_rate", "DBMAIL", 0), 0);
+	gc.checkpoint = gc_save;
+
+	if (config_get_value("gc_checkpoint", "DBMAIL", gc_file) < 0)
+		g_strlcpy(gc_file, DEFAULT_GC_CHECKPOINT, sizeof(gc_file));
+
+	gc_resume = g_tree_new_full((GCompareDataFunc)dm_strcmpdata, NULL, g_free, g_free);
+
+	/* a checkpoint others can write could make a run skip rows */
+	dir = g_path_get_dirname(gc_file);
+	if (dm_private_dir(dir) != 0) {
+		TRACE(TRACE_WARNING, "gc checkpoints disabled, [%s] is not private", dir);
+		qprintf("Warning: [%s] is not private, interrupted runs will start over.\n", dir);
+		gc.checkpoint = NULL;
+		g_free(dir);
+		return;
+	}
+	g_free(dir);
+
+	if (! g_file_get_contents(gc_file, &buf, NULL, NULL))
+		return;
+
+	lines = g_strsplit(buf, "\n", 0);
+	for (l = lines; *l; l++) {
+		char table[64];
+		uint64_t *id = g_new0(uint64_t, 1);
+		if (sscanf(*l, "%63s %" SCNu64, table, id) == 2)
+			g_tree_replace(gc_resume, g_strdup(table), id);
+		else
+			g_free(id);
+	}
+	g_strfreev(lines);
+	g_free(buf);
 }
 
 int do_purge_deleted(void)
 {
-	uint64_t deleted_messages;
+	int count;
 
 	if (no_to_all) {
 		qprintf("\nCounting messages with DELETE status...\n");
 		TRACE(TRACE_INFO, "Counting messages with DELETE status...");
-		if (! db_deleted_count(&deleted_messages)) {
+		if ((count = db_purge_deleted(FALSE, &gc)) < 0) {
 			qprintf ("Failed. An error occured. Please check log.\n");
 			TRACE(TRACE_INFO, "Failed. An error occured. Please check log.");
 			serious_errors = 1;
 			return -1;
 		}
-		qprintf("Ok. [%" PRIu64 "] messages have DELETE status.\n", deleted_messages);
-		TRACE(TRACE_INFO, "Ok. [%" PRIu64 "] messages have DELETE status.", deleted_messages);
+		qprintf("Ok. [%d] messages have DELETE status.\n", count);
+		TRACE(TRACE_INFO, "Ok. [%d] messages have DELETE status.", count);
 	}
 	if (yes_to_all) {
 		qprintf("\nDeleting messages with DELETE status...\n");
 		TRACE(TRACE_INFO, "Deleting messages with DELETE status...");
-		if (! db_deleted_purge()) {
+		gc.resume = gc_load("messages");
+		if ((count = db_purge_deleted(TRUE, &gc)) < 0) {
 			qprintf ("Failed. An error occured. Please check log.\n");
 			TRACE(TRACE_INFO, "Failed. An error occured. Please check log");
 			serious_errors = 1;
 			return -1;
 		}
-		qprintf("Ok. Messages deleted.\n");
-		TRACE(TRACE_INFO, "Ok. Messages deleted.");
+		qprintf("Ok. [%d] messages deleted.\n", count);
+		TRACE(TRACE_INFO, "Ok. [%d] messages deleted.", count);
 	}
 	return 0;
 }
 
+int do_verify_refcounts(void)
+{
+	time_t start, stop;
+	const char *action;
+	int threads, count;
+
+	action = yes_to_all ? "Repairing" : "Checking";
+	threads = max(config_get_value_default_int("gc_threads", "DBMAIL", 4), 1);
+
+	time(&start);
+	qprintf("\n%s DBMAIL mimeparts reference counts...\n", action);
+	TRACE(TRACE_INFO, "%s DBMAIL mimeparts reference counts...", action);
+	if ((count = db_verify_refcounts(yes_to_all, &gc, threads)) < 0) {
+		qprintf("Failed. An error occurred. Please check log.\n");
+		TRACE(TRACE_INFO, "Failed. An error occurred. Please check log.");
+		serious_errors = 1;
+		return -1;
+	}
+	qprintf("Ok. Found [%d] stale reference counts.\n", count);
+	TRACE(TRACE_INFO, "Ok. Found [%d] stale reference counts.", count);
+	if (count > 0 && yes_to_all) {
+		qprintf("Ok. Reference counts updated.\n");
+		TRACE(TRACE_INFO, "Ok. Reference counts updated.");
+	}
+
+	time(&stop);
+	qverbosef("--- %s reference counts took %g seconds\n",
+		action, difftime(stop, start));
+
+	return 0;
+}
+
 int do_set_deleted(void)
 {
 	uint64_t messages_set_to_delete;
@@ -747,7 +846,8 @@ int do_check_integrity(void)
 	time(&start);
 	qprintf("\n%s DBMAIL physmessage integrity...\n", action);
 	TRACE(TRACE_INFO, "%s DBMAIL physmessage integrity...", action);
-	if ((count = db_icheck_physmessages(cleanup)) < 0) {
+	gc.resume = gc_load("physmessage");
+	if ((count = db_icheck_physmessages(cleanup, &gc)) < 0) {
 		qprintf("Failed. An error occurred. Please check log.\n");
 		serious_errors = 1;
 		return -1;
@@ -769,7 +869,8 @@ int do_check_integrity(void)
 	start = stop;
 	qprintf("\n%s DBMAIL partlists integrity...\n", action);
 	TRACE(TRACE_INFO, "%s DBMAIL partlists integrity...", action);
-	if ((count = db_icheck_partlists(cleanup)) < 0) {
+	gc.resume = gc_load("partlists");
+	if ((count = db_icheck_partlists(cleanup, &gc)) < 0) {
 		qprintf("Failed. An error occurred. Please check log.\n");
 		TRACE(TRACE_INFO, "Failed. An error occurred. Please check log.");
 		serious_errors = 1;
@@ -795,7 +896,8 @@ int do_check_integrity(void)
 	start = stop;
 	qprintf("\n%s DBMAIL mimeparts integrity...\n", action);
 	TRACE(TRACE_INFO, "%s DBMAIL mimeparts integrity...", action);
-	if ((count = db_icheck_mimeparts(cleanup)) < 0) {
+	gc.resume = gc_load("mimeparts");
+	if ((count = db_icheck_mimeparts(cleanup, &gc)) < 0) {
 		qprintf("Failed. An error occurred. Please check log.\n");
 		serious_errors = 1;
 		return -1;
@@ -97,13 +97,277 @@ static void send_greeting(ClientSession_T *session)
 extern DBParam_T db_params;
 #define DBPFX db_params.pfx
 
+/*
+ * per-mailbox listing snapshots, reused for as long as the
+ * mailbox seq has not moved. They are kept in memory, and in a
+ * small file per mailbox so that other pop3 processes, and this
+ * one after a restart, can map them instead of querying.
+ */
+typedef struct {
+	uint64_t seq;
+	uint64_t totalsize;
+	time_t used;
+	GArray *messages;
+} Pop3Listing;
+
+#define LISTING_MAGIC 0x44504c31 /* DPL1 */
+
+typedef struct {
+	uint32_t magic;
+	uint32_t recsize;	/* sizeof(struct message) of the writer */
+	uint64_t mailbox_idnr;
+	uint64_t seq;
+	uint64_t totalsize;
+	uint64_t count;
+} Pop3ListingHeader;
+
+G_LOCK_DEFINE_STATIC(listings);
+static GTree *listings = NULL;
+
+static void _listing_free(gpointer data)
+{
+	Pop3Listing *l = (Pop3Listing *)data;
+	g_array_free(l->messages, TRUE);
+	g_free(l);
+}
+
+static GArray * _listing_copy(GArray *messages)
+{
+	GArray *copy = g_array_sized_new(FALSE, FALSE, sizeof(struct message), messages->len);
+	g_array_append_vals(copy, messages->data, messages->len);
+	return copy;
+}
+
+static gboolean _listing_oldest(gpointer key, gpointer value, gpointer data)
+{
+	gpointer *oldest = (gpointer *)data;
+	Pop3Listing *l = (Pop3Listing *)value;
+
+	if ((! oldest[1]) || (l->used < ((Pop3Listing *)oldest[1])->used)) {
+		oldest[0] = key;
+		oldest[1] = value;
+	}
+	return FALSE;
+}
+
+static void _listing_remember(uint64_t mailbox_idnr, uint64_t seq, ClientSession_T *session)
+{
+	Pop3Listing *l;
+	uint64_t *id;
+	int size = config_get_value_default_int("listing_cache", "POP", 64);
+
+	if (size <= 0)
+		return;
+
+	l = g_new0(Pop3Listing, 1);
+	l->seq = seq;
+	l->totalsize = session->totalsize;
+	l->used = time(NULL);
+	l->messages = _listing_copy(session->messages);
+
+	id = g_new0(uint64_t, 1);
+	*id = mailbox_idnr;
+
+	G_LOCK(listings);
+	if (! listings)
+		listings = g_tree_new_full((GCompareDataFunc)ucmpdata, NULL, g_free, _listing_free);
+	if (g_tree_nnodes(listings) >= size && (! g_tree_lookup(listings, id))) {
+		gpointer oldest[2] = { NULL, NULL };
+		g_tree_foreach(listings, _listing_oldest, oldest);
+		if (oldest[0])
+			g_tree_remove(listings, oldest[0]);
+	}
+	g_tree_replace(listings, id, l);
+	G_UNLOCK(listings);
+}
+
+static char * _listing_file(uint64_t mailbox_idnr)
+{
+	char *file, *dir;
+
+	if (! (file = db_listing_file(mailbox_idnr)))
+		return NULL;
+
+	/* other users must not be able to plant or alter listings */
+	dir = g_path_get_dirname(file);
+	if (dm_private_dir(dir) != 0) {
+		g_free(file);
+		file = NULL;
+	}
+	g_free(dir);
+
+	return file;
+}
+
+static gboolean _listing_load(uint64_t mailbox_idnr, uint64_t seq, ClientSession_T *session)
+{
+	Pop3ListingHeader *h;
+	struct stat st;
+	struct message *msg;
+	void *map;
+	char *file;
+	size_t records;
+	guint i;
+	int fd;
+	gboolean found = FALSE;
+
+	if (! (file = _listing_file(mailbox_idnr)))
+		return FALSE;
+
+	fd = open(file, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		g_free(file);
+		return FALSE;
+	}
+
+	if (fstat(fd, &st) != 0 || (! S_ISREG(st.st_mode)) || st.st_uid != geteuid()
+			|| (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		TRACE(TRACE_WARNING, "ignoring listing [%s]: not a private file", file);
+		close(fd);
+		g_free(file);
+		return FALSE;
+	}
+
+	if ((size_t)st.st_size < sizeof(Pop3ListingHeader)
+			|| ((size_t)st.st_size - sizeof(Pop3ListingHeader)) % sizeof(struct message)) {
+		close(fd);
+		unlink(file);
+		g_free(file);
+		return FALSE;
+	}
+	records = ((size_t)st.st_size - sizeof(Pop3ListingHeader)) / sizeof(struct message);
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		g_free(file);
+		return FALSE;
+	}
+
+	h = (Pop3ListingHeader *)map;
+	if (h->magic == LISTING_MAGIC
+			&& h->recsize == sizeof(struct message)
+			&& h->mailbox_idnr == mailbox_idnr
+			&& h->seq == seq
+			&& h->count == records) {
+		session->messages = g_array_sized_new(FALSE, FALSE, sizeof(struct message), records);
+		g_array_append_vals(session->messages, (char *)map + sizeof(Pop3ListingHeader), records);
+		/* only a hint: keep the records well formed, the ids are
+		 * checked against the mailbox when they are used */
+		for (i = 0; i < session->messages->len; i++) {
+			msg = &g_array_index(session->messages, struct message, i);
+			msg->messageid = i + 1;
+			msg->uidl[UID_SIZE - 1] = '\0';
+			msg->virtual_messagestatus = msg->messagestatus;
+		}
+		session->totalsize = h->totalsize;
+		found = TRUE;
+	} else if (h->magic != LISTING_MAGIC
+			|| h->recsize != sizeof(struct message)
+			|| h->seq < seq) {
+		/* unreadable, or the mailbox changed since: no use to anyone.
+		 * A newer one was written after our seq was read, leave it */
+		unlink(file);
+	}
+
+	munmap(map, st.st_size);
+	g_free(file);
+
+	return found;
+}
+
+static void _listing_store(uint64_t mailbox_idnr, uint64_t seq, ClientSession_T *session)
+{
+	Pop3ListingHeader h;
+	GString *buf;
+	char *file, *tmp;
+	const char *p;
+	size_t left;
+	ssize_t n;
+	int fd;
+
+	if (! (file = _listing_file(mailbox_idnr)))
+		return;
+
+	memset(&h, 0, sizeof(h));
+	h.magic = LISTING_MAGIC;
+	h.recsize = sizeof(struct message);
+	h.mailbox_idnr = mailbox_idnr;
+	h.seq = seq;
+	h.totalsize = session->totalsize;
+	h.count = session->messages->len;
+
+	buf = g_string_sized_new(sizeof(h) + h.count * sizeof(struct message));
+	g_string_append_len(buf, (const char *)&h, sizeof(h));
+	g_string_append_len(buf, session->messages->data, h.count * sizeof(struct message));
+
+	/* written to a temporary file and renamed, readers never see a
+	 * partial listing. Not synced: this is on the login path, and a
+	 * listing lost in a crash is simply built again */
+	tmp = g_strdup_printf("%s.XXXXXX", file);
+	if ((fd = g_mkstemp_full(tmp, O_WRONLY, 0600)) < 0) {
+		TRACE(TRACE_WARNING, "unable to write listing [%s]: %s", tmp, strerror(errno));
+	} else {
+		for (p = buf->str, left = buf->len; left; p += n, left -= n) {
+			if ((n = write(fd, p, left)) < 0) {
+				if (errno == EINTR) {
+					n = 0;
+					continue;
+				}
+				break;
+			}
+		}
+		if (left) {
+			TRACE(TRACE_WARNING, "unable to write listing [%s]: %s", tmp, strerror(errno));
+			unlink(tmp);
+		} else if (rename(tmp, file) != 0) {
+			TRACE(TRACE_WARNING, "unable to rename listing [%s]: %s", tmp, strerror(errno));
+			unlink(tmp);
+		}
+		close(fd);
+	}
+
+	g_free(tmp);
+	g_string_free(buf, TRUE);
+	g_free(file);
+}
+
+static gboolean _listing_get(uint64_t mailbox_idnr, uint64_t seq, ClientSession_T *session)
+{
+	Pop3Listing *l;
+	gboolean found = FALSE;
+
+	G_LOCK(listings);
+	if (listings && (l = g_tree_lookup(listings, &mailbox_idnr))) {
+		if (l->seq == seq) {
+			session->messages = _listing_copy(l->messages);
+			session->totalsize = l->totalsize;
+			l->used = time(NULL);
+			found = TRUE;
+		} else {
+			g_tree_remove(listings, &mailbox_idnr);
+		}
+	}
+	G_UNLOCK(listings);
+
+	if ((! found) && (found = _listing_load(mailbox_idnr, seq, session)))
+		_listing_remember(mailbox_idnr, seq, session);
+
+	return found;
+}
+
+static void _listing_put(uint64_t mailbox_idnr, uint64_t seq, ClientSession_T *session)
+{
+	_listing_remember(mailbox_idnr, seq, session);
+	_listing_store(mailbox_idnr, seq, session);
+}
+
 static int db_createsession(uint64_t user_idnr, ClientSession_T * session)
 {
 	Connection_T c; ResultSet_T r; volatile int t = DM_SUCCESS;
-	struct message *tmpmessage;
-	volatile int message_counter = 0;
+	struct message tmpmessage;
 	const char *query_result;
-	uint64_t mailbox_idnr;
+	uint64_t mailbox_idnr, seq = 0;
 	INIT_QUERY;
 
 	if (db_find_create_mailbox("INBOX", BOX_DEFAULT, user_idnr, &mailbox_idnr) < 0) {
@@ -113,6 +377,26 @@ static int db_createsession(uint64_t user_idnr, ClientSession_T * session)
 
 	g_return_val_if_fail(mailbox_idnr > 0, DM_EQUERY);
 
+	session->mailbox_idnr = mailbox_idnr;
+	session->totalmessages = 0;
+	session->totalsize = 0;
+
+	/* read the seq before the listing, so a change in between
+	 * only ever makes the snapshot look older than it is */
+	if (db_get_mailbox_seq(mailbox_idnr, &seq) == DM_EQUERY)
+		return DM_EQUERY;
+
+	if (_listing_get(mailbox_idnr, seq, session)) {
+		metrics_add(METRIC_LISTING_CACHE_HIT, 1);
+		TRACE(TRACE_DEBUG, "listing for mailbox [%" PRIu64 "] seq [%" PRIu64 "] from cache",
+				mailbox_idnr, seq);
+		session->totalmessages = session->messages->len;
+		session->virtual_totalmessages = session->totalmessages;
+		session->virtual_totalsize = session->totalsize;
+		return DM_EGENERAL;
+	}
+	metrics_add(METRIC_LISTING_CACHE_MISS, 1);
+
 	/* query is < MESSAGE_STATUS_DELETE  because we don't want deleted 
 	 * messages
 	 */
@@ -125,40 +409,35 @@ static int db_createsession(uint64_t user_idnr, ClientSession_T * session)
 		 "ORDER BY msg.message_idnr ASC",DBPFX,DBPFX,
 		 mailbox_idnr, MESSAGE_STATUS_DELETE);
 
+	session->messages = g_array_new(FALSE, FALSE, sizeof(struct message));
+
 	c = db_con_get();
 	TRY
 		r = db_query(c, query);
 
-		session->totalmessages = 0;
-		session->totalsize = 0;
-
-		/* messagecounter is total message, +1 tot end at message 1 */
-		message_counter = 1;
-
 		/* filling the list */
 		TRACE(TRACE_DEBUG, "adding items to list");
 		while (db_result_next(r)) {
-			tmpmessage = mempool_pop(session->pool, sizeof(struct message));
+			memset(&tmpmessage, 0, sizeof(tmpmessage));
 			/* message size */
-			tmpmessage->msize = db_result_get_u64(r,0);
+			tmpmessage.msize = db_result_get_u64(r,0);
 			/* real message id */
-			tmpmessage->realmessageid = db_result_get_u64(r,1);
+			tmpmessage.realmessageid = db_result_get_u64(r,1);
 			/* message status */
-			tmpmessage->messagestatus = db_result_get_u64(r,2);
+			tmpmessage.messagestatus = db_result_get_u64(r,2);
 			/* virtual message status */
-			tmpmessage->virtual_messagestatus = tmpmessage->messagestatus;
+			tmpmessage.virtual_messagestatus = tmpmessage.messagestatus;
 			/* unique id */
 			query_result = db_result_get(r,3);
 			if (query_result)
-				strncpy(tmpmessage->uidl, query_result, UID_SIZE-1);
+				strncpy(tmpmessage.uidl, query_result, UID_SIZE-1);
 
 			session->totalmessages++;
-			session->totalsize += tmpmessage->msize;
-			tmpmessage->messageid = (uint64_t) message_counter;
+			session->totalsize += tmpmessage.msize;
+			/* messages are numbered from 1 */
+			tmpmessage.messageid = session->totalmessages;
 
-			session->messagelst = p_list_append(session->messagelst, tmpmessage);
-
-			message_counter++;
+			g_array_append_val(session->messages, tmpmessage);
 		}
 	CATCH(SQLException)
 		LOG_SQLERROR;
@@ -168,7 +447,10 @@ static int db_createsession(uint64_t user_idnr, ClientSession_T * session)
 	END_TRY;
 
 	if (t == DM_EQUERY) return t;
-	if (message_counter == 1) {
+
+	_listing_put(mailbox_idnr, seq, session);
+
+	if (session->totalmessages == 0) {
 		/* there are no messages for this user */
 		return DM_EGENERAL;
 	}
@@ -233,6 +515,8 @@ static void pop3_handle_input(void *arg)
 {
 	char buffer[MAX_LINESIZE];	/* connection buffer */
 	ClientSession_T *session = (ClientSession_T *)arg;
+	gint64 start;
+	int result;
 
 	if (p_string_len(session->ci->write_buffer)) {
 		ci_write(session->ci, NULL);
@@ -244,7 +528,12 @@ static void pop3_handle_input(void *arg)
 		return;
 
 	ci_cork(session->ci);
-	if (pop3(session, buffer) <= 0) {
+	start = g_get_monotonic_time();
+	session->command_type = POP3_FAIL;
+	result = pop3(session, buffer);
+	if (session->command_type < POP3_FAIL)
+		metrics_command("pop3", commands[session->command_type], g_get_monotonic_time() - start);
+	if (result <= 0) {
 		client_session_bailout(&session);
 		return;
 	}
@@ -357,6 +646,73 @@ static int _pop3_session_authenticated(ClientSession_T *session, int user_idnr)
 	return result;
 }
 
+/* look up a message by its number in the listing, skipping deleted ones */
+static struct message * _pop3_message(ClientSession_T *session, const char *value)
+{
+	struct message *msg;
+	uint64_t id;
+
+	if (! (value && session->messages))
+		return NULL;
+
+	id = strtoull(value, NULL, 10);
+	if (id < 1 || id > session->messages->len)
+		return NULL;
+
+	msg = &g_array_index(session->messages, struct message, id - 1);
+	if (msg->virtual_messagestatus >= MESSAGE_STATUS_DELETE)
+		return NULL;
+
+	return msg;
+}
+
+/* RETR and TOP hold back their +OK line until the message has been found
+ * in storage and its first chunk is ready, so a failed lookup can still be
+ * answered with -ERR */
+typedef struct {
+	ClientBase_T *ci;
+	const char *ok;
+	gboolean started;
+} Pop3Stream;
+
+static int _pop3_stream_write(const char *buf, size_t len, void *data)
+{
+	Pop3Stream *s = (Pop3Stream *)data;
+
+	if (! s->started) {
+		s->started = TRUE;
+		if (ci_write(s->ci, (char *)s->ok) < 0)
+			return 1;
+	}
+	return (ci_write_len(s->ci, buf, len) < 0) ? 1 : 0;
+}
+
+/* \return 1 if the message was sent, 0 if -ERR was returned instead, -1
+ * if it broke off after the +OK and the connection has to be dropped */
+static int _pop3_stream_message(ClientSession_T *session, uint64_t message_idnr, long lines, const char *ok)
+{
+	ClientBase_T *ci = session->ci;
+	Pop3Stream s;
+	int result;
+
+	memset(&s, 0, sizeof(s));
+	s.ci = ci;
+	s.ok = ok;
+
+	result = db_stream_message_lines(session->mailbox_idnr, message_idnr, lines, _pop3_stream_write, &s);
+
+	if (! s.started) {
+		TRACE(TRACE_ERR, "message [%" PRIu64 "] could not be retrieved [%d]", message_idnr, result);
+		ci_write(ci, "-ERR message could not be retrieved\r\n");
+		return 0;
+	}
+	if (result != DM_SUCCESS)
+		return -1;
+
+	ci_write(ci, "\r\n.\r\n");
+	return 1;
+}
+
 int pop3(ClientSession_T *session, const char *buffer)
 {
 	/* returns a 0  on a quit
@@ -365,9 +721,10 @@ int pop3(ClientSession_T *session, const char *buffer)
 	 */
 	char *command, *value, *searchptr, *enctype, *s;
 	Pop3Cmd cmdtype;
-	int found = 0;
+	guint i;
 	//int indx = 0;
-	int validate_result;
+	int validate_result, streamed;
+	char ok[128];
 	gboolean login_disabled = FALSE;
 	uint64_t result, top_lines, top_messageid, user_idnr;
 	unsigned char *md5_apop_he;
@@ -413,6 +770,7 @@ int pop3(ClientSession_T *session, const char *buffer)
 
 	TRACE(TRACE_DEBUG, "command looked up as commandtype %d", 
 			cmdtype);
+	session->command_type = cmdtype;
 
 	/* commands that are allowed to have no arguments */
 	if (value == NULL) {
@@ -536,24 +894,12 @@ int pop3(ClientSession_T *session, const char *buffer)
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		session->messagelst = p_list_first(session->messagelst);
-
 		if (value != NULL) {
 			/* they're asking for a specific message */
-			while (session->messagelst) {
-				msg = (struct message *)p_list_data(session->messagelst);
-				if ((msg ) && (msg->messageid == strtoull(value,NULL, 10)) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {
-					ci_write(ci, "+OK %" PRIu64 " %" PRIu64 "\r\n", msg->messageid,msg->msize);
-					found = 1;
-				}
-				if (! p_list_next(session->messagelst))
-					break;
-				session->messagelst = p_list_next(session->messagelst);
-			}
-			if (!found)
+			if (! (msg = _pop3_message(session, value)))
 				return pop3_error(session, "-ERR [%s] no such message\r\n", value);
-			else
-				return 1;
+			ci_write(ci, "+OK %" PRIu64 " %" PRIu64 "\r\n", msg->messageid,msg->msize);
+			return 1;
 		}
 
 		/* just drop the list */
@@ -561,13 +907,10 @@ int pop3(ClientSession_T *session, const char *buffer)
 
 		if (session->virtual_totalmessages > 0) {
 			/* traversing list */
-			while (session->messagelst) {
-				msg = (struct message *)p_list_data(session->messagelst);
-				if ((msg) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE))
+			for (i = 0; i < session->messages->len; i++) {
+				msg = &g_array_index(session->messages, struct message, i);
+				if (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)
 					ci_write(ci, "%" PRIu64 " %" PRIu64 "\r\n", msg->messageid,msg->msize);
-				if (! p_list_next(session->messagelst))
-					break;
-				session->messagelst = p_list_next(session->messagelst);
 			}
 		}
 		ci_write(ci, ".\r\n");
@@ -589,69 +932,44 @@ int pop3(ClientSession_T *session, const char *buffer)
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		session->messagelst = p_list_first(session->messagelst);
-
 		/* selecting a message */
 		TRACE(TRACE_DEBUG, "RETR command, selecting message");
-		
-		while (session->messagelst) {
-			msg = (struct message *)p_list_data(session->messagelst);
-			if ((msg) && (msg->messageid == strtoull(value, NULL, 10)) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {	/* message is not deleted */
-				char *s = NULL;
-				msg->virtual_messagestatus = MESSAGE_STATUS_SEEN;
-				if (! (s = db_get_message_lines(msg->realmessageid, -2)))
-					return -1;
-				ci_write(ci, "+OK %" PRIu64 " octets\r\n%s", (uint64_t)strlen(s), s);
-				ci_write(ci, "\r\n.\r\n");
-				g_free(s);
-				return 1;
-			}
-			if (! p_list_next(session->messagelst))
-				break;
-			session->messagelst = p_list_next(session->messagelst);
-		}
-		return pop3_error(session, "-ERR [%s] no such message\r\n", value);
+
+		if (! (msg = _pop3_message(session, value)))
+			return pop3_error(session, "-ERR [%s] no such message\r\n", value);
+
+		snprintf(ok, sizeof(ok), "+OK %" PRIu64 " octets\r\n", msg->msize);
+		if ((streamed = _pop3_stream_message(session, msg->realmessageid, -2, ok)) < 0)
+			return -1;
+		if (streamed)
+			msg->virtual_messagestatus = MESSAGE_STATUS_SEEN;
+		return 1;
 
 	case POP3_DELE:
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		session->messagelst = p_list_first(session->messagelst);
-
 		/* selecting a message */
-		while (session->messagelst) {
-			msg = (struct message *)p_list_data(session->messagelst);
-			if ((msg) && (msg->messageid == strtoull(value, NULL, 10)) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {	/* message is not deleted */
-				msg->virtual_messagestatus = MESSAGE_STATUS_DELETE;
-				session->virtual_totalsize -= msg->msize;
-				session->virtual_totalmessages -= 1;
-
-				ci_write(ci, "+OK message %" PRIu64 " deleted\r\n", msg->messageid);
-				return 1;
-			}
-			if (! p_list_next(session->messagelst))
-				break;
-			session->messagelst = p_list_next(session->messagelst);
-		}
-		return pop3_error(session, "-ERR [%s] no such message\r\n", value);
+		if (! (msg = _pop3_message(session, value)))
+			return pop3_error(session, "-ERR [%s] no such message\r\n", value);
+
+		msg->virtual_messagestatus = MESSAGE_STATUS_DELETE;
+		session->virtual_totalsize -= msg->msize;
+		session->virtual_totalmessages -= 1;
+
+		ci_write(ci, "+OK message %" PRIu64 " deleted\r\n", msg->messageid);
+		return 1;
 
 	case POP3_RSET:
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		session->messagelst = p_list_first(session->messagelst);
-
 		session->virtual_totalsize = session->totalsize;
 		session->virtual_totalmessages = session->totalmessages;
 
-		while (session->messagelst) {
-			msg = (struct message *)p_list_data(session->messagelst);
-			if (msg) 
-				msg->virtual_messagestatus = msg->messagestatus;
-
-			if (! p_list_next(session->messagelst))
-				break;
-			session->messagelst = p_list_next(session->messagelst);
+		for (i = 0; i < session->messages->len; i++) {
+			msg = &g_array_index(session->messages, struct message, i);
+			msg->virtual_messagestatus = msg->messagestatus;
 		}
 
 		ci_write(ci, "+OK %" PRIu64 " messages (%" PRIu64 " octets)\r\n", session->virtual_totalmessages, session->virtual_totalsize);
@@ -662,18 +980,13 @@ int pop3(ClientSession_T *session, const char *buffer)
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		session->messagelst = p_list_first(session->messagelst);
-
-		while (session->messagelst) {
-			msg = (struct message *)p_list_data(session->messagelst);
-			if ((msg) && (msg->virtual_messagestatus == MESSAGE_STATUS_NEW)) {
+		for (i = 0; i < session->messages->len; i++) {
+			msg = &g_array_index(session->messages, struct message, i);
+			if (msg->virtual_messagestatus == MESSAGE_STATUS_NEW) {
 				/* we need the last message that has been accessed */
 				ci_write(ci, "+OK %" PRIu64 "\r\n", msg->messageid - 1);
 				return 1;
 			}
-			if (! p_list_next(session->messagelst))
-				break;
-			session->messagelst = p_list_next(session->messagelst);
 		}
 
 		/* all old messages */
@@ -692,25 +1005,12 @@ int pop3(ClientSession_T *session, const char *buffer)
 		if (state != CLIENTSTATE_AUTHENTICATED)
 			return pop3_error(session, "-ERR wrong command mode\r\n");
 
-		session->messagelst = p_list_first(session->messagelst);
-
 		if (value != NULL) {
 			/* they're asking for a specific message */
-			while (session->messagelst) {
-				msg = (struct message *)p_list_data(session->messagelst);
-				if ((msg) && (msg->messageid == strtoull(value,NULL, 10)) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {
-					ci_write(ci, "+OK %" PRIu64 " %s\r\n", msg->messageid,msg->uidl);
-					found = 1;
-				}
-
-				if (! p_list_next(session->messagelst))
-					break;
-				session->messagelst = p_list_next(session->messagelst);
-			}
-			if (!found)
+			if (! (msg = _pop3_message(session, value)))
 				return pop3_error(session, "-ERR [%s] no such message\r\n", value);
-			else
-				return 1;
+			ci_write(ci, "+OK %" PRIu64 " %s\r\n", msg->messageid,msg->uidl);
+			return 1;
 		}
 
 		/* just drop the list */
@@ -718,14 +1018,10 @@ int pop3(ClientSession_T *session, const char *buffer)
 
 		if (session->virtual_totalmessages > 0) {
 			/* traversing list */
-			while (session->messagelst) {
-				msg = (struct message *)p_list_data(session->messagelst); 
-				if (msg && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE))
+			for (i = 0; i < session->messages->len; i++) {
+				msg = &g_array_index(session->messages, struct message, i);
+				if (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)
 					ci_write(ci, "%" PRIu64 " %s\r\n", msg->messageid, msg->uidl);
-
-				if (! p_list_next(session->messagelst))
-					break;
-				session->messagelst = p_list_next(session->messagelst);
 			}
 		}
 
@@ -843,28 +1139,16 @@ int pop3(ClientSession_T *session, const char *buffer)
 
 		TRACE(TRACE_DEBUG, "TOP command (partially) retrieving message");
 
-		session->messagelst = p_list_first(session->messagelst);
-
 		/* selecting a message */
 		TRACE(TRACE_DEBUG, "TOP command, selecting message");
 
-		while (session->messagelst) {
-			msg = (struct message *)p_list_data(session->messagelst);
-			if ((msg) && (msg->messageid == top_messageid) && (msg->virtual_messagestatus < MESSAGE_STATUS_DELETE)) {	/* message is not deleted */
-				char *s = NULL; size_t i;
-				if (! (s = db_get_message_lines(msg->realmessageid, top_lines)))
-					return -1;
-				i = ci_write(ci, "+OK %" PRIu64 " lines of message %" PRIu64 "\r\n%s", top_lines, top_messageid, s);
-				ci_write(ci, "\r\n.\r\n");
-				g_free(s);
-				return i;
-			}
-			if (! p_list_next(session->messagelst))
-				break;
-			session->messagelst = p_list_next(session->messagelst);
+		if (! (msg = _pop3_message(session, value)))
+			return pop3_error(session, "-ERR no such message\r\n");
 
-		}
-		return pop3_error(session, "-ERR no such message\r\n");
+		snprintf(ok, sizeof(ok), "+OK %" PRIu64 " lines of message %" PRIu64 "\r\n", top_lines, top_messageid);
+		if (_pop3_stream_message(session, msg->realmessageid, (long)top_lines, ok) < 0)
+			return -1;
+		return 1;
 
 	case POP3_CAPA:
 		ci_write(ci, "+OK Capability list follows\r\nTOP\r\nUSER\r\nUIDL%s\r\n.\r\n", server_conf->ssl?"\r\nSTLS":"");
@@ -27,6 +27,8 @@
 
 #include <libgen.h>
 #include "dbmail.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include "dm_request.h"
 #include "dm_mempool.h"
 
@@ -56,6 +58,7 @@ struct event *sig_hup = NULL;
 struct event *sig_term = NULL;
 struct event *sig_pipe = NULL;
 struct event *sig_usr = NULL;
+struct event *sig_usr2 = NULL;
 struct event *heartbeat = NULL;
 
 SSL_CTX *tls_context;
@@ -175,6 +178,13 @@ void dm_thread_data_push(gpointer session, gpointer cb_enter, gpointer cb_leave,
 	// we're not done until we're done
 	D->session->command_state = FALSE; 
 
+	/* cleared again by _ic_cb_leave, on this thread */
+	if (! s->parent) {
+		PLOCK(s->lock);
+		s->pipe_busy = TRUE;
+		PUNLOCK(s->lock);
+	}
+
 	TRACE(TRACE_DEBUG,"[%p] [%p]", D, D->session);
 	
 	g_thread_pool_push(tpool, D, &err);
@@ -205,7 +215,7 @@ void dm_thread_data_sendmessage(gpointer data)
 	ImapSession *session = (ImapSession *)D->session;
 	String_T buf = D->data;
 
-	ci_write(session->ci, "%s", p_string_str(buf));
+	ci_write_len(session->ci, p_string_str(buf), p_string_len(buf));
 
 	p_string_free(buf, TRUE);
 }
@@ -224,7 +234,10 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
 	if (session->state == CLIENTSTATE_QUIT_QUEUED)
 		return;
 
+	/* jobs may lower their priority for the database queue */
+	db_con_priority(DB_PRIORITY_NORMAL);
 	D->cb_enter(D);
+	db_con_priority(DB_PRIORITY_NORMAL);
 }
 
 /*
@@ -236,7 +249,8 @@ static void dm_thread_dispatch(gpointer data, gpointer user_data)
 static int server_setup(ServerConfig_T *conf)
 {
 	GError *err = NULL;
-	guint tpool_size = db_params.max_db_connections;
+	int workers;
+	guint tpool_size;
 
 	server_set_sighandler();
 
@@ -255,6 +269,22 @@ static int server_setup(ServerConfig_T *conf)
 
 	queue_pool = mempool_open();
 
+	// More workers than database connections, so jobs that don't
+	// need the database keep running while others queue for a
+	// connection, and the admission queue gets to see the overload
+	// it is meant to order and shed.
+	workers = config_get_value_default_int("worker_threads", "IMAP", 0);
+	if (workers > 0)
+		tpool_size = (guint)workers;
+	else if (db_params.max_db_connections)
+		tpool_size = db_params.max_db_connections * 2;
+	else
+		tpool_size = 20;
+	if (db_params.max_db_connections && tpool_size < db_params.max_db_connections)
+		TRACE(TRACE_NOTICE, "worker_threads [%u] below max_db_connections [%u]",
+				tpool_size, db_params.max_db_connections);
+	TRACE(TRACE_INFO, "starting [%u] worker threads", tpool_size);
+
 	// Create the thread pool
 	if (! (tpool = g_thread_pool_new((GFunc)dm_thread_dispatch,NULL,tpool_size,TRUE,&err)))
 		TRACE(TRACE_DEBUG,"g_thread_pool creation failed [%s]", err->message);
@@ -659,6 +689,120 @@ static void server_sock_ssl_cb(int sock, short event, void *arg)
 	_sock_cb(sock, event, arg, TRUE);
 }
 
+/*
+ * metrics
+ *
+ * Besides the /metrics page of dbmail-httpd, every daemon can serve
+ * its own metrics on a local socket, set by metrics_socket. Any
+ * request on it gets the Prometheus text format in an HTTP/1.0 reply:
+ *
+ *   curl --unix-socket /var/run/dbmail/imapd.metrics http://localhost/metrics
+ *
+ * Replies go out through a bufferevent, so a slow reader never holds up
+ * the event loop. The socket gets metrics_socket_mode, 0660 by default.
+ */
+static void server_metrics(GString *out)
+{
+	CompressStats z;
+
+	if (tpool) {
+		g_string_append(out, "# HELP dbmail_threads Worker threads.\n# TYPE dbmail_threads gauge\n");
+		g_string_append_printf(out, "dbmail_threads{state=\"running\"} %u\n", g_thread_pool_get_num_threads(tpool));
+		g_string_append_printf(out, "dbmail_threads{state=\"max\"} %d\n", g_thread_pool_get_max_threads(tpool));
+		g_string_append(out, "# HELP dbmail_thread_queue_depth Jobs waiting for a worker thread.\n# TYPE dbmail_thread_queue_depth gauge\n");
+		g_string_append_printf(out, "dbmail_thread_queue_depth %u\n", g_thread_pool_unprocessed(tpool));
+	}
+
+	ci_compress_stats(&z);
+	if (! z.sessions)
+		return;
+	g_string_append(out, "# HELP dbmail_compress_sessions_total Connections that enabled COMPRESS.\n# TYPE dbmail_compress_sessions_total counter\n");
+	g_string_append_printf(out, "dbmail_compress_sessions_total %" PRIu64 "\n", z.sessions);
+	g_string_append(out, "# HELP dbmail_compress_bytes_total Octets before and after compression.\n# TYPE dbmail_compress_bytes_total counter\n");
+	g_string_append_printf(out, "dbmail_compress_bytes_total{direction=\"tx\",side=\"plain\"} %" PRIu64 "\n", z.plain_tx);
+	g_string_append_printf(out, "dbmail_compress_bytes_total{direction=\"tx\",side=\"wire\"} %" PRIu64 "\n", z.wire_tx);
+	g_string_append_printf(out, "dbmail_compress_bytes_total{direction=\"rx\",side=\"plain\"} %" PRIu64 "\n", z.plain_rx);
+	g_string_append_printf(out, "dbmail_compress_bytes_total{direction=\"rx\",side=\"wire\"} %" PRIu64 "\n", z.wire_rx);
+	g_string_append(out, "# HELP dbmail_compress_cpu_seconds_total Thread cpu time spent compressing.\n# TYPE dbmail_compress_cpu_seconds_total counter\n");
+	g_string_append_printf(out, "dbmail_compress_cpu_seconds_total %.6f\n", (double)z.cpu_usec / G_USEC_PER_SEC);
+}
+
+static void server_metrics_event_cb(struct bufferevent *bev, short UNUSED what, void UNUSED *arg)
+{
+	bufferevent_free(bev);
+}
+
+static void server_metrics_write_cb(struct bufferevent *bev, void UNUSED *arg)
+{
+	if (evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		bufferevent_free(bev);
+}
+
+static void server_metrics_reply_cb(struct bufferevent *bev, void UNUSED *arg)
+{
+	struct evbuffer *in = bufferevent_get_input(bev);
+	GString *body;
+
+	evbuffer_drain(in, evbuffer_get_length(in));
+	bufferevent_disable(bev, EV_READ);
+
+	body = g_string_new("");
+	metrics_render(body);
+	bufferevent_setcb(bev, NULL, server_metrics_write_cb, server_metrics_event_cb, NULL);
+	evbuffer_add_printf(bufferevent_get_output(bev), "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n"
+			"Content-Length: %zu\r\n\r\n", (size_t)body->len);
+	bufferevent_write(bev, body->str, body->len);
+	g_string_free(body, TRUE);
+}
+
+static void server_metrics_cb(int sock, short UNUSED event, void UNUSED *arg)
+{
+	struct timeval timeout = { 5, 0 };
+	struct bufferevent *bev;
+	int fd;
+
+	if ((fd = accept(sock, NULL, NULL)) < 0)
+		return;
+
+	evutil_make_socket_nonblocking(fd);
+	if (! (bev = bufferevent_socket_new(evbase, fd, BEV_OPT_CLOSE_ON_FREE))) {
+		close(fd);
+		return;
+	}
+	bufferevent_setcb(bev, server_metrics_reply_cb, NULL, server_metrics_event_cb, NULL);
+	bufferevent_set_timeouts(bev, &timeout, &timeout);
+	bufferevent_enable(bev, EV_READ);
+}
+
+static void server_metrics_listen(ServerConfig_T *conf)
+{
+	struct sockaddr_un un;
+	struct event *ev;
+	int sock;
+
+	if ((sock = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+		TRACE(TRACE_ERR, "metrics socket: [%s]", strerror(errno));
+		return;
+	}
+
+	memset(&un, 0, sizeof(un));
+	un.sun_family = AF_UNIX;
+	strncpy(un.sun_path, conf->metrics_socket, sizeof(un.sun_path)-1);
+	unlink(conf->metrics_socket);
+
+	if (bind(sock, (struct sockaddr *)&un, sizeof(un)) || listen(sock, 16)) {
+		TRACE(TRACE_ERR, "metrics socket [%s]: [%s]", conf->metrics_socket, strerror(errno));
+		close(sock);
+		return;
+	}
+	if (chmod(conf->metrics_socket, conf->metrics_socket_mode))
+		TRACE(TRACE_ERR, "chmod [%s] failed: [%s]", conf->metrics_socket, strerror(errno));
+
+	ev = event_new(evbase, sock, EV_READ|EV_PERSIST, server_metrics_cb, NULL);
+	event_add(ev, NULL);
+	TRACE(TRACE_INFO, "metrics available on [%s]", conf->metrics_socket);
+}
 
 void server_sig_cb(int UNUSED fd, short UNUSED event, void *arg)
 {
@@ -669,6 +813,9 @@ void server_sig_cb(int UNUSED fd, short UNUSED event, void *arg)
 			mainReload = 1;
 		case SIGPIPE: // ignore
 		break;
+		case SIGUSR2:
+			db_profile_dump();
+		break;
 		default:
 			exit(0);
 		break;
@@ -695,6 +842,10 @@ static int server_set_sighandler(void)
 	evsignal_assign(sig_pipe, evbase, SIGPIPE, server_sig_cb, sig_pipe);
 	evsignal_add(sig_pipe, NULL);
 
+	sig_usr2 = evsignal_new(evbase, SIGUSR2, server_sig_cb, NULL);
+	evsignal_assign(sig_usr2, evbase, SIGUSR2, server_sig_cb, sig_usr2);
+	evsignal_add(sig_usr2, NULL);
+
 #if MEMDEBUG
 	sig_usr = evsignal_new(evbase, SIGUSR1, server_sig_cb, NULL); 
 	evsignal_assign(sig_usr, evbase, SIGUSR1, server_sig_cb, sig_usr); 
@@ -732,6 +883,10 @@ void disconnect_all(void)
 		event_free(sig_term);
 		sig_term = NULL;
 	}
+	if (sig_usr2) {
+		event_free(sig_usr2);
+		sig_usr2 = NULL;
+	}
 #if MEMDEBUG
 	if (sig_usr) {
 		free(sig_usr);
@@ -801,6 +956,10 @@ int server_run(ServerConfig_T *conf)
 	if (server_setup(conf))
 		return -1;
 
+	metrics_collector(server_metrics);
+	if (strlen(conf->metrics_socket))
+		server_metrics_listen(conf);
+
 	if (strlen(conf->port) || strlen(conf->ssl_port)) {
 
 		if (MATCH(conf->service_name, "HTTP")) {
@@ -1049,6 +1208,12 @@ void server_config_load(ServerConfig_T * config, const char * const service)
 		TRACE(TRACE_DEBUG, "no value for SOCKET in config file");
 	strncpy(config->socket, val, FIELDSIZE-1);
 	TRACE(TRACE_DEBUG, "socket [%s]", config->socket);
+
+	config_get_value("metrics_socket", service, val);
+	strncpy(config->metrics_socket, val, FIELDSIZE-1);
+
+	config_get_value("metrics_socket_mode", service, val);
+	config->metrics_socket_mode = strlen(val) ? (mode_t)strtol(val, NULL, 8) : 0660;
 	
 	/* read items: PORT */
 	config_get_value("PORT", service, val);
@@ -233,6 +233,33 @@ class testImapServer(unittest.TestCase):
         expect = '1 (FLAGS (\\Seen \\Flagged \\Recent Userflag))'
         self.assertEquals(result[1][0], expect)
 
+    def testMultiAppend(self):
+        """
+        MULTIAPPEND (RFC 3502)
+            Append several messages in one command. A short single line
+            literal must not be taken for the date-time of the next message.
+        """
+        self.o.create('testmultiappend')
+        short = 'short message'
+        full = str(TESTMSG['strict822'])
+        tag = self.o._new_tag()
+        self.o.send('%s APPEND testmultiappend {%d+}\r\n%s '
+                    '(\\Seen) "03-Mar-2006 07:15:00 +0200" {%d+}\r\n%s\r\n' % (
+                        tag, len(short), short, len(full), full))
+        while True:
+            line = self.o.readline().rstrip('\r\n')
+            if line.startswith(tag):
+                break
+        self.assertTrue(line.startswith(tag + ' OK'), line)
+        self.assertRegexpMatches(line, '\[APPENDUID \d+ \d+[:,]\d+\]')
+
+        self.assertEquals(self.o.select('testmultiappend')[1][0], '2')
+        result = self.o.fetch('1', '(BODY.PEEK[])')
+        self.assertEquals(result[1][0][1], short)
+        result = self.o.fetch('2', '(FLAGS INTERNALDATE)')
+        self.assertTrue('\\Seen' in result[1][0], result[1][0])
+        self.assertTrue('03-Mar-2006' in result[1][0], result[1][0])
+
     def testCheck(self):
         """
         'check()'
@@ -628,6 +655,38 @@ class testImapServer(unittest.TestCase):
         self.assertEquals('(\\hasnochildren) "/" "%s"' % mailboxes[2]
                           in result, True)
 
+    def testMove(self):
+        """
+        MOVE (RFC 6851)
+            Move messages to another mailbox. The COPYUID response code
+            must be sent before the EXPUNGE responses.
+        """
+        self.o.create('testmove1')
+        self.o.create('testmove2')
+        for i in range(0, 3):
+            self.o.append('testmove1', (), "", str(TESTMSG['strict822']))
+        self.o.response('APPENDUID')
+        self.o.select('testmove1')
+
+        # read the raw response, imaplib doesn't keep the order
+        tag = self.o._new_tag()
+        self.o.send('%s MOVE 1:2 testmove2\r\n' % tag)
+        lines = []
+        while True:
+            line = self.o.readline().rstrip('\r\n')
+            lines.append(line)
+            if line.startswith(tag):
+                break
+        self.assertTrue(lines[-1].startswith(tag + ' OK'), lines[-1])
+
+        copyuid = [i for i, l in enumerate(lines) if '[COPYUID ' in l]
+        expunge = [i for i, l in enumerate(lines) if l.endswith(' EXPUNGE')]
+        self.assertEquals(len(copyuid), 1)
+        self.assertEquals(len(expunge), 2)
+        self.assertLess(copyuid[0], min(expunge))
+
+        self.assertEquals(self.o.select('testmove2')[1][0], '2')
+
     def testNoop(self):
         """
         noop()
@@ -0,0 +1,582 @@
+/*
+ *   Copyright (c) 2020-2025 Alan Hicks, Persistent Objects Ltd support@p-o.co.uk
+ *
+ *   This program is free software; you can redistribute it and/or
+ *   modify it under the terms of the GNU General Public License
+ *   as published by the Free Software Foundation; either
+ *   version 2 of the License, or (at your option) any later
+ *   version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ *
+ *   Microbenchmarks for the message store and the mailbox state.
+ *
+ *   Runs against a fresh SQLite database in a temporary directory and
+ *   reports, per function, the time, the allocations and the queries
+ *   issued per message, as the MIME depth and the mailbox size grow.
+ *
+ *   Not part of 'make check'; build with 'make bench_dbmail' and run
+ *   ./bench_dbmail -h for the options.
+ *
+ */
+
+#include "dbmail.h"
+
+#define THIS_MODULE "bench"
+
+extern char configFile[PATH_MAX];
+extern DBParam_T db_params;
+#define DBPFX db_params.pfx
+
+/*
+ * allocation counting
+ *
+ * glibc exports its allocator under __libc_* names, so the ones
+ * below take precedence over it for this program and every library
+ * it loads, and only count.
+ */
+static uint64_t allocs = 0;
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void *__libc_memalign(size_t, size_t);
+
+void *malloc(size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+	__atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+	if (! (*ptr = __libc_memalign(alignment, size)))
+		return ENOMEM;
+	return 0;
+}
+#define ALLOCS_COUNTED 1
+#else
+#define ALLOCS_COUNTED 0
+#endif
+
+/*
+ * measurement
+ */
+
+typedef struct {
+	uint64_t ns;
+	uint64_t allocs;
+	uint64_t queries;
+} Sample_T;
+
+static FILE *output = NULL;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t queries_issued(void)
+{
+	GList *profile = db_profile_list(), *l;
+	uint64_t n = 0;
+
+	for (l = profile; l; l = l->next)
+		n += ((DbQueryProfile_T *)l->data)->calls;
+	db_profile_free(profile);
+	return n;
+}
+
+static void sample_start(Sample_T *S)
+{
+	S->queries = queries_issued();
+	S->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+	S->ns = now_ns();
+}
+
+static void sample_stop(Sample_T *S)
+{
+	S->ns = now_ns() - S->ns;
+	S->allocs = __atomic_load_n(&allocs, __ATOMIC_RELAXED) - S->allocs;
+	S->queries = queries_issued() - S->queries;
+}
+
+static void report_header(void)
+{
+	printf("%-28s %5s %9s %7s %12s %12s %10s\n",
+			"function", "depth", "messages", "calls", "ns/msg", "allocs/msg", "queries/msg");
+	if (output)
+		fprintf(output, "# function depth messages calls ns_per_msg allocs_per_msg queries_per_msg\n");
+}
+
+/* messages is the number of messages the calls handled in total */
+static void report(const char *name, int depth, uint64_t messages, unsigned calls, Sample_T *S)
+{
+	double per = messages ? (double)messages : 1;
+
+	if (ALLOCS_COUNTED)
+		printf("%-28s %5d %9" PRIu64 " %7u %12.0f %12.1f %10.2f\n",
+				name, depth, messages, calls, S->ns / per, S->allocs / per, S->queries / per);
+	else
+		printf("%-28s %5d %9" PRIu64 " %7u %12.0f %12s %10.2f\n",
+				name, depth, messages, calls, S->ns / per, "-", S->queries / per);
+	if (output)
+		fprintf(output, "%s %d %" PRIu64 " %u %.0f %.1f %.2f\n",
+				name, depth, messages, calls, S->ns / per,
+				ALLOCS_COUNTED ? S->allocs / per : -1.0, S->queries / per);
+}
+
+/*
+ * synthetic messages
+ *
+ * depth 0 is a single text/plain part; every level above wraps the
+ * level below as a message/rfc822 part of a multipart/mixed, next to
+ * a text part and a small attachment.
+ */
+
+static void message_body(GString *s, int n)
+{
+	int i;
+	for (i = 0; i < 8; i++)
+		g_string_append_printf(s, "line %d of benchmark message %d, about the quarterly report\n", i, n);
+}
+
+static void message_headers(GString *s, int n, int depth)
+{
+	g_string_append_printf(s,
+			"From: \"Sender %d\" <sender%d@example.com>\n"
+			"To: <bench@example.org>\n"
+			"Subject: bench message %d depth %d\n"
+			"Date: Mon, %d Jan %d 10:00:00 +0100\n"
+			"Message-ID: <bench-%d-%d@example.com>\n"
+			"MIME-Version: 1.0\n",
+			n % 50, n % 50, n, depth, 1 + n % 28, 2000 + n % 25, n, depth);
+}
+
+static void message_part(GString *s, int n, int depth)
+{
+	int i;
+
+	message_headers(s, n, depth);
+	if (depth == 0) {
+		g_string_append(s, "Content-Type: text/plain; charset=us-ascii\n\n");
+		message_body(s, n);
+		return;
+	}
+
+	g_string_append_printf(s, "Content-Type: multipart/mixed; boundary=\"b%d-%d\"\n\n", n, depth);
+	g_string_append_printf(s, "--b%d-%d\nContent-Type: text/plain; charset=us-ascii\n\n", n, depth);
+	message_body(s, n);
+	g_string_append_printf(s, "--b%d-%d\nContent-Type: message/rfc822\n\n", n, depth);
+	message_part(s, n, depth - 1);
+	g_string_append_printf(s, "--b%d-%d\nContent-Type: application/octet-stream; name=\"part%d.bin\"\n"
+			"Content-Transfer-Encoding: base64\n\n", n, depth, depth);
+	for (i = 0; i < 16; i++)
+		g_string_append(s, "AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwdHh8gISIjJCUmJygpKissLS4vMDEy\n");
+	g_string_append_printf(s, "--b%d-%d--\n", n, depth);
+}
+
+static char * message_new(int n, int depth)
+{
+	GString *s = g_string_new("");
+	message_part(s, n, depth);
+	return g_string_free(s, FALSE);
+}
+
+/*
+ * setup
+ */
+
+static char *tmpdir = NULL;
+
+/* the system configuration, with the database moved to a scratch sqlite file */
+static int bench_configure(const char *config)
+{
+	GKeyFile *keys = g_key_file_new();
+	GError *err = NULL;
+	char *data, *file, *uri;
+	gsize len;
+
+	if (! g_key_file_load_from_file(keys, config, G_KEY_FILE_NONE, NULL))
+		g_key_file_load_from_data(keys, DM_DEFAULT_CONFIGURATION, -1, G_KEY_FILE_NONE, NULL);
+
+	if (! (tmpdir = g_dir_make_tmp("dbmail-bench-XXXXXX", &err))) {
+		fprintf(stderr, "%s\n", err->message);
+		g_error_free(err);
+		return -1;
+	}
+
+	uri = g_strdup_printf("sqlite://%s/dbmail.db", tmpdir);
+	g_key_file_set_value(keys, "DBMAIL", "dburi", uri);
+	g_key_file_set_value(keys, "DBMAIL", "authdriver", "sql");
+	g_key_file_set_value(keys, "DBMAIL", "table_prefix", "dbmail_");
+	g_key_file_remove_key(keys, "DBMAIL", "replica_dburi", NULL);
+	g_free(uri);
+
+	file = g_build_filename(tmpdir, "dbmail.conf", NULL);
+	data = g_key_file_to_data(keys, &len, NULL);
+	g_file_set_contents(file, data, len, NULL);
+	g_strlcpy(configFile, file, sizeof(configFile));
+	g_free(data);
+	g_free(file);
+	g_key_file_free(keys);
+
+	config_read(configFile);
+	configure_debug(NULL, 0, TRACE_EMERG | TRACE_ALERT | TRACE_CRIT | TRACE_ERR);
+	GetDBParams();
+	if (db_connect() != DM_SUCCESS || auth_connect() != 0) {
+		fprintf(stderr, "cannot set up the database in [%s]\n", tmpdir);
+		return -1;
+	}
+	return 0;
+}
+
+static void bench_cleanup(void)
+{
+	const char *name;
+	GDir *dir;
+
+	auth_disconnect();
+	db_disconnect();
+	config_free();
+
+	if (! tmpdir)
+		return;
+	/* the database, its journal and the configuration */
+	if ((dir = g_dir_open(tmpdir, 0, NULL))) {
+		while ((name = g_dir_read_name(dir))) {
+			char *path = g_build_filename(tmpdir, name, NULL);
+			unlink(path);
+			g_free(path);
+		}
+		g_dir_close(dir);
+	}
+	rmdir(tmpdir);
+	g_free(tmpdir);
+}
+
+static uint64_t bench_mailbox(const char *name, uint64_t *user_idnr)
+{
+	uint64_t id = 0;
+
+	if (! auth_user_exists("benchuser", user_idnr))
+		auth_adduser("benchuser", "bench", "md5", 0, 0, user_idnr);
+	if (db_find_create_mailbox(name, BOX_COMMANDLINE, *user_idnr, &id) != DM_SUCCESS) {
+		fprintf(stderr, "cannot create mailbox [%s]\n", name);
+		return 0;
+	}
+	return id;
+}
+
+/*
+ * message store, retrieve and BODYSTRUCTURE, per MIME depth
+ */
+
+static void bench_messages(int depth, int count, uint64_t mailbox_idnr, uint64_t user_idnr, GArray *msgids)
+{
+	uint64_t *physids = g_new0(uint64_t, count);
+	DbmailMessage **messages = g_new0(DbmailMessage *, count);
+	char **raw = g_new0(char *, count);
+	Sample_T S;
+	int i;
+
+	for (i = 0; i < count; i++)
+		raw[i] = message_new(i, depth);
+
+	/* parse and store */
+	sample_start(&S);
+	for (i = 0; i < count; i++) {
+		DbmailMessage *m = dbmail_message_new(NULL);
+		m = dbmail_message_init_with_string(m, raw[i]);
+		dbmail_message_store(m);
+		physids[i] = m->id;
+		if (msgids) {
+			uint64_t msgid = 0;
+			db_copymsg(m->msg_idnr, mailbox_idnr, user_idnr, &msgid);
+			g_array_append_val(msgids, msgid);
+		}
+		dbmail_message_free(m);
+	}
+	sample_stop(&S);
+	report("dbmail_message_store", depth, count, count, &S);
+
+	for (i = 0; i < count; i++)
+		g_free(raw[i]);
+	g_free(raw);
+
+	/* _mime_retrieve */
+	sample_start(&S);
+	for (i = 0; i < count; i++) {
+		DbmailMessage *m = dbmail_message_new(NULL);
+		messages[i] = dbmail_message_retrieve(m, physids[i]);
+	}
+	sample_stop(&S);
+	report("dbmail_message_retrieve", depth, count, count, &S);
+
+	sample_start(&S);
+	for (i = 0; i < count; i++) {
+		char *s;
+		if (! messages[i])
+			continue;
+		s = imap_get_structure(GMIME_MESSAGE(messages[i]->content), TRUE);
+		g_free(s);
+	}
+	sample_stop(&S);
+	report("imap_get_structure", depth, count, count, &S);
+
+	for (i = 0; i < count; i++)
+		dbmail_message_free(messages[i]);
+	g_free(messages);
+	g_free(physids);
+}
+
+/*
+ * mailbox state and search, per mailbox size
+ */
+
+/* grow the mailbox by copying its rows, doubling up to size; returns the new size */
+static uint64_t mailbox_fill(uint64_t mailbox_idnr, uint64_t size)
+{
+	Connection_T c = db_con_get();
+	volatile uint64_t count = 0;
+	ResultSet_T r;
+
+	TRY
+		r = db_query(c, "SELECT COUNT(*) FROM %smessages WHERE mailbox_idnr = %" PRIu64, DBPFX, mailbox_idnr);
+		if (db_result_next(r))
+			count = db_result_get_u64(r, 0);
+		db_con_clear(c);
+
+		db_begin_transaction(c);
+		while (count && count < size) {
+			uint64_t add = MIN((uint64_t)count, size - count);
+			db_exec(c, "INSERT INTO %smessages (mailbox_idnr, physmessage_id, seen_flag, answered_flag, "
+					"deleted_flag, flagged_flag, recent_flag, draft_flag, unique_id, status) "
+					"SELECT mailbox_idnr, physmessage_id, seen_flag, answered_flag, deleted_flag, "
+					"flagged_flag, recent_flag, draft_flag, unique_id, status FROM %smessages "
+					"WHERE mailbox_idnr = %" PRIu64 " ORDER BY message_idnr LIMIT %" PRIu64,
+					DBPFX, DBPFX, mailbox_idnr, add);
+			count += add;
+		}
+		/* a spread of flags for the searches */
+		db_exec(c, "UPDATE %smessages SET seen_flag = (message_idnr %% 3 <> 0), "
+				"flagged_flag = (message_idnr %% 17 = 0), recent_flag = 0 "
+				"WHERE mailbox_idnr = %" PRIu64, DBPFX, mailbox_idnr);
+		db_commit_transaction(c);
+	CATCH(SQLException)
+		LOG_SQLERROR;
+		db_rollback_transaction(c);
+		count = 0;
+	FINALLY
+		db_con_close(c);
+	END_TRY;
+
+	db_mailbox_seq_update(mailbox_idnr, 0);
+	return count;
+}
+
+static String_T * search_keys_new(Mempool_T pool, const char *args, size_t *size)
+{
+	char **array = g_strsplit(args, " ", 0);
+	String_T *search_keys;
+	int idx, arglen = 0;
+
+	while (array[arglen++]);
+	*size = sizeof(String_T) * arglen;
+	search_keys = (String_T *)mempool_pop(pool, *size);
+	for (idx = 0; idx < arglen && array[idx]; idx++)
+		search_keys[idx] = p_string_new(pool, array[idx]);
+	g_strfreev(array);
+	return search_keys;
+}
+
+static void bench_search(uint64_t mailbox_idnr, uint64_t size, const char *name, const char *keys, int reps)
+{
+	Mempool_T pool = mempool_open();
+	Sample_T S;
+	int i;
+
+	sample_start(&S);
+	for (i = 0; i < reps; i++) {
+		DbmailMailbox *mb = dbmail_mailbox_new(pool, mailbox_idnr);
+		uint64_t idx = 0;
+		size_t len;
+		String_T *search_keys = search_keys_new(pool, keys, &len);
+
+		dbmail_mailbox_set_uid(mb, TRUE);
+		dbmail_mailbox_build_imap_search(mb, search_keys, &idx, SEARCH_UNORDERED);
+		dbmail_mailbox_search(mb);
+		dbmail_mailbox_free(mb);
+		mempool_push(pool, search_keys, len);
+	}
+	sample_stop(&S);
+	report(name, 0, size * reps, reps, &S);
+	mempool_close(&pool);
+}
+
+static void bench_mailbox_size(uint64_t mailbox_idnr, uint64_t size, int reps)
+{
+	MailboxState_T M;
+	Sample_T S;
+	int i;
+
+	/* a mailbox does not shrink; the sizes should ascend */
+	if (! (size = mailbox_fill(mailbox_idnr, size)))
+		return;
+
+	/* state_load_messages */
+	sample_start(&S);
+	for (i = 0; i < reps; i++) {
+		M = MailboxState_new(NULL, mailbox_idnr);
+		MailboxState_free(&M);
+	}
+	sample_stop(&S);
+	report("MailboxState_new", 0, size * reps, reps, &S);
+
+	M = MailboxState_new(NULL, mailbox_idnr);
+	sample_start(&S);
+	for (i = 0; i < reps; i++) {
+		GTree *set = MailboxState_get_set(M, "1:*", TRUE);
+		if (set)
+			g_tree_destroy(set);
+	}
+	sample_stop(&S);
+	report("MailboxState_get_set 1:*", 0, size * reps, reps, &S);
+	MailboxState_free(&M);
+
+	bench_search(mailbox_idnr, size, "search UNSEEN", "UNSEEN", reps);
+	bench_search(mailbox_idnr, size, "search FLAGGED SINCE", "FLAGGED SINCE 1-Jan-2010", reps);
+	bench_search(mailbox_idnr, size, "search SUBJECT", "SUBJECT report", reps);
+}
+
+static GArray * parse_list(const char *s)
+{
+	GArray *a = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	char **parts = g_strsplit(s, ",", 0);
+	int i;
+
+	for (i = 0; parts[i]; i++) {
+		uint64_t v = strtoull(parts[i], NULL, 10);
+		g_array_append_val(a, v);
+	}
+	g_strfreev(parts);
+	return a;
+}
+
+static void do_showhelp(void)
+{
+	printf(
+	"*** bench_dbmail ***\n"
+	"Microbenchmarks of message store and mailbox state on a scratch SQLite database.\n"
+	"\n"
+	"     -s, --sizes list     mailbox sizes in messages (1000,10000,100000)\n"
+	"     -d, --depths list    MIME depths of the stored messages (0,1,3,5)\n"
+	"     -k, --messages n     distinct messages stored per depth (200)\n"
+	"     -r, --reps n         repetitions of the mailbox benchmarks (3)\n"
+	"     -f, --config file    configuration to start from (the installed one)\n"
+	"     -o, --output file    also write the results to file\n"
+	"     -h, --help           this help\n"
+	"\n"
+	"Mailboxes are filled by copying message rows, so sizes up to 1000000\n"
+	"cost seconds to set up, not a million deliveries.\n");
+}
+
+int main(int argc, char *argv[])
+{
+	GArray *sizes, *depths, *msgids;
+	const char *config = NULL, *sizes_arg = "1000,10000,100000", *depths_arg = "0,1,3,5";
+	uint64_t mailbox_idnr, user_idnr = 0;
+	int opt, count = 200, reps = 3;
+	guint i;
+
+	static struct option long_options[] = {
+		{"sizes",    required_argument, NULL, 's'},
+		{"depths",   required_argument, NULL, 'd'},
+		{"messages", required_argument, NULL, 'k'},
+		{"reps",     required_argument, NULL, 'r'},
+		{"config",   required_argument, NULL, 'f'},
+		{"output",   required_argument, NULL, 'o'},
+		{"help",     no_argument,       NULL, 'h'},
+		{NULL,       0,                 NULL, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "s:d:k:r:f:o:h", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 's': sizes_arg = optarg; break;
+		case 'd': depths_arg = optarg; break;
+		case 'k': count = atoi(optarg); break;
+		case 'r': reps = atoi(optarg); break;
+		case 'f': config = optarg; break;
+		case 'o':
+			if (! (output = fopen(optarg, "w"))) {
+				fprintf(stderr, "cannot write [%s]: %s\n", optarg, strerror(errno));
+				return 1;
+			}
+			break;
+		case 'h': do_showhelp(); return 0;
+		default: do_showhelp(); return 1;
+		}
+	}
+	if (count < 1 || reps < 1) {
+		do_showhelp();
+		return 1;
+	}
+
+	if (! config) {
+		config_get_file();
+		config = g_strdup(configFile);
+	}
+	if (bench_configure(config)) {
+		bench_cleanup();
+		return 1;
+	}
+
+	sizes = parse_list(sizes_arg);
+	depths = parse_list(depths_arg);
+	msgids = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+
+	printf("scratch database in %s%s\n\n", tmpdir, ALLOCS_COUNTED ? "" : ", allocations not counted");
+	report_header();
+
+	/* the first depth also seeds the mailbox for the state benchmarks */
+	mailbox_idnr = bench_mailbox("bench", &user_idnr);
+	for (i = 0; i < depths->len && mailbox_idnr; i++)
+		bench_messages((int)g_array_index(depths, uint64_t, i), count,
+				mailbox_idnr, user_idnr, i ? NULL : msgids);
+
+	for (i = 0; i < sizes->len && msgids->len; i++)
+		bench_mailbox_size(mailbox_idnr, g_array_index(sizes, uint64_t, i), reps);
+
+	g_array_free(msgids, TRUE);
+	g_array_free(sizes, TRUE);
+	g_array_free(depths, TRUE);
+	if (output)
+		fclose(output);
+	bench_cleanup();
+
+	return 0;
+}
@@ -41,6 +41,7 @@
 extern char configFile[PATH_MAX];
 extern int quiet;
 extern int reallyquiet;
+extern DBParam_T db_params;
 
 uint64_t useridnr = 0;
 uint64_t useridnr_domain = 0;
@@ -104,6 +105,9 @@ void teardown(void)
 	if (db_findmailbox("testdeletebox",testidnr,&mailbox_id))
 		db_delete_mailbox(mailbox_id,0,0);
 
+	if (db_findmailbox("testappendbox",testidnr,&mailbox_id))
+		db_delete_mailbox(mailbox_id,0,0);
+
 	if (db_findmailbox("testpermissionbox",testidnr,&mailbox_id)) {
 		db_mailbox_set_permission(mailbox_id, IMAPPERM_READWRITE);
 		db_delete_mailbox(mailbox_id,0,0);
@@ -124,6 +128,96 @@ START_TEST(test_db_stmt_prepare)
 }
 END_TEST
 
+START_TEST(test_db_stmt_prepare_cached)
+{
+	Connection_T c; PreparedStatement_T s, t; ResultSet_T r;
+	const char *q = "SELECT user_idnr FROM %susers WHERE userid=?";
+	int i;
+	c = db_con_get();
+	s = db_stmt_prepare_cached(c, q, "dbmail_");
+	fail_unless(s != NULL, "db_stmt_prepare_cached failed");
+	for (i = 0; i < 3; i++) {
+		t = db_stmt_prepare_cached(c, q, "dbmail_");
+		fail_unless(s == t, "statement not reused on the same connection");
+		db_stmt_set_str(t, 1, "testuser1");
+		r = db_stmt_query(t);
+		fail_unless(db_result_next(r), "db_result_next failed");
+	}
+	db_con_clear(c);
+	s = db_stmt_prepare_cached(c, q, "dbmail_");
+	db_stmt_set_str(s, 1, "testuser1");
+	r = db_stmt_query(s);
+	fail_unless(db_result_next(r), "statement not prepared again after clear");
+	db_con_close(c);
+}
+END_TEST
+
+START_TEST(test_db_con_get_read)
+{
+	Connection_T c;
+	uint64_t mailbox_id = 0, seq = 0;
+	DbReplicaStats_T stats;
+
+	/* the test database doubles as its own replica */
+	if (! strlen(db_params.dburi))
+		return;
+	fail_unless(db_replica_connect(db_params.dburi) == 1, "db_replica_connect failed");
+
+	db_createmailbox("testcreatebox", testidnr, &mailbox_id);
+	fail_unless(mailbox_id > 0, "db_createmailbox failed");
+	db_mailbox_seq_update(mailbox_id, 0);
+	db_get_mailbox_seq(mailbox_id, &seq);
+
+	c = db_con_get_read(mailbox_id, seq);
+	fail_unless(db_con_is_replica(c), "read not routed to the replica");
+	db_con_close(c);
+
+	/* a session that has seen a newer seq stays on the primary */
+	c = db_con_get_read(mailbox_id, seq + 1);
+	fail_if(db_con_is_replica(c), "lagging replica used for read");
+	db_con_close(c);
+
+	db_replica_stats(&stats);
+	fail_unless(stats.replicas == 1, "wrong replica count");
+	fail_unless(stats.lagging == 1, "lag not recorded");
+	fail_unless(stats.max_lag == 1, "wrong lag [%" PRIu64 "]", stats.max_lag);
+
+	/* the lagging replica is skipped for a while */
+	c = db_con_get_read(mailbox_id, 0);
+	fail_if(db_con_is_replica(c), "lagging replica not skipped");
+	db_con_close(c);
+
+	db_replica_disconnect();
+}
+END_TEST
+
+START_TEST(test_db_profile_list)
+{
+	Connection_T c;
+	ResultSet_T r;
+	GList *l, *profiles;
+	DbQueryProfile_T *p = NULL;
+
+	c = db_con_get();
+	r = db_query(c, "SELECT user_idnr FROM %susers WHERE user_idnr IN (%" PRIu64 ", 0, 1) AND userid <> 'x'", "dbmail_", testidnr);
+	while (db_result_next(r));
+	r = db_query(c, "SELECT user_idnr FROM %susers WHERE user_idnr IN (%" PRIu64 ") AND userid <> 'it''s'", "dbmail_", testidnr);
+	while (db_result_next(r));
+	db_con_close(c);
+
+	profiles = db_profile_list();
+	for (l = profiles; l; l = l->next) {
+		DbQueryProfile_T *q = (DbQueryProfile_T *)l->data;
+		if (MATCH(q->query, "SELECT user_idnr FROM dbmail_users WHERE user_idnr IN (?) AND userid <> ?"))
+			p = q;
+	}
+	fail_unless(p != NULL, "statement template not found");
+	fail_unless(p->calls >= 2, "calls not merged [%" PRIu64 "]", p->calls);
+	fail_unless(p->rows >= 2, "rows not counted [%" PRIu64 "]", p->rows);
+	db_profile_free(profiles);
+}
+END_TEST
+
 START_TEST(test_db_stmt_set_str)
 {
 	Connection_T c; PreparedStatement_T s; ResultSet_T r;
@@ -357,6 +451,8 @@ END_TEST
 START_TEST(test_db_delete_mailbox)
 {
 	uint64_t mailbox_id = 999999999;
+	char *file = NULL;
+	gboolean listed = FALSE;
 	int result;
 
 	result = db_delete_mailbox(mailbox_id, 0, 0);
@@ -364,9 +460,21 @@ START_TEST(test_db_delete_mailbox)
 
 	result = db_createmailbox("testdeletebox",testidnr, &mailbox_id);
 	fail_unless(result == DM_SUCCESS,"db_createmailbox failed");
+
+	/* a cached pop3 listing goes with the mailbox */
+	if ((file = db_listing_file(mailbox_id))) {
+		char *dir = g_path_get_dirname(file);
+		if (g_mkdir_with_parents(dir, 0700) == 0 && g_file_set_contents(file, "", 0, NULL))
+			listed = TRUE;
+		g_free(dir);
+	}
+
 	result = db_delete_mailbox(mailbox_id,0,1);
 	fail_unless(result == DM_SUCCESS,"db_delete_mailbox failed");
 
+	if (listed)
+		fail_unless(! g_file_test(file, G_FILE_TEST_EXISTS), "listing [%s] not removed", file);
+	g_free(file);
 }
 END_TEST
 
@@ -416,6 +524,57 @@ START_TEST(test_db_get_sql)
 }
 END_TEST
 
+START_TEST(test_db_append_msgs)
+{
+	uint64_t mailbox_id = 0, before = 0, after = 0, used = 0;
+	AppendMessage one, two;
+	GList *appends = NULL;
+	const char *longer = "From: nobody@example.org\r\n"
+		"Subject: multiappend\r\n"
+		"\r\n"
+		"second message\r\n";
+	int result;
+
+	result = db_createmailbox("testappendbox", testidnr, &mailbox_id);
+	fail_unless(result == DM_SUCCESS, "db_createmailbox failed");
+
+	memset(&one, 0, sizeof(one));
+	memset(&two, 0, sizeof(two));
+	/* a short single line message, not to be mistaken for a date-time */
+	one.message = "short message";
+	one.size = strlen(one.message);
+	two.message = longer;
+	two.size = strlen(longer);
+	two.internal_date = "03-Mar-2006 07:15:00 +0200";
+	two.flags[IMAP_FLAG_SEEN] = 1;
+
+	appends = g_list_append(appends, &one);
+	appends = g_list_append(appends, &two);
+
+	result = db_append_msgs(appends, mailbox_id, testidnr);
+	fail_unless(result == DM_SUCCESS, "db_append_msgs failed [%d]", result);
+	fail_unless(one.uid > 0 && two.uid > one.uid,
+			"db_append_msgs uids [%" PRIu64 "] [%" PRIu64 "]", one.uid, two.uid);
+
+	/* over quota: neither message may be stored */
+	db_get_mailbox_size(mailbox_id, 0, &before);
+	dm_quota_user_get(testidnr, &used);
+	auth_change_mailboxsize(testidnr, used + one.size + 1);
+
+	one.uid = two.uid = 0;
+	result = db_append_msgs(appends, mailbox_id, testidnr);
+	auth_change_mailboxsize(testidnr, 0);
+
+	fail_unless(result == DM_OVERQUOTA, "db_append_msgs should exceed quotum [%d]", result);
+	fail_unless(one.uid == 0 && two.uid == 0, "no uids expected over quotum");
+	db_get_mailbox_size(mailbox_id, 0, &after);
+	fail_unless(before == after, "mailbox size changed [%" PRIu64 "] -> [%" PRIu64 "]",
+			before, after);
+
+	g_list_free(appends);
+}
+END_TEST
+
 START_TEST(test_diff_time)
 {
 	struct timeval before, after;
@@ -452,11 +611,15 @@ Suite *dbmail_db_suite(void)
 	tcase_add_checked_fixture(tc_db, setup, teardown);
 
 	tcase_add_test(tc_db, test_db_stmt_prepare);
+	tcase_add_test(tc_db, test_db_stmt_prepare_cached);
+	tcase_add_test(tc_db, test_db_con_get_read);
+	tcase_add_test(tc_db, test_db_profile_list);
 	tcase_add_test(tc_db, test_db_stmt_set_str);
 
 	tcase_add_test(tc_db, test_Connection_executeQuery);
 	tcase_add_test(tc_db, test_db_createmailbox);
 	tcase_add_test(tc_db, test_db_delete_mailbox);
+	tcase_add_test(tc_db, test_db_append_msgs);
 	tcase_add_test(tc_db, test_db_replycache);
 	tcase_add_test(tc_db, test_db_mailbox_set_permission);
 	tcase_add_test(tc_db, test_db_mailbox_create_with_parents);
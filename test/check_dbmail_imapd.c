@@ -41,6 +41,9 @@
 extern char configFile[PATH_MAX];
 extern DBParam_T db_params;
 extern Mempool_T queue_pool;
+extern GAsyncQueue *queue;
+extern struct event_base *evbase;
+extern ServerConfig_T *server_conf;
 
 #define DBPFX db_params.pfx
 
@@ -192,6 +195,210 @@ START_TEST(test_imap_session_new)
 }
 END_TEST
 
+static ImapSession * tokenizer_session(Mempool_T pool)
+{
+	ImapSession *s;
+	client_sock *c;
+	s = dbmail_imap_session_new(pool);
+	c = mempool_pop(s->pool, sizeof(client_sock));
+	c->pool = s->pool;
+	s->ci = client_init(c);
+	return s;
+}
+
+START_TEST(test_imap4_tokenizer_main)
+{
+	ImapSession *s;
+	Mempool_T pool = mempool_open();
+	char fetch[] = "1:5 (UID BODY[HEADER.FIELDS (FROM)] \"a \\\"b\\\"\")\r\n";
+	char broken[] = "1:5 (UID BODY[HEADER])]";
+	const char *expect[] = { "1:5", "(", "UID", "BODY", "[", "HEADER.FIELDS",
+		"(", "FROM", ")", "]", "a \\\"b\\\"", ")", NULL };
+	int i;
+
+	s = tokenizer_session(pool);
+	ck_assert_int_eq(imap4_tokenizer_main(s, fetch), 1);
+	for (i = 0; expect[i]; i++) {
+		ck_assert_ptr_nonnull(s->args[i]);
+		ck_assert_str_eq(p_string_str(s->args[i]), expect[i]);
+	}
+	ck_assert_ptr_null(s->args[i]);
+
+	dbmail_imap_session_args_free(s, FALSE);
+	ck_assert_int_eq(imap4_tokenizer_main(s, broken), -1);
+	dbmail_imap_session_delete(&s);
+}
+END_TEST
+
+START_TEST(test_imap4_tokenizer_literal)
+{
+	ImapSession *s;
+	Mempool_T pool = mempool_open();
+	const char literal[] = "From: a\0b\r\n\r\nbody";
+
+	s = tokenizer_session(pool);
+	s->ci->rbuff_size = sizeof(literal) - 1;
+	ck_assert_int_eq(imap4_tokenizer_literal(s, literal, 9), 0);
+	ck_assert_uint_eq(s->args_idx, 0);
+	ck_assert_int_eq(imap4_tokenizer_literal(s, literal + 9, sizeof(literal) - 10), 0);
+	ck_assert_uint_eq(s->args_idx, 1);
+	ck_assert_uint_eq(s->ci->rbuff_size, 0);
+	ck_assert_uint_eq(p_string_len(s->args[0]), sizeof(literal) - 1);
+	ck_assert(memcmp(p_string_str(s->args[0]), literal, sizeof(literal) - 1) == 0);
+	dbmail_imap_session_delete(&s);
+}
+END_TEST
+
+/*
+ * pipelining: a session on one end of a socketpair, with the queue
+ * and event base the imap daemon has
+ */
+static int pipeline_fd[2];
+
+static void pipeline_event_cb(int UNUSED fd, short UNUSED what, void UNUSED *arg)
+{
+}
+
+static ImapSession * pipeline_session(Mempool_T pool)
+{
+	ImapSession *s = tokenizer_session(pool);
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pipeline_fd), 0);
+	if (! evbase)
+		evbase = event_base_new();
+	if (! queue)
+		queue = g_async_queue_new();
+	if (! server_conf)
+		server_conf = g_new0(ServerConfig_T, 1);
+
+	s->ci->rx = s->ci->tx = pipeline_fd[0];
+	s->ci->rev = event_new(evbase, pipeline_fd[0], EV_READ, pipeline_event_cb, NULL);
+	s->ci->wev = event_new(evbase, pipeline_fd[0], EV_WRITE, pipeline_event_cb, NULL);
+	s->state = CLIENTSTATE_SELECTED;
+	return s;
+}
+
+static void pipeline_session_free(ImapSession *s)
+{
+	event_free(s->ci->rev);
+	event_free(s->ci->wev);
+	dbmail_imap_session_delete(&s);
+	close(pipeline_fd[0]);
+	close(pipeline_fd[1]);
+}
+
+/* what the client received so far */
+static char * pipeline_output(void)
+{
+	GString *out = g_string_new("");
+	char buf[1024];
+	ssize_t n;
+
+	dm_queue_drain();
+	while ((n = recv(pipeline_fd[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		g_string_append_len(out, buf, n);
+	return g_string_free(out, FALSE);
+}
+
+static ImapSession * pipeline_child(ImapSession *s, const char *tag)
+{
+	ImapSession *child = dbmail_imap_session_fork(s);
+	g_strlcpy(child->tag, tag, sizeof(child->tag));
+	dbmail_imap_session_buff_printf(child, "%s OK STATUS completed\r\n", tag);
+	s->pipeline = g_list_append(s->pipeline, child);
+	return child;
+}
+
+START_TEST(test_imap_pipeline_order)
+{
+	ImapSession *s, *b, *c;
+	Mempool_T pool = mempool_open();
+	char *out;
+
+	s = pipeline_session(pool);
+	g_strlcpy(s->tag, "a", sizeof(s->tag));
+	g_strlcpy(s->command, "FETCH", sizeof(s->command));
+	s->pipe_busy = TRUE; // as dm_thread_data_push leaves it
+
+	b = pipeline_child(s, "b");
+	c = pipeline_child(s, "c");
+
+	/* the worker of the main command is done, but _ic_cb_leave
+	 * hasn't run yet */
+	dbmail_imap_session_buff_printf(s, "* 1 FETCH (FLAGS ())\r\n");
+	dbmail_imap_session_buff_flush(s);
+	dbmail_imap_session_buff_printf(s, "a OK FETCH completed\r\n");
+	s->command_state = TRUE;
+
+	/* both children finish before their parent, the last one first */
+	imap_pipeline_done(c, 0);
+	imap_pipeline_done(b, 0);
+	out = pipeline_output();
+	ck_assert_str_eq(out, "* 1 FETCH (FLAGS ())\r\n");
+	g_free(out);
+	ck_assert_uint_eq(g_list_length(s->pipeline), 2);
+
+	dm_queue_push(_ic_cb_leave, s, NULL);
+	out = pipeline_output();
+	ck_assert_str_eq(out,
+			"a OK FETCH completed\r\n"
+			"b OK STATUS completed\r\n"
+			"c OK STATUS completed\r\n");
+	g_free(out);
+	ck_assert_ptr_null(s->pipeline);
+
+	pipeline_session_free(s);
+}
+END_TEST
+
+START_TEST(test_imap_pipeline_barrier)
+{
+	ImapSession *s;
+	Mempool_T pool = mempool_open();
+	const char *barriers[] = {
+		"b STORE 1 +FLAGS (\\Seen)",
+		"b UID STORE 1 +FLAGS (\\Seen)",
+		"b EXPUNGE",
+		"b SELECT INBOX",
+		"b NOOP",
+		"b FETCH 1 (BODY[])",
+		"b FETCH 1 (RFC822)",
+		"b APPEND INBOX {10}",
+		NULL
+	};
+	int i;
+
+	s = pipeline_session(pool);
+
+	ck_assert_int_eq(imap_pipeline_class(s, "b FETCH 1:* (FLAGS UID)"), PIPE_READER);
+	ck_assert_int_eq(imap_pipeline_class(s, "b UID FETCH 1:* (FLAGS BODY.PEEK[HEADER])"), PIPE_READER);
+	ck_assert_int_eq(imap_pipeline_class(s, "b STATUS INBOX (MESSAGES)"), PIPE_INDEPENDENT);
+
+	for (i = 0; barriers[i]; i++) {
+		ck_assert_msg(imap_pipeline_class(s, barriers[i]) == PIPE_NONE, "[%s] pipelined", barriers[i]);
+		ck_assert(! imap_pipeline_admit(s, imap_pipeline_class(s, barriers[i])));
+	}
+
+	/* idle: any run of readers */
+	ck_assert(imap_pipeline_admit(s, PIPE_READER));
+	ck_assert(imap_pipeline_admit(s, PIPE_INDEPENDENT));
+
+	/* a running FETCH refreshes the mailbox state */
+	s->pipe_busy = TRUE;
+	s->pipe_class = PIPE_READER;
+	ck_assert(! imap_pipeline_admit(s, PIPE_READER));
+	ck_assert(imap_pipeline_admit(s, PIPE_INDEPENDENT));
+
+	/* nothing runs next to a STORE, EXPUNGE or SELECT */
+	s->pipe_class = PIPE_NONE;
+	ck_assert(! imap_pipeline_admit(s, PIPE_READER));
+	ck_assert(! imap_pipeline_admit(s, PIPE_INDEPENDENT));
+
+	s->pipe_busy = FALSE;
+	pipeline_session_free(s);
+}
+END_TEST
+
 START_TEST(test_imap_get_structure_bare_bones)
 {
 	DbmailMessage *message;
@@ -1430,6 +1637,10 @@ Suite *dbmail_suite(void)
 	
 	tcase_add_checked_fixture(tc_session, setup, teardown);
 	tcase_add_test(tc_session, test_imap_session_new);
+	tcase_add_test(tc_session, test_imap4_tokenizer_main);
+	tcase_add_test(tc_session, test_imap4_tokenizer_literal);
+	tcase_add_test(tc_session, test_imap_pipeline_order);
+	tcase_add_test(tc_session, test_imap_pipeline_barrier);
 	tcase_add_test(tc_session, test_imap_get_structure_bare_bones);
 	tcase_add_test(tc_session, test_imap_get_structure_text_plain);
 	tcase_add_test(tc_session, test_imap_get_structure_multipart);
@@ -48,6 +48,19 @@ uint64_t empty_box = 0;
 /* we need this one because we can't directly link imapd.o */
 int imap_before_smtp = 0;
 
+/* number of messages in a search result */
+static int found_count(DbmailMailbox *mb)
+{
+	int count = 0;
+	guint i;
+
+	for (i = 0; mb->found && i < mb->found->len; i++) {
+		IdRange *r = &g_array_index(mb->found, IdRange, i);
+		count += r->last - r->first + 1;
+	}
+	return count;
+}
+
 static void add_message(void)
 {
 	int result;
@@ -302,6 +315,46 @@ START_TEST(test_dbmail_mailbox_sort)
 }
 END_TEST
 
+START_TEST(test_dbmail_mailbox_esort)
+{
+	String_T *search_keys;
+	size_t size;
+	uint64_t idx = 0;
+	char *res, *plain, *first;
+	DbmailMailbox *mb;
+	Mempool_T pool = mempool_open();
+
+	mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	search_keys = _build_search_keys(pool,
+			"RETURN ( MIN COUNT PARTIAL 1:2 ) ( reverse arrival ) us-ascii ALL", &size);
+
+	fail_unless(dbmail_mailbox_build_imap_search(mb, search_keys, &idx, SEARCH_SORTED) >= 0, "RETURN options rejected");
+	fail_unless(mb->result_options == (SEARCH_RETURN_MIN|SEARCH_RETURN_COUNT|SEARCH_RETURN_PARTIAL), "result options not parsed");
+	fail_unless(mb->partial_first == 1 && mb->partial_last == 2, "partial range not parsed");
+
+	dbmail_mailbox_set_uid(mb, TRUE);
+	dbmail_mailbox_search(mb);
+	dbmail_mailbox_sort(mb);
+
+	plain = dbmail_mailbox_sorted_as_string(mb);
+	fail_unless(plain != NULL, "sort failed");
+	first = g_strdup_printf("MIN %" PRIu64 " ", *(uint64_t *)g_list_first(mb->sorted)->data);
+
+	res = dbmail_mailbox_esort_as_string(mb);
+	fail_unless(g_str_has_prefix(res, first), "esort MIN is not the first sorted uid [%s]", res);
+	fail_unless(strstr(res, "COUNT ") != NULL, "esort COUNT missing [%s]", res);
+	fail_unless(strstr(res, "PARTIAL (1:2 ") != NULL, "esort PARTIAL missing [%s]", res);
+
+	g_free(first);
+	g_free(plain);
+	g_free(res);
+
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	mempool_close(&pool);
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_search)
 {
 	String_T *search_keys;
@@ -346,7 +399,7 @@ START_TEST(test_dbmail_mailbox_search2)
 	
 	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	all = g_tree_nnodes(mb->found);
+	all = found_count(mb);
 	
 	dbmail_mailbox_free(mb);
 
@@ -358,7 +411,7 @@ START_TEST(test_dbmail_mailbox_search2)
 	
 	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	found = g_tree_nnodes(mb->found);
+	found = found_count(mb);
 	
 	dbmail_mailbox_free(mb);
 
@@ -370,7 +423,7 @@ START_TEST(test_dbmail_mailbox_search2)
 	
 	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	notfound = g_tree_nnodes(mb->found);
+	notfound = found_count(mb);
 	
 	dbmail_mailbox_free(mb);
 
@@ -381,6 +434,110 @@ START_TEST(test_dbmail_mailbox_search2)
 }
 END_TEST
 
+static int _search_count(Mempool_T pool, const char *keys)
+{
+	String_T *search_keys;
+	size_t size;
+	uint64_t idx = 0;
+	int found;
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+
+	search_keys = _build_search_keys(pool, keys, &size);
+	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, SEARCH_UNORDERED);
+	dbmail_mailbox_search(mb);
+	found = found_count(mb);
+
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+
+	return found;
+}
+
+START_TEST(test_dbmail_mailbox_search_state)
+{
+	int all, seen, unseen, n;
+	Mempool_T pool = mempool_open();
+
+	all = _search_count(pool, "1:*");
+	seen = _search_count(pool, "1:* SEEN");
+	unseen = _search_count(pool, "1:* UNSEEN");
+	fail_unless(seen + unseen == all, "SEEN [%d] + UNSEEN [%d] != ALL [%d]", seen, unseen, all);
+
+	n = _search_count(pool, "1:* NOT SEEN");
+	fail_unless(n == unseen, "NOT SEEN [%d] != UNSEEN [%d]", n, unseen);
+
+	n = _search_count(pool, "1:* OR SEEN UNSEEN");
+	fail_unless(n == all, "OR SEEN UNSEEN [%d] != ALL [%d]", n, all);
+
+	n = _search_count(pool, "1:* NOT ( SEEN UNSEEN )");
+	fail_unless(n == all, "NOT ( SEEN UNSEEN ) [%d] != ALL [%d]", n, all);
+
+	n = _search_count(pool, "1:* SINCE 1-Jan-1970 LARGER 0");
+	fail_unless(n == all, "SINCE/LARGER [%d] != ALL [%d]", n, all);
+
+	n = _search_count(pool, "1:* BEFORE 1-Jan-1970");
+	fail_unless(n == 0, "BEFORE 1-Jan-1970 matched [%d]", n);
+
+	/* mixed with a criterion that needs the database */
+	n = _search_count(pool, "1:* UNSEEN NOT TEXT @");
+	fail_unless(n <= unseen, "UNSEEN NOT TEXT [%d] > UNSEEN [%d]", n, unseen);
+
+	mempool_close(&pool);
+}
+END_TEST
+
+START_TEST(test_dbmail_mailbox_esearch)
+{
+	String_T *search_keys;
+	size_t size;
+	uint64_t idx = 0;
+	int all;
+	char *res, *expect;
+	GTree *set;
+	DbmailMailbox *mb;
+	Mempool_T pool = mempool_open();
+
+	all = _search_count(pool, "1:*");
+
+	mb = dbmail_mailbox_new(pool, get_mailbox_id("INBOX"));
+	dbmail_mailbox_set_uid(mb, TRUE);
+
+	/* save the result, without returning it */
+	search_keys = _build_search_keys(pool, "RETURN ( SAVE ) 1:*", &size);
+	fail_unless(dbmail_mailbox_build_imap_search(mb, search_keys, &idx, SEARCH_UNORDERED) >= 0, "RETURN (SAVE) rejected");
+	fail_unless(mb->result_options == SEARCH_RETURN_SAVE, "result options not parsed");
+	dbmail_mailbox_search(mb);
+	dbmail_mailbox_save_result(mb);
+	fail_unless(mb->saved && mb->saved->len > 0, "search result not saved");
+	mempool_push(pool, search_keys, size);
+
+	set = dbmail_mailbox_get_set(mb, "$", FALSE);
+	fail_unless(set && g_tree_nnodes(set) == all, "$ resolved to [%d] of [%d] messages", set ? g_tree_nnodes(set) : -1, all);
+	g_tree_destroy(set);
+
+	/* and search it again on the same mailbox */
+	idx = 0;
+	search_keys = _build_search_keys(pool, "RETURN ( MIN MAX COUNT ALL ) $", &size);
+	fail_unless(dbmail_mailbox_build_imap_search(mb, search_keys, &idx, SEARCH_UNORDERED) >= 0, "$ rejected");
+	dbmail_mailbox_search(mb);
+	fail_unless(found_count(mb) == all, "SEARCH $ found [%d] of [%d]", found_count(mb), all);
+
+	res = dbmail_mailbox_esearch_as_string(mb);
+	expect = g_strdup_printf("COUNT %d", all);
+	fail_unless(g_str_has_prefix(res, "MIN "), "esearch MIN missing [%s]", res);
+	fail_unless(strstr(res, " MAX ") != NULL, "esearch MAX missing [%s]", res);
+	fail_unless(strstr(res, " ALL ") != NULL, "esearch ALL missing [%s]", res);
+	fail_unless(strstr(res, expect) != NULL, "esearch [%s] lacks [%s]", res, expect);
+	fail_unless(strchr(strstr(res, " ALL ") + 5, ' ') == strstr(res, " COUNT"), "esearch ALL is not a sequence-set [%s]", res);
+	g_free(expect);
+	g_free(res);
+
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	mempool_close(&pool);
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_search3)
 {
 	String_T *search_keys;
@@ -411,7 +568,7 @@ START_TEST(test_dbmail_mailbox_search3)
 	
 	dbmail_mailbox_build_imap_search(mb, search_keys, &idx, sorted);
 	dbmail_mailbox_search(mb);
-	found = g_tree_nnodes(mb->found);
+	found = found_count(mb);
 	fail_unless(found==1,"dbmail_mailbox_search failed: SEARCH UID 1");
 	
 	dbmail_mailbox_free(mb);
@@ -509,6 +666,151 @@ START_TEST(test_dbmail_mailbox_orderedsubject)
 
 }
 END_TEST
+/* five messages in two threads: "apple" 1 <- 2 <- 4 linked by their
+ * references, and "banana" 3 with a reply 5 that only shares the subject */
+static const char *thread_messages[] = {
+	"Message-ID: <apple1@example.org>\n"
+	"Date: Mon, 1 Jan 2024 10:00:00 +0000\n"
+	"From: one@example.org\n"
+	"Subject: apple\n\n"
+	"first\n",
+	"Message-ID: <apple2@example.org>\n"
+	"References: <apple1@example.org>\n"
+	"Date: Tue, 2 Jan 2024 10:00:00 +0000\n"
+	"From: two@example.org\n"
+	"Subject: Re: apple\n\n"
+	"second\n",
+	"Message-ID: <banana3@example.org>\n"
+	"Date: Wed, 3 Jan 2024 10:00:00 +0000\n"
+	"From: three@example.org\n"
+	"Subject: banana\n\n"
+	"third\n",
+	"Message-ID: <apple4@example.org>\n"
+	"References: <apple1@example.org> <apple2@example.org>\n"
+	"Date: Thu, 4 Jan 2024 10:00:00 +0000\n"
+	"From: four@example.org\n"
+	"Subject: Re: apple\n\n"
+	"fourth\n",
+	"Message-ID: <banana5@example.org>\n"
+	"Date: Fri, 5 Jan 2024 10:00:00 +0000\n"
+	"From: five@example.org\n"
+	"Subject: Re: banana\n\n"
+	"fifth\n",
+};
+#define THREAD_MESSAGES (sizeof(thread_messages) / sizeof(thread_messages[0]))
+
+static uint64_t thread_mailbox(uint64_t *uids)
+{
+	AppendMessage appends[THREAD_MESSAGES];
+	GList *l = NULL;
+	uint64_t id, owner;
+	unsigned i;
+	int result;
+
+	auth_user_exists("testuser1", &owner);
+	if (db_findmailbox("testthread", owner, &id))
+		db_delete_mailbox(id, 0, 0);
+	id = get_mailbox_id("testthread");
+
+	memset(appends, 0, sizeof(appends));
+	for (i = 0; i < THREAD_MESSAGES; i++) {
+		appends[i].message = thread_messages[i];
+		appends[i].size = strlen(thread_messages[i]);
+		l = g_list_append(l, &appends[i]);
+	}
+	result = db_append_msgs(l, id, owner);
+	g_list_free(l);
+	assert(result == DM_SUCCESS);
+
+	for (i = 0; i < THREAD_MESSAGES; i++)
+		uids[i] = appends[i].uid;
+
+	return id;
+}
+
+static DbmailMailbox * thread_search(Mempool_T pool, uint64_t id, int type, String_T **keys, size_t *size)
+{
+	uint64_t idx = 0;
+	DbmailMailbox *mb = dbmail_mailbox_new(pool, id);
+
+	*keys = _build_search_keys(pool, "ALL", size);
+	dbmail_mailbox_build_imap_search(mb, *keys, &idx, type);
+	dbmail_mailbox_search(mb);
+	return mb;
+}
+
+START_TEST(test_dbmail_mailbox_orderedsubject_tree)
+{
+	char *res, *expect;
+	uint64_t id, u[THREAD_MESSAGES];
+	size_t size;
+	String_T *search_keys;
+	Mempool_T pool = mempool_open();
+	DbmailMailbox *mb;
+
+	id = thread_mailbox(u);
+	mb = thread_search(pool, id, SEARCH_THREAD_ORDEREDSUBJECT, &search_keys, &size);
+
+	res = dbmail_mailbox_orderedsubject(mb);
+	// 1 is the parent of 2 and 4, 3 of 5
+	fail_unless(MATCH(res, "(1 (2)(4))(3 5)"),
+			"dbmail_mailbox_orderedsubject failed [%s]", res);
+	g_free(res);
+
+	dbmail_mailbox_set_uid(mb, TRUE);
+	res = dbmail_mailbox_orderedsubject(mb);
+	expect = g_strdup_printf("(%" PRIu64 " (%" PRIu64 ")(%" PRIu64 "))"
+			"(%" PRIu64 " %" PRIu64 ")", u[0], u[1], u[3], u[2], u[4]);
+	fail_unless(MATCH(res, expect), "dbmail_mailbox_orderedsubject failed [%s] != [%s]",
+			res, expect);
+	g_free(expect);
+	g_free(res);
+
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	mempool_close(&pool);
+	db_delete_mailbox(id, 0, 0);
+}
+END_TEST
+
+START_TEST(test_dbmail_mailbox_threadreferences)
+{
+	char *res, *again, *expect;
+	uint64_t id, u[THREAD_MESSAGES];
+	size_t size;
+	String_T *search_keys;
+	Mempool_T pool = mempool_open();
+	DbmailMailbox *mb;
+
+	id = thread_mailbox(u);
+	mb = thread_search(pool, id, SEARCH_THREAD_REFERENCES, &search_keys, &size);
+
+	res = dbmail_mailbox_threadreferences(mb);
+	fail_unless(MATCH(res, "(1 2 4)(3 5)"),
+			"dbmail_mailbox_threadreferences failed [%s]", res);
+
+	// second call is served from the cached thread index
+	again = dbmail_mailbox_threadreferences(mb);
+	fail_unless(MATCH(res, again), "thread index mismatch [%s] != [%s]", res, again);
+	g_free(again);
+	g_free(res);
+
+	dbmail_mailbox_set_uid(mb, TRUE);
+	res = dbmail_mailbox_threadreferences(mb);
+	expect = g_strdup_printf("(%" PRIu64 " %" PRIu64 " %" PRIu64 ")(%" PRIu64 " %" PRIu64 ")",
+			u[0], u[1], u[3], u[2], u[4]);
+	fail_unless(MATCH(res, expect), "dbmail_mailbox_threadreferences failed [%s] != [%s]",
+			res, expect);
+	g_free(expect);
+	g_free(res);
+
+	dbmail_mailbox_free(mb);
+	mempool_push(pool, search_keys, size);
+	mempool_close(&pool);
+	db_delete_mailbox(id, 0, 0);
+}
+END_TEST
+
 START_TEST(test_dbmail_mailbox_get_set)
 {
 	guint c, d, r;
@@ -655,13 +957,18 @@ Suite *dbmail_mailbox_suite(void)
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_dump);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_build_imap_search);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_sort);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_esort);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search2);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search3);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_state);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_esearch);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search4);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_1);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_search_parsed_2);
 	tcase_add_test(tc_mailbox, test_dbmail_mailbox_orderedsubject);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_orderedsubject_tree);
+	tcase_add_test(tc_mailbox, test_dbmail_mailbox_threadreferences);
 
 	return s;
 }
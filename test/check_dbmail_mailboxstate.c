@@ -140,6 +140,53 @@ START_TEST(test_metadata)
 }
 END_TEST
 
+START_TEST(test_update)
+{
+	MailboxState_T M, N;
+	uint64_t *uid;
+	GList *ids;
+
+	testboxid = get_mailbox_id("mailboxstate2", "update1");
+	M = MailboxState_new(NULL, testboxid);
+	ck_assert_uint_eq (MailboxState_getExists(M), 0);
+
+	insert_message();
+
+	// differential reload picks up the new message
+	N = MailboxState_update(NULL, M);
+	ck_assert_uint_eq (MailboxState_getExists(N), 1);
+	ck_assert_uint_eq (MailboxState_getUnseen(N), 1);
+	ck_assert_uint_eq (g_tree_nnodes(MailboxState_getIds(N)), 1);
+	ck_assert_uint_eq (g_tree_nnodes(MailboxState_getMsn(N)), 1);
+	// only changed messages are left behind in the old state
+	ck_assert_uint_eq (g_tree_nnodes(MailboxState_getMsginfo(M)), 0);
+	MailboxState_free(&M);
+
+	insert_message();
+	insert_message();
+	M = MailboxState_update(NULL, N);
+	ck_assert_uint_eq (MailboxState_getExists(M), 3);
+	MailboxState_free(&N);
+
+	ids = g_tree_keys(MailboxState_getIds(M));
+	uid = (uint64_t *)g_list_nth_data(ids, 1);
+	ck_assert_uint_gt (MailboxState_getUidnext(M), *uid);
+	db_set_message_status(*uid, MESSAGE_STATUS_DELETE);
+	db_mailbox_seq_update(testboxid, *uid);
+
+	// the expunge is seen as a delta and the tail moves up
+	N = MailboxState_update(NULL, M);
+	ck_assert_uint_eq (MailboxState_getExists(N), 2);
+	ck_assert_uint_eq (g_tree_nnodes(MailboxState_getIds(N)), 2);
+	ck_assert_uint_eq (g_tree_nnodes(MailboxState_getMsn(N)), 2);
+	uid = (uint64_t *)g_list_nth_data(ids, 2);
+	ck_assert_uint_eq (*(uint64_t *)g_tree_lookup(MailboxState_getIds(N), uid), 2);
+	g_list_free(ids);
+	MailboxState_free(&M);
+	MailboxState_free(&N);
+}
+END_TEST
+
 static void mailboxstate_destroy(MailboxState_T M)
 {
 	MailboxState_free(&M);
@@ -180,6 +227,7 @@ Suite *dbmail_common_suite(void)
 	tcase_add_checked_fixture(tc_state, setup, teardown);
 	tcase_add_test(tc_state, test_createdestroy);
 	tcase_add_test(tc_state, test_metadata);
+	tcase_add_test(tc_state, test_update);
 	tcase_add_test(tc_state, test_mbxinfo);
 
 	return s;
@@ -97,7 +97,110 @@ START_TEST(test_mempool_push)
 }
 END_TEST
 
+START_TEST(test_arena_alloc)
+{
+	int i;
+	char *s, *big;
+	Arena_T A = arena_new(1024);
+	fail_unless(A != NULL);
+
+	for (i = 1; i < 200; i++) {
+		char *p = arena_alloc(A, i);
+		fail_unless(p != NULL);
+		fail_unless(((uintptr_t)p % 16) == 0, "arena_alloc returned unaligned block");
+		fail_unless(p[0] == 0 && p[i - 1] == 0, "arena_alloc returned dirty block");
+		memset(p, 'x', i);
+	}
+
+	/* larger than a chunk */
+	big = arena_alloc(A, 4096);
+	fail_unless(big != NULL);
+	fail_unless(big[4095] == 0);
+	memset(big, 'y', 4096);
+
+	s = arena_strdup(A, "dbmail");
+	fail_unless(MATCH(s, "dbmail"));
+	fail_unless(arena_strdup(A, NULL) == NULL);
+
+	arena_reset(A);
+	for (i = 0; i < 64; i++) {
+		char *p = arena_alloc(A, 32);
+		fail_unless(p[0] == 0 && p[31] == 0, "arena_alloc returned dirty block after reset");
+	}
+
+	arena_free(&A);
+	fail_unless(A == NULL);
+}
+END_TEST
+
+/*
+ * allocation rate of many small, short lived blocks from several
+ * threads: a shared pool against a private arena per thread
+ */
+#define BENCH_THREADS 8
+#define BENCH_ROUNDS 200
+#define BENCH_BLOCKS 512
 
+static Mempool_T bench_pool;
+
+static gpointer bench_mempool(gpointer data UNUSED)
+{
+	void *blocks[BENCH_BLOCKS];
+	int r, i;
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		for (i = 0; i < BENCH_BLOCKS; i++)
+			blocks[i] = mempool_pop(bench_pool, 16 + (i % 8) * 8);
+		for (i = 0; i < BENCH_BLOCKS; i++)
+			mempool_push(bench_pool, blocks[i], 16 + (i % 8) * 8);
+	}
+	return NULL;
+}
+
+static gpointer bench_arena(gpointer data UNUSED)
+{
+	Arena_T A = arena_new(0);
+	int r, i;
+	for (r = 0; r < BENCH_ROUNDS; r++) {
+		for (i = 0; i < BENCH_BLOCKS; i++)
+			arena_alloc(A, 16 + (i % 8) * 8);
+		arena_reset(A);
+	}
+	arena_free(&A);
+	return NULL;
+}
+
+static double bench_run(GThreadFunc func)
+{
+	GThread *threads[BENCH_THREADS];
+	gint64 start;
+	double secs;
+	int i;
+
+	start = g_get_monotonic_time();
+	for (i = 0; i < BENCH_THREADS; i++)
+		threads[i] = g_thread_new("bench", func, NULL);
+	for (i = 0; i < BENCH_THREADS; i++)
+		g_thread_join(threads[i]);
+	secs = (double)(g_get_monotonic_time() - start) / G_USEC_PER_SEC;
+
+	return (double)BENCH_THREADS * BENCH_ROUNDS * BENCH_BLOCKS / (secs > 0 ? secs : 1e-6);
+}
+
+START_TEST(test_arena_benchmark)
+{
+	double pool_rate, arena_rate;
+
+	bench_pool = mempool_open();
+	pool_rate = bench_run(bench_mempool);
+	mempool_close(&bench_pool);
+
+	arena_rate = bench_run(bench_arena);
+
+	TRACE(TRACE_INFO, "%d threads: mempool %.0f allocs/s, arena %.0f allocs/s (%.1fx)",
+			BENCH_THREADS, pool_rate, arena_rate, arena_rate / pool_rate);
+	fail_unless(pool_rate > 0 && arena_rate > 0);
+}
+END_TEST
 
 Suite *dbmail_mempool_suite(void)
 {
@@ -110,6 +213,8 @@ Suite *dbmail_mempool_suite(void)
 	tcase_add_test(tc_mempool, test_mempool_new);
 	tcase_add_test(tc_mempool, test_mempool_pop);
 	tcase_add_test(tc_mempool, test_mempool_push);
+	tcase_add_test(tc_mempool, test_arena_alloc);
+	tcase_add_test(tc_mempool, test_arena_benchmark);
 	
 	return s;
 }
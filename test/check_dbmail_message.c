@@ -985,6 +985,44 @@ START_TEST(test_db_get_message_lines)
 }
 END_TEST
 
+static int _stream_append(const char *buf, size_t len, void *data)
+{
+	g_string_append_len((GString *)data, buf, len);
+	return 0;
+}
+
+START_TEST(test_db_stream_message_lines)
+{
+	DbmailMessage *m;
+	GString *s;
+	char *result;
+	long lines[] = { 0, 1, 2, -2 };
+	int i;
+	const char *raw = "From: foo@bar.org\r\n"
+	"Subject: Some test\r\n"
+	"To: bar@foo.org\r\n"
+	"\r\n"
+	"first line\r\n"
+	".dotted line\r\n"
+	"last line\r\n";
+
+	m = dbmail_message_new(NULL);
+	m = dbmail_message_init_with_string(m, raw);
+	dbmail_message_store(m);
+
+	for (i = 0; i < 4; i++) {
+		s = g_string_new("");
+		fail_unless(db_stream_message_lines(0, m->msg_idnr, lines[i], _stream_append, s) == DM_SUCCESS);
+		result = db_get_message_lines(m->msg_idnr, lines[i]);
+		fail_unless(MATCH(s->str, result), "stream [%ld] lines\n[%s] !=\n[%s]", lines[i], s->str, result);
+		g_free(result);
+		g_string_free(s, TRUE);
+	}
+
+	dbmail_message_free(m);
+}
+END_TEST
+
 /* Fetching subject from database */
 extern DBParam_T db_params;
 #define DBPFX db_params.pfx
@@ -1087,6 +1125,7 @@ Suite *dbmail_message_suite(void)
 	tcase_add_test(tc_message, test_dbmail_message_get_size);
 	tcase_add_test(tc_message, test_encoding);
 	tcase_add_test(tc_message, test_db_get_message_lines);
+	tcase_add_test(tc_message, test_db_stream_message_lines);
 	tcase_add_test(tc_message, test_dbmail_message_utf8_headers);
 	return s;
 }
@@ -283,6 +283,64 @@ START_TEST(test_dbmail_iconv_decode_address)
 }
 END_TEST
 
+static gpointer iconv_str_to_utf8_thread(gpointer data UNUSED)
+{
+	int i;
+	for (i = 0; i < 1000; i++) {
+		char *u8 = dbmail_iconv_str_to_utf8("L\xf6sung f\xfcr", "iso-8859-1");
+		if (! MATCH(u8, "Lösung für")) {
+			g_free(u8);
+			return GINT_TO_POINTER(1);
+		}
+		g_free(u8);
+	}
+	return NULL;
+}
+
+START_TEST(test_dbmail_iconv_str_to_utf8)
+{
+	GThread *threads[4];
+	char *u8;
+	int i;
+
+	/* 7-bit and valid utf-8 are copied as-is, whatever the charset */
+	u8 = dbmail_iconv_str_to_utf8("a plain ascii subject line, well over a word long", "iso-8859-1");
+	ck_assert_str_eq(u8, "a plain ascii subject line, well over a word long");
+	g_free(u8);
+
+	u8 = dbmail_iconv_str_to_utf8("Übergabe ééé", "iso-8859-1");
+	ck_assert_str_eq(u8, "Übergabe ééé");
+	g_free(u8);
+
+	u8 = dbmail_iconv_str_to_utf8("", NULL);
+	ck_assert_str_eq(u8, "");
+	g_free(u8);
+
+	u8 = dbmail_iconv_str_to_utf8("\xdc" "bergabe", "iso-8859-1");
+	ck_assert_str_eq(u8, "Übergabe");
+	g_free(u8);
+
+	u8 = dbmail_iconv_str_to_utf8("\xd0\xf3\xf1", "windows-1251");
+	ck_assert_str_eq(u8, "Рус");
+	g_free(u8);
+
+	/* repeated through the cached converter */
+	u8 = dbmail_iconv_str_to_utf8("\xdc" "bergabe", "iso-8859-1");
+	ck_assert_str_eq(u8, "Übergabe");
+	g_free(u8);
+
+	/* unknown charset falls back to the default message encoding */
+	u8 = dbmail_iconv_str_to_utf8("\xdc" "bergabe", "x-no-such-charset");
+	fail_unless(u8 != NULL);
+	g_free(u8);
+
+	for (i = 0; i < 4; i++)
+		threads[i] = g_thread_new("iconv", iconv_str_to_utf8_thread, NULL);
+	for (i = 0; i < 4; i++)
+		fail_unless(g_thread_join(threads[i]) == NULL, "threaded conversion failed");
+}
+END_TEST
+
 START_TEST(test_create_unique_id)
 {
 	char *a = g_new0(char, 64);
@@ -565,6 +623,56 @@ START_TEST(test_date_sql2imap)
 }
 END_TEST
 
+START_TEST(test_metrics_render)
+{
+	static const char *command = "noop";
+	GString *out = g_string_new("");
+
+	metrics_add(METRIC_CONNECTIONS, 2);
+	metrics_add(METRIC_CONNECTIONS, -1);
+	metrics_command("imap", command, 50);
+	metrics_command("imap", command, 5000);
+
+	metrics_render(out);
+	fail_unless(strstr(out->str, "\ndbmail_connections 1\n") != NULL, "gauge not rendered");
+	fail_unless(strstr(out->str, "dbmail_command_duration_seconds_bucket{protocol=\"imap\",command=\"noop\",le=\"0.0001\"} 1\n") != NULL, "first bucket wrong");
+	fail_unless(strstr(out->str, "dbmail_command_duration_seconds_bucket{protocol=\"imap\",command=\"noop\",le=\"0.01\"} 2\n") != NULL, "buckets not cumulative");
+	fail_unless(strstr(out->str, "dbmail_command_duration_seconds_count{protocol=\"imap\",command=\"noop\"} 2\n") != NULL, "count wrong");
+	fail_unless(strstr(out->str, "# TYPE dbmail_db_connections_active gauge\n") != NULL, "db metrics missing");
+	g_string_free(out, TRUE);
+}
+END_TEST
+
+START_TEST(test_dm_private_dir)
+{
+	char base[] = "/tmp/dbmail-check-XXXXXX";
+	char *dir, *link;
+
+	fail_unless(mkdtemp(base) != NULL, "mkdtemp failed");
+	dir = g_build_filename(base, "state", "pop3", NULL);
+	link = g_build_filename(base, "link", NULL);
+
+	fail_unless(dm_private_dir(dir) == 0, "new private dir refused");
+	fail_unless(g_file_test(dir, G_FILE_TEST_IS_DIR), "private dir not created");
+
+	chmod(dir, 0777);
+	fail_unless(dm_private_dir(dir) != 0, "world writable dir accepted");
+	chmod(dir, 0700);
+
+	fail_unless(symlink(dir, link) == 0, "symlink failed");
+	fail_unless(dm_private_dir(link) != 0, "symlink accepted");
+
+	unlink(link);
+	rmdir(dir);
+	g_free(dir);
+	dir = g_build_filename(base, "state", NULL);
+	rmdir(dir);
+	rmdir(base);
+	g_free(dir);
+	g_free(link);
+}
+END_TEST
+
 
 Suite *dbmail_misc_suite(void)
 {
@@ -579,6 +687,7 @@ Suite *dbmail_misc_suite(void)
 	tcase_add_test(tc_misc, test_mailbox_remove_namespace);
 	tcase_add_test(tc_misc, test_dbmail_iconv_str_to_db);
 	tcase_add_test(tc_misc, test_dbmail_iconv_decode_address);
+	tcase_add_test(tc_misc, test_dbmail_iconv_str_to_utf8);
 	tcase_add_test(tc_misc, test_create_unique_id);
 	tcase_add_test(tc_misc, test_g_list_merge);
  	tcase_add_test(tc_misc, test_dm_strtoull);
@@ -594,6 +703,8 @@ Suite *dbmail_misc_suite(void)
 	tcase_add_test(tc_misc, test_get_crlf_encoded_opt2);
 	tcase_add_test(tc_misc, test_date_imap2sql);
 	tcase_add_test(tc_misc, test_date_sql2imap);
+	tcase_add_test(tc_misc, test_metrics_render);
+	tcase_add_test(tc_misc, test_dm_private_dir);
 
 	return s;
 }
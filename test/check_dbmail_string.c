@@ -72,6 +72,18 @@ START_TEST(test_string_new)
 }
 END_TEST
 
+START_TEST(test_string_new_len)
+{
+	String_T S = p_string_new_len(pool, "ABCDE", 3);
+	fail_unless(MATCH("ABC", p_string_str(S)), p_string_str(S));
+	fail_unless(p_string_len(S) == 3);
+	p_string_append_len(S, "\0F", 2);
+	fail_unless(p_string_len(S) == 5);
+	fail_unless(memcmp(p_string_str(S), "ABC\0F", 5) == 0);
+	p_string_free(S, TRUE);
+}
+END_TEST
+
 START_TEST(test_string_assign)
 {
 	int i=0;
@@ -223,6 +235,7 @@ Suite *dbmail_string_suite(void)
 	
 	tcase_add_checked_fixture(tc, setup, teardown);
 	tcase_add_test(tc, test_string_new);
+	tcase_add_test(tc, test_string_new_len);
 	tcase_add_test(tc, test_string_assign);
 	tcase_add_test(tc, test_string_printf);
 	tcase_add_test(tc, test_string_append_printf);